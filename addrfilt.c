@@ -33,6 +33,7 @@
 #include "sysincl.h"
 
 #include "addrfilt.h"
+#include "array.h"
 #include "memory.h"
 
 /* Define the number of bits which are stripped off per level of
@@ -49,11 +50,58 @@ typedef struct _TableNode {
   struct _TableNode *extended;
 } TableNode;
 
+/* Number of bits of the address indexing the root and other nodes of
+   the compiled table.  The root is indexed by at least MIN_ROOT_BITS bits,
+   enough to cover all rules if possible.  Small tables have a smaller root
+   to limit the memory used by the compiled table to ROOT_CHUNKS_PER_RULE
+   chunks of the root per rule. */
+#define MIN_ROOT_BITS 8
+#define MAX_ROOT_BITS 24
+#define NODE_BITS 8
+#define ROOT_CHUNKS_PER_RULE 16
+
+/* Slots of the compiled nodes are grouped in chunks of 64 */
+#define CHUNK_BITS 6
+#define CHUNK_SIZE (1U << CHUNK_BITS)
+#define NODE_CHUNKS (1U << (NODE_BITS - CHUNK_BITS))
+
+/* A chunk of slots in a compiled node.  A slot with its bit set in the
+   internal bitmap points to a child node, other slots have the final
+   result in the allowed bitmap.  Child nodes of the internal slots are
+   stored consecutively from the base chunk, in the order of the slots. */
+typedef struct {
+  uint64_t internal;
+  uint64_t allowed;
+  uint32_t base;
+} Chunk;
+
+/* Read-only version of the table for faster lookups, which needs to be
+   compiled again after each modification of the table */
+typedef struct {
+  int root_bits;
+  Chunk *chunks;
+  ARR_Instance chunk_array;
+} CompiledTable;
+
 struct ADF_AuthTableInst {
   TableNode base4;      /* IPv4 node */
   TableNode base6;      /* IPv6 node */
+  CompiledTable *compiled4;
+  CompiledTable *compiled6;
+};
+
+/* Compiled tables waiting to be published */
+struct ADF_CompiledTableInst {
+  CompiledTable *compiled4;
+  CompiledTable *compiled6;
 };
 
+/* Internal slot of a compiled node waiting for its child node */
+typedef struct {
+  TableNode *node;
+  State state;
+} PendingNode;
+
 /* ================================================== */
 
 static void
@@ -94,6 +142,8 @@ ADF_CreateTable(void)
   result->base4.extended = NULL;
   result->base6.state = DENY;
   result->base6.extended = NULL;
+  result->compiled4 = NULL;
+  result->compiled6 = NULL;
 
   return result;
 }
@@ -223,6 +273,19 @@ set_subnet(TableNode *start_node,
 
 /* ================================================== */
 
+static void
+destroy_compiled(CompiledTable **compiled)
+{
+  if (!*compiled)
+    return;
+
+  ARR_DestroyInstance((*compiled)->chunk_array);
+  Free(*compiled);
+  *compiled = NULL;
+}
+
+/* ================================================== */
+
 static ADF_Status
 set_subnet_(ADF_AuthTable table,
            IPAddr *ip_addr,
@@ -232,6 +295,10 @@ set_subnet_(ADF_AuthTable table,
 {
   uint32_t ip6[4];
 
+  /* The compiled tables are no longer valid */
+  destroy_compiled(&table->compiled4);
+  destroy_compiled(&table->compiled6);
+
   switch (ip_addr->family) {
     case IPADDR_INET4:
       return set_subnet(&table->base4, &ip_addr->addr.in4, 1, subnet_bits, new_state, delete_children);
@@ -296,6 +363,8 @@ ADF_DenyAll(ADF_AuthTable table,
 void
 ADF_DestroyTable(ADF_AuthTable table)
 {
+  destroy_compiled(&table->compiled4);
+  destroy_compiled(&table->compiled6);
   close_node(&table->base4);
   close_node(&table->base6);
   Free(table);
@@ -345,6 +414,43 @@ check_ip_in_node(TableNode *start_node, uint32_t *ip)
 }
 
 
+/* ================================================== */
+
+static int
+count_bits(uint64_t x)
+{
+  x = x - (x >> 1 & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + (x >> 2 & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return x * 0x0101010101010101ULL >> 56;
+}
+
+/* ================================================== */
+
+static int
+check_ip_in_compiled(CompiledTable *compiled, uint32_t *ip)
+{
+  unsigned int slot, bits, index;
+  Chunk *chunk;
+
+  bits = compiled->root_bits;
+  slot = ip[0] >> (32 - bits);
+  chunk = &compiled->chunks[slot / CHUNK_SIZE];
+
+  while (1) {
+    slot %= CHUNK_SIZE;
+
+    if (!(chunk->internal >> slot & 1))
+      return chunk->allowed >> slot & 1;
+
+    /* Find the child node and the chunk containing the next slot */
+    index = count_bits(chunk->internal << (CHUNK_SIZE - 1 - slot)) - 1;
+    slot = ip[bits / 32] >> (32 - NODE_BITS - bits % 32) & ((1U << NODE_BITS) - 1);
+    chunk = &compiled->chunks[chunk->base + index * NODE_CHUNKS + slot / CHUNK_SIZE];
+    bits += NODE_BITS;
+  }
+}
+
 /* ================================================== */
 
 int
@@ -355,9 +461,13 @@ ADF_IsAllowed(ADF_AuthTable table,
 
   switch (ip_addr->family) {
     case IPADDR_INET4:
+      if (table->compiled4)
+        return check_ip_in_compiled(table->compiled4, &ip_addr->addr.in4);
       return check_ip_in_node(&table->base4, &ip_addr->addr.in4);
     case IPADDR_INET6:
       split_ip6(ip_addr, ip6);
+      if (table->compiled6)
+        return check_ip_in_compiled(table->compiled6, ip6);
       return check_ip_in_node(&table->base6, ip6);
   }
 
@@ -401,3 +511,253 @@ ADF_IsAnyAllowed(ADF_AuthTable table, int family)
       return 0;
   }
 }
+
+/* ================================================== */
+
+static void
+iterate_subnets(TableNode *node, uint32_t *addr, int bits, IPAddr *ip,
+                ADF_SubnetHandler handler, void *arg)
+{
+  int i, j;
+
+  if (node->state != AS_PARENT) {
+    if (ip->family == IPADDR_INET4) {
+      ip->addr.in4 = addr[0];
+    } else {
+      for (i = 0; i < 16; i++)
+        ip->addr.in6[i] = addr[i / 4] >> (24 - i % 4 * 8);
+    }
+
+    (handler)(ip, bits, node->state == ALLOW, arg);
+  }
+
+  if (!node->extended)
+    return;
+
+  for (i = 0; i < TABLE_SIZE; i++) {
+    j = bits / 32;
+    addr[j] &= ~(((1UL << NBITS) - 1) << (32 - NBITS - bits % 32));
+    addr[j] |= (uint32_t)i << (32 - NBITS - bits % 32);
+    iterate_subnets(&node->extended[i], addr, bits + NBITS, ip, handler, arg);
+  }
+
+  addr[bits / 32] &= ~(((1UL << NBITS) - 1) << (32 - NBITS - bits % 32));
+}
+
+/* ================================================== */
+
+void
+ADF_IterateSubnets(ADF_AuthTable table, int family, ADF_SubnetHandler handler, void *arg)
+{
+  uint32_t addr[4] = {0, 0, 0, 0};
+  IPAddr ip;
+
+  memset(&ip, 0, sizeof (ip));
+  ip.family = family;
+
+  switch (family) {
+    case IPADDR_INET4:
+      iterate_subnets(&table->base4, addr, 0, &ip, handler, arg);
+      break;
+    case IPADDR_INET6:
+      iterate_subnets(&table->base6, addr, 0, &ip, handler, arg);
+      break;
+    default:
+      break;
+  }
+}
+
+/* ================================================== */
+
+static int
+get_max_depth(TableNode *node, int depth)
+{
+  int i, max_depth, d;
+
+  max_depth = node->state != AS_PARENT ? depth : 0;
+
+  if (node->extended) {
+    for (i = 0; i < TABLE_SIZE; i++) {
+      d = get_max_depth(&node->extended[i], depth + NBITS);
+      if (max_depth < d)
+        max_depth = d;
+    }
+  }
+
+  return max_depth;
+}
+
+/* ================================================== */
+
+static unsigned int
+count_rules(TableNode *node)
+{
+  unsigned int i, rules;
+
+  rules = node->state != AS_PARENT;
+
+  if (node->extended) {
+    for (i = 0; i < TABLE_SIZE; i++)
+      rules += count_rules(&node->extended[i]);
+  }
+
+  return rules;
+}
+
+/* ================================================== */
+
+static void
+fill_slots(Chunk *chunks, int bits, TableNode *node, State state, uint32_t prefix,
+           int depth, ARR_Instance pending)
+{
+  PendingNode pending_node;
+  uint32_t i, first, count;
+
+  if (node && node->state != AS_PARENT)
+    state = node->state;
+
+  if (depth == bits) {
+    if (node && node->extended) {
+      chunks[prefix / CHUNK_SIZE].internal |= 1ULL << prefix % CHUNK_SIZE;
+      pending_node.node = node;
+      pending_node.state = state;
+      ARR_AppendElement(pending, &pending_node);
+    } else if (state == ALLOW) {
+      chunks[prefix / CHUNK_SIZE].allowed |= 1ULL << prefix % CHUNK_SIZE;
+    }
+    return;
+  }
+
+  if (!node || !node->extended) {
+    /* The whole range of slots has the same result */
+    if (state != ALLOW)
+      return;
+
+    first = prefix << (bits - depth);
+    count = 1U << (bits - depth);
+
+    if (count >= CHUNK_SIZE) {
+      for (i = first / CHUNK_SIZE; i < (first + count) / CHUNK_SIZE; i++)
+        chunks[i].allowed = ~0ULL;
+    } else {
+      chunks[first / CHUNK_SIZE].allowed |= ((1ULL << count) - 1) << first % CHUNK_SIZE;
+    }
+    return;
+  }
+
+  for (i = 0; i < TABLE_SIZE; i++)
+    fill_slots(chunks, bits, &node->extended[i], state, prefix << NBITS | i,
+               depth + NBITS, pending);
+}
+
+/* ================================================== */
+
+static void
+compile_node(ARR_Instance chunk_array, unsigned int first_chunk, int bits,
+             TableNode *node, State state)
+{
+  unsigned int i, num_chunks, base;
+  PendingNode *pending_nodes;
+  ARR_Instance pending;
+  Chunk *chunks;
+
+  num_chunks = 1U << (bits - CHUNK_BITS);
+  pending = ARR_CreateInstance(sizeof (PendingNode));
+
+  chunks = ARR_GetElement(chunk_array, first_chunk);
+  memset(chunks, 0, num_chunks * sizeof (Chunk));
+  fill_slots(chunks, bits, node, state, 0, 0, pending);
+
+  /* Reserve the chunks of all child nodes */
+  base = ARR_GetSize(chunk_array);
+  ARR_SetSize(chunk_array, base + ARR_GetSize(pending) * NODE_CHUNKS);
+
+  chunks = ARR_GetElement(chunk_array, first_chunk);
+  for (i = 0; i < num_chunks; i++) {
+    chunks[i].base = base;
+    base += count_bits(chunks[i].internal) * NODE_CHUNKS;
+  }
+
+  base = ARR_GetSize(chunk_array) - ARR_GetSize(pending) * NODE_CHUNKS;
+  pending_nodes = ARR_GetElements(pending);
+
+  for (i = 0; i < ARR_GetSize(pending); i++)
+    compile_node(chunk_array, base + i * NODE_CHUNKS, NODE_BITS,
+                 pending_nodes[i].node, pending_nodes[i].state);
+
+  ARR_DestroyInstance(pending);
+}
+
+/* ================================================== */
+
+static CompiledTable *
+compile_table(TableNode *base)
+{
+  CompiledTable *compiled;
+  unsigned int rules;
+  int root_bits;
+
+  root_bits = (get_max_depth(base, 0) + NODE_BITS - 1) / NODE_BITS * NODE_BITS;
+  if (root_bits > MAX_ROOT_BITS)
+    root_bits = MAX_ROOT_BITS;
+
+  rules = count_rules(base);
+  while (root_bits > MIN_ROOT_BITS &&
+         1U << (root_bits - CHUNK_BITS) > ROOT_CHUNKS_PER_RULE * rules)
+    root_bits -= NODE_BITS;
+
+  if (root_bits < MIN_ROOT_BITS)
+    root_bits = MIN_ROOT_BITS;
+
+  compiled = MallocNew(CompiledTable);
+  compiled->root_bits = root_bits;
+  compiled->chunk_array = ARR_CreateInstance(sizeof (Chunk));
+  ARR_SetSize(compiled->chunk_array, 1U << (root_bits - CHUNK_BITS));
+
+  compile_node(compiled->chunk_array, 0, root_bits, base, DENY);
+
+  compiled->chunks = ARR_GetElements(compiled->chunk_array);
+
+  return compiled;
+}
+
+/* ================================================== */
+
+void
+ADF_Compile(ADF_AuthTable table)
+{
+  ADF_PublishCompiled(table, ADF_PrepareCompiled(table));
+}
+
+/* ================================================== */
+
+ADF_CompiledTable
+ADF_PrepareCompiled(ADF_AuthTable table)
+{
+  ADF_CompiledTable result;
+
+  result = MallocNew(struct ADF_CompiledTableInst);
+
+  /* Compile only the tables which were modified */
+  result->compiled4 = !table->compiled4 ? compile_table(&table->base4) : NULL;
+  result->compiled6 = !table->compiled6 ? compile_table(&table->base6) : NULL;
+
+  return result;
+}
+
+/* ================================================== */
+
+void
+ADF_PublishCompiled(ADF_AuthTable table, ADF_CompiledTable compiled)
+{
+  if (compiled->compiled4) {
+    assert(!table->compiled4);
+    table->compiled4 = compiled->compiled4;
+  }
+  if (compiled->compiled6) {
+    assert(!table->compiled6);
+    table->compiled6 = compiled->compiled6;
+  }
+
+  Free(compiled);
+}
@@ -31,6 +31,8 @@
 
 typedef struct ADF_AuthTableInst *ADF_AuthTable;
 
+typedef struct ADF_CompiledTableInst *ADF_CompiledTable;
+
 typedef enum {
   ADF_SUCCESS,
   ADF_BADSUBNET
@@ -67,6 +69,18 @@ extern ADF_Status ADF_DenyAll(ADF_AuthTable table,
 /* Clear up the table */
 extern void ADF_DestroyTable(ADF_AuthTable table);
 
+/* Compile the rules into a read-only structure which speeds up
+   ADF_IsAllowed() until the table is modified again */
+extern void ADF_Compile(ADF_AuthTable table);
+
+/* Compile the rules without changing the table, which allows other threads
+   to use it in the meantime.  The result needs to be passed to
+   ADF_PublishCompiled() before the table is modified. */
+extern ADF_CompiledTable ADF_PrepareCompiled(ADF_AuthTable table);
+
+/* Start using the compiled rules in the table */
+extern void ADF_PublishCompiled(ADF_AuthTable table, ADF_CompiledTable compiled);
+
 /* Check whether a given IP address is allowed by the rules in 
    the table */
 extern int ADF_IsAllowed(ADF_AuthTable table,
@@ -77,4 +91,12 @@ extern int ADF_IsAllowed(ADF_AuthTable table,
 extern int ADF_IsAnyAllowed(ADF_AuthTable table,
                             int family);
 
+/* Call a handler for each subnet of a given family which has its own rule
+   in the table (including the default rule for the whole address space).
+   A more specific subnet is always reported after the subnet containing it. */
+typedef void (*ADF_SubnetHandler)(IPAddr *ip, int subnet_bits, int allow, void *arg);
+
+extern void ADF_IterateSubnets(ADF_AuthTable table, int family,
+                               ADF_SubnetHandler handler, void *arg);
+
 #endif /* GOT_ADDRFILT_H */
@@ -35,11 +35,11 @@
 
 #include "sysincl.h"
 
-#include "array.h"
 #include "clientlog.h"
 #include "conf.h"
 #include "memory.h"
 #include "ntp.h"
+#include "ntp_io.h"
 #include "reports.h"
 #include "util.h"
 #include "logging.h"
@@ -62,8 +62,24 @@ typedef struct {
   NTP_int64 ntp_tx_ts;
 } Record;
 
+/* Records are aligned to the size of a cache line.  With the fields above
+   one record fits exactly in one line. */
+#define RECORD_ALIGNMENT 64
+
 /* Hash table of records, there is a fixed number of records per slot */
-static ARR_Instance records;
+static Record *records;
+static void *records_mem;
+
+/* Previous hash table after expansion.  Its slots are migrated to the new
+   table on demand when a client is accessed and in small steps when a new
+   record is added, so the cost of the expansion is spread over time. */
+static Record *old_records;
+static void *old_records_mem;
+static unsigned int old_slots;
+static unsigned int next_migrated_slot;
+
+/* Number of old slots migrated on each new record */
+#define MIGRATION_STEP 4
 
 #define SLOT_BITS 4
 
@@ -82,6 +98,26 @@ static unsigned int slots;
 /* Maximum number of slots given memory allocation limit */
 static unsigned int max_slots;
 
+/* Records can be updated by the server workers concurrently with the main
+   thread.  Changes in the hash table itself are made only by the main thread
+   with the workers locked. */
+#ifdef HAVE_SERVER_WORKERS
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define FETCH_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define FETCH_AND(x, v) __atomic_fetch_and(&(x), (v), __ATOMIC_RELAXED)
+#define FETCH_OR(x, v) __atomic_fetch_or(&(x), (v), __ATOMIC_RELAXED)
+#define COMPARE_EXCHANGE(x, e, v) \
+  __atomic_compare_exchange_n(&(x), &(e), (v), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define LOAD(x) (x)
+#define STORE(x, v) ((x) = (v))
+#define FETCH_ADD(x, v) ((x) += (v))
+#define FETCH_AND(x, v) ((x) &= (v))
+#define FETCH_OR(x, v) ((x) |= (v))
+#define COMPARE_EXCHANGE(x, e, v) ((x) == (e) ? ((x) = (v), 1) : ((e) = (x), 0))
+#endif
+
 /* Times of last hits are saved as 32-bit fixed point values */
 #define TS_FRAC 4
 #define INVALID_TS 0
@@ -131,6 +167,9 @@ static int cmd_leak_rate;
 /* NTP limit interval in log2 */
 static int ntp_limit_interval;
 
+/* Configured NTP burst */
+static int ntp_limit_burst;
+
 /* Flag indicating whether facility is turned on or not */
 static int active;
 
@@ -162,52 +201,147 @@ compare_ts(uint32_t x, uint32_t y)
 /* ================================================== */
 
 static Record *
-get_record(IPAddr *ip)
+allocate_table(unsigned int n_slots, void **mem)
 {
-  unsigned int first, i;
-  time_t last_hit, oldest_hit = 0;
-  Record *record, *oldest_record;
+  Record *table;
+  unsigned int i;
 
-  if (!active || (ip->family != IPADDR_INET4 && ip->family != IPADDR_INET6))
-    return NULL;
+  *mem = Malloc(n_slots * SLOT_SIZE * sizeof (Record) + RECORD_ALIGNMENT);
+  table = (Record *)(((uintptr_t)*mem + RECORD_ALIGNMENT - 1) &
+                     ~(uintptr_t)(RECORD_ALIGNMENT - 1));
 
-  while (1) {
-    /* Get index of the first record in the slot */
-    first = UTI_IPToHash(ip) % slots * SLOT_SIZE;
+  /* Mark all records as empty */
+  for (i = 0; i < n_slots * SLOT_SIZE; i++)
+    table[i].ip_addr.family = IPADDR_UNSPEC;
 
-    for (i = 0, oldest_record = NULL; i < SLOT_SIZE; i++) {
-      record = ARR_GetElement(records, first + i);
+  return table;
+}
 
-      if (!UTI_CompareIPs(ip, &record->ip_addr, NULL))
-        return record;
+/* ================================================== */
+/* Find the record of an address in a slot, or an empty record in the slot.
+   If there is no such record, return NULL and the oldest record if
+   requested. */
 
-      if (record->ip_addr.family == IPADDR_UNSPEC)
-        break;
+static Record *
+find_record(Record *table, unsigned int slot, IPAddr *ip, Record **oldest_record)
+{
+  uint32_t last_hit, oldest_hit = 0;
+  Record *record, *oldest;
+  unsigned int i;
+
+  for (i = 0, oldest = NULL; i < SLOT_SIZE; i++) {
+    record = &table[slot * SLOT_SIZE + i];
 
-      last_hit = compare_ts(record->last_ntp_hit, record->last_cmd_hit) > 0 ?
-                 record->last_ntp_hit : record->last_cmd_hit;
+    if (record->ip_addr.family == IPADDR_UNSPEC ||
+        !UTI_CompareIPs(ip, &record->ip_addr, NULL))
+      return record;
 
-      if (!oldest_record || compare_ts(oldest_hit, last_hit) > 0 ||
-          (oldest_hit == last_hit && record->ntp_hits + record->cmd_hits <
-           oldest_record->ntp_hits + oldest_record->cmd_hits)) {
-        oldest_record = record;
-        oldest_hit = last_hit;
-      }
+    if (!oldest_record)
+      continue;
+
+    last_hit = compare_ts(LOAD(record->last_ntp_hit), record->last_cmd_hit) > 0 ?
+               LOAD(record->last_ntp_hit) : record->last_cmd_hit;
+
+    if (!oldest || compare_ts(oldest_hit, last_hit) > 0 ||
+        (oldest_hit == last_hit && LOAD(record->ntp_hits) + record->cmd_hits <
+         LOAD(oldest->ntp_hits) + oldest->cmd_hits)) {
+      oldest = record;
+      oldest_hit = last_hit;
     }
+  }
 
-    /* If the slot still has an empty record, use it */
-    if (record->ip_addr.family == IPADDR_UNSPEC)
+  if (oldest_record)
+    *oldest_record = oldest;
+
+  return NULL;
+}
+
+/* ================================================== */
+
+static void
+migrate_slot(unsigned int slot)
+{
+  Record *old_record, *new_record;
+  unsigned int i;
+
+  for (i = 0; i < SLOT_SIZE; i++) {
+    old_record = &old_records[slot * SLOT_SIZE + i];
+    if (old_record->ip_addr.family == IPADDR_UNSPEC)
       break;
 
+    /* Records from one old slot are distributed between two new slots,
+       which cannot have any other records yet */
+    new_record = find_record(records, UTI_IPToHash(&old_record->ip_addr) % slots,
+                             &old_record->ip_addr, NULL);
+    assert(new_record && new_record->ip_addr.family == IPADDR_UNSPEC);
+    *new_record = *old_record;
+  }
+
+  while (i > 0)
+    old_records[slot * SLOT_SIZE + --i].ip_addr.family = IPADDR_UNSPEC;
+}
+
+/* ================================================== */
+
+static void
+migrate_slots(unsigned int n)
+{
+  for (; n > 0 && next_migrated_slot < old_slots; n--)
+    migrate_slot(next_migrated_slot++);
+
+  if (next_migrated_slot < old_slots)
+    return;
+
+  Free(old_records_mem);
+  old_records = old_records_mem = NULL;
+  old_slots = 0;
+}
+
+/* ================================================== */
+/* Get the record of an address, or create a new record.  This can be called
+   only from the main thread. */
+
+static Record *
+get_record(IPAddr *ip)
+{
+  Record *record, *oldest_record;
+  uint32_t hash;
+
+  if (!active || (ip->family != IPADDR_INET4 && ip->family != IPADDR_INET6))
+    return NULL;
+
+  hash = UTI_IPToHash(ip);
+
+  /* Move the client's slot from the old table if it was not migrated yet */
+  if (old_records &&
+      old_records[hash % old_slots * SLOT_SIZE].ip_addr.family != IPADDR_UNSPEC) {
+    NIO_LockServerWorkers();
+    migrate_slot(hash % old_slots);
+    NIO_UnlockServerWorkers();
+  }
+
+  record = find_record(records, hash % slots, ip, &oldest_record);
+  if (record && record->ip_addr.family != IPADDR_UNSPEC)
+    return record;
+
+  NIO_LockServerWorkers();
+
+  if (old_records)
+    migrate_slots(MIGRATION_STEP);
+
+  while (!record) {
     /* Resize the table if possible and try again as the new slot may
        have some empty records */
-    if (expand_hashtable())
+    if (expand_hashtable()) {
+      if (old_records)
+        migrate_slot(hash % old_slots);
+      record = find_record(records, hash % slots, ip, &oldest_record);
       continue;
+    }
 
     /* There is no other option, replace the oldest record */
     record = oldest_record;
     total_record_drops++;
-    break;
   }
 
   record->ip_addr = *ip;
@@ -222,52 +356,61 @@ get_record(IPAddr *ip)
   UTI_ZeroNtp64(&record->ntp_rx_ts);
   UTI_ZeroNtp64(&record->ntp_tx_ts);
 
+  NIO_UnlockServerWorkers();
+
   return record;
 }
 
 /* ================================================== */
+/* Get an existing record of an address without modifying the hash table.
+   This can be called from the server workers. */
 
-static int
-expand_hashtable(void)
+static Record *
+get_existing_record(IPAddr *ip)
 {
-  ARR_Instance old_records;
-  Record *old_record, *new_record;
-  unsigned int i;
+  Record *record;
+  uint32_t hash;
 
-  old_records = records;
+  if (ip->family != IPADDR_INET4 && ip->family != IPADDR_INET6)
+    return NULL;
 
-  if (2 * slots > max_slots)
-    return 0;
+  hash = UTI_IPToHash(ip);
 
-  records = ARR_CreateInstance(sizeof (Record));
+  record = find_record(records, hash % slots, ip, NULL);
+  if (record && record->ip_addr.family != IPADDR_UNSPEC)
+    return record;
 
-  slots = MAX(MIN_SLOTS, 2 * slots);
-  assert(slots <= max_slots);
+  if (!old_records)
+    return NULL;
 
-  ARR_SetSize(records, slots * SLOT_SIZE);
+  record = find_record(old_records, hash % old_slots, ip, NULL);
+  if (record && record->ip_addr.family != IPADDR_UNSPEC)
+    return record;
 
-  /* Mark all new records as empty */
-  for (i = 0; i < slots * SLOT_SIZE; i++) {
-    new_record = ARR_GetElement(records, i);
-    new_record->ip_addr.family = IPADDR_UNSPEC;
-  }
+  return NULL;
+}
 
-  if (!old_records)
-    return 1;
+/* ================================================== */
 
-  /* Copy old records to the new hash table */
-  for (i = 0; i < ARR_GetSize(old_records); i++) {
-    old_record = ARR_GetElement(old_records, i);
-    if (old_record->ip_addr.family == IPADDR_UNSPEC)
-      continue;
+static int
+expand_hashtable(void)
+{
+  if (2 * slots > max_slots)
+    return 0;
 
-    new_record = get_record(&old_record->ip_addr);
+  /* Finish the migration from the previous expansion */
+  if (old_records)
+    migrate_slots(old_slots);
 
-    assert(new_record);
-    *new_record = *old_record;
-  }
+  old_records = records;
+  old_records_mem = records_mem;
+  old_slots = old_records ? slots : 0;
+  next_migrated_slot = 0;
+
+  slots = MAX(MIN_SLOTS, 2 * slots);
+  assert(slots <= max_slots);
 
-  ARR_DestroyInstance(old_records);
+  records = allocate_table(slots, &records_mem);
 
   return 1;
 }
@@ -313,12 +456,14 @@ CLG_Initialise(void)
   ntp_token_shift = cmd_token_shift = 0;
   ntp_leak_rate = cmd_leak_rate = 0;
   ntp_limit_interval = MIN_LIMIT_INTERVAL;
+  ntp_limit_burst = 0;
 
   if (CNF_GetNTPRateLimit(&interval, &burst, &leak_rate)) {
     set_bucket_params(interval, burst, &max_ntp_tokens, &ntp_tokens_per_packet,
                       &ntp_token_shift);
     ntp_leak_rate = CLAMP(MIN_LEAK_RATE, leak_rate, MAX_LEAK_RATE);
     ntp_limit_interval = CLAMP(MIN_LIMIT_INTERVAL, interval, MAX_LIMIT_INTERVAL);
+    ntp_limit_burst = CLAMP(MIN_LIMIT_BURST, burst, MAX_LIMIT_BURST);
   }
 
   if (CNF_GetCommandRateLimit(&interval, &burst, &leak_rate)) {
@@ -341,7 +486,9 @@ CLG_Initialise(void)
   max_slots = CLAMP(MIN_SLOTS, max_slots, MAX_SLOTS);
 
   slots = 0;
-  records = NULL;
+  records = old_records = NULL;
+  records_mem = old_records_mem = NULL;
+  old_slots = 0;
 
   expand_hashtable();
 
@@ -357,7 +504,8 @@ CLG_Finalise(void)
   if (!active)
     return;
 
-  ARR_DestroyInstance(records);
+  Free(records_mem);
+  Free(old_records_mem);
 }
 
 /* ================================================== */
@@ -384,13 +532,16 @@ update_record(struct timespec *now, uint32_t *last_hit, uint32_t *hits,
               uint16_t *tokens, uint32_t max_tokens, int token_shift, int8_t *rate)
 {
   uint32_t interval, now_ts, prev_hit, new_tokens;
+  uint16_t prev_tokens;
+  int8_t prev_rate;
   int interval2;
 
   now_ts = get_ts_from_timespec(now);
 
-  prev_hit = *last_hit;
-  *last_hit = now_ts;
-  (*hits)++;
+  prev_hit = LOAD(*last_hit);
+  while (!COMPARE_EXCHANGE(*last_hit, prev_hit, now_ts))
+    ;
+  FETCH_ADD(*hits, 1);
 
   interval = now_ts - prev_hit;
 
@@ -403,7 +554,10 @@ update_record(struct timespec *now, uint32_t *last_hit, uint32_t *hits,
     new_tokens = max_tokens;
   else
     new_tokens = (now_ts - prev_hit) << -token_shift;
-  *tokens = MIN(*tokens + new_tokens, max_tokens);
+
+  prev_tokens = LOAD(*tokens);
+  while (!COMPARE_EXCHANGE(*tokens, prev_tokens, MIN(prev_tokens + new_tokens, max_tokens)))
+    ;
 
   /* Convert the interval to scaled and rounded log2 */
   if (interval) {
@@ -418,17 +572,20 @@ update_record(struct timespec *now, uint32_t *last_hit, uint32_t *hits,
     interval2 = -RATE_SCALE * (TS_FRAC + 1);
   }
 
-  /* Update the rate in a rough approximation of exponential moving average */
-  if (*rate == INVALID_RATE) {
-    *rate = -interval2;
+  /* Update the rate in a rough approximation of exponential moving average.
+     A concurrent update may be lost, which is not important for the
+     estimate. */
+  prev_rate = LOAD(*rate);
+  if (prev_rate == INVALID_RATE) {
+    STORE(*rate, -interval2);
   } else {
-    if (*rate < -interval2) {
-      (*rate)++;
-    } else if (*rate > -interval2) {
-      if (*rate > RATE_SCALE * 5 / 2 - interval2)
-        *rate = RATE_SCALE * 5 / 2 - interval2;
+    if (prev_rate < -interval2) {
+      STORE(*rate, prev_rate + 1);
+    } else if (prev_rate > -interval2) {
+      if (prev_rate > RATE_SCALE * 5 / 2 - interval2)
+        STORE(*rate, RATE_SCALE * 5 / 2 - interval2);
       else
-        *rate = (*rate - interval2 - 1) / 2;
+        STORE(*rate, (prev_rate - interval2 - 1) / 2);
     }
   }
 }
@@ -438,7 +595,17 @@ update_record(struct timespec *now, uint32_t *last_hit, uint32_t *hits,
 static int
 get_index(Record *record)
 {
-  return record - (Record *)ARR_GetElements(records);
+  return record - records;
+}
+
+/* ================================================== */
+
+static Record *
+get_record_by_index(int index)
+{
+  if (index < slots * SLOT_SIZE)
+    return &records[index];
+  return &old_records[index - slots * SLOT_SIZE];
 }
 
 /* ================================================== */
@@ -457,27 +624,35 @@ CLG_GetClientIndex(IPAddr *client)
 
 /* ================================================== */
 
+static void
+log_ntp_access(Record *record, struct timespec *now)
+{
+  /* Update one of the two rates depending on whether the previous request
+     of the client had a reply or it timed out */
+  update_record(now, &record->last_ntp_hit, &record->ntp_hits,
+                &record->ntp_tokens, max_ntp_tokens, ntp_token_shift,
+                LOAD(record->flags) & FLAG_NTP_DROPPED ?
+                &record->ntp_timeout_rate : &record->ntp_rate);
+}
+
+/* ================================================== */
+
 int
 CLG_LogNTPAccess(IPAddr *client, struct timespec *now)
 {
   Record *record;
 
-  total_ntp_hits++;
+  FETCH_ADD(total_ntp_hits, 1);
 
   record = get_record(client);
   if (record == NULL)
     return -1;
 
-  /* Update one of the two rates depending on whether the previous request
-     of the client had a reply or it timed out */
-  update_record(now, &record->last_ntp_hit, &record->ntp_hits,
-                &record->ntp_tokens, max_ntp_tokens, ntp_token_shift,
-                record->flags & FLAG_NTP_DROPPED ?
-                &record->ntp_timeout_rate : &record->ntp_rate);
+  log_ntp_access(record, now);
 
   DEBUG_LOG("NTP hits %"PRIu32" rate %d trate %d tokens %d",
-            record->ntp_hits, record->ntp_rate, record->ntp_timeout_rate,
-            record->ntp_tokens);
+            LOAD(record->ntp_hits), LOAD(record->ntp_rate),
+            LOAD(record->ntp_timeout_rate), LOAD(record->ntp_tokens));
 
   return get_index(record);
 }
@@ -529,48 +704,93 @@ limit_response_random(int leak_rate)
 
 /* ================================================== */
 
-int
-CLG_LimitNTPResponseRate(int index)
+static int
+take_ntp_tokens(Record *record)
 {
-  Record *record;
-  int drop;
+  uint16_t tokens;
 
-  if (!ntp_tokens_per_packet)
-    return 0;
-
-  record = ARR_GetElement(records, index);
-  record->flags &= ~FLAG_NTP_DROPPED;
+  FETCH_AND(record->flags, ~FLAG_NTP_DROPPED);
 
-  if (record->ntp_tokens >= ntp_tokens_per_packet) {
-    record->ntp_tokens -= ntp_tokens_per_packet;
-    return 0;
+  tokens = LOAD(record->ntp_tokens);
+  while (tokens >= ntp_tokens_per_packet) {
+    if (COMPARE_EXCHANGE(record->ntp_tokens, tokens, tokens - ntp_tokens_per_packet))
+      return 1;
   }
 
-  drop = limit_response_random(ntp_leak_rate);
+  return 0;
+}
+
+/* ================================================== */
+
+static int
+drop_ntp_response(Record *record, int drop)
+{
+  int8_t timeout_rate = LOAD(record->ntp_timeout_rate);
 
   /* Poorly implemented clients may send new requests at even a higher rate
      when they are not getting replies.  If the request rate seems to be more
      than twice as much as when replies are sent, give up on rate limiting to
      reduce the amount of traffic.  Invert the sense of the leak to respond to
      most of the requests, but still keep the estimated rate updated. */
-  if (record->ntp_timeout_rate != INVALID_RATE &&
-      record->ntp_timeout_rate > record->ntp_rate + RATE_SCALE)
+  if (timeout_rate != INVALID_RATE && timeout_rate > LOAD(record->ntp_rate) + RATE_SCALE)
     drop = !drop;
 
   if (!drop) {
-    record->ntp_tokens = 0;
+    STORE(record->ntp_tokens, 0);
     return 0;
   }
 
-  record->flags |= FLAG_NTP_DROPPED;
-  record->ntp_drops++;
-  total_ntp_drops++;
+  FETCH_OR(record->flags, FLAG_NTP_DROPPED);
+  FETCH_ADD(record->ntp_drops, 1);
+  FETCH_ADD(total_ntp_drops, 1);
 
   return 1;
 }
 
 /* ================================================== */
 
+int
+CLG_LimitNTPResponseRate(int index)
+{
+  Record *record;
+
+  if (!ntp_tokens_per_packet)
+    return 0;
+
+  record = get_record_by_index(index);
+
+  if (take_ntp_tokens(record))
+    return 0;
+
+  return drop_ntp_response(record, limit_response_random(ntp_leak_rate));
+}
+
+/* ================================================== */
+
+int
+CLG_LogAndLimitNTPAccess(IPAddr *client, struct timespec *now, uint32_t random)
+{
+  Record *record;
+
+  if (!active)
+    return 0;
+
+  record = get_existing_record(client);
+  if (!record)
+    return -1;
+
+  FETCH_ADD(total_ntp_hits, 1);
+
+  log_ntp_access(record, now);
+
+  if (!ntp_tokens_per_packet || take_ntp_tokens(record))
+    return 0;
+
+  return drop_ntp_response(record, random % (1U << ntp_leak_rate) ? 1 : 0);
+}
+
+/* ================================================== */
+
 int
 CLG_LimitCommandResponseRate(int index)
 {
@@ -579,7 +799,7 @@ CLG_LimitCommandResponseRate(int index)
   if (!cmd_tokens_per_packet)
     return 0;
 
-  record = ARR_GetElement(records, index);
+  record = get_record_by_index(index);
 
   if (record->cmd_tokens >= cmd_tokens_per_packet) {
     record->cmd_tokens -= cmd_tokens_per_packet;
@@ -603,7 +823,7 @@ void CLG_GetNtpTimestamps(int index, NTP_int64 **rx_ts, NTP_int64 **tx_ts)
 {
   Record *record;
 
-  record = ARR_GetElement(records, index);
+  record = get_record_by_index(index);
 
   *rx_ts = &record->ntp_rx_ts;
   *tx_ts = &record->ntp_tx_ts;
@@ -619,13 +839,28 @@ CLG_GetNtpMinPoll(void)
 
 /* ================================================== */
 
+int
+CLG_GetNtpRateLimit(int *interval, int *burst, int *leak_rate)
+{
+  if (!ntp_tokens_per_packet)
+    return 0;
+
+  *interval = ntp_limit_interval;
+  *burst = ntp_limit_burst;
+  *leak_rate = ntp_leak_rate;
+
+  return 1;
+}
+
+/* ================================================== */
+
 int
 CLG_GetNumberOfIndices(void)
 {
   if (!active)
     return -1;
 
-  return ARR_GetSize(records);
+  return (slots + old_slots) * SLOT_SIZE;
 }
 
 /* ================================================== */
@@ -658,10 +893,10 @@ CLG_GetClientAccessReportByIndex(int index, RPT_ClientAccessByIndex_Report *repo
   Record *record;
   uint32_t now_ts;
 
-  if (!active || index < 0 || index >= ARR_GetSize(records))
+  if (!active || index < 0 || index >= (slots + old_slots) * SLOT_SIZE)
     return 0;
 
-  record = ARR_GetElement(records, index);
+  record = get_record_by_index(index);
 
   if (record->ip_addr.family == IPADDR_UNSPEC)
     return 0;
@@ -669,14 +904,14 @@ CLG_GetClientAccessReportByIndex(int index, RPT_ClientAccessByIndex_Report *repo
   now_ts = get_ts_from_timespec(now);
 
   report->ip_addr = record->ip_addr;
-  report->ntp_hits = record->ntp_hits;
+  report->ntp_hits = LOAD(record->ntp_hits);
   report->cmd_hits = record->cmd_hits;
-  report->ntp_drops = record->ntp_drops;
+  report->ntp_drops = LOAD(record->ntp_drops);
   report->cmd_drops = record->cmd_drops;
-  report->ntp_interval = get_interval(record->ntp_rate);
+  report->ntp_interval = get_interval(LOAD(record->ntp_rate));
   report->cmd_interval = get_interval(record->cmd_rate);
-  report->ntp_timeout_interval = get_interval(record->ntp_timeout_rate);
-  report->last_ntp_hit_ago = get_last_ago(now_ts, record->last_ntp_hit);
+  report->ntp_timeout_interval = get_interval(LOAD(record->ntp_timeout_rate));
+  report->last_ntp_hit_ago = get_last_ago(now_ts, LOAD(record->last_ntp_hit));
   report->last_cmd_hit_ago = get_last_ago(now_ts, record->last_cmd_hit);
 
   return 1;
@@ -687,9 +922,16 @@ CLG_GetClientAccessReportByIndex(int index, RPT_ClientAccessByIndex_Report *repo
 void
 CLG_GetServerStatsReport(RPT_ServerStatsReport *report)
 {
-  report->ntp_hits = total_ntp_hits;
+  uint32_t kernel_hits, kernel_drops;
+
+  report->ntp_hits = LOAD(total_ntp_hits);
   report->cmd_hits = total_cmd_hits;
-  report->ntp_drops = total_ntp_drops;
+  report->ntp_drops = LOAD(total_ntp_drops);
   report->cmd_drops = total_cmd_drops;
   report->log_drops = total_record_drops;
+
+  /* Add requests which were handled by the kernel */
+  NIO_GetKernelServerStats(&kernel_hits, &kernel_drops);
+  report->ntp_hits += kernel_hits;
+  report->ntp_drops += kernel_drops;
 }
@@ -37,10 +37,21 @@ extern int CLG_GetClientIndex(IPAddr *client);
 extern int CLG_LogNTPAccess(IPAddr *client, struct timespec *now);
 extern int CLG_LogCommandAccess(IPAddr *client, struct timespec *now);
 extern int CLG_LimitNTPResponseRate(int index);
+
+/* Log an NTP request and check its rate if the client already has a record
+   (i.e. without modifying the table of clients).  It can be called from
+   the server workers.  Return -1 if the client has no record, 1 if the
+   response should be dropped, and 0 otherwise. */
+extern int CLG_LogAndLimitNTPAccess(IPAddr *client, struct timespec *now, uint32_t random);
+
 extern int CLG_LimitCommandResponseRate(int index);
 extern void CLG_GetNtpTimestamps(int index, NTP_int64 **rx_ts, NTP_int64 **tx_ts);
 extern int CLG_GetNtpMinPoll(void);
 
+/* Get the clamped NTP rate limiting parameters.  Return zero if the rate
+   limiting is disabled. */
+extern int CLG_GetNtpRateLimit(int *interval, int *burst, int *leak_rate);
+
 /* And some reporting functions, for use by chronyc. */
 
 extern int CLG_GetNumberOfIndices(void);
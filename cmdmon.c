@@ -37,6 +37,7 @@
 #include "keys.h"
 #include "ntp_sources.h"
 #include "ntp_core.h"
+#include "nts_ke.h"
 #include "smooth.h"
 #include "sources.h"
 #include "sourcestats.h"
@@ -722,6 +723,7 @@ static void
 handle_rekey(CMD_Request *rx_message, CMD_Reply *tx_message)
 {
   KEY_Reload();
+  NKE_ReloadKeys();
 }
 
 /* ================================================== */
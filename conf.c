@@ -51,6 +51,7 @@ static int parse_double(char *line, double *result);
 static int parse_null(char *line);
 
 static void parse_allow_deny(char *line, ARR_Instance restrictions, int allow);
+static void parse_allow_deny_file(char *line, ARR_Instance restrictions, int allow);
 static void parse_bindacqaddress(char *);
 static void parse_bindaddress(char *);
 static void parse_bindcmdaddress(char *);
@@ -58,6 +59,7 @@ static void parse_broadcast(char *);
 static void parse_clientloglimit(char *);
 static void parse_fallbackdrift(char *);
 static void parse_hwtimestamp(char *);
+static void parse_ntsntpserver(char *);
 static void parse_include(char *);
 static void parse_initstepslew(char *);
 static void parse_leapsecmode(char *);
@@ -72,6 +74,7 @@ static void parse_refclock(char *);
 static void parse_smoothtime(char *);
 static void parse_source(char *line, NTP_Source_Type type, int pool);
 static void parse_tempcomp(char *);
+static void parse_xdpinterface(char *);
 
 /* ================================================== */
 /* Configuration variables */
@@ -79,7 +82,9 @@ static void parse_tempcomp(char *);
 static int restarted = 0;
 static char *rtc_device;
 static int acquisition_port = -1;
+static int acquisition_rotate = 0;
 static int ntp_port = NTP_PORT;
+static int server_workers = 0;
 static char *keys_file = NULL;
 static char *drift_file = NULL;
 static char *rtc_file = NULL;
@@ -225,13 +230,23 @@ static char *user;
 
 /* NTS certificates and private key */
 static char *nts_ca_cert_file = NULL;
+static char *nts_dump_dir = NULL;
+static int nts_rotate = 3600;
 static char *nts_server_cert_file = NULL;
 static char *nts_server_key_file = NULL;
 static int nts_server_port = 11443;
+static int max_nts_connections = 100;
+static int nts_server_threads = 1;
+
+/* Array of CNF_NtsNtpServer */
+static ARR_Instance nts_ntp_servers;
 
 /* Array of CNF_HwTsInterface */
 static ARR_Instance hwts_interfaces;
 
+/* Array of (char *) */
+static ARR_Instance xdp_interfaces;
+
 typedef struct {
   NTP_Source_Type type;
   int pool;
@@ -334,6 +349,8 @@ CNF_Initialise(int r, int client_only)
   restarted = r;
 
   hwts_interfaces = ARR_CreateInstance(sizeof (CNF_HwTsInterface));
+  xdp_interfaces = ARR_CreateInstance(sizeof (char *));
+  nts_ntp_servers = ARR_CreateInstance(sizeof (CNF_NtsNtpServer));
 
   init_sources = ARR_CreateInstance(sizeof (IPAddr));
   ntp_sources = ARR_CreateInstance(sizeof (NTP_Source));
@@ -370,6 +387,14 @@ CNF_Finalise(void)
     Free(((CNF_HwTsInterface *)ARR_GetElement(hwts_interfaces, i))->name);
   ARR_DestroyInstance(hwts_interfaces);
 
+  for (i = 0; i < ARR_GetSize(xdp_interfaces); i++)
+    Free(*(char **)ARR_GetElement(xdp_interfaces, i));
+  ARR_DestroyInstance(xdp_interfaces);
+
+  for (i = 0; i < ARR_GetSize(nts_ntp_servers); i++)
+    Free(((CNF_NtsNtpServer *)ARR_GetElement(nts_ntp_servers, i))->name);
+  ARR_DestroyInstance(nts_ntp_servers);
+
   for (i = 0; i < ARR_GetSize(ntp_sources); i++)
     Free(((NTP_Source *)ARR_GetElement(ntp_sources, i))->params.name);
 
@@ -397,6 +422,7 @@ CNF_Finalise(void)
   Free(tempcomp_sensor_file);
   Free(tempcomp_point_file);
   Free(nts_ca_cert_file);
+  Free(nts_dump_dir);
   Free(nts_server_cert_file);
   Free(nts_server_key_file);
 }
@@ -452,8 +478,12 @@ CNF_ParseLine(const char *filename, int number, char *line)
 
   if (!strcasecmp(command, "acquisitionport")) {
     parse_int(p, &acquisition_port);
+  } else if (!strcasecmp(command, "acquisitionrotate")) {
+    parse_int(p, &acquisition_rotate);
   } else if (!strcasecmp(command, "allow")) {
     parse_allow_deny(p, ntp_restrictions, 1);
+  } else if (!strcasecmp(command, "allowfile")) {
+    parse_allow_deny_file(p, ntp_restrictions, 1);
   } else if (!strcasecmp(command, "bindacqaddress")) {
     parse_bindacqaddress(p);
   } else if (!strcasecmp(command, "bindaddress")) {
@@ -479,6 +509,8 @@ CNF_ParseLine(const char *filename, int number, char *line)
     parse_double(p, &correction_time_ratio);
   } else if (!strcasecmp(command, "deny")) {
     parse_allow_deny(p, ntp_restrictions, 0);
+  } else if (!strcasecmp(command, "denyfile")) {
+    parse_allow_deny_file(p, ntp_restrictions, 0);
   } else if (!strcasecmp(command, "driftfile")) {
     parse_string(p, &drift_file);
   } else if (!strcasecmp(command, "dumpdir")) {
@@ -529,6 +561,8 @@ CNF_ParseLine(const char *filename, int number, char *line)
     parse_double(p, &max_drift);
   } else if (!strcasecmp(command, "maxjitter")) {
     parse_double(p, &max_jitter);
+  } else if (!strcasecmp(command, "maxntsconnections")) {
+    parse_int(p, &max_nts_connections);
   } else if (!strcasecmp(command, "maxsamples")) {
     parse_int(p, &max_samples);
   } else if (!strcasecmp(command, "maxslewrate")) {
@@ -545,12 +579,20 @@ CNF_ParseLine(const char *filename, int number, char *line)
     parse_string(p, &ntp_signd_socket);
   } else if (!strcasecmp(command, "ntscacert")) {
     parse_string(p, &nts_ca_cert_file);
+  } else if (!strcasecmp(command, "ntsdumpdir")) {
+    parse_string(p, &nts_dump_dir);
+  } else if (!strcasecmp(command, "ntsntpserver")) {
+    parse_ntsntpserver(p);
   } else if (!strcasecmp(command, "ntsport")) {
     parse_int(p, &nts_server_port);
+  } else if (!strcasecmp(command, "ntsrotate")) {
+    parse_int(p, &nts_rotate);
   } else if (!strcasecmp(command, "ntsservercert")) {
     parse_string(p, &nts_server_cert_file);
   } else if (!strcasecmp(command, "ntsserverkey")) {
     parse_string(p, &nts_server_key_file);
+  } else if (!strcasecmp(command, "ntsserverthreads")) {
+    parse_int(p, &nts_server_threads);
   } else if (!strcasecmp(command, "peer")) {
     parse_source(p, NTP_PEER, 0);
   } else if (!strcasecmp(command, "pidfile")) {
@@ -580,6 +622,8 @@ CNF_ParseLine(const char *filename, int number, char *line)
     parse_int(p, &sched_priority);
   } else if (!strcasecmp(command, "server")) {
     parse_source(p, NTP_SERVER, 0);
+  } else if (!strcasecmp(command, "serverworkers")) {
+    parse_int(p, &server_workers);
   } else if (!strcasecmp(command, "smoothtime")) {
     parse_smoothtime(p);
   } else if (!strcasecmp(command, "stratumweight")) {
@@ -588,6 +632,8 @@ CNF_ParseLine(const char *filename, int number, char *line)
     parse_tempcomp(p);
   } else if (!strcasecmp(command, "user")) {
     parse_string(p, &user);
+  } else if (!strcasecmp(command, "xdpinterface")) {
+    parse_xdpinterface(p);
   } else if (!strcasecmp(command, "commandkey") ||
              !strcasecmp(command, "generatecommandkey") ||
              !strcasecmp(command, "linux_freq_scale") ||
@@ -1117,6 +1163,52 @@ parse_allow_deny(char *line, ARR_Instance restrictions, int allow)
   
 /* ================================================== */
 
+static void
+parse_allow_deny_file(char *line, ARR_Instance restrictions, int allow)
+{
+  char buf[256], *slash;
+  int number, bits;
+  AllowDeny *node;
+  IPAddr ip_addr;
+  FILE *in;
+
+  check_number_of_args(line, 1);
+
+  in = fopen(line, "r");
+  if (!in)
+    LOG_FATAL("Could not open %s : %s", line, strerror(errno));
+
+  /* Unlike the allow and deny directives, accept only addresses and
+     subnets in the address/bits notation to quickly load large lists */
+  for (number = 1; fgets(buf, sizeof (buf), in); number++) {
+    CPS_NormalizeLine(buf);
+    if (!*buf)
+      continue;
+
+    slash = strchr(buf, '/');
+    if (slash)
+      *slash++ = '\0';
+
+    if (!UTI_StringToIP(buf, &ip_addr) ||
+        (slash && (sscanf(slash, "%d", &bits) != 1 || bits < 0))) {
+      LOG_FATAL("Could not parse subnet at line %d in file %s", number, line);
+    }
+
+    if (!slash)
+      bits = ip_addr.family == IPADDR_INET6 ? 128 : 32;
+
+    node = ARR_GetNewElement(restrictions);
+    node->allow = allow;
+    node->all = 0;
+    node->ip = ip_addr;
+    node->subnet_bits = bits;
+  }
+
+  fclose(in);
+}
+
+/* ================================================== */
+
 static void
 parse_bindacqaddress(char *line)
 {
@@ -1290,6 +1382,15 @@ parse_tempcomp(char *line)
 
 /* ================================================== */
 
+static void
+parse_xdpinterface(char *line)
+{
+  check_number_of_args(line, 1);
+  *(char **)ARR_GetNewElement(xdp_interfaces) = Strdup(line);
+}
+
+/* ================================================== */
+
 static void
 parse_hwtimestamp(char *line)
 {
@@ -1362,6 +1463,55 @@ parse_hwtimestamp(char *line)
 
 /* ================================================== */
 
+static void
+parse_ntsntpserver(char *line)
+{
+  CNF_NtsNtpServer *server;
+  IPAddr ip;
+  char *p;
+  int n;
+
+  if (!*line) {
+    command_parse_error();
+    return;
+  }
+
+  p = line;
+  line = CPS_SplitWord(line);
+
+  /* NTS clients accept only an address in the server negotiation record */
+  if (!UTI_StringToIP(p, &ip)) {
+    command_parse_error();
+    return;
+  }
+
+  server = ARR_GetNewElement(nts_ntp_servers);
+  server->name = Strdup(p);
+  server->port = 0;
+  server->weight = 1;
+
+  for (p = line; *p; line += n, p = line) {
+    line = CPS_SplitWord(line);
+
+    if (!strcasecmp(p, "port")) {
+      if (sscanf(line, "%d%n", &server->port, &n) != 1 ||
+          server->port <= 0 || server->port > 65535)
+        break;
+    } else if (!strcasecmp(p, "weight")) {
+      if (sscanf(line, "%u%n", &server->weight, &n) != 1 ||
+          server->weight < 1 || server->weight > 1000)
+        break;
+    } else {
+      break;
+    }
+  }
+
+  if (*p)
+    command_parse_error();
+}
+
+/* ================================================== */
+
 static void
 parse_include(char *line)
 {
@@ -1416,6 +1566,8 @@ CNF_CreateDirs(uid_t uid, gid_t gid)
     UTI_CreateDirAndParents(logdir, 0755, uid, gid);
   if (dumpdir[0])
     UTI_CreateDirAndParents(dumpdir, 0755, uid, gid);
+  if (nts_dump_dir)
+    UTI_CreateDirAndParents(nts_dump_dir, 0700, uid, gid);
 }
 
 /* ================================================== */
@@ -1511,6 +1663,14 @@ CNF_GetAcquisitionPort(void)
 
 /* ================================================== */
 
+int
+CNF_GetAcquisitionRotate(void)
+{
+  return acquisition_rotate;
+}
+
+/* ================================================== */
+
 char *
 CNF_GetDriftFile(void)
 {
@@ -1926,6 +2086,14 @@ CNF_GetLeapSecTimezone(void)
 
 /* ================================================== */
 
+int
+CNF_GetServerWorkers(void)
+{
+  return server_workers;
+}
+
+/* ================================================== */
+
 int
 CNF_GetSchedPriority(void)
 {
@@ -2054,6 +2222,18 @@ CNF_GetHwTsInterface(unsigned int index, CNF_HwTsInterface **iface)
 
 /* ================================================== */
 
+int
+CNF_GetXdpInterface(unsigned int index, char **iface)
+{
+  if (index >= ARR_GetSize(xdp_interfaces))
+    return 0;
+
+  *iface = *(char **)ARR_GetElement(xdp_interfaces, index);
+  return 1;
+}
+
+/* ================================================== */
+
 char *
 CNF_GetNtsCaCertFile(void)
 {
@@ -2062,6 +2242,14 @@ CNF_GetNtsCaCertFile(void)
 
 /* ================================================== */
 
+char *
+CNF_GetNtsDumpDir(void)
+{
+  return nts_dump_dir;
+}
+
+/* ================================================== */
+
 char *
 CNF_GetNtsServerCertFile(void)
 {
@@ -2082,3 +2270,39 @@ CNF_GetNtsServerPort(void)
 {
   return nts_server_port;
 }
+
+/* ================================================== */
+
+int
+CNF_GetMaxNtsConnections(void)
+{
+  return max_nts_connections;
+}
+
+/* ================================================== */
+
+int
+CNF_GetNtsRotate(void)
+{
+  return nts_rotate;
+}
+
+/* ================================================== */
+
+int
+CNF_GetNtsNtpServer(unsigned int index, CNF_NtsNtpServer **server)
+{
+  if (index >= ARR_GetSize(nts_ntp_servers))
+    return 0;
+
+  *server = (CNF_NtsNtpServer *)ARR_GetElement(nts_ntp_servers, index);
+  return 1;
+}
+
+/* ================================================== */
+
+int
+CNF_GetNtsServerThreads(void)
+{
+  return nts_server_threads;
+}
@@ -47,7 +47,9 @@ extern void CNF_AddBroadcasts(void);
 extern void CNF_AddRefclocks(void);
 
 extern int CNF_GetAcquisitionPort(void);
+extern int CNF_GetAcquisitionRotate(void);
 extern int CNF_GetNTPPort(void);
+extern int CNF_GetServerWorkers(void);
 extern char *CNF_GetDriftFile(void);
 extern char *CNF_GetLogDir(void);
 extern char *CNF_GetDumpDir(void);
@@ -139,9 +141,23 @@ typedef struct {
 
 extern int CNF_GetHwTsInterface(unsigned int index, CNF_HwTsInterface **iface);
 
+extern int CNF_GetXdpInterface(unsigned int index, char **iface);
+
 extern char *CNF_GetNtsCaCertFile(void);
+extern char *CNF_GetNtsDumpDir(void);
 extern char *CNF_GetNtsServerCertFile(void);
 extern char *CNF_GetNtsServerKeyFile(void);
 extern int CNF_GetNtsServerPort(void);
+extern int CNF_GetMaxNtsConnections(void);
+extern int CNF_GetNtsRotate(void);
+
+typedef struct {
+  char *name;
+  int port;
+  unsigned int weight;
+} CNF_NtsNtpServer;
+
+extern int CNF_GetNtsNtpServer(unsigned int index, CNF_NtsNtpServer **server);
+extern int CNF_GetNtsServerThreads(void);
 
 #endif /* GOT_CONF_H */
@@ -38,6 +38,20 @@ extern unsigned int HSH_Hash(int id,
     const unsigned char *in2, unsigned int in2_len,
     unsigned char *out, unsigned int out_len);
 
+/* Saved state of a hash function after processing some input */
+typedef struct HSH_StateInstance *HSH_State;
+
+/* Create a state of a hash function after processing the input.  Hashing
+   data from the state gives the same result as HSH_Hash() with the input
+   followed by the data. */
+extern HSH_State HSH_CreateState(int id, const unsigned char *in, unsigned int in_len);
+
+extern unsigned int HSH_HashState(HSH_State state,
+    const unsigned char *in, unsigned int in_len,
+    unsigned char *out, unsigned int out_len);
+
+extern void HSH_DestroyState(HSH_State state);
+
 extern void HSH_Finalise(void);
 
 #endif
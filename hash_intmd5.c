@@ -35,6 +35,10 @@
 
 static MD5_CTX ctx;
 
+struct HSH_StateInstance {
+  MD5_CTX ctx;
+};
+
 int
 HSH_GetHashId(const char *name)
 {
@@ -63,6 +67,39 @@ HSH_Hash(int id, const unsigned char *in1, unsigned int in1_len,
   return out_len;
 }
 
+HSH_State
+HSH_CreateState(int id, const unsigned char *in, unsigned int in_len)
+{
+  HSH_State state;
+
+  state = MallocNew(struct HSH_StateInstance);
+  MD5Init(&state->ctx);
+  MD5Update(&state->ctx, in, in_len);
+
+  return state;
+}
+
+unsigned int
+HSH_HashState(HSH_State state, const unsigned char *in, unsigned int in_len,
+              unsigned char *out, unsigned int out_len)
+{
+  ctx = state->ctx;
+  MD5Update(&ctx, in, in_len);
+  MD5Final(&ctx);
+
+  out_len = MIN(out_len, 16);
+
+  memcpy(out, ctx.digest, out_len);
+
+  return out_len;
+}
+
+void
+HSH_DestroyState(HSH_State state)
+{
+  Free(state);
+}
+
 void
 HSH_Finalise(void)
 {
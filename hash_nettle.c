@@ -55,6 +55,11 @@ static struct hash hashes[] = {
   { NULL, NULL, NULL, NULL }
 };
 
+struct HSH_StateInstance {
+  int id;
+  void *context;
+};
+
 int
 HSH_GetHashId(const char *name)
 {
@@ -108,6 +113,51 @@ HSH_Hash(int id, const unsigned char *in1, unsigned int in1_len,
   return out_len;
 }
 
+HSH_State
+HSH_CreateState(int id, const unsigned char *in, unsigned int in_len)
+{
+  const struct nettle_hash *hash;
+  HSH_State state;
+
+  hash = hashes[id].nettle_hash;
+
+  state = MallocNew(struct HSH_StateInstance);
+  state->id = id;
+  state->context = Malloc(hash->context_size);
+
+  hash->init(state->context);
+  hash->update(state->context, in_len, in);
+
+  return state;
+}
+
+unsigned int
+HSH_HashState(HSH_State state, const unsigned char *in, unsigned int in_len,
+              unsigned char *out, unsigned int out_len)
+{
+  const struct nettle_hash *hash;
+  void *context;
+
+  hash = hashes[state->id].nettle_hash;
+  context = hashes[state->id].context;
+
+  if (out_len > hash->digest_size)
+    out_len = hash->digest_size;
+
+  memcpy(context, state->context, hash->context_size);
+  hash->update(context, in_len, in);
+  hash->digest(context, out_len, out);
+
+  return out_len;
+}
+
+void
+HSH_DestroyState(HSH_State state)
+{
+  Free(state->context);
+  Free(state);
+}
+
 void
 HSH_Finalise(void)
 {
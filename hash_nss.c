@@ -32,6 +32,7 @@
 #include <nsslowhash.h>
 
 #include "hash.h"
+#include "memory.h"
 #include "util.h"
 
 static NSSLOWInitContext *ictx;
@@ -51,6 +52,13 @@ static struct hash hashes[] = {
   { 0, NULL, NULL }
 };
 
+/* The library cannot copy contexts, the state keeps the input */
+struct HSH_StateInstance {
+  int id;
+  unsigned char *in;
+  unsigned int in_len;
+};
+
 int
 HSH_GetHashId(const char *name)
 {
@@ -94,6 +102,34 @@ HSH_Hash(int id, const unsigned char *in1, unsigned int in1_len,
   return ret;
 }
 
+HSH_State
+HSH_CreateState(int id, const unsigned char *in, unsigned int in_len)
+{
+  HSH_State state;
+
+  state = MallocNew(struct HSH_StateInstance);
+  state->id = id;
+  state->in = MallocArray(unsigned char, in_len);
+  memcpy(state->in, in, in_len);
+  state->in_len = in_len;
+
+  return state;
+}
+
+unsigned int
+HSH_HashState(HSH_State state, const unsigned char *in, unsigned int in_len,
+              unsigned char *out, unsigned int out_len)
+{
+  return HSH_Hash(state->id, state->in, state->in_len, in, in_len, out, out_len);
+}
+
+void
+HSH_DestroyState(HSH_State state)
+{
+  Free(state->in);
+  Free(state);
+}
+
 void
 HSH_Finalise(void)
 {
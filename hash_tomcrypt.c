@@ -29,6 +29,7 @@
 
 #include "config.h"
 #include "hash.h"
+#include "memory.h"
 #include "util.h"
 
 struct hash {
@@ -78,6 +79,11 @@ static const struct hash hashes[] = {
   { NULL, NULL, NULL }
 };
 
+struct HSH_StateInstance {
+  int id;
+  hash_state md;
+};
+
 int
 HSH_GetHashId(const char *name)
 {
@@ -127,6 +133,49 @@ HSH_Hash(int id, const unsigned char *in1, unsigned int in1_len,
   return len;
 }
 
+HSH_State
+HSH_CreateState(int id, const unsigned char *in, unsigned int in_len)
+{
+  HSH_State state;
+
+  state = MallocNew(struct HSH_StateInstance);
+  state->id = id;
+
+  if (hash_descriptor[id].init(&state->md) != CRYPT_OK ||
+      hash_descriptor[id].process(&state->md, in, in_len) != CRYPT_OK)
+    state->id = -1;
+
+  return state;
+}
+
+unsigned int
+HSH_HashState(HSH_State state, const unsigned char *in, unsigned int in_len,
+              unsigned char *out, unsigned int out_len)
+{
+  unsigned char buf[MAX_HASH_LENGTH];
+  unsigned long len;
+  hash_state md;
+
+  if (state->id < 0 || hash_descriptor[state->id].hashsize > sizeof (buf))
+    return 0;
+
+  md = state->md;
+  if (hash_descriptor[state->id].process(&md, in, in_len) != CRYPT_OK ||
+      hash_descriptor[state->id].done(&md, buf) != CRYPT_OK)
+    return 0;
+
+  len = MIN(hash_descriptor[state->id].hashsize, out_len);
+  memcpy(out, buf, len);
+
+  return len;
+}
+
+void
+HSH_DestroyState(HSH_State state)
+{
+  Free(state);
+}
+
 void
 HSH_Finalise(void)
 {
@@ -34,6 +34,7 @@
 #include "keys.h"
 #include "cmdparse.h"
 #include "conf.h"
+#include "hash.h"
 #include "memory.h"
 #include "util.h"
 #include "local.h"
@@ -48,26 +49,39 @@ typedef struct {
   int len;
   int hash_id;
   int auth_delay;
+  HSH_State hash_state;
 } Key;
 
+/* Measured authentication delay for a hash function and key length */
+typedef struct {
+  int hash_id;
+  int len;
+  int auth_delay;
+} AuthDelay;
+
 static ARR_Instance keys;
 
-static int cache_valid;
-static uint32_t cache_key_id;
-static int cache_key_pos;
+/* Hash table of positions of the keys (plus one) indexed by their ID,
+   using linear probing.  Its size is a power of two and at least twice
+   the number of keys. */
+static ARR_Instance key_index;
 
 /* ================================================== */
 
 static void
-free_keys(void)
+free_keys(ARR_Instance array)
 {
   unsigned int i;
+  Key *key;
 
-  for (i = 0; i < ARR_GetSize(keys); i++)
-    Free(((Key *)ARR_GetElement(keys, i))->val);
+  for (i = 0; i < ARR_GetSize(array); i++) {
+    key = ARR_GetElement(array, i);
+    Free(key->val);
+    if (key->hash_state)
+      HSH_DestroyState(key->hash_state);
+  }
 
-  ARR_SetSize(keys, 0);
-  cache_valid = 0;
+  ARR_SetSize(array, 0);
 }
 
 /* ================================================== */
@@ -76,7 +90,7 @@ void
 KEY_Initialise(void)
 {
   keys = ARR_CreateInstance(sizeof (Key));
-  cache_valid = 0;
+  key_index = ARR_CreateInstance(sizeof (uint32_t));
   KEY_Reload();
 }
 
@@ -85,8 +99,9 @@ KEY_Initialise(void)
 void
 KEY_Finalise(void)
 {
-  free_keys();
+  free_keys(keys);
   ARR_DestroyInstance(keys);
+  ARR_DestroyInstance(key_index);
 }
 
 /* ================================================== */
@@ -99,6 +114,64 @@ get_key(unsigned int index)
 
 /* ================================================== */
 
+static uint32_t *
+find_index_slot(uint32_t key_id)
+{
+  uint32_t *slots, mask, i;
+
+  slots = ARR_GetElements(key_index);
+  mask = ARR_GetSize(key_index) - 1;
+
+  i = key_id * 2654435761U;
+  i ^= i >> 16;
+
+  /* Return the slot of the key, or an empty slot if it is not present */
+  for (i &= mask; slots[i] != 0; i = (i + 1) & mask) {
+    if (get_key(slots[i] - 1)->id == key_id)
+      break;
+  }
+
+  return &slots[i];
+}
+
+/* ================================================== */
+
+static void
+index_keys(void)
+{
+  unsigned int i, size, n;
+  uint32_t *slot;
+  Key *key;
+
+  for (size = 1; size < 2 * ARR_GetSize(keys); size *= 2)
+    ;
+
+  ARR_SetSize(key_index, size);
+  memset(ARR_GetElements(key_index), 0, size * sizeof (uint32_t));
+
+  /* Add the keys to the index and drop duplicates.  If there is
+     a duplicate, the first key is used - the user should have been
+     more careful! */
+  for (i = n = 0; i < ARR_GetSize(keys); i++) {
+    key = get_key(i);
+    slot = find_index_slot(key->id);
+
+    if (*slot != 0) {
+      LOG(LOGS_WARN, "Detected duplicate key %"PRIu32, key->id);
+      Free(key->val);
+      continue;
+    }
+
+    if (n != i)
+      *get_key(n) = *key;
+    *slot = ++n;
+  }
+
+  ARR_SetSize(keys, n);
+}
+
+/* ================================================== */
+
 static int
 determine_hash_delay(uint32_t key_id)
 {
@@ -163,22 +236,25 @@ decode_password(char *key)
 
 /* ================================================== */
 
-/* Compare two keys */
-
 static int
-compare_keys_by_id(const void *a, const void *b)
+get_auth_delay(Key *key, ARR_Instance auth_delays)
 {
-  const Key *c = (const Key *) a;
-  const Key *d = (const Key *) b;
+  AuthDelay *delay;
+  unsigned int i;
 
-  if (c->id < d->id) {
-    return -1;
-  } else if (c->id > d->id) {
-    return +1;
-  } else {
-    return 0;
+  /* The delay depends only on the hash function and length of the key */
+  for (i = 0; i < ARR_GetSize(auth_delays); i++) {
+    delay = ARR_GetElement(auth_delays, i);
+    if (delay->hash_id == key->hash_id && delay->len == key->len)
+      return delay->auth_delay;
   }
 
+  delay = ARR_GetNewElement(auth_delays);
+  delay->hash_id = key->hash_id;
+  delay->len = key->len;
+  delay->auth_delay = determine_hash_delay(key->id);
+
+  return delay->auth_delay;
 }
 
 /* ================================================== */
@@ -187,27 +263,25 @@ void
 KEY_Reload(void)
 {
   unsigned int i, line_number;
+  ARR_Instance old_keys, auth_delays;
   FILE *in;
-  uint32_t key_id;
+  uint32_t key_id, *slot;
   char line[2048], *keyval, *key_file;
   const char *hashname;
-  Key key;
+  Key key, *old_key, *new_key;
 
-  free_keys();
+  /* Keep the previous keys to avoid measuring unchanged keys again */
+  old_keys = keys;
+  keys = ARR_CreateInstance(sizeof (Key));
 
   key_file = CNF_GetKeysFile();
   line_number = 0;
 
-  if (!key_file)
-    return;
-
-  in = fopen(key_file, "r");
-  if (!in) {
+  in = key_file ? fopen(key_file, "r") : NULL;
+  if (key_file && !in)
     LOG(LOGS_WARN, "Could not open keyfile %s", key_file);
-    return;
-  }
 
-  while (fgets(line, sizeof (line), in)) {
+  while (in && fgets(line, sizeof (line), in)) {
     line_number++;
 
     CPS_NormalizeLine(line);
@@ -234,47 +308,51 @@ KEY_Reload(void)
     key.id = key_id;
     key.val = MallocArray(char, key.len);
     memcpy(key.val, keyval, key.len);
+    key.auth_delay = 0;
+    key.hash_state = NULL;
     ARR_AppendElement(keys, &key);
   }
 
-  fclose(in);
-
-  /* Sort keys into order.  Note, if there's a duplicate, it is
-     arbitrary which one we use later - the user should have been
-     more careful! */
-  qsort(ARR_GetElements(keys), ARR_GetSize(keys), sizeof (Key), compare_keys_by_id);
-
-  /* Check for duplicates */
-  for (i = 1; i < ARR_GetSize(keys); i++) {
-    if (get_key(i - 1)->id == get_key(i)->id)
-      LOG(LOGS_WARN, "Detected duplicate key %"PRIu32, get_key(i - 1)->id);
-  }
+  if (in)
+    fclose(in);
 
   /* Erase any passwords from stack */
   memset(line, 0, sizeof (line));
 
-  for (i = 0; i < ARR_GetSize(keys); i++)
-    get_key(i)->auth_delay = determine_hash_delay(get_key(i)->id);
-}
+  index_keys();
 
-/* ================================================== */
+  /* Move the hash state and delay of unchanged keys */
+  for (i = 0; i < ARR_GetSize(old_keys); i++) {
+    old_key = ARR_GetElement(old_keys, i);
+    slot = find_index_slot(old_key->id);
+    if (*slot == 0)
+      continue;
 
-static int
-lookup_key(uint32_t id)
-{
-  Key specimen, *where, *keys_ptr;
-  int pos;
-
-  keys_ptr = ARR_GetElements(keys);
-  specimen.id = id;
-  where = (Key *)bsearch((void *)&specimen, keys_ptr, ARR_GetSize(keys),
-                         sizeof (Key), compare_keys_by_id);
-  if (!where) {
-    return -1;
-  } else {
-    pos = where - keys_ptr;
-    return pos;
+    new_key = get_key(*slot - 1);
+    if (new_key->hash_id != old_key->hash_id || new_key->len != old_key->len ||
+        memcmp(new_key->val, old_key->val, new_key->len) != 0)
+      continue;
+
+    new_key->hash_state = old_key->hash_state;
+    new_key->auth_delay = old_key->auth_delay;
+    old_key->hash_state = NULL;
   }
+
+  free_keys(old_keys);
+  ARR_DestroyInstance(old_keys);
+
+  auth_delays = ARR_CreateInstance(sizeof (AuthDelay));
+
+  for (i = 0; i < ARR_GetSize(keys); i++) {
+    new_key = get_key(i);
+    if (new_key->hash_state)
+      continue;
+    new_key->hash_state = HSH_CreateState(new_key->hash_id, (unsigned char *)new_key->val,
+                                          new_key->len);
+    new_key->auth_delay = get_auth_delay(new_key, auth_delays);
+  }
+
+  ARR_DestroyInstance(auth_delays);
 }
 
 /* ================================================== */
@@ -282,22 +360,14 @@ lookup_key(uint32_t id)
 static Key *
 get_key_by_id(uint32_t key_id)
 {
-  int position;
+  uint32_t *slot;
 
-  if (cache_valid && key_id == cache_key_id)
-    return get_key(cache_key_pos);
+  slot = find_index_slot(key_id);
 
-  position = lookup_key(key_id);
-
-  if (position >= 0) {
-    cache_valid = 1;
-    cache_key_pos = position;
-    cache_key_id = key_id;
-
-    return get_key(position);
-  }
+  if (*slot == 0)
+    return NULL;
 
-  return NULL;
+  return get_key(*slot - 1);
 }
 
 /* ================================================== */
@@ -357,24 +427,22 @@ KEY_CheckKeyLength(uint32_t key_id)
 /* ================================================== */
 
 static int
-generate_ntp_auth(int hash_id, const unsigned char *key, int key_len,
-                  const unsigned char *data, int data_len,
+generate_ntp_auth(Key *key, const unsigned char *data, int data_len,
                   unsigned char *auth, int auth_len)
 {
-  return HSH_Hash(hash_id, key, key_len, data, data_len, auth, auth_len);
+  return HSH_HashState(key->hash_state, data, data_len, auth, auth_len);
 }
 
 /* ================================================== */
 
 static int
-check_ntp_auth(int hash_id, const unsigned char *key, int key_len,
-               const unsigned char *data, int data_len,
+check_ntp_auth(Key *key, const unsigned char *data, int data_len,
                const unsigned char *auth, int auth_len, int trunc_len)
 {
   unsigned char buf[MAX_HASH_LENGTH];
   int hash_len;
 
-  hash_len = generate_ntp_auth(hash_id, key, key_len, data, data_len, buf, sizeof (buf));
+  hash_len = generate_ntp_auth(key, data, data_len, buf, sizeof (buf));
 
   return MIN(hash_len, trunc_len) == auth_len && !memcmp(buf, auth, auth_len);
 }
@@ -392,8 +460,7 @@ KEY_GenerateAuth(uint32_t key_id, const unsigned char *data, int data_len,
   if (!key)
     return 0;
 
-  return generate_ntp_auth(key->hash_id, (unsigned char *)key->val, key->len,
-                           data, data_len, auth, auth_len);
+  return generate_ntp_auth(key, data, data_len, auth, auth_len);
 }
 
 /* ================================================== */
@@ -409,6 +476,5 @@ KEY_CheckAuth(uint32_t key_id, const unsigned char *data, int data_len,
   if (!key)
     return 0;
 
-  return check_ntp_auth(key->hash_id, (unsigned char *)key->val, key->len,
-                        data, data_len, auth, auth_len, trunc_len);
+  return check_ntp_auth(key, data, data_len, auth, auth_len, trunc_len);
 }
@@ -92,6 +92,13 @@ static DispersionNotifyListEntry dispersion_notify_list;
 
 /* ================================================== */
 
+/* Correction accumulated from all changes of the local time since the last
+   step, and the correction accumulated before the step */
+static LCL_Correction correction;
+static LCL_Correction prev_correction;
+
+/* ================================================== */
+
 static int precision_log;
 static double precision_quantum;
 
@@ -178,6 +185,9 @@ LCL_Initialise(void)
   max_freq_ppm = CLAMP(0.0, max_freq_ppm, 500000.0);
 
   max_clock_error = CNF_GetMaxClockError() * 1e-6;
+
+  memset(&correction, 0, sizeof (correction));
+  memset(&prev_correction, 0, sizeof (prev_correction));
 }
 
 /* ================================================== */
@@ -284,6 +294,102 @@ LCL_IsFirstParameterChangeHandler(LCL_ParameterChangeHandler handler)
 
 /* ================================================== */
 
+/* Combine correction c1 followed by correction c2 into one correction,
+   which is relative to the time of c2 */
+
+static void
+combine_corrections(LCL_Correction *c1, LCL_Correction *c2, LCL_Correction *result)
+{
+  double elapsed, dfreq, doffset;
+
+  elapsed = UTI_DiffTimespecsToDouble(&c2->when, &c1->when);
+  dfreq = c1->dfreq + c2->dfreq - c1->dfreq * c2->dfreq;
+  doffset = (elapsed * c1->dfreq + c1->doffset) * (1.0 - c2->dfreq) + c2->doffset;
+
+  result->when = c2->when;
+  result->dfreq = dfreq;
+  result->doffset = doffset;
+}
+
+/* ================================================== */
+
+static void
+invert_correction(LCL_Correction *c, LCL_Correction *result)
+{
+  result->when = c->when;
+  result->dfreq = -c->dfreq / (1.0 - c->dfreq);
+  result->doffset = -c->doffset / (1.0 - c->dfreq);
+}
+
+/* ================================================== */
+
+static void
+update_correction(struct timespec *cooked, double dfreq, double doffset,
+                  LCL_ChangeType change_type)
+{
+  LCL_Correction change;
+
+  change.when = *cooked;
+  change.dfreq = dfreq;
+  change.doffset = doffset;
+  combine_corrections(&correction, &change, &correction);
+  correction.id++;
+
+  /* Restart the correction on steps to avoid losing precision with large
+     offsets.  The handlers need to correct their timestamps now. */
+  if (change_type != LCL_ChangeAdjust) {
+    prev_correction = correction;
+    correction.dfreq = 0.0;
+    correction.doffset = 0.0;
+    correction.epoch++;
+  }
+}
+
+/* ================================================== */
+
+void
+LCL_GetCorrection(LCL_Correction *c)
+{
+  *c = correction;
+}
+
+/* ================================================== */
+
+int
+LCL_GetPendingCorrection(LCL_Correction *since, struct timespec *when,
+                         double *dfreq, double *doffset)
+{
+  LCL_Correction pending;
+
+  if (since->id == correction.id)
+    return 0;
+
+  invert_correction(since, &pending);
+
+  if (since->epoch != correction.epoch) {
+    assert(since->epoch + 1 == correction.epoch);
+    combine_corrections(&pending, &prev_correction, &pending);
+  }
+
+  combine_corrections(&pending, &correction, &pending);
+
+  *when = pending.when;
+  *dfreq = pending.dfreq;
+  *doffset = pending.doffset;
+
+  return 1;
+}
+
+/* ================================================== */
+
+unsigned int
+LCL_GetCorrectionEpoch(void)
+{
+  return correction.epoch;
+}
+
+/* ================================================== */
+
 static void
 invoke_parameter_change_handlers(struct timespec *raw, struct timespec *cooked,
                                  double dfreq, double doffset,
@@ -291,6 +397,8 @@ invoke_parameter_change_handlers(struct timespec *raw, struct timespec *cooked,
 {
   ChangeListEntry *ptr;
 
+  update_correction(cooked, dfreq, doffset, change_type);
+
   for (ptr = change_list.next; ptr != &change_list; ptr = ptr->next) {
     (ptr->handler)(raw, cooked, dfreq, doffset, change_type, ptr->anything);
   }
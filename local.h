@@ -85,6 +85,35 @@ typedef void (*LCL_ParameterChangeHandler)
       void *anything
       );
 
+/* Accumulated correction of the local time, which allows timestamps to be
+   corrected lazily (when they are used) instead of correcting them in
+   a parameter change handler.  It has the same form as a change of the
+   local time, i.e. it can be applied to a timestamp with
+   UTI_AdjustTimespec(). */
+
+typedef struct {
+  struct timespec when;
+  double dfreq;
+  double doffset;
+  unsigned long id;             /* Number of changes of the local time */
+  unsigned int epoch;           /* Number of steps of the local time */
+} LCL_Correction;
+
+/* Get the current accumulated correction, i.e. the correction to which
+   newly collected timestamps correspond */
+extern void LCL_GetCorrection(LCL_Correction *correction);
+
+/* Get the correction which needs to be applied to timestamps corresponding
+   to an older accumulated correction.  Return zero if no correction is
+   needed.  The accumulated correction is restarted on each step, so the
+   timestamps need to be corrected in the parameter change handler when the
+   epoch is changed. */
+extern int LCL_GetPendingCorrection(LCL_Correction *since, struct timespec *when,
+                                    double *dfreq, double *doffset);
+
+/* Get the current epoch of the accumulated correction */
+extern unsigned int LCL_GetCorrectionEpoch(void);
+
 /* Add a handler.  Then handler MUST NOT deregister itself!!! */
 extern void LCL_AddParameterChangeHandler(LCL_ParameterChangeHandler handler, void *anything);
 
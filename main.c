@@ -561,6 +561,7 @@ int main
   NIO_Initialise(address_family);
   NCR_Initialise();
   CNF_SetupAccessRestrictions();
+  NIO_FlushServerAccess();
 
   /* Command-line switch must have priority */
   if (!sched_priority) {
@@ -38,21 +38,124 @@
 #ifdef USE_PTHREAD_ASYNCDNS
 #include <pthread.h>
 
+/* Maximum number of names resolved at the same time.  Requests passed
+   to the privops helper cannot be interleaved. */
+#ifdef PRIVOPS_NAME2IPADDRESS
+#define MAX_RESOLVING_THREADS 1
+#else
+#define MAX_RESOLVING_THREADS 8
+#endif
+
+/* Maximum number of cached results and the time (in seconds) for which
+   they can be used.  The resolver doesn't provide the TTL of the records,
+   so the time is short enough to just merge requests for the same name
+   made in one round of resolving. */
+#define MAX_CACHED_NAMES 32
+#define CACHE_TIME 10.0
+
 /* ================================================== */
 
 struct DNS_Async_Instance {
-  const char *name;
+  char *name;
   DNS_Status status;
   IPAddr addresses[DNS_MAX_ADDRESSES];
   DNS_NameResolveHandler handler;
   void *arg;
 
+  int running;
   pthread_t thread;
   int pipe[2];
+
+  struct DNS_Async_Instance *next;
+};
+
+struct CachedName {
+  char *name;
+  struct timespec time;
+  IPAddr addresses[DNS_MAX_ADDRESSES];
 };
 
+/* List of requests which are waiting for a thread or running */
+static struct DNS_Async_Instance *requests = NULL;
+
 static int resolving_threads = 0;
 
+/* List of requests using cached results, which are waiting for the
+   handlers to be called from the main loop */
+static struct DNS_Async_Instance *cached_requests = NULL;
+static SCH_TimeoutID cached_requests_id = 0;
+
+static struct CachedName cache[MAX_CACHED_NAMES];
+
+/* ================================================== */
+
+static struct CachedName *
+find_cached_name(const char *name)
+{
+  struct timespec now;
+  double age;
+  int i;
+
+  SCH_GetLastEventTime(NULL, NULL, &now);
+
+  for (i = 0; i < MAX_CACHED_NAMES; i++) {
+    if (!cache[i].name || strcmp(cache[i].name, name) != 0)
+      continue;
+
+    age = UTI_DiffTimespecsToDouble(&now, &cache[i].time);
+    if (age < 0.0 || age >= CACHE_TIME)
+      return NULL;
+
+    return &cache[i];
+  }
+
+  return NULL;
+}
+
+/* ================================================== */
+
+static void
+save_cached_name(struct DNS_Async_Instance *inst)
+{
+  struct CachedName *entry;
+  int i;
+
+  /* Replace an existing entry for the name, or the oldest entry */
+  for (i = 0, entry = &cache[0]; i < MAX_CACHED_NAMES; i++) {
+    if (!cache[i].name || strcmp(cache[i].name, inst->name) == 0) {
+      entry = &cache[i];
+      break;
+    }
+    if (UTI_CompareTimespecs(&cache[i].time, &entry->time) < 0)
+      entry = &cache[i];
+  }
+
+  if (!entry->name || strcmp(entry->name, inst->name) != 0) {
+    Free(entry->name);
+    entry->name = Strdup(inst->name);
+  }
+
+  SCH_GetLastEventTime(NULL, NULL, &entry->time);
+  memcpy(entry->addresses, inst->addresses, sizeof (entry->addresses));
+}
+
+/* ================================================== */
+
+static void
+call_handler(struct DNS_Async_Instance *inst)
+{
+  int i;
+
+  for (i = 0; inst->status == DNS_Success && i < DNS_MAX_ADDRESSES &&
+              inst->addresses[i].family != IPADDR_UNSPEC; i++)
+    ;
+
+  (inst->handler)(inst->status, i, inst->addresses, inst->arg);
+
+  Free(inst->name);
+  Free(inst);
+}
+
 /* ================================================== */
 
 static void *
@@ -71,11 +174,54 @@ start_resolving(void *anything)
 
 /* ================================================== */
 
+static void end_resolving(int fd, int event, void *anything);
+
+/* Start threads for waiting requests, unless the same name is already
+   being resolved in another thread */
+
+static void
+start_threads(void)
+{
+  struct DNS_Async_Instance *inst, *inst2;
+
+  for (inst = requests; inst && resolving_threads < MAX_RESOLVING_THREADS;
+       inst = inst->next) {
+    if (inst->running)
+      continue;
+
+    for (inst2 = requests; inst2; inst2 = inst2->next) {
+      if (inst2->running && strcmp(inst2->name, inst->name) == 0)
+        break;
+    }
+    if (inst2)
+      continue;
+
+    if (pipe(inst->pipe)) {
+      LOG_FATAL("pipe() failed");
+    }
+
+    UTI_FdSetCloexec(inst->pipe[0]);
+    UTI_FdSetCloexec(inst->pipe[1]);
+
+    resolving_threads++;
+    assert(resolving_threads <= MAX_RESOLVING_THREADS);
+
+    if (pthread_create(&inst->thread, NULL, start_resolving, inst)) {
+      LOG_FATAL("pthread_create() failed");
+    }
+
+    inst->running = 1;
+    SCH_AddFileHandler(inst->pipe[0], SCH_FILE_INPUT, end_resolving, inst);
+  }
+}
+
+/* ================================================== */
+
 static void
 end_resolving(int fd, int event, void *anything)
 {
   struct DNS_Async_Instance *inst = (struct DNS_Async_Instance *)anything;
-  int i;
+  struct DNS_Async_Instance *finished, **last, **i;
 
   if (pthread_join(inst->thread, NULL)) {
     LOG_FATAL("pthread_join() failed");
@@ -87,13 +233,58 @@ end_resolving(int fd, int event, void *anything)
   close(inst->pipe[0]);
   close(inst->pipe[1]);
 
-  for (i = 0; inst->status == DNS_Success && i < DNS_MAX_ADDRESSES &&
-              inst->addresses[i].family != IPADDR_UNSPEC; i++)
-    ;
+  if (inst->status == DNS_Success)
+    save_cached_name(inst);
+
+  /* Remove the request and other requests waiting for the same name from
+     the list and give them the result */
+  finished = NULL;
+  last = &finished;
+
+  for (i = &requests; *i; ) {
+    if (*i == inst || (!(*i)->running && strcmp((*i)->name, inst->name) == 0)) {
+      if (*i != inst) {
+        (*i)->status = inst->status;
+        memcpy((*i)->addresses, inst->addresses, sizeof (inst->addresses));
+      }
+      *last = *i;
+      *i = (*i)->next;
+      last = &(*last)->next;
+      *last = NULL;
+    } else {
+      i = &(*i)->next;
+    }
+  }
 
-  (inst->handler)(inst->status, i, inst->addresses, inst->arg);
+  start_threads();
 
-  Free(inst);
+  /* The handlers may make new requests */
+  while (finished) {
+    inst = finished;
+    finished = inst->next;
+    call_handler(inst);
+  }
+}
+
+/* ================================================== */
+
+/* Call the handlers of all requests using cached results from one
+   timeout, so any number of them doesn't look like a scheduling loop */
+
+static void
+return_cached_names(void *anything)
+{
+  struct DNS_Async_Instance *inst, *next;
+
+  /* The handlers may make new requests */
+  inst = cached_requests;
+  cached_requests = NULL;
+  cached_requests_id = 0;
+
+  for (; inst; inst = next) {
+    next = inst->next;
+    call_handler(inst);
+  }
 }
 
 /* ================================================== */
@@ -101,29 +292,52 @@ end_resolving(int fd, int event, void *anything)
 void
 DNS_Name2IPAddressAsync(const char *name, DNS_NameResolveHandler handler, void *anything)
 {
-  struct DNS_Async_Instance *inst;
+  struct DNS_Async_Instance *inst, **i;
+  struct CachedName *cached;
 
   inst = MallocNew(struct DNS_Async_Instance);
-  inst->name = name;
+  inst->name = Strdup(name);
   inst->handler = handler;
   inst->arg = anything;
   inst->status = DNS_Failure;
-
-  if (pipe(inst->pipe)) {
-    LOG_FATAL("pipe() failed");
+  inst->running = 0;
+  inst->next = NULL;
+
+  /* Use a recent result if available.  The handler is always called
+     later from the main loop. */
+  cached = find_cached_name(name);
+  if (cached) {
+    DEBUG_LOG("Using cached addresses of %s", name);
+    inst->status = DNS_Success;
+    memcpy(inst->addresses, cached->addresses, sizeof (inst->addresses));
+
+    for (i = &cached_requests; *i; i = &(*i)->next)
+      ;
+    *i = inst;
+
+    if (!cached_requests_id)
+      cached_requests_id = SCH_AddTimeoutByDelay(0.0, return_cached_names, NULL);
+    return;
   }
 
-  UTI_FdSetCloexec(inst->pipe[0]);
-  UTI_FdSetCloexec(inst->pipe[1]);
+  for (i = &requests; *i; i = &(*i)->next)
+    ;
+  *i = inst;
 
-  resolving_threads++;
-  assert(resolving_threads <= 1);
+  start_threads();
+}
 
-  if (pthread_create(&inst->thread, NULL, start_resolving, inst)) {
-    LOG_FATAL("pthread_create() failed");
-  }
+/* ================================================== */
 
-  SCH_AddFileHandler(inst->pipe[0], SCH_FILE_INPUT, end_resolving, inst);
+void
+DNS_FinaliseAsync(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_CACHED_NAMES; i++) {
+    Free(cache[i].name);
+    cache[i].name = NULL;
+  }
 }
 
 /* ================================================== */
@@ -37,4 +37,7 @@ typedef void (*DNS_NameResolveHandler)(DNS_Status status, int n_addrs, IPAddr *i
    called when the result is available. */
 extern void DNS_Name2IPAddressAsync(const char *name, DNS_NameResolveHandler handler, void *anything);
 
+/* Free the cached results */
+extern void DNS_FinaliseAsync(void);
+
 #endif
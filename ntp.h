@@ -54,6 +54,10 @@ typedef uint32_t NTP_int32;
 /* The minimum valid length of an extension field */
 #define NTP_MIN_EF_LENGTH 16
 
+/* The maximum number of extension fields which are indexed in parsed
+   NTP packets */
+#define NTP_MAX_INDEXED_EFS 16
+
 /* The maximum assumed length of all extension fields in an NTP packet,
    including a MAC (RFC 5905 doesn't specify a limit on length or number of
    extension fields in one packet) */
@@ -127,6 +131,13 @@ typedef struct {
 
   int ext_fields;
 
+  /* Positions of the first NTP_MAX_INDEXED_EFS extension fields */
+  struct {
+    uint16_t type;
+    uint16_t body_start;
+    uint16_t body_length;
+  } ext_field_index[NTP_MAX_INDEXED_EFS];
+
   struct {
     NTP_AuthMode mode;
     union {
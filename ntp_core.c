@@ -54,6 +54,11 @@
 static LOG_FileID logfileid;
 static int log_raw_measurements;
 
+/* Interval after which a client socket kept open between requests is
+   replaced with a new socket (using a new source port), or 0 if the socket
+   is closed after each request */
+static int client_socket_rotate;
+
 /* ================================================== */
 /* Enumeration used for remembering the operating mode of one of the
    sources */
@@ -89,6 +94,7 @@ struct NCR_Instance_Record {
   OperatingMode opmode;         /* Whether we are sampling this source
                                    or not and in what way */
   SCH_TimeoutID rx_timeout_id;  /* Timeout ID for latest received response */
+  struct timespec client_socket_ts; /* Time when the client socket was opened */
   SCH_TimeoutID tx_timeout_id;  /* Timeout ID for next transmission */
   int tx_suspended;             /* Boolean indicating we can't transmit yet */
 
@@ -302,6 +308,9 @@ static int server_sock_fd6;
 
 static ADF_AuthTable access_auth_table;
 
+/* Timeout for compiling the table after a change in the restrictions */
+static SCH_TimeoutID access_compile_timeout_id;
+
 /* Characters for printing synchronisation status and timestamping source */
 static const char leap_chars[4] = {'N', '+', '-', '?'};
 static const char tss_chars[3] = {'D', 'K', 'H'};
@@ -397,7 +406,10 @@ NCR_Initialise(void)
       "   Date (UTC) Time     IP Address   L St 123 567 ABCD  LP RP Score    Offset  Peer del. Peer disp.  Root del. Root disp. Refid     MTxRx")
     : -1;
 
+  client_socket_rotate = MAX(CNF_GetAcquisitionRotate(), 0);
+
   access_auth_table = ADF_CreateTable();
+  access_compile_timeout_id = 0;
   broadcasts = ARR_CreateInstance(sizeof (BroadcastDestination));
 
   /* Server socket will be opened when access is allowed */
@@ -421,7 +433,13 @@ NCR_Finalise(void)
     NIO_CloseServerSocket(((BroadcastDestination *)ARR_GetElement(broadcasts, i))->local_addr.sock_fd);
 
   ARR_DestroyInstance(broadcasts);
+
+  SCH_RemoveTimeout(access_compile_timeout_id);
+
+  NIO_LockServerWorkers();
   ADF_DestroyTable(access_auth_table);
+  access_auth_table = NULL;
+  NIO_UnlockServerWorkers();
 }
 
 /* ================================================== */
@@ -493,6 +511,40 @@ close_client_socket(NCR_Instance inst)
 
 /* ================================================== */
 
+static int
+is_client_socket_reusable(NCR_Instance inst)
+{
+  struct timespec now;
+  double age;
+
+  if (client_socket_rotate <= 0 || inst->local_addr.sock_fd == INVALID_SOCK_FD)
+    return 0;
+
+  SCH_GetLastEventTime(&now, NULL, NULL);
+  age = UTI_DiffTimespecsToDouble(&now, &inst->client_socket_ts);
+
+  return age >= 0.0 && age < client_socket_rotate;
+}
+
+/* ================================================== */
+
+/* Close the client socket when no more responses are expected, unless it
+   can be used for the next request */
+
+static void
+release_client_socket(NCR_Instance inst)
+{
+  if (inst->mode == MODE_CLIENT && is_client_socket_reusable(inst)) {
+    SCH_RemoveTimeout(inst->rx_timeout_id);
+    inst->rx_timeout_id = 0;
+    return;
+  }
+
+  close_client_socket(inst);
+}
+
+/* ================================================== */
+
 static void
 take_offline(NCR_Instance inst)
 {
@@ -577,7 +629,7 @@ NCR_CreateInstance(NTP_Remote_Address *remote_addr, NTP_Source_Type type,
 
   if (params->nts) {
     result->auth.mode = AUTH_NTS;
-    result->auth.nts = NTS_CreateClientInstance(&remote_addr->ip_addr, params->nts_port, name);
+    result->auth.nts = NTS_CreateClientInstance(remote_addr, params->nts_port, name);
   } else if (params->authkey != INACTIVE_AUTHKEY) {
     result->auth.mode = AUTH_SYMMETRIC;
     result->auth.key_id = params->authkey;
@@ -926,7 +978,7 @@ receive_timeout(void *arg)
             UTI_IPToString(&inst->remote_addr.ip_addr), inst->remote_addr.port);
 
   inst->rx_timeout_id = 0;
-  close_client_socket(inst);
+  release_client_socket(inst);
 }
 
 /* ================================================== */
@@ -1300,11 +1352,13 @@ transmit_timeout(void *arg)
   DEBUG_LOG("Transmit timeout for [%s:%d]",
       UTI_IPToString(&inst->remote_addr.ip_addr), inst->remote_addr.port);
 
-  /* Open new client socket */
+  /* Open new client socket, unless the previous socket can be reused */
   if (inst->mode == MODE_CLIENT) {
-    close_client_socket(inst);
-    assert(inst->local_addr.sock_fd == INVALID_SOCK_FD);
-    inst->local_addr.sock_fd = NIO_OpenClientSocket(&inst->remote_addr);
+    release_client_socket(inst);
+    if (inst->local_addr.sock_fd == INVALID_SOCK_FD) {
+      inst->local_addr.sock_fd = NIO_OpenClientSocket(&inst->remote_addr);
+      SCH_GetLastEventTime(&inst->client_socket_ts, NULL, NULL);
+    }
   }
 
   /* Don't require the packet to be sent from the same address as before */
@@ -1424,8 +1478,9 @@ is_zero_data(unsigned char *data, int length)
 static int
 parse_packet(NTP_Packet *packet, int length, NTP_PacketInfo *info)
 {
-  int parsed, remainder, ef_parsed, ef_type;
+  int parsed, remainder, ef_parsed, ef_type, ef_body_length;
   unsigned char *data;
+  void *ef_body;
 
   if (length < NTP_HEADER_LENGTH || length % 4U != 0) {
     DEBUG_LOG("NTP packet has invalid length %d", length);
@@ -1489,7 +1544,7 @@ parse_packet(NTP_Packet *packet, int length, NTP_PacketInfo *info)
     }
 
     /* Check if this is a valid NTPv4 extension field and skip it */
-    ef_parsed = NEF_ParseField(packet, length, parsed, &ef_type, NULL, NULL);
+    ef_parsed = NEF_ParseField(packet, length, parsed, &ef_type, &ef_body, &ef_body_length);
     if (parsed > ef_parsed) {
       /* Invalid MAC or format error */
       return 0;
@@ -1507,6 +1562,13 @@ parse_packet(NTP_Packet *packet, int length, NTP_PacketInfo *info)
         DEBUG_LOG("Unknown extension field type=%x", (unsigned int)ef_type);
     }
 
+    /* Index the field for the NTS code to avoid parsing it again */
+    if (info->ext_fields < NTP_MAX_INDEXED_EFS) {
+      info->ext_field_index[info->ext_fields].type = ef_type;
+      info->ext_field_index[info->ext_fields].body_start = (unsigned char *)ef_body - data;
+      info->ext_field_index[info->ext_fields].body_length = ef_body_length;
+    }
+
     info->ext_fields++;
     parsed = ef_parsed;
     remainder = length - parsed;
@@ -1982,7 +2044,7 @@ receive_packet(NCR_Instance inst, NTP_Local_Address *local_addr,
 
     /* If in client mode, no more packets are expected to be coming from the
        server and the socket can be closed */
-    close_client_socket(inst);
+    release_client_socket(inst);
 
     /* Update the local address and interface */
     inst->local_addr.ip_addr = local_addr->ip_addr;
@@ -2627,11 +2689,32 @@ NCR_GetNTPReport(NCR_Instance inst, RPT_NTPReport *report)
 
 /* ================================================== */
 
+static void
+compile_access_table(void *arg)
+{
+  ADF_CompiledTable compiled;
+
+  access_compile_timeout_id = 0;
+
+  /* The table is modified only in this thread, so it can be compiled while
+     the server workers are using it.  They need to be stopped only to
+     switch to the compiled table. */
+  compiled = ADF_PrepareCompiled(access_auth_table);
+
+  NIO_LockServerWorkers();
+  ADF_PublishCompiled(access_auth_table, compiled);
+  NIO_UnlockServerWorkers();
+}
+
+/* ================================================== */
+
 int
 NCR_AddAccessRestriction(IPAddr *ip_addr, int subnet_bits, int allow, int all)
  {
   ADF_Status status;
 
+  NIO_LockServerWorkers();
+
   if (allow) {
     if (all) {
       status = ADF_AllowAll(access_auth_table, ip_addr, subnet_bits);
@@ -2646,9 +2729,17 @@ NCR_AddAccessRestriction(IPAddr *ip_addr, int subnet_bits, int allow, int all)
     }
   }
 
+  NIO_UnlockServerWorkers();
+
   if (status != ADF_SUCCESS)
     return 0;
 
+  /* Compile the table once after all changes made in this dispatch */
+  if (!access_compile_timeout_id)
+    access_compile_timeout_id = SCH_AddTimeoutByDelay(0.0, compile_access_table, NULL);
+
+  NIO_UpdateServerAccess();
+
   /* Keep server sockets open only when an address allowed */
   if (allow) {
     NTP_Remote_Address remote_addr;
@@ -2684,11 +2775,23 @@ NCR_AddAccessRestriction(IPAddr *ip_addr, int subnet_bits, int allow, int all)
 int
 NCR_CheckAccessRestriction(IPAddr *ip_addr)
 {
+  /* The table may be already destroyed when called from a server worker */
+  if (!access_auth_table)
+    return 0;
+
   return ADF_IsAllowed(access_auth_table, ip_addr);
 }
 
 /* ================================================== */
 
+void
+NCR_IterateAccessRestrictions(int family, ADF_SubnetHandler handler, void *arg)
+{
+  ADF_IterateSubnets(access_auth_table, family, handler, arg);
+}
+
+/* ================================================== */
+
 void
 NCR_IncrementActivityCounters(NCR_Instance inst, int *online, int *offline,
                               int *burst_online, int *burst_offline)
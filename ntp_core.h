@@ -30,6 +30,7 @@
 #include "sysincl.h"
 
 #include "addressing.h"
+#include "addrfilt.h"
 #include "srcparams.h"
 #include "ntp.h"
 #include "reports.h"
@@ -126,6 +127,9 @@ extern void NCR_GetNTPReport(NCR_Instance inst, RPT_NTPReport *report);
 extern int NCR_AddAccessRestriction(IPAddr *ip_addr, int subnet_bits, int allow, int all);
 extern int NCR_CheckAccessRestriction(IPAddr *ip_addr);
 
+/* Call a handler for each subnet which has its own access rule */
+extern void NCR_IterateAccessRestrictions(int family, ADF_SubnetHandler handler, void *arg);
+
 extern void NCR_IncrementActivityCounters(NCR_Instance inst, int *online, int *offline, 
                                           int *burst_online, int *burst_offline);
 
@@ -112,3 +112,33 @@ NEF_ParseField(NTP_Packet *packet, int length, int parsed,
 
   return parsed;
 }
+
+/* ================================================== */
+
+int
+NEF_GetIndexedField(NTP_Packet *packet, NTP_PacketInfo *info, int index,
+                    int *type, void **body, int *body_length)
+{
+  int i, parsed;
+
+  if (index < 0 || index >= info->ext_fields)
+    return 0;
+
+  /* Parse the fields which follow the last indexed field */
+  if (index >= NTP_MAX_INDEXED_EFS) {
+    parsed = info->ext_field_index[NTP_MAX_INDEXED_EFS - 1].body_start +
+             info->ext_field_index[NTP_MAX_INDEXED_EFS - 1].body_length;
+    for (i = NTP_MAX_INDEXED_EFS; i <= index && parsed > 0; i++)
+      parsed = NEF_ParseField(packet, info->length, parsed, type, body, body_length);
+    return parsed > 0;
+  }
+
+  if (type)
+    *type = info->ext_field_index[index].type;
+  if (body)
+    *body = (unsigned char *)packet + info->ext_field_index[index].body_start;
+  if (body_length)
+    *body_length = info->ext_field_index[index].body_length;
+
+  return 1;
+}
@@ -34,4 +34,10 @@ extern int NEF_AddField(NTP_Packet *packet, NTP_PacketInfo *info,
 extern int NEF_ParseField(NTP_Packet *packet, int length, int parsed,
                           int *type, void **body, int *body_length);
 
+/* Get an extension field indexed in parsing of the packet, without parsing
+   it again if it is one of the first NTP_MAX_INDEXED_EFS fields.  Return
+   zero if the index is not valid. */
+extern int NEF_GetIndexedField(NTP_Packet *packet, NTP_PacketInfo *info, int index,
+                               int *type, void **body, int *body_length);
+
 #endif
@@ -45,6 +45,18 @@
 #include "ntp_io_linux.h"
 #endif
 
+#ifdef HAVE_SERVER_WORKERS
+#include "ntp_io_workers.h"
+#endif
+
+#ifdef HAVE_XDP
+#include "ntp_io_xdp.h"
+#endif
+
+#ifdef HAVE_IO_URING
+#include "ntp_io_uring.h"
+#endif
+
 #define INVALID_SOCK_FD -1
 #define CMSGBUF_SIZE 256
 
@@ -65,7 +77,6 @@ struct Message {
 };
 
 #ifdef HAVE_RECVMMSG
-#define MAX_RECV_MESSAGES 4
 #define MessageHeader mmsghdr
 #else
 /* Compatible with mmsghdr */
@@ -74,6 +85,7 @@ struct MessageHeader {
   unsigned int msg_len;
 };
 
+#undef MAX_RECV_MESSAGES
 #define MAX_RECV_MESSAGES 1
 #endif
 
@@ -81,6 +93,18 @@ struct MessageHeader {
 static ARR_Instance recv_messages;
 static ARR_Instance recv_headers;
 
+#ifdef HAVE_SENDMMSG
+/* Arrays of Message and mmsghdr for responses which are sent in one
+   sendmmsg() call after processing all messages received in one batch */
+static ARR_Instance send_messages;
+static ARR_Instance send_headers;
+
+/* Socket to which the responses are currently queued, or INVALID_SOCK_FD
+   if the responses are sent immediately, and number of queued responses */
+static int send_queue_sock_fd;
+static unsigned int send_queue_length;
+#endif
+
 /* The server/peer and client sockets for IPv4 and IPv6 */
 static int server_sock_fd4;
 static int client_sock_fd4;
@@ -105,6 +129,10 @@ static int separate_client_sockets;
    disabled */
 static int permanent_server_sockets;
 
+/* Number of threads responding to client requests in parallel with
+   the main thread */
+static int server_workers;
+
 /* Flag indicating the server IPv4 socket is bound to an address */
 static int bound_server_sock_fd4;
 
@@ -115,6 +143,7 @@ static int initialised=0;
 
 /* Forward prototypes */
 static void read_from_socket(int sock_fd, int event, void *anything);
+static void process_message(struct msghdr *hdr, int length, int sock_fd);
 
 /* ================================================== */
 
@@ -207,6 +236,16 @@ prepare_socket(int family, int port_number, int client_only)
     /* Don't quit - we might survive anyway */
   }
   
+#ifdef HAVE_SERVER_WORKERS
+  /* Allow the workers to share the port with the server socket */
+  if (!client_only && server_workers > 0 &&
+      setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on_off, sizeof(on_off)) < 0) {
+    LOG(LOGS_ERR, "Could not set %s socket option", "SO_REUSEPORT");
+    close(sock_fd);
+    return INVALID_SOCK_FD;
+  }
+#endif
+
   /* Make the socket capable of sending broadcast pkts - needed for NTP broadcast mode */
   if (!client_only &&
       setsockopt(sock_fd, SOL_SOCKET, SO_BROADCAST, (char *)&on_off, sizeof(on_off)) < 0) {
@@ -278,6 +317,12 @@ prepare_socket(int family, int port_number, int client_only)
   /* Register handler for read and possibly exception events on the socket */
   SCH_AddFileHandler(sock_fd, events, read_from_socket, NULL);
 
+#ifdef HAVE_IO_URING
+  /* Receive messages on server sockets via io_uring if possible */
+  if (!client_only && NIO_Uring_AddSocket(sock_fd))
+    SCH_SetFileHandlerEvent(sock_fd, SCH_FILE_INPUT, 0);
+#endif
+
   return sock_fd;
 }
 
@@ -330,6 +375,9 @@ close_socket(int sock_fd)
 
 #ifdef HAVE_LINUX_TIMESTAMPING
   NIO_Linux_NotifySocketClosing(sock_fd);
+#endif
+#ifdef HAVE_IO_URING
+  NIO_Uring_RemoveSocket(sock_fd);
 #endif
   SCH_RemoveFileHandler(sock_fd);
   close(sock_fd);
@@ -337,6 +385,16 @@ close_socket(int sock_fd)
 
 /* ================================================== */
 
+#ifdef HAVE_IO_URING
+static void
+resume_reading(int sock_fd)
+{
+  SCH_SetFileHandlerEvent(sock_fd, SCH_FILE_INPUT, 1);
+}
+#endif
+
+/* ================================================== */
+
 static void
 prepare_buffers(unsigned int n)
 {
@@ -387,16 +445,37 @@ NIO_Initialise(int family)
   ARR_SetSize(recv_headers, MAX_RECV_MESSAGES);
   prepare_buffers(MAX_RECV_MESSAGES);
 
+#ifdef HAVE_SENDMMSG
+  send_messages = ARR_CreateInstance(sizeof (struct Message));
+  ARR_SetSize(send_messages, MAX_RECV_MESSAGES);
+  send_headers = ARR_CreateInstance(sizeof (struct mmsghdr));
+  ARR_SetSize(send_headers, MAX_RECV_MESSAGES);
+  send_queue_sock_fd = INVALID_SOCK_FD;
+  send_queue_length = 0;
+#endif
+
   server_port = CNF_GetNTPPort();
   client_port = CNF_GetAcquisitionPort();
 
+  server_workers = server_port ? CNF_GetServerWorkers() : 0;
+#ifndef HAVE_SERVER_WORKERS
+  if (server_workers > 0)
+    LOG_FATAL("Server workers not supported");
+#endif
+
   /* Use separate connected sockets if client port is negative */
   separate_client_sockets = client_port < 0;
   if (client_port < 0)
     client_port = 0;
 
-  permanent_server_sockets = !server_port || (!separate_client_sockets &&
-                                              client_port == server_port);
+  permanent_server_sockets = !server_port || server_workers > 0 ||
+                             (!separate_client_sockets && client_port == server_port);
+
+#ifdef HAVE_IO_URING
+  /* The server workers read their own sockets */
+  if (server_port && server_workers == 0)
+    NIO_Uring_Initialise(process_message, resume_reading);
+#endif
 
   server_sock_fd4 = INVALID_SOCK_FD;
   client_sock_fd4 = INVALID_SOCK_FD;
@@ -442,6 +521,31 @@ NIO_Initialise(int family)
       )) {
     LOG_FATAL("Could not open NTP sockets");
   }
+
+#ifdef HAVE_SERVER_WORKERS
+  if (server_workers > 0)
+    NIO_Workers_Initialise(server_workers, server_sock_fd4,
+#ifdef FEAT_IPV6
+                           server_sock_fd6,
+#else
+                           INVALID_SOCK_FD,
+#endif
+                           process_message);
+#endif
+
+  if (server_port && (family == IPADDR_UNSPEC || family == IPADDR_INET4)) {
+#ifdef HAVE_XDP
+    IPAddr bind_address;
+
+    CNF_GetBindAddress(IPADDR_INET4, &bind_address);
+    NIO_Xdp_Initialise(server_port, &bind_address);
+#else
+    char *iface;
+
+    if (CNF_GetXdpInterface(0, &iface))
+      LOG_FATAL("XDP not supported");
+#endif
+  }
 }
 
 /* ================================================== */
@@ -449,6 +553,15 @@ NIO_Initialise(int family)
 void
 NIO_Finalise(void)
 {
+#ifdef HAVE_XDP
+  NIO_Xdp_Finalise();
+#endif
+
+#ifdef HAVE_SERVER_WORKERS
+  if (server_workers > 0)
+    NIO_Workers_Finalise();
+#endif
+
   if (server_sock_fd4 != client_sock_fd4)
     close_socket(client_sock_fd4);
   close_socket(server_sock_fd4);
@@ -458,9 +571,16 @@ NIO_Finalise(void)
     close_socket(client_sock_fd6);
   close_socket(server_sock_fd6);
   server_sock_fd6 = client_sock_fd6 = INVALID_SOCK_FD;
+#endif
+#ifdef HAVE_IO_URING
+  NIO_Uring_Finalise();
 #endif
   ARR_DestroyInstance(recv_headers);
   ARR_DestroyInstance(recv_messages);
+#ifdef HAVE_SENDMMSG
+  ARR_DestroyInstance(send_headers);
+  ARR_DestroyInstance(send_messages);
+#endif
 
 #ifdef HAVE_LINUX_TIMESTAMPING
   NIO_Linux_Finalise();
@@ -713,6 +833,70 @@ process_message(struct msghdr *hdr, int length, int sock_fd)
 
 /* ================================================== */
 
+#ifdef HAVE_SENDMMSG
+static void
+flush_send_queue(void)
+{
+  struct mmsghdr *hdr;
+  unsigned int i, n;
+  int status;
+
+  hdr = ARR_GetElements(send_headers);
+  n = send_queue_length;
+
+  for (i = 0; i < n; ) {
+    status = sendmmsg(send_queue_sock_fd, hdr + i, n - i, 0);
+    if (status <= 0) {
+      /* Skip the message which could not be sent */
+      DEBUG_LOG("Could not send to fd %d : %s", send_queue_sock_fd, strerror(errno));
+      status = 1;
+    } else {
+      DEBUG_LOG("Sent %d messages to fd %d", status, send_queue_sock_fd);
+    }
+    i += status;
+  }
+
+  send_queue_length = 0;
+}
+
+/* ================================================== */
+
+static void
+queue_message(struct msghdr *msg)
+{
+  struct mmsghdr *hdr;
+  struct Message *m;
+
+  if (send_queue_length >= ARR_GetSize(send_messages))
+    flush_send_queue();
+
+  /* Copy the message with its address and control messages */
+  m = ARR_GetElement(send_messages, send_queue_length);
+  assert(msg->msg_iovlen == 1 && msg->msg_iov[0].iov_len <= sizeof (m->buf));
+  assert(msg->msg_controllen <= sizeof (m->cmsgbuf));
+  assert(msg->msg_namelen <= sizeof (m->name));
+
+  memcpy(&m->buf, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+  m->iov.iov_base = &m->buf;
+  m->iov.iov_len = msg->msg_iov[0].iov_len;
+  if (msg->msg_namelen)
+    memcpy(&m->name, msg->msg_name, msg->msg_namelen);
+  if (msg->msg_controllen)
+    memcpy(&m->cmsgbuf, msg->msg_control, msg->msg_controllen);
+
+  hdr = ARR_GetElement(send_headers, send_queue_length++);
+  memset(hdr, 0, sizeof (*hdr));
+  hdr->msg_hdr.msg_name = msg->msg_namelen ? &m->name : NULL;
+  hdr->msg_hdr.msg_namelen = msg->msg_namelen;
+  hdr->msg_hdr.msg_iov = &m->iov;
+  hdr->msg_hdr.msg_iovlen = 1;
+  hdr->msg_hdr.msg_control = msg->msg_controllen ? &m->cmsgbuf : NULL;
+  hdr->msg_hdr.msg_controllen = msg->msg_controllen;
+}
+#endif
+
+/* ================================================== */
+
 static void
 read_from_socket(int sock_fd, int event, void *anything)
 {
@@ -771,11 +955,22 @@ read_from_socket(int sock_fd, int event, void *anything)
     return;
   }
 
+#ifdef HAVE_SENDMMSG
+  /* Queue responses to the received messages to send them in one call */
+  if (n > 1 && !(flags & MSG_ERRQUEUE))
+    send_queue_sock_fd = sock_fd;
+#endif
+
   for (i = 0; i < n; i++) {
     hdr = ARR_GetElement(recv_headers, i);
     process_message(&hdr->msg_hdr, hdr->msg_len, sock_fd);
   }
 
+#ifdef HAVE_SENDMMSG
+  flush_send_queue();
+  send_queue_sock_fd = INVALID_SOCK_FD;
+#endif
+
   /* Restore the buffers to their original state */
   prepare_buffers(n);
 }
@@ -893,6 +1088,29 @@ NIO_SendPacket(NTP_Packet *packet, NTP_Remote_Address *remote_addr,
   if (!cmsglen)
     msg.msg_control = NULL;
 
+#ifdef HAVE_IO_URING
+  /* Queue the message if it is a response to a message received from
+     the ring, unless its transmit timestamp is requested */
+  if (!process_tx && NIO_Uring_QueueMessage(&msg, local_addr->sock_fd)) {
+    DEBUG_LOG("Queued %d bytes to %s:%d from %s fd %d", length,
+        UTI_IPToString(&remote_addr->ip_addr), remote_addr->port,
+        UTI_IPToString(&local_addr->ip_addr), local_addr->sock_fd);
+    return 1;
+  }
+#endif
+
+#ifdef HAVE_SENDMMSG
+  /* Queue the message if it is a response to a message received in a batch
+     on the same socket, unless its transmit timestamp is requested */
+  if (local_addr->sock_fd == send_queue_sock_fd && !process_tx) {
+    queue_message(&msg);
+    DEBUG_LOG("Queued %d bytes to %s:%d from %s fd %d", length,
+        UTI_IPToString(&remote_addr->ip_addr), remote_addr->port,
+        UTI_IPToString(&local_addr->ip_addr), local_addr->sock_fd);
+    return 1;
+  }
+#endif
+
   if (sendmsg(local_addr->sock_fd, &msg, 0) < 0) {
     DEBUG_LOG("Could not send to %s:%d from %s fd %d : %s",
         UTI_IPToString(&remote_addr->ip_addr), remote_addr->port,
@@ -907,3 +1125,56 @@ NIO_SendPacket(NTP_Packet *packet, NTP_Remote_Address *remote_addr,
 
   return 1;
 }
+
+/* ================================================== */
+
+void
+NIO_LockServerWorkers(void)
+{
+#ifdef HAVE_SERVER_WORKERS
+  if (server_workers > 0)
+    NIO_Workers_Lock();
+#endif
+}
+
+/* ================================================== */
+
+void
+NIO_UnlockServerWorkers(void)
+{
+#ifdef HAVE_SERVER_WORKERS
+  if (server_workers > 0)
+    NIO_Workers_Unlock();
+#endif
+}
+
+/* ================================================== */
+
+void
+NIO_UpdateServerAccess(void)
+{
+#ifdef HAVE_XDP
+  NIO_Xdp_UpdateAccess();
+#endif
+}
+
+/* ================================================== */
+
+void
+NIO_FlushServerAccess(void)
+{
+#ifdef HAVE_XDP
+  NIO_Xdp_FlushAccess();
+#endif
+}
+
+/* ================================================== */
+
+void
+NIO_GetKernelServerStats(uint32_t *hits, uint32_t *drops)
+{
+  *hits = *drops = 0;
+#ifdef HAVE_XDP
+  NIO_Xdp_GetStats(hits, drops);
+#endif
+}
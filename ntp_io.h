@@ -60,4 +60,19 @@ extern int NIO_IsServerConnectable(NTP_Remote_Address *remote_addr);
 extern int NIO_SendPacket(NTP_Packet *packet, NTP_Remote_Address *remote_addr,
                           NTP_Local_Address *local_addr, int length, int process_tx);
 
+/* Functions to lock and unlock the state shared with the server workers */
+extern void NIO_LockServerWorkers(void);
+extern void NIO_UnlockServerWorkers(void);
+
+/* Function to be called after a change in the access restrictions */
+extern void NIO_UpdateServerAccess(void);
+
+/* Function to apply pending changes in the access restrictions to the kernel
+   before dropping root privileges */
+extern void NIO_FlushServerAccess(void);
+
+/* Function to get the number of NTP requests which were answered or dropped
+   by the kernel without reaching the server */
+extern void NIO_GetKernelServerStats(uint32_t *hits, uint32_t *drops);
+
 #endif /* GOT_NTP_IO_H */
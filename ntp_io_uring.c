@@ -0,0 +1,720 @@
+/*
+  chronyd/chronyc - Programs for keeping computer clocks accurate.
+
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+
+  =======================================================================
+
+  Receiving and sending of NTP packets on the server sockets using io_uring.
+  The ring is used directly with the system calls, no library is needed.
+
+  Each socket has a multishot recvmsg request, which receives messages into
+  buffers provided to the kernel in a buffer ring, so the messages are
+  received without any system call.  The descriptor of the ring is registered
+  in the scheduler, which calls the handler when completions are available.
+  Responses to the messages processed in one batch are queued as sendmsg
+  requests and submitted together with replenished receive requests in one
+  io_uring_enter() call.
+
+  The error queue of the sockets (transmit timestamps) is read by the caller
+  as before.  If the kernel does not support the multishot recvmsg request,
+  the socket is returned to the caller.
+
+  The ring is created disabled and enabled only after restricting it to the
+  recvmsg, sendmsg and cancel requests, so it cannot be used to get around
+  the seccomp filter, which allows io_uring_enter().
+  */
+
+#include "config.h"
+
+#include "sysincl.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ntp_io_uring.h"
+#include "array.h"
+#include "logging.h"
+#include "memory.h"
+#include "ntp.h"
+#include "sched.h"
+#include "util.h"
+
+/* Number of entries in the submission queue */
+#define QUEUE_ENTRIES 256
+
+/* Number of buffers for received messages (a power of 2) */
+#define RECV_BUFFERS 256
+#define BUFFER_GROUP 0
+
+/* Space reserved for the source address and control messages in the
+   buffers for received messages, and in the queued messages */
+#define NAME_SPACE 32
+#define CONTROL_SPACE 256
+
+/* Size of a buffer for a received message */
+#define RECV_BUFFER_SIZE (sizeof (struct io_uring_recvmsg_out) + NAME_SPACE + \
+                          CONTROL_SPACE + sizeof (NTP_Packet))
+
+/* Maximum number of sent messages waiting for completion */
+#define MAX_SENT_MESSAGES 256
+
+/* Types of requests in the upper half of user_data */
+#define REQUEST_RECV 1
+#define REQUEST_SEND 2
+#define REQUEST_CANCEL 3
+
+#define MAKE_USER_DATA(type, id) ((uint64_t)(type) << 32 | (uint32_t)(id))
+#define GET_REQUEST_TYPE(user_data) ((user_data) >> 32)
+#define GET_REQUEST_ID(user_data) ((uint32_t)(user_data))
+
+/* Socket which has a receive request */
+typedef struct {
+  int sock_fd;
+  uint32_t id;
+} Socket;
+
+/* Message waiting for completion of its sendmsg request */
+typedef struct {
+  struct msghdr hdr;
+  struct iovec iov;
+  NTP_Packet buf;
+  union {
+    struct sockaddr u;
+    char bytes[NAME_SPACE];
+  } name;
+  /* Aligned buffer for control messages */
+  struct cmsghdr cmsgbuf[CONTROL_SPACE / sizeof (struct cmsghdr)];
+} SentMessage;
+
+static int ring_fd;
+
+/* Mapped submission and completion queues */
+static void *rings;
+static size_t rings_size;
+static struct io_uring_sqe *sqes;
+static size_t sqes_size;
+static unsigned int *sq_head;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_flags;
+static unsigned int sq_entries;
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* Submission queue entries which were not submitted yet */
+static unsigned int pending_sqes;
+
+/* Buffer ring and memory of the buffers for received messages */
+static struct io_uring_buf_ring *buf_ring;
+static size_t buf_ring_size;
+static char *recv_buffers;
+
+/* Header specifying the space reserved for the address and control
+   messages in the buffers */
+static struct msghdr recv_header;
+
+/* Array of Socket */
+static ARR_Instance sockets;
+static uint32_t last_socket_id;
+
+/* Array of SentMessage and stack of indices of free messages */
+static ARR_Instance sent_messages;
+static ARR_Instance free_sent_messages;
+
+/* Flag indicating a batch of received messages is being processed */
+static int processing;
+
+static NIO_Uring_MessageHandler message_handler;
+static NIO_Uring_FallbackHandler fallback_handler;
+
+static int initialised = 0;
+
+/* ================================================== */
+
+static void read_completions(int fd, int event, void *anything);
+
+/* ================================================== */
+
+static int
+setup_ring(unsigned int entries, struct io_uring_params *params)
+{
+  return syscall(SYS_io_uring_setup, entries, params);
+}
+
+/* ================================================== */
+
+static int
+enter_ring(unsigned int to_submit, unsigned int flags)
+{
+  return syscall(SYS_io_uring_enter, ring_fd, to_submit, 0, flags, NULL, 0);
+}
+
+/* ================================================== */
+
+static int
+register_ring(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+  return syscall(SYS_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/* ================================================== */
+
+static int
+restrict_ring(void)
+{
+  struct io_uring_restriction res[4];
+  const int ops[] = { IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL };
+  int i;
+
+  memset(res, 0, sizeof (res));
+
+  for (i = 0; i < 3; i++) {
+    res[i].opcode = IORING_RESTRICTION_SQE_OP;
+    res[i].sqe_op = ops[i];
+  }
+
+  res[i].opcode = IORING_RESTRICTION_SQE_FLAGS_ALLOWED;
+  res[i].sqe_flags = IOSQE_BUFFER_SELECT;
+
+  if (register_ring(IORING_REGISTER_RESTRICTIONS, res, 4) < 0 ||
+      register_ring(IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+    return 0;
+
+  return 1;
+}
+
+/* ================================================== */
+
+static void
+submit_requests(void)
+{
+  int r;
+
+  /* Flush completions which did not fit in the completion queue */
+  if (pending_sqes == 0 && !(__atomic_load_n(sq_flags, __ATOMIC_RELAXED) &
+                             IORING_SQ_CQ_OVERFLOW))
+    return;
+
+  r = enter_ring(pending_sqes, IORING_ENTER_GETEVENTS);
+  if (r < 0) {
+    DEBUG_LOG("Could not submit %u requests : %s", pending_sqes, strerror(errno));
+    return;
+  }
+
+  pending_sqes -= MIN(r, pending_sqes);
+}
+
+/* ================================================== */
+
+static struct io_uring_sqe *
+get_sqe(void)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int tail;
+
+  tail = *sq_tail;
+
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    submit_requests();
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+      return NULL;
+  }
+
+  sqe = &sqes[tail & *sq_mask];
+  memset(sqe, 0, sizeof (*sqe));
+
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  pending_sqes++;
+
+  return sqe;
+}
+
+/* ================================================== */
+
+static void
+provide_buffer(unsigned int id)
+{
+  struct io_uring_buf *buf;
+  uint16_t tail;
+
+  tail = buf_ring->tail;
+  buf = &buf_ring->bufs[tail & (RECV_BUFFERS - 1)];
+  buf->addr = (uintptr_t)(recv_buffers + id * RECV_BUFFER_SIZE);
+  buf->len = RECV_BUFFER_SIZE;
+  buf->bid = id;
+
+  __atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* ================================================== */
+
+static Socket *
+find_socket(int sock_fd)
+{
+  Socket *sock;
+  unsigned int i;
+
+  for (i = 0; i < ARR_GetSize(sockets); i++) {
+    sock = ARR_GetElement(sockets, i);
+    if (sock->sock_fd == sock_fd)
+      return sock;
+  }
+
+  return NULL;
+}
+
+/* ================================================== */
+
+static Socket *
+find_socket_by_id(uint32_t id)
+{
+  Socket *sock;
+  unsigned int i;
+
+  for (i = 0; i < ARR_GetSize(sockets); i++) {
+    sock = ARR_GetElement(sockets, i);
+    if (sock->id == id)
+      return sock;
+  }
+
+  return NULL;
+}
+
+/* ================================================== */
+
+static void
+remove_socket(Socket *sock)
+{
+  unsigned int last;
+
+  last = ARR_GetSize(sockets) - 1;
+  *sock = *(Socket *)ARR_GetElement(sockets, last);
+  ARR_SetSize(sockets, last);
+}
+
+/* ================================================== */
+
+static int
+add_recv_request(Socket *sock)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = get_sqe();
+  if (!sqe)
+    return 0;
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = sock->sock_fd;
+  sqe->addr = (uintptr_t)&recv_header;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = MAKE_USER_DATA(REQUEST_RECV, sock->id);
+
+  return 1;
+}
+
+/* ================================================== */
+
+static void
+process_received_message(struct io_uring_recvmsg_out *out, int length, int sock_fd)
+{
+  struct msghdr hdr;
+  struct iovec iov;
+  char *name, *control;
+
+  if (length < (int)(sizeof (*out) + NAME_SPACE + CONTROL_SPACE)) {
+    DEBUG_LOG("Invalid recvmsg buffer");
+    return;
+  }
+
+  name = (char *)(out + 1);
+  control = name + NAME_SPACE;
+
+  iov.iov_base = control + CONTROL_SPACE;
+  iov.iov_len = sizeof (NTP_Packet);
+
+  hdr.msg_name = name;
+  hdr.msg_namelen = out->namelen;
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = MIN(out->controllen, CONTROL_SPACE);
+  hdr.msg_flags = out->flags;
+
+  (message_handler)(&hdr, out->payloadlen, sock_fd);
+}
+
+/* ================================================== */
+
+static void
+process_recv_completion(struct io_uring_cqe *cqe)
+{
+  unsigned int buffer_id;
+  Socket *sock;
+  int sock_fd;
+
+  sock = find_socket_by_id(GET_REQUEST_ID(cqe->user_data));
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    assert(buffer_id < RECV_BUFFERS);
+
+    /* Ignore messages received from removed sockets */
+    if (sock && cqe->res >= 0)
+      process_received_message((struct io_uring_recvmsg_out *)
+                                 (recv_buffers + buffer_id * RECV_BUFFER_SIZE),
+                               cqe->res, sock->sock_fd);
+
+    provide_buffer(buffer_id);
+  }
+
+  /* The handler might have removed the socket */
+  sock = find_socket_by_id(GET_REQUEST_ID(cqe->user_data));
+  if (!sock || cqe->flags & IORING_CQE_F_MORE)
+    return;
+
+  /* Restart the request if it was terminated due to missing buffers */
+  if ((cqe->res >= 0 || cqe->res == -ENOBUFS) && add_recv_request(sock))
+    return;
+
+  DEBUG_LOG("Could not receive from fd %d : %s", sock->sock_fd,
+            cqe->res < 0 ? strerror(-cqe->res) : "Request not restarted");
+
+  if (cqe->res == -EINVAL)
+    LOG(LOGS_WARN, "Multishot io_uring recvmsg not supported");
+
+  /* Return the socket to the caller */
+  sock_fd = sock->sock_fd;
+  remove_socket(sock);
+  (fallback_handler)(sock_fd);
+}
+
+/* ================================================== */
+
+static void
+process_send_completion(struct io_uring_cqe *cqe)
+{
+  unsigned int index;
+
+  index = GET_REQUEST_ID(cqe->user_data);
+  assert(index < ARR_GetSize(sent_messages));
+
+  if (cqe->res < 0)
+    DEBUG_LOG("Could not send message : %s", strerror(-cqe->res));
+
+  ARR_AppendElement(free_sent_messages, &index);
+}
+
+/* ================================================== */
+
+static void
+read_completions(int fd, int event, void *anything)
+{
+  struct io_uring_cqe *cqe;
+  unsigned int head, tail;
+
+  processing = 1;
+
+  head = *cq_head;
+
+  while (head != (tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))) {
+    for (; head != tail; head++) {
+      cqe = &cqes[head & *cq_mask];
+
+      switch (GET_REQUEST_TYPE(cqe->user_data)) {
+        case REQUEST_RECV:
+          process_recv_completion(cqe);
+          break;
+        case REQUEST_SEND:
+          process_send_completion(cqe);
+          break;
+        default:
+          break;
+      }
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  processing = 0;
+
+  /* Submit the queued messages and restarted receive requests */
+  submit_requests();
+}
+
+/* ================================================== */
+
+static void
+destroy_ring(void)
+{
+  if (buf_ring != MAP_FAILED)
+    munmap(buf_ring, buf_ring_size);
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  if (rings != MAP_FAILED)
+    munmap(rings, rings_size);
+  close(ring_fd);
+}
+
+/* ================================================== */
+
+void
+NIO_Uring_Initialise(NIO_Uring_MessageHandler msg_handler,
+                     NIO_Uring_FallbackHandler fb_handler)
+{
+  struct io_uring_buf_reg buf_reg;
+  struct io_uring_params params;
+  unsigned int i;
+
+  assert(!initialised);
+
+  memset(&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_R_DISABLED;
+  ring_fd = setup_ring(QUEUE_ENTRIES, &params);
+  if (ring_fd < 0) {
+    DEBUG_LOG("Could not create io_uring : %s", strerror(errno));
+    return;
+  }
+
+  rings = MAP_FAILED;
+  sqes = MAP_FAILED;
+  buf_ring = MAP_FAILED;
+
+  /* Lost completions would stop receive requests */
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP)) {
+    DEBUG_LOG("Missing io_uring features");
+    destroy_ring();
+    return;
+  }
+
+  rings_size = MAX(params.sq_off.array + params.sq_entries * sizeof (unsigned int),
+                   params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe));
+  rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ring_fd, IORING_OFF_SQ_RING);
+  sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring_fd, IORING_OFF_SQES);
+  buf_ring_size = RECV_BUFFERS * sizeof (struct io_uring_buf);
+  buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (rings == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED) {
+    LOG(LOGS_ERR, "Could not map io_uring : %s", strerror(errno));
+    destroy_ring();
+    return;
+  }
+
+  sq_head = (unsigned int *)((char *)rings + params.sq_off.head);
+  sq_tail = (unsigned int *)((char *)rings + params.sq_off.tail);
+  sq_mask = (unsigned int *)((char *)rings + params.sq_off.ring_mask);
+  sq_flags = (unsigned int *)((char *)rings + params.sq_off.flags);
+  sq_entries = params.sq_entries;
+  cq_head = (unsigned int *)((char *)rings + params.cq_off.head);
+  cq_tail = (unsigned int *)((char *)rings + params.cq_off.tail);
+  cq_mask = (unsigned int *)((char *)rings + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)rings + params.cq_off.cqes);
+
+  /* Use the submission queue entries in the order of their indices */
+  for (i = 0; i < sq_entries; i++)
+    ((unsigned int *)((char *)rings + params.sq_off.array))[i] = i;
+  pending_sqes = 0;
+
+  memset(&buf_reg, 0, sizeof (buf_reg));
+  buf_reg.ring_addr = (uintptr_t)buf_ring;
+  buf_reg.ring_entries = RECV_BUFFERS;
+  buf_reg.bgid = BUFFER_GROUP;
+
+  if (register_ring(IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0) {
+    DEBUG_LOG("Could not register io_uring buffers : %s", strerror(errno));
+    destroy_ring();
+    return;
+  }
+
+  /* No other requests or registrations are possible after this */
+  if (!restrict_ring()) {
+    DEBUG_LOG("Could not restrict io_uring : %s", strerror(errno));
+    destroy_ring();
+    return;
+  }
+
+  recv_buffers = Malloc2(RECV_BUFFERS, RECV_BUFFER_SIZE);
+  for (i = 0; i < RECV_BUFFERS; i++)
+    provide_buffer(i);
+
+  memset(&recv_header, 0, sizeof (recv_header));
+  recv_header.msg_namelen = NAME_SPACE;
+  recv_header.msg_controllen = CONTROL_SPACE;
+
+  sockets = ARR_CreateInstance(sizeof (Socket));
+  last_socket_id = 0;
+
+  sent_messages = ARR_CreateInstance(sizeof (SentMessage));
+  ARR_SetSize(sent_messages, MAX_SENT_MESSAGES);
+  free_sent_messages = ARR_CreateInstance(sizeof (unsigned int));
+  for (i = MAX_SENT_MESSAGES; i > 0; i--) {
+    unsigned int index = i - 1;
+    ARR_AppendElement(free_sent_messages, &index);
+  }
+
+  processing = 0;
+  message_handler = msg_handler;
+  fallback_handler = fb_handler;
+
+  SCH_AddFileHandler(ring_fd, SCH_FILE_INPUT, read_completions, NULL);
+
+  initialised = 1;
+
+  DEBUG_LOG("Created io_uring fd=%d", ring_fd);
+}
+
+/* ================================================== */
+
+void
+NIO_Uring_Finalise(void)
+{
+  if (!initialised)
+    return;
+
+  SCH_RemoveFileHandler(ring_fd);
+
+  /* Closing the ring cancels all requests */
+  destroy_ring();
+
+  ARR_DestroyInstance(free_sent_messages);
+  ARR_DestroyInstance(sent_messages);
+  ARR_DestroyInstance(sockets);
+  Free(recv_buffers);
+
+  initialised = 0;
+}
+
+/* ================================================== */
+
+int
+NIO_Uring_AddSocket(int sock_fd)
+{
+  Socket *sock;
+
+  if (!initialised)
+    return 0;
+
+  assert(!find_socket(sock_fd));
+
+  sock = ARR_GetNewElement(sockets);
+  sock->sock_fd = sock_fd;
+  sock->id = ++last_socket_id;
+
+  if (!add_recv_request(sock)) {
+    remove_socket(sock);
+    return 0;
+  }
+
+  /* Submit the request now unless the batch is being processed */
+  if (!processing)
+    submit_requests();
+
+  DEBUG_LOG("Receiving from fd %d via io_uring", sock_fd);
+
+  return 1;
+}
+
+/* ================================================== */
+
+void
+NIO_Uring_RemoveSocket(int sock_fd)
+{
+  struct io_uring_sqe *sqe;
+  Socket *sock;
+
+  if (!initialised)
+    return;
+
+  sock = find_socket(sock_fd);
+  if (!sock)
+    return;
+
+  /* Cancel the request to release the socket.  Completions of the request
+     (including the buffers) will be ignored. */
+  sqe = get_sqe();
+  if (sqe) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MAKE_USER_DATA(REQUEST_RECV, sock->id);
+    sqe->user_data = MAKE_USER_DATA(REQUEST_CANCEL, sock->id);
+    submit_requests();
+  }
+
+  remove_socket(sock);
+}
+
+/* ================================================== */
+
+int
+NIO_Uring_QueueMessage(struct msghdr *msg, int sock_fd)
+{
+  struct io_uring_sqe *sqe;
+  SentMessage *m;
+  unsigned int index;
+
+  /* Messages are queued only in the batch to be submitted together */
+  if (!processing || ARR_GetSize(free_sent_messages) == 0)
+    return 0;
+
+  if (msg->msg_iovlen != 1 || msg->msg_iov[0].iov_len > sizeof (m->buf) ||
+      msg->msg_namelen > sizeof (m->name) || msg->msg_controllen > sizeof (m->cmsgbuf))
+    return 0;
+
+  sqe = get_sqe();
+  if (!sqe)
+    return 0;
+
+  index = *(unsigned int *)ARR_GetElement(free_sent_messages,
+                                          ARR_GetSize(free_sent_messages) - 1);
+  ARR_SetSize(free_sent_messages, ARR_GetSize(free_sent_messages) - 1);
+
+  /* Copy the message with its address and control messages */
+  m = ARR_GetElement(sent_messages, index);
+  memcpy(&m->buf, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+  m->iov.iov_base = &m->buf;
+  m->iov.iov_len = msg->msg_iov[0].iov_len;
+  if (msg->msg_namelen)
+    memcpy(&m->name, msg->msg_name, msg->msg_namelen);
+  if (msg->msg_controllen)
+    memcpy(&m->cmsgbuf, msg->msg_control, msg->msg_controllen);
+
+  memset(&m->hdr, 0, sizeof (m->hdr));
+  m->hdr.msg_name = msg->msg_namelen ? &m->name : NULL;
+  m->hdr.msg_namelen = msg->msg_namelen;
+  m->hdr.msg_iov = &m->iov;
+  m->hdr.msg_iovlen = 1;
+  m->hdr.msg_control = msg->msg_controllen ? &m->cmsgbuf : NULL;
+  m->hdr.msg_controllen = msg->msg_controllen;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = sock_fd;
+  sqe->addr = (uintptr_t)&m->hdr;
+  sqe->user_data = MAKE_USER_DATA(REQUEST_SEND, index);
+
+  return 1;
+}
@@ -0,0 +1,54 @@
+/*
+  chronyd/chronyc - Programs for keeping computer clocks accurate.
+
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+
+  =======================================================================
+
+  This is the header file for the io_uring-based NTP socket I/O.
+  */
+
+#ifndef GOT_NTP_IO_URING_H
+#define GOT_NTP_IO_URING_H
+
+/* Handler of received messages */
+typedef void (*NIO_Uring_MessageHandler)(struct msghdr *hdr, int length, int sock_fd);
+
+/* Handler called when a socket can no longer be read by the ring and needs
+   to be read by the caller */
+typedef void (*NIO_Uring_FallbackHandler)(int sock_fd);
+
+/* Create the ring if io_uring is supported */
+extern void NIO_Uring_Initialise(NIO_Uring_MessageHandler message_handler,
+                                 NIO_Uring_FallbackHandler fallback_handler);
+
+extern void NIO_Uring_Finalise(void);
+
+/* Start receiving messages from a socket.  Return zero if the socket
+   needs to be read by the caller. */
+extern int NIO_Uring_AddSocket(int sock_fd);
+
+/* Stop receiving messages from a socket before it is closed */
+extern void NIO_Uring_RemoveSocket(int sock_fd);
+
+/* Queue a message to be sent after processing the current batch of
+   received messages.  Return zero if the message needs to be sent by
+   the caller. */
+extern int NIO_Uring_QueueMessage(struct msghdr *msg, int sock_fd);
+
+#endif
@@ -0,0 +1,855 @@
+/*
+  chronyd/chronyc - Programs for keeping computer clocks accurate.
+
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+
+  =======================================================================
+
+  Multi-threaded NTP server.  Each worker thread has its own socket bound to
+  the server port with the SO_REUSEPORT option, which makes the kernel
+  distribute the received packets between the workers and the server socket
+  of the main thread.  The workers respond to basic client requests using a
+  copy of the server state, which is periodically updated by the main thread.
+  Requests from clients which don't have a record in the client log yet, and
+  all other packets, are passed to the main thread.
+
+  The workers must not call any function which is not thread-safe, e.g. they
+  cannot log messages.
+  */
+
+#include "config.h"
+
+#include "sysincl.h"
+
+#include <pthread.h>
+
+#include "ntp_io_workers.h"
+#include "array.h"
+#include "clientlog.h"
+#include "conf.h"
+#include "local.h"
+#include "logging.h"
+#include "memory.h"
+#include "ntp.h"
+#include "ntp_core.h"
+#include "privops.h"
+#include "reference.h"
+#include "sched.h"
+#include "smooth.h"
+#include "util.h"
+
+#define INVALID_SOCK_FD -1
+#define NTP_INVALID_STRATUM 0
+#define CMSGBUF_SIZE 256
+
+/* Maximum number of packets received in one recvmmsg() call */
+#define MAX_WORKER_MESSAGES 16
+
+/* Maximum number of packets waiting to be processed by the main thread */
+#define MAX_FORWARDED_MESSAGES 64
+
+/* Interval between updates of the server state copied to the workers */
+#define STATE_UPDATE_INTERVAL 1.0
+
+union sockaddr_in46 {
+  struct sockaddr_in in4;
+#ifdef FEAT_IPV6
+  struct sockaddr_in6 in6;
+#endif
+  struct sockaddr u;
+};
+
+struct Message {
+  union sockaddr_in46 name;
+  socklen_t name_len;
+  NTP_Packet buf;
+  int length;
+  /* Aligned buffer for control messages */
+  struct cmsghdr cmsgbuf[CMSGBUF_SIZE / sizeof (struct cmsghdr)];
+  socklen_t cmsg_len;
+  int flags;
+};
+
+/* Server state linearised around the time of the update, which allows the
+   workers to convert raw timestamps to cooked time and get the current root
+   dispersion and smoothing offset without calling the local and reference
+   modules */
+typedef struct {
+  struct timespec raw_ts;
+  double correction;
+  double correction_rate;
+  double root_dispersion;
+  double root_dispersion_rate;
+  double smooth_offset;
+  double smooth_rate;
+  double root_delay;
+  double quantum;
+  struct timespec ref_time;
+  uint32_t ref_id;
+  NTP_Leap leap;
+  int stratum;
+  int precision;
+  int min_poll;
+  int smoothing;
+} ServerState;
+
+struct Worker {
+  pthread_t thread;
+  int sock_fd;
+  int server_sock_fd;
+  int stop;
+
+  /* Mutex protecting all following fields and the state of other modules
+     which the worker accesses (i.e. the access table) */
+  pthread_mutex_t lock;
+  ServerState state;
+  int state_valid;
+  struct Message forwarded[MAX_FORWARDED_MESSAGES];
+  int num_forwarded;
+
+  /* Buffers used only by the worker thread */
+  struct Message messages[MAX_WORKER_MESSAGES];
+  struct mmsghdr headers[MAX_WORKER_MESSAGES];
+  struct iovec iovs[MAX_WORKER_MESSAGES];
+  struct Message responses[MAX_WORKER_MESSAGES];
+  struct mmsghdr response_headers[MAX_WORKER_MESSAGES];
+  struct iovec response_iovs[MAX_WORKER_MESSAGES];
+  int num_responses;
+  unsigned char random_bytes[256];
+  unsigned int available_random_bytes;
+};
+
+/* Array of pointers to workers */
+static ARR_Instance workers;
+
+/* Pipe used to wake up the main thread when a message is forwarded */
+static int notify_pipe[2];
+
+static NIO_Workers_MessageHandler message_handler;
+
+/* Flag indicating the threads were started */
+static int started;
+
+static SCH_TimeoutID update_timeout_id;
+
+/* ================================================== */
+
+static void process_forwarded_messages(int fd, int event, void *anything);
+static void update_timeout(void *arg);
+static void handle_slew(struct timespec *raw, struct timespec *cooked, double dfreq,
+                        double doffset, LCL_ChangeType change_type, void *anything);
+
+/* ================================================== */
+
+static int
+open_socket(int family, int port)
+{
+  union sockaddr_in46 addr;
+  socklen_t addr_len;
+  IPAddr bind_address;
+  int sock_fd, on_off = 1;
+
+  sock_fd = socket(family, SOCK_DGRAM, 0);
+  if (sock_fd < 0) {
+    LOG(LOGS_ERR, "Could not open %s NTP socket : %s",
+        UTI_SockaddrFamilyToString(family), strerror(errno));
+    return INVALID_SOCK_FD;
+  }
+
+  UTI_FdSetCloexec(sock_fd);
+
+  CNF_GetBindAddress(family == AF_INET ? IPADDR_INET4 : IPADDR_INET6, &bind_address);
+  if (bind_address.family == IPADDR_UNSPEC) {
+    bind_address.family = family == AF_INET ? IPADDR_INET4 : IPADDR_INET6;
+    if (bind_address.family == IPADDR_INET4)
+      bind_address.addr.in4 = INADDR_ANY;
+    else
+      memset(&bind_address.addr.in6, 0, sizeof (bind_address.addr.in6));
+  }
+
+  addr_len = UTI_IPAndPortToSockaddr(&bind_address, port, &addr.u);
+  assert(addr_len);
+
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on_off, sizeof (on_off)) < 0 ||
+      setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &on_off, sizeof (on_off)) < 0) {
+    LOG(LOGS_ERR, "Could not set %s socket option", "SO_REUSEPORT");
+    close(sock_fd);
+    return INVALID_SOCK_FD;
+  }
+
+#ifdef SO_TIMESTAMPNS
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on_off, sizeof (on_off)) < 0)
+    LOG(LOGS_ERR, "Could not set %s socket option", "SO_TIMESTAMPNS");
+#endif
+
+#ifdef IP_FREEBIND
+  if (setsockopt(sock_fd, IPPROTO_IP, IP_FREEBIND, &on_off, sizeof (on_off)) < 0)
+    LOG(LOGS_ERR, "Could not set %s socket option", "IP_FREEBIND");
+#endif
+
+  if (family == AF_INET) {
+#ifdef HAVE_IN_PKTINFO
+    if (setsockopt(sock_fd, IPPROTO_IP, IP_PKTINFO, &on_off, sizeof (on_off)) < 0)
+      LOG(LOGS_ERR, "Could not set %s socket option", "IP_PKTINFO");
+#endif
+  }
+#ifdef FEAT_IPV6
+  else {
+#ifdef IPV6_V6ONLY
+    if (setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &on_off, sizeof (on_off)) < 0)
+      LOG(LOGS_ERR, "Could not set %s socket option", "IPV6_V6ONLY");
+#endif
+#if defined(HAVE_IN6_PKTINFO) && defined(IPV6_RECVPKTINFO)
+    if (setsockopt(sock_fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on_off, sizeof (on_off)) < 0)
+      LOG(LOGS_ERR, "Could not set %s socket option", "IPV6_RECVPKTINFO");
+#endif
+  }
+#endif
+
+  if (PRV_BindSocket(sock_fd, &addr.u, addr_len) < 0) {
+    LOG(LOGS_ERR, "Could not bind %s NTP socket : %s",
+        UTI_SockaddrFamilyToString(family), strerror(errno));
+    close(sock_fd);
+    return INVALID_SOCK_FD;
+  }
+
+  return sock_fd;
+}
+
+/* ================================================== */
+
+static void
+add_worker(int family, int server_sock_fd)
+{
+  struct Worker *w;
+  int sock_fd;
+
+  sock_fd = open_socket(family, CNF_GetNTPPort());
+  if (sock_fd == INVALID_SOCK_FD)
+    return;
+
+  w = MallocNew(struct Worker);
+  memset(w, 0, sizeof (*w));
+  w->sock_fd = sock_fd;
+  w->server_sock_fd = server_sock_fd;
+
+  if (pthread_mutex_init(&w->lock, NULL))
+    LOG_FATAL("pthread_mutex_init() failed");
+
+  ARR_AppendElement(workers, &w);
+}
+
+/* ================================================== */
+
+void
+NIO_Workers_Initialise(int num_workers, int server_sock_fd4, int server_sock_fd6,
+                       NIO_Workers_MessageHandler handler)
+{
+  int i;
+
+  workers = ARR_CreateInstance(sizeof (struct Worker *));
+  message_handler = handler;
+  started = 0;
+
+  for (i = 0; i < num_workers; i++) {
+    if (server_sock_fd4 != INVALID_SOCK_FD)
+      add_worker(AF_INET, server_sock_fd4);
+#ifdef FEAT_IPV6
+    if (server_sock_fd6 != INVALID_SOCK_FD)
+      add_worker(AF_INET6, server_sock_fd6);
+#endif
+  }
+
+  if (pipe(notify_pipe) < 0)
+    LOG_FATAL("pipe() failed : %s", strerror(errno));
+
+  UTI_FdSetCloexec(notify_pipe[0]);
+  UTI_FdSetCloexec(notify_pipe[1]);
+  if (fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK))
+    LOG_FATAL("Could not set O_NONBLOCK : %s", strerror(errno));
+
+  SCH_AddFileHandler(notify_pipe[0], SCH_FILE_INPUT, process_forwarded_messages, NULL);
+  LCL_AddParameterChangeHandler(handle_slew, NULL);
+
+  /* Start the threads from the main loop after all modules are initialised,
+     root privileges are dropped, and the system call filter is enabled */
+  update_timeout_id = SCH_AddTimeoutByDelay(0.0, update_timeout, NULL);
+
+  LOG(LOGS_INFO, "Opened %u NTP server worker sockets", ARR_GetSize(workers));
+}
+
+/* ================================================== */
+
+void
+NIO_Workers_Finalise(void)
+{
+  struct Worker *w;
+  unsigned int i;
+
+  for (i = 0; i < ARR_GetSize(workers); i++) {
+    w = *(struct Worker **)ARR_GetElement(workers, i);
+
+    if (started) {
+      pthread_mutex_lock(&w->lock);
+      w->stop = 1;
+      pthread_mutex_unlock(&w->lock);
+
+      /* Wake up the thread waiting in recvmmsg() */
+      shutdown(w->sock_fd, SHUT_RD);
+
+      if (pthread_join(w->thread, NULL))
+        LOG_FATAL("pthread_join() failed");
+    }
+
+    close(w->sock_fd);
+    pthread_mutex_destroy(&w->lock);
+    Free(w);
+  }
+
+  ARR_DestroyInstance(workers);
+
+  SCH_RemoveTimeout(update_timeout_id);
+  LCL_RemoveParameterChangeHandler(handle_slew, NULL);
+  SCH_RemoveFileHandler(notify_pipe[0]);
+  close(notify_pipe[0]);
+  close(notify_pipe[1]);
+}
+
+/* ================================================== */
+
+void
+NIO_Workers_Lock(void)
+{
+  unsigned int i;
+
+  for (i = 0; i < ARR_GetSize(workers); i++)
+    pthread_mutex_lock(&(*(struct Worker **)ARR_GetElement(workers, i))->lock);
+}
+
+/* ================================================== */
+
+void
+NIO_Workers_Unlock(void)
+{
+  unsigned int i;
+
+  for (i = 0; i < ARR_GetSize(workers); i++)
+    pthread_mutex_unlock(&(*(struct Worker **)ARR_GetElement(workers, i))->lock);
+}
+
+/* ================================================== */
+
+static void
+update_state(void)
+{
+  struct timespec raw2, cooked, cooked2, ref_time2;
+  double correction2, root_delay2, root_dispersion2;
+  int synchronised, stratum2;
+  uint32_t ref_id2;
+  NTP_Leap leap2;
+  ServerState state;
+  struct Worker *w;
+  unsigned int i;
+
+  /* Get the values at the current time and one second later to get
+     the rate of their change */
+
+  LCL_ReadRawTime(&state.raw_ts);
+  UTI_AddDoubleToTimespec(&state.raw_ts, 1.0, &raw2);
+
+  LCL_GetOffsetCorrection(&state.raw_ts, &state.correction, NULL);
+  LCL_GetOffsetCorrection(&raw2, &correction2, NULL);
+  state.correction_rate = correction2 - state.correction;
+
+  UTI_AddDoubleToTimespec(&state.raw_ts, state.correction, &cooked);
+  UTI_AddDoubleToTimespec(&raw2, correction2, &cooked2);
+
+  REF_GetReferenceParams(&cooked, &synchronised, &state.leap, &state.stratum,
+                         &state.ref_id, &state.ref_time, &state.root_delay,
+                         &state.root_dispersion);
+  REF_GetReferenceParams(&cooked2, &synchronised, &leap2, &stratum2, &ref_id2,
+                         &ref_time2, &root_delay2, &root_dispersion2);
+  state.root_dispersion_rate = root_dispersion2 - state.root_dispersion;
+
+  state.smoothing = SMT_IsEnabled();
+  if (state.smoothing) {
+    state.smooth_offset = SMT_GetOffset(&cooked);
+    state.smooth_rate = SMT_GetOffset(&cooked2) - state.smooth_offset;
+
+    /* Suppress leap second when smoothing and slew mode are enabled */
+    if (REF_GetLeapMode() == REF_LeapModeSlew &&
+        (state.leap == LEAP_InsertSecond || state.leap == LEAP_DeleteSecond))
+      state.leap = LEAP_Normal;
+  } else {
+    state.smooth_offset = state.smooth_rate = 0.0;
+  }
+
+  state.precision = LCL_GetSysPrecisionAsLog();
+  state.quantum = LCL_GetSysPrecisionAsQuantum();
+  state.min_poll = CLG_GetNtpMinPoll();
+
+  for (i = 0; i < ARR_GetSize(workers); i++) {
+    w = *(struct Worker **)ARR_GetElement(workers, i);
+    pthread_mutex_lock(&w->lock);
+    w->state = state;
+    w->state_valid = 1;
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/* ================================================== */
+
+static void
+handle_slew(struct timespec *raw, struct timespec *cooked, double dfreq,
+            double doffset, LCL_ChangeType change_type, void *anything)
+{
+  /* The reference module may not be initialised yet */
+  if (!started)
+    return;
+
+  update_state();
+}
+
+/* ================================================== */
+
+static void
+get_random_bytes(struct Worker *w, unsigned char *buf, unsigned int len)
+{
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    if (!w->available_random_bytes) {
+      if (getrandom(w->random_bytes, sizeof (w->random_bytes), 0) !=
+          sizeof (w->random_bytes))
+        memset(w->random_bytes, 0, sizeof (w->random_bytes));
+      w->available_random_bytes = sizeof (w->random_bytes);
+    }
+    buf[i] = w->random_bytes[--w->available_random_bytes];
+  }
+}
+
+/* ================================================== */
+/* Thread-safe version of UTI_GetNtp64Fuzz() */
+
+static void
+get_ntp64_fuzz(struct Worker *w, NTP_int64 *ts, int precision)
+{
+  int start, bits;
+
+  start = sizeof (*ts) - (precision + 32 + 7) / 8;
+  ts->hi = ts->lo = 0;
+
+  get_random_bytes(w, (unsigned char *)ts + start, sizeof (*ts) - start);
+
+  bits = (precision + 32) % 8;
+  if (bits)
+    ((unsigned char *)ts)[start] %= 1U << bits;
+}
+
+/* ================================================== */
+
+static void
+cook_time(ServerState *state, struct timespec *raw, struct timespec *cooked,
+          double *root_dispersion, double *smooth_offset)
+{
+  double elapsed;
+
+  elapsed = UTI_DiffTimespecsToDouble(raw, &state->raw_ts);
+  UTI_AddDoubleToTimespec(raw, state->correction + elapsed * state->correction_rate,
+                          cooked);
+
+  if (root_dispersion)
+    *root_dispersion = state->root_dispersion + elapsed * state->root_dispersion_rate;
+  if (smooth_offset)
+    *smooth_offset = state->smooth_offset + elapsed * state->smooth_rate;
+}
+
+/* ================================================== */
+/* Check if a received message is a client request which can be answered
+   by the worker */
+
+static int
+is_basic_request(struct Message *msg)
+{
+  NTP_Packet *request = &msg->buf;
+  int version;
+
+  if (msg->length != NTP_HEADER_LENGTH || msg->flags & (MSG_TRUNC | MSG_CTRUNC))
+    return 0;
+
+  /* Leave the special handling of NTPv1 requests to the main thread */
+  version = NTP_LVM_TO_VERSION(request->lvm);
+  if (version < 2 || version > NTP_VERSION ||
+      NTP_LVM_TO_MODE(request->lvm) != MODE_CLIENT)
+    return 0;
+
+  if (msg->name_len < sizeof (msg->name.in4) ||
+      (msg->name.u.sa_family != AF_INET
+#ifdef FEAT_IPV6
+       && msg->name.u.sa_family != AF_INET6
+#endif
+      ))
+    return 0;
+
+  return 1;
+}
+
+/* ================================================== */
+
+static void
+get_rx_info(struct Message *msg, struct timespec *rx_raw, struct timespec *rx_default,
+            struct cmsghdr *cmsgbuf, socklen_t *cmsg_len)
+{
+  struct msghdr hdr;
+  struct cmsghdr *cmsg, *reply_cmsg;
+
+  memset(&hdr, 0, sizeof (hdr));
+  hdr.msg_control = msg->cmsgbuf;
+  hdr.msg_controllen = msg->cmsg_len;
+
+  *rx_raw = *rx_default;
+  *cmsg_len = 0;
+  reply_cmsg = cmsgbuf;
+  memset(cmsgbuf, 0, CMSGBUF_SIZE);
+
+  for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+#ifdef SCM_TIMESTAMPNS
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+      memcpy(rx_raw, CMSG_DATA(cmsg), sizeof (*rx_raw));
+#endif
+
+    /* Respond from the address and interface to which the request was sent */
+#ifdef HAVE_IN_PKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+      struct in_pktinfo ipi;
+
+      memcpy(&ipi, CMSG_DATA(cmsg), sizeof (ipi));
+      ipi.ipi_spec_dst = ipi.ipi_addr;
+      ipi.ipi_addr.s_addr = 0;
+
+      reply_cmsg->cmsg_level = IPPROTO_IP;
+      reply_cmsg->cmsg_type = IP_PKTINFO;
+      reply_cmsg->cmsg_len = CMSG_LEN(sizeof (ipi));
+      memcpy(CMSG_DATA(reply_cmsg), &ipi, sizeof (ipi));
+      *cmsg_len = CMSG_SPACE(sizeof (ipi));
+    }
+#endif
+#ifdef HAVE_IN6_PKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+      struct in6_pktinfo ipi;
+
+      memcpy(&ipi, CMSG_DATA(cmsg), sizeof (ipi));
+
+      reply_cmsg->cmsg_level = IPPROTO_IPV6;
+      reply_cmsg->cmsg_type = IPV6_PKTINFO;
+      reply_cmsg->cmsg_len = CMSG_LEN(sizeof (ipi));
+      memcpy(CMSG_DATA(reply_cmsg), &ipi, sizeof (ipi));
+      *cmsg_len = CMSG_SPACE(sizeof (ipi));
+    }
+#endif
+  }
+}
+
+/* ================================================== */
+/* Prepare a response to a basic client request.  This corresponds to
+   transmit_packet() in ntp_core.c called for a request which is not
+   authenticated and is not in the interleaved mode. */
+
+static void
+add_response(struct Worker *w, ServerState *state, struct Message *msg,
+             struct timespec *rx_default)
+{
+  struct timespec rx_raw, local_receive, local_transmit, ref_time;
+  double root_dispersion, smooth_offset;
+  struct Message *resp_msg;
+  struct msghdr *hdr;
+  NTP_Packet *request, *response;
+  NTP_int64 ts_fuzz;
+  uint32_t ref_id;
+  int smooth_time;
+
+  request = &msg->buf;
+  resp_msg = &w->responses[w->num_responses];
+  resp_msg->name = msg->name;
+  resp_msg->name_len = msg->name_len;
+  response = &resp_msg->buf;
+
+  get_rx_info(msg, &rx_raw, rx_default, resp_msg->cmsgbuf, &resp_msg->cmsg_len);
+  cook_time(state, &rx_raw, &local_receive, &root_dispersion, &smooth_offset);
+
+  ref_id = state->ref_id;
+  ref_time = state->ref_time;
+
+  smooth_time = state->smoothing && fabs(smooth_offset) > state->quantum;
+  if (smooth_time) {
+    ref_id = NTP_REFID_SMOOTH;
+    UTI_AddDoubleToTimespec(&ref_time, smooth_offset, &ref_time);
+    UTI_AddDoubleToTimespec(&local_receive, smooth_offset, &local_receive);
+  }
+
+  response->lvm = NTP_LVM(state->leap, NTP_LVM_TO_VERSION(request->lvm), MODE_SERVER);
+  response->stratum = state->stratum < NTP_MAX_STRATUM ? state->stratum : NTP_INVALID_STRATUM;
+  response->poll = MAX(state->min_poll, request->poll);
+  response->precision = state->precision;
+  response->root_delay = UTI_DoubleToNtp32(state->root_delay);
+  response->root_dispersion = UTI_DoubleToNtp32(root_dispersion);
+  response->reference_id = htonl(ref_id);
+  UTI_TimespecToNtp64(&ref_time, &response->reference_ts, NULL);
+  response->originate_ts = request->transmit_ts;
+
+  do {
+    get_ntp64_fuzz(w, &ts_fuzz, state->precision);
+    UTI_TimespecToNtp64(&local_receive, &response->receive_ts, &ts_fuzz);
+  } while (!UTI_IsZeroNtp64(&response->receive_ts) &&
+           UTI_IsEqualAnyNtp64(&response->receive_ts, &response->originate_ts, NULL, NULL));
+
+  LCL_ReadRawTime(&local_transmit);
+  cook_time(state, &local_transmit, &local_transmit, NULL, NULL);
+  if (smooth_time)
+    UTI_AddDoubleToTimespec(&local_transmit, smooth_offset, &local_transmit);
+
+  do {
+    get_ntp64_fuzz(w, &ts_fuzz, state->precision);
+    UTI_TimespecToNtp64(&local_transmit, &response->transmit_ts, &ts_fuzz);
+  } while (!UTI_IsZeroNtp64(&response->transmit_ts) &&
+           UTI_IsEqualAnyNtp64(&response->transmit_ts, &response->receive_ts,
+                               &response->originate_ts, NULL));
+
+  resp_msg->length = NTP_HEADER_LENGTH;
+
+  w->response_iovs[w->num_responses].iov_base = response;
+  w->response_iovs[w->num_responses].iov_len = resp_msg->length;
+
+  hdr = &w->response_headers[w->num_responses].msg_hdr;
+  memset(hdr, 0, sizeof (*hdr));
+  hdr->msg_name = &resp_msg->name.u;
+  hdr->msg_namelen = resp_msg->name_len;
+  hdr->msg_iov = &w->response_iovs[w->num_responses];
+  hdr->msg_iovlen = 1;
+  hdr->msg_control = resp_msg->cmsg_len ? resp_msg->cmsgbuf : NULL;
+  hdr->msg_controllen = resp_msg->cmsg_len;
+
+  w->num_responses++;
+}
+
+/* ================================================== */
+
+static void
+send_responses(struct Worker *w)
+{
+  int i, r;
+
+  /* Errors cannot be logged here */
+  for (i = 0; i < w->num_responses; i += r > 0 ? r : 1) {
+#ifdef HAVE_SENDMMSG
+    r = sendmmsg(w->sock_fd, &w->response_headers[i], w->num_responses - i, 0);
+#else
+    r = sendmsg(w->sock_fd, &w->response_headers[i].msg_hdr, 0) >= 0;
+#endif
+  }
+
+  w->num_responses = 0;
+}
+
+/* ================================================== */
+
+static void
+forward_message(struct Worker *w, struct Message *msg)
+{
+  char c = 0;
+
+  /* Drop the message if the main thread is not keeping up */
+  if (w->num_forwarded >= MAX_FORWARDED_MESSAGES)
+    return;
+
+  w->forwarded[w->num_forwarded++] = *msg;
+
+  /* Wake up the main thread on the first message */
+  if (w->num_forwarded == 1 && write(notify_pipe[1], &c, 1) < 0)
+    ;
+}
+
+/* ================================================== */
+
+static void
+prepare_buffers(struct Worker *w)
+{
+  struct mmsghdr *hdr;
+  int i;
+
+  for (i = 0; i < MAX_WORKER_MESSAGES; i++) {
+    hdr = &w->headers[i];
+    w->iovs[i].iov_base = &w->messages[i].buf;
+    w->iovs[i].iov_len = sizeof (w->messages[i].buf);
+    hdr->msg_hdr.msg_name = &w->messages[i].name;
+    hdr->msg_hdr.msg_namelen = sizeof (w->messages[i].name);
+    hdr->msg_hdr.msg_iov = &w->iovs[i];
+    hdr->msg_hdr.msg_iovlen = 1;
+    hdr->msg_hdr.msg_control = &w->messages[i].cmsgbuf;
+    hdr->msg_hdr.msg_controllen = sizeof (w->messages[i].cmsgbuf);
+    hdr->msg_hdr.msg_flags = 0;
+    hdr->msg_len = 0;
+  }
+}
+
+/* ================================================== */
+
+static void *
+run_worker(void *arg)
+{
+  struct Worker *w = arg;
+  struct timespec now, now_cooked;
+  struct Message *msg;
+  ServerState state;
+  unsigned short port;
+  uint32_t random;
+  IPAddr ip;
+  int i, n, r, stop, respond[MAX_WORKER_MESSAGES];
+
+  for (stop = 0; !stop; ) {
+    prepare_buffers(w);
+
+    n = recvmmsg(w->sock_fd, w->headers, MAX_WORKER_MESSAGES, MSG_WAITFORONE, NULL);
+
+    /* Fallback timestamp for messages without a kernel timestamp */
+    LCL_ReadRawTime(&now);
+
+    for (i = 0; i < n; i++) {
+      msg = &w->messages[i];
+      msg->name_len = w->headers[i].msg_hdr.msg_namelen;
+      msg->length = w->headers[i].msg_len;
+      msg->cmsg_len = w->headers[i].msg_hdr.msg_controllen;
+      msg->flags = w->headers[i].msg_hdr.msg_flags;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    stop = w->stop;
+    state = w->state;
+    cook_time(&state, &now, &now_cooked, NULL, NULL);
+
+    for (i = 0; !stop && i < n; i++) {
+      msg = &w->messages[i];
+      respond[i] = 0;
+
+      if (!w->state_valid || !is_basic_request(msg)) {
+        if (msg->length >= NTP_HEADER_LENGTH)
+          forward_message(w, msg);
+        continue;
+      }
+
+      /* Ignore requests from unauthorised hosts */
+      UTI_SockaddrToIPAndPort(&msg->name.u, &ip, &port);
+      if (!NCR_CheckAccessRestriction(&ip))
+        continue;
+
+      /* Log the request and limit the response rate if the client is already
+         known, otherwise let the main thread create a new record */
+      get_random_bytes(w, (unsigned char *)&random, sizeof (random));
+      r = CLG_LogAndLimitNTPAccess(&ip, &now_cooked, random);
+      if (r < 0)
+        forward_message(w, msg);
+      else
+        respond[i] = !r;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 0; !stop && i < n; i++) {
+      if (respond[i])
+        add_response(w, &state, &w->messages[i], &now);
+    }
+
+    send_responses(w);
+  }
+
+  return NULL;
+}
+
+/* ================================================== */
+
+static void
+start_workers(void)
+{
+  struct Worker *w;
+  unsigned int i;
+
+  for (i = 0; i < ARR_GetSize(workers); i++) {
+    w = *(struct Worker **)ARR_GetElement(workers, i);
+    if (pthread_create(&w->thread, NULL, run_worker, w))
+      LOG_FATAL("pthread_create() failed");
+  }
+
+  started = 1;
+}
+
+/* ================================================== */
+
+static void
+update_timeout(void *arg)
+{
+  if (!started)
+    start_workers();
+
+  update_state();
+
+  update_timeout_id = SCH_AddTimeoutByDelay(STATE_UPDATE_INTERVAL, update_timeout, NULL);
+}
+
+/* ================================================== */
+
+static void
+process_forwarded_messages(int fd, int event, void *anything)
+{
+  struct Message messages[MAX_FORWARDED_MESSAGES], *msg;
+  struct msghdr hdr;
+  struct iovec iov;
+  struct Worker *w;
+  char buf[64];
+  unsigned int i;
+  int j, n;
+
+  if (read(fd, buf, sizeof (buf)) < 0)
+    DEBUG_LOG("Could not read from pipe : %s", strerror(errno));
+
+  for (i = 0; i < ARR_GetSize(workers); i++) {
+    w = *(struct Worker **)ARR_GetElement(workers, i);
+
+    pthread_mutex_lock(&w->lock);
+    n = w->num_forwarded;
+    memcpy(messages, w->forwarded, n * sizeof (messages[0]));
+    w->num_forwarded = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    for (j = 0; j < n; j++) {
+      msg = &messages[j];
+
+      iov.iov_base = &msg->buf;
+      iov.iov_len = sizeof (msg->buf);
+      hdr.msg_name = &msg->name;
+      hdr.msg_namelen = msg->name_len;
+      hdr.msg_iov = &iov;
+      hdr.msg_iovlen = 1;
+      hdr.msg_control = msg->cmsgbuf;
+      hdr.msg_controllen = msg->cmsg_len;
+      hdr.msg_flags = msg->flags;
+
+      (message_handler)(&hdr, msg->length, w->server_sock_fd);
+    }
+  }
+}
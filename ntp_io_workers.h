@@ -0,0 +1,45 @@
+/*
+  chronyd/chronyc - Programs for keeping computer clocks accurate.
+
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+
+  =======================================================================
+
+  This is the header file for the multi-threaded NTP server.
+  */
+
+#ifndef GOT_NTP_IO_WORKERS_H
+#define GOT_NTP_IO_WORKERS_H
+
+/* Handler of messages which are passed from the workers to the main thread */
+typedef void (*NIO_Workers_MessageHandler)(struct msghdr *hdr, int length, int sock_fd);
+
+/* Open the worker sockets sharing the port with the server sockets (which need
+   to have the SO_REUSEPORT option set) and prepare the workers.  The threads
+   are started later from the main loop. */
+extern void NIO_Workers_Initialise(int workers, int server_sock_fd4, int server_sock_fd6,
+                                   NIO_Workers_MessageHandler handler);
+
+extern void NIO_Workers_Finalise(void);
+
+/* Functions to prevent the workers from accessing the state shared with the
+   main thread (e.g. the access table) while it is modified */
+extern void NIO_Workers_Lock(void);
+extern void NIO_Workers_Unlock(void);
+
+#endif
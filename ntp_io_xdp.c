@@ -0,0 +1,1153 @@
+/*
+  chronyd/chronyc - Programs for keeping computer clocks accurate.
+
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+
+  =======================================================================
+
+  NTP server responding to basic client requests in the kernel using an XDP
+  program attached to the network interfaces.  The program is assembled here
+  and loaded with the bpf() system call, no compiler or library is needed.
+
+  It responds only to IPv4 requests which have no options, no fragmentation,
+  no authentication or extension fields, and which are not in the interleaved
+  mode.  All other packets, and all packets when the access restrictions or
+  the server state are not valid, are passed to the network stack.
+
+  The state of the server is shared with the program in a memory-mapped BPF
+  array.  It is linearised around the time of the update (as in the server
+  workers) with the kernel CLOCK_MONOTONIC as the time base.  There are two
+  copies of the state and the main thread updates the inactive one before
+  switching them.  The access restrictions are copied to an LPM trie.
+  */
+
+#include "config.h"
+
+#include "sysincl.h"
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "ntp_io_xdp.h"
+#include "array.h"
+#include "clientlog.h"
+#include "conf.h"
+#include "local.h"
+#include "logging.h"
+#include "memory.h"
+#include "ntp.h"
+#include "ntp_core.h"
+#include "reference.h"
+#include "sched.h"
+#include "smooth.h"
+#include "util.h"
+
+#define NTP_INVALID_STRATUM 0
+
+/* Interval between updates of the server state */
+#define STATE_UPDATE_INTERVAL 1.0
+
+/* Maximum age of the state accepted by the program (in nanoseconds) */
+#define MAX_STATE_AGE 2000000000
+
+/* Maximum number of rules in the access map */
+#define MAX_ACCESS_RULES 262144
+
+/* Range of the number of clients in the rate-limiting map */
+#define MIN_RATELIMIT_CLIENTS 1024
+#define MAX_RATELIMIT_CLIENTS (1 << 24)
+
+/* Approximate memory used by a client in the rate-limiting map, which is
+   used to keep the map in the clientloglimit */
+#define RATELIMIT_CLIENT_SIZE 64
+
+/* Maximum number of instructions in the program */
+#define MAX_PROGRAM_LENGTH 512
+
+/* Offsets of the headers in the request and its expected length */
+#define IP_OFFSET ETH_HLEN
+#define UDP_OFFSET (IP_OFFSET + (int)sizeof (struct iphdr))
+#define NTP_OFFSET (UDP_OFFSET + (int)sizeof (struct udphdr))
+#define PACKET_LENGTH (NTP_OFFSET + NTP_HEADER_LENGTH)
+
+#define IP_FIELD(field) (IP_OFFSET + (int)offsetof(struct iphdr, field))
+#define UDP_FIELD(field) (UDP_OFFSET + (int)offsetof(struct udphdr, field))
+#define NTP_FIELD(field) (NTP_OFFSET + (int)offsetof(NTP_Packet, field))
+
+/* Server state in the format used by the program.  The NTP time at
+   a monotonic time T is ntp_base + (T - mono_base) * (1 + rate), where
+   the magnitude of the rate is scaled by 2^32.  The timestamp is XORed with
+   random bits selected by fuzz_mask.  The root dispersion is in the host
+   byte order with the same format as in the packet, the fields which are
+   copied to the response are in the network order. */
+typedef struct {
+  uint64_t mono_base;
+  uint64_t ntp_base;
+  uint32_t rate;
+  uint32_t rate_negative;
+  uint32_t root_dispersion;
+  uint32_t root_dispersion_rate;
+  uint32_t fuzz_mask;
+  uint32_t root_delay;
+  uint32_t ref_id;
+  uint32_t ref_ts[2];
+  uint8_t leap;
+  uint8_t stratum;
+  int8_t min_poll;
+  int8_t precision;
+} XdpState;
+
+/* Content of the memory-mapped state map.  The rate limiting is disabled
+   when the interval (in nanoseconds) is zero.  The burst is the maximum
+   difference between the theoretical arrival time of the next request
+   and the current time (in nanoseconds) for the request to be answered. */
+typedef struct {
+  uint32_t active_state;
+  uint32_t access_valid;
+  uint64_t limit_interval;
+  uint64_t limit_burst;
+  uint32_t limit_leak_mask;
+  uint32_t reserved;
+  uint64_t ntp_hits;
+  uint64_t ntp_drops;
+  XdpState states[2];
+} SharedData;
+
+/* Key of the access map */
+typedef struct {
+  uint32_t prefix_length;
+  uint32_t address;
+} AccessKey;
+
+/* Program being assembled */
+static struct bpf_insn program[MAX_PROGRAM_LENGTH];
+static int program_length;
+
+/* Jumps to the instruction passing the packet to the network stack */
+static int pass_jumps[MAX_PROGRAM_LENGTH];
+static int num_pass_jumps;
+
+static int initialised;
+static int state_map_fd;
+static int access_map_fd;
+static int ratelimit_map_fd;
+static int program_fd;
+
+static SharedData *shared;
+static size_t shared_size;
+
+/* Array of BPF links attaching the program to the interfaces */
+static ARR_Instance links;
+
+/* Array of AccessKey which are currently in the access map */
+static ARR_Instance access_keys;
+
+/* Flag indicating the reference module is initialised */
+static int started;
+
+static SCH_TimeoutID update_timeout_id;
+static SCH_TimeoutID access_timeout_id;
+
+/* ================================================== */
+
+static void update_timeout(void *arg);
+static void handle_slew(struct timespec *raw, struct timespec *cooked, double dfreq,
+                        double doffset, LCL_ChangeType change_type, void *anything);
+
+/* ================================================== */
+
+static int
+call_bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(SYS_bpf, cmd, attr, sizeof (*attr));
+}
+
+/* ================================================== */
+
+static int
+create_map(int type, int key_size, int value_size, int max_entries, int flags)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  attr.map_flags = flags;
+
+  return call_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/* ================================================== */
+
+static int
+update_map(int fd, void *key, void *value)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t)key;
+  attr.value = (uintptr_t)value;
+  attr.flags = BPF_ANY;
+
+  return call_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/* ================================================== */
+
+static int
+delete_from_map(int fd, void *key)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t)key;
+
+  return call_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/* ================================================== */
+/* Functions assembling the program */
+
+static int
+add_insn(int code, int dst, int src, int off, int imm)
+{
+  struct bpf_insn *insn;
+
+  assert(program_length < MAX_PROGRAM_LENGTH);
+
+  insn = &program[program_length];
+  memset(insn, 0, sizeof (*insn));
+  insn->code = code;
+  insn->dst_reg = dst;
+  insn->src_reg = src;
+  insn->off = off;
+  insn->imm = imm;
+
+  return program_length++;
+}
+
+/* ================================================== */
+
+static void
+load(int size, int dst, int src, int off)
+{
+  add_insn(BPF_LDX | BPF_MEM | size, dst, src, off, 0);
+}
+
+/* ================================================== */
+
+static void
+store(int size, int dst, int off, int src)
+{
+  add_insn(BPF_STX | BPF_MEM | size, dst, src, off, 0);
+}
+
+/* ================================================== */
+
+static void
+store_imm(int size, int dst, int off, int imm)
+{
+  add_insn(BPF_ST | BPF_MEM | size, dst, 0, off, imm);
+}
+
+/* ================================================== */
+
+static void
+alu(int op, int dst, int imm)
+{
+  add_insn(BPF_ALU64 | BPF_K | op, dst, 0, 0, imm);
+}
+
+/* ================================================== */
+
+static void
+alu_reg(int op, int dst, int src)
+{
+  add_insn(BPF_ALU64 | BPF_X | op, dst, src, 0, 0);
+}
+
+/* ================================================== */
+/* Convert the lower 16 or 32 bits of a register between the host
+   and network byte order */
+
+static void
+swap_order(int reg, int bits)
+{
+  add_insn(BPF_ALU | BPF_END | BPF_TO_BE, reg, 0, 0, bits);
+}
+
+/* ================================================== */
+
+static int
+jump(int op, int dst, int imm)
+{
+  return add_insn(BPF_JMP | BPF_K | op, dst, 0, 0, imm);
+}
+
+/* ================================================== */
+
+static int
+jump_reg(int op, int dst, int src)
+{
+  return add_insn(BPF_JMP | BPF_X | op, dst, src, 0, 0);
+}
+
+/* ================================================== */
+
+static void
+set_jump_target(int jump)
+{
+  program[jump].off = program_length - jump - 1;
+}
+
+/* ================================================== */
+
+static void
+add_pass_jump(int jump)
+{
+  assert(num_pass_jumps < MAX_PROGRAM_LENGTH);
+  pass_jumps[num_pass_jumps++] = jump;
+}
+
+/* ================================================== */
+/* Pass the packet to the network stack if the 32-bit value in the register
+   has the relation to the immediate value */
+
+static void
+pass_if(int op, int dst, uint32_t imm)
+{
+  add_pass_jump(add_insn(BPF_JMP32 | BPF_K | op, dst, 0, 0, imm));
+}
+
+/* ================================================== */
+
+static void
+call(int function)
+{
+  add_insn(BPF_JMP | BPF_CALL, 0, 0, 0, function);
+}
+
+/* ================================================== */
+
+static void
+load_map_fd(int dst, int fd)
+{
+  add_insn(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+  add_insn(0, 0, 0, 0, 0);
+}
+
+/* ================================================== */
+
+static void
+copy(int size, int dst, int dst_off, int src, int src_off)
+{
+  load(size, BPF_REG_1, src, src_off);
+  store(size, dst, dst_off, BPF_REG_1);
+}
+
+/* ================================================== */
+
+static void
+swap(int size, int reg, int off1, int off2)
+{
+  load(size, BPF_REG_1, reg, off1);
+  load(size, BPF_REG_2, reg, off2);
+  store(size, reg, off1, BPF_REG_2);
+  store(size, reg, off2, BPF_REG_1);
+}
+
+/* ================================================== */
+/* Store a 64-bit timestamp (in the host order) to the packet */
+
+static void
+store_timestamp(int dst, int off, int src)
+{
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, src, 0, 0);
+  alu(BPF_RSH, BPF_REG_1, 32);
+  swap_order(BPF_REG_1, 32);
+  store(BPF_W, dst, off, BPF_REG_1);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, src, 0, 0);
+  swap_order(BPF_REG_1, 32);
+  store(BPF_W, dst, off + 4, BPF_REG_1);
+}
+
+/* ================================================== */
+/* Get the current NTP time (before adding the fuzz) in R0 and the time
+   elapsed since the update of the state (in the NTP format) in R9.  The state
+   is pointed to by R7. */
+
+static void
+add_ntp_time(void)
+{
+  int j1, j2;
+
+  call(BPF_FUNC_ktime_get_ns);
+  load(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(XdpState, mono_base));
+  alu_reg(BPF_SUB, BPF_REG_0, BPF_REG_1);
+
+  /* The unsigned comparison catches also negative values */
+  add_pass_jump(jump(BPF_JGT, BPF_REG_0, MAX_STATE_AGE));
+
+  alu(BPF_LSH, BPF_REG_0, 32);
+  alu(BPF_DIV, BPF_REG_0, 1000000000);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_0, 0, 0);
+
+  load(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(XdpState, rate));
+  alu_reg(BPF_MUL, BPF_REG_1, BPF_REG_0);
+  alu(BPF_RSH, BPF_REG_1, 32);
+  load(BPF_W, BPF_REG_2, BPF_REG_7, offsetof(XdpState, rate_negative));
+  j1 = jump(BPF_JNE, BPF_REG_2, 0);
+  alu_reg(BPF_ADD, BPF_REG_0, BPF_REG_1);
+  j2 = jump(BPF_JA, 0, 0);
+  set_jump_target(j1);
+  alu_reg(BPF_SUB, BPF_REG_0, BPF_REG_1);
+  set_jump_target(j2);
+
+  load(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(XdpState, ntp_base));
+  alu_reg(BPF_ADD, BPF_REG_0, BPF_REG_1);
+}
+
+/* ================================================== */
+/* XOR a register with random bits selected by the fuzz mask */
+
+static void
+add_fuzz(int reg)
+{
+  call(BPF_FUNC_get_prandom_u32);
+  load(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(XdpState, fuzz_mask));
+  alu_reg(BPF_AND, BPF_REG_0, BPF_REG_1);
+  alu_reg(BPF_XOR, reg, BPF_REG_0);
+}
+
+/* ================================================== */
+/* Increment a counter in the shared data, which is pointed to by the pointer
+   saved on the stack */
+
+static void
+count_request(int offset)
+{
+  load(BPF_DW, BPF_REG_1, BPF_REG_10, -32);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 1);
+  add_insn(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_1, BPF_REG_2, offset, 0);
+}
+
+/* ================================================== */
+/* Drop requests from clients which exceed the configured rate.  This is
+   the generic cell rate algorithm, which is equivalent to the token bucket
+   in clientlog.c.  The rate-limiting map contains the theoretical arrival
+   time of the next request from the client.  R7 points to the shared data. */
+
+static void
+add_rate_limiting(void)
+{
+  int disabled, found, over_limit, drop, done[3];
+
+  load(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(SharedData, limit_interval));
+  disabled = jump(BPF_JEQ, BPF_REG_1, 0);
+
+  /* R8 = current time */
+  call(BPF_FUNC_ktime_get_ns);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_0, 0, 0);
+
+  load(BPF_W, BPF_REG_2, BPF_REG_6, IP_FIELD(saddr));
+  store(BPF_W, BPF_REG_10, -16, BPF_REG_2);
+  load_map_fd(BPF_REG_1, ratelimit_map_fd);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  alu(BPF_ADD, BPF_REG_2, -16);
+  call(BPF_FUNC_map_lookup_elem);
+  found = jump(BPF_JNE, BPF_REG_0, 0);
+
+  /* Add a new client with the first request taken from its burst */
+  load(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(SharedData, limit_interval));
+  alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_8);
+  store(BPF_DW, BPF_REG_10, -24, BPF_REG_1);
+  load_map_fd(BPF_REG_1, ratelimit_map_fd);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  alu(BPF_ADD, BPF_REG_2, -16);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+  alu(BPF_ADD, BPF_REG_3, -24);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_ANY);
+  call(BPF_FUNC_map_update_elem);
+  done[0] = jump(BPF_JA, 0, 0);
+
+  /* R9 = record of the client, R1 = maximum of its arrival time and
+     the current time */
+  set_jump_target(found);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_0, 0, 0);
+  load(BPF_DW, BPF_REG_1, BPF_REG_9, 0);
+  found = jump_reg(BPF_JGE, BPF_REG_1, BPF_REG_8);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_8, 0, 0);
+  set_jump_target(found);
+
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0);
+  alu_reg(BPF_SUB, BPF_REG_2, BPF_REG_8);
+  load(BPF_DW, BPF_REG_3, BPF_REG_7, offsetof(SharedData, limit_burst));
+  over_limit = jump_reg(BPF_JGT, BPF_REG_2, BPF_REG_3);
+
+  load(BPF_DW, BPF_REG_2, BPF_REG_7, offsetof(SharedData, limit_interval));
+  alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_2);
+  store(BPF_DW, BPF_REG_9, 0, BPF_REG_1);
+  done[1] = jump(BPF_JA, 0, 0);
+
+  /* Let a random request through and leave the client with no burst */
+  set_jump_target(over_limit);
+  call(BPF_FUNC_get_prandom_u32);
+  load(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(SharedData, limit_leak_mask));
+  alu_reg(BPF_AND, BPF_REG_0, BPF_REG_1);
+  drop = jump(BPF_JNE, BPF_REG_0, 0);
+
+  load(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(SharedData, limit_interval));
+  load(BPF_DW, BPF_REG_2, BPF_REG_7, offsetof(SharedData, limit_burst));
+  alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_2);
+  alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_8);
+  store(BPF_DW, BPF_REG_9, 0, BPF_REG_1);
+  done[2] = jump(BPF_JA, 0, 0);
+
+  set_jump_target(drop);
+  count_request(offsetof(SharedData, ntp_hits));
+  count_request(offsetof(SharedData, ntp_drops));
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP);
+  add_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  set_jump_target(disabled);
+  set_jump_target(done[0]);
+  set_jump_target(done[1]);
+  set_jump_target(done[2]);
+}
+
+/* ================================================== */
+
+static void
+assemble_program(int server_port, IPAddr *bind_address)
+{
+  int i, j;
+
+  program_length = num_pass_jumps = 0;
+
+  /* R6 = start of the packet */
+  load(BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct xdp_md, data));
+  load(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end));
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_6, 0, 0);
+  alu(BPF_ADD, BPF_REG_2, PACKET_LENGTH);
+  add_pass_jump(jump_reg(BPF_JGT, BPF_REG_2, BPF_REG_3));
+
+  /* Check the headers */
+  load(BPF_H, BPF_REG_2, BPF_REG_6, offsetof(struct ethhdr, h_proto));
+  pass_if(BPF_JNE, BPF_REG_2, htons(ETH_P_IP));
+  load(BPF_B, BPF_REG_2, BPF_REG_6, IP_OFFSET);
+  pass_if(BPF_JNE, BPF_REG_2, 0x45);
+  load(BPF_H, BPF_REG_2, BPF_REG_6, IP_FIELD(frag_off));
+  alu(BPF_AND, BPF_REG_2, htons(0x3fff));
+  pass_if(BPF_JNE, BPF_REG_2, 0);
+  load(BPF_B, BPF_REG_2, BPF_REG_6, IP_FIELD(protocol));
+  pass_if(BPF_JNE, BPF_REG_2, IPPROTO_UDP);
+
+  /* Leave multicast and broadcast requests to the network stack */
+  load(BPF_B, BPF_REG_2, BPF_REG_6, IP_FIELD(daddr));
+  pass_if(BPF_JGE, BPF_REG_2, 224);
+
+  if (bind_address->family == IPADDR_INET4 && bind_address->addr.in4 != 0) {
+    load(BPF_W, BPF_REG_2, BPF_REG_6, IP_FIELD(daddr));
+    pass_if(BPF_JNE, BPF_REG_2, htonl(bind_address->addr.in4));
+  }
+
+  load(BPF_H, BPF_REG_2, BPF_REG_6, UDP_FIELD(dest));
+  pass_if(BPF_JNE, BPF_REG_2, htons(server_port));
+  load(BPF_B, BPF_REG_2, BPF_REG_6, NTP_FIELD(lvm));
+  alu(BPF_AND, BPF_REG_2, 0x7);
+  pass_if(BPF_JNE, BPF_REG_2, MODE_CLIENT);
+
+  /* Check the access restrictions */
+  store_imm(BPF_W, BPF_REG_10, -8, 32);
+  load(BPF_W, BPF_REG_2, BPF_REG_6, IP_FIELD(saddr));
+  store(BPF_W, BPF_REG_10, -4, BPF_REG_2);
+  load_map_fd(BPF_REG_1, access_map_fd);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  alu(BPF_ADD, BPF_REG_2, -8);
+  call(BPF_FUNC_map_lookup_elem);
+  add_pass_jump(jump(BPF_JEQ, BPF_REG_0, 0));
+  load(BPF_W, BPF_REG_2, BPF_REG_0, 0);
+  pass_if(BPF_JEQ, BPF_REG_2, 0);
+
+  /* R7 = shared data, which is also saved on the stack */
+  store_imm(BPF_W, BPF_REG_10, -12, 0);
+  load_map_fd(BPF_REG_1, state_map_fd);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  alu(BPF_ADD, BPF_REG_2, -12);
+  call(BPF_FUNC_map_lookup_elem);
+  add_pass_jump(jump(BPF_JEQ, BPF_REG_0, 0));
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0);
+
+  store(BPF_DW, BPF_REG_10, -32, BPF_REG_7);
+
+  /* The access map may be incomplete */
+  load(BPF_W, BPF_REG_2, BPF_REG_7, offsetof(SharedData, access_valid));
+  pass_if(BPF_JEQ, BPF_REG_2, 0);
+
+  if (ratelimit_map_fd >= 0)
+    add_rate_limiting();
+
+  /* Check if the request is a basic request which can be answered here */
+  load(BPF_H, BPF_REG_2, BPF_REG_6, IP_FIELD(tot_len));
+  pass_if(BPF_JNE, BPF_REG_2, htons(PACKET_LENGTH - IP_OFFSET));
+  load(BPF_H, BPF_REG_2, BPF_REG_6, UDP_FIELD(len));
+  pass_if(BPF_JNE, BPF_REG_2, htons(PACKET_LENGTH - UDP_OFFSET));
+
+  /* Leave NTPv1 requests to the main thread */
+  load(BPF_B, BPF_REG_2, BPF_REG_6, NTP_FIELD(lvm));
+  alu(BPF_AND, BPF_REG_2, 0x38);
+  pass_if(BPF_JLT, BPF_REG_2, NTP_LVM(0, 2, 0));
+  pass_if(BPF_JGT, BPF_REG_2, NTP_LVM(0, NTP_VERSION, 0));
+
+  /* Leave requests which may be in the interleaved mode (non-zero origin
+     timestamp and receive timestamp different from transmit timestamp)
+     to the main thread, which can detect them using the client log */
+  load(BPF_W, BPF_REG_2, BPF_REG_6, NTP_FIELD(originate_ts));
+  load(BPF_W, BPF_REG_3, BPF_REG_6, NTP_FIELD(originate_ts) + 4);
+  alu_reg(BPF_OR, BPF_REG_2, BPF_REG_3);
+  i = jump(BPF_JEQ, BPF_REG_2, 0);
+  for (j = 0; j < 8; j += 4) {
+    load(BPF_W, BPF_REG_2, BPF_REG_6, NTP_FIELD(receive_ts) + j);
+    load(BPF_W, BPF_REG_3, BPF_REG_6, NTP_FIELD(transmit_ts) + j);
+    add_pass_jump(jump_reg(BPF_JNE, BPF_REG_2, BPF_REG_3));
+  }
+  set_jump_target(i);
+
+  /* R7 = active state */
+  load(BPF_W, BPF_REG_2, BPF_REG_7, offsetof(SharedData, active_state));
+  i = jump(BPF_JEQ, BPF_REG_2, 0);
+  alu(BPF_ADD, BPF_REG_7, sizeof (XdpState));
+  set_jump_target(i);
+  alu(BPF_ADD, BPF_REG_7, offsetof(SharedData, states));
+
+  /* R8 = receive timestamp */
+  add_ntp_time();
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_0, 0, 0);
+  add_fuzz(BPF_REG_8);
+
+  /* Root dispersion at the time of the reception */
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_9, 0, 0);
+  alu(BPF_RSH, BPF_REG_1, 16);
+  load(BPF_W, BPF_REG_2, BPF_REG_7, offsetof(XdpState, root_dispersion_rate));
+  alu_reg(BPF_MUL, BPF_REG_1, BPF_REG_2);
+  alu(BPF_RSH, BPF_REG_1, 32);
+  load(BPF_W, BPF_REG_2, BPF_REG_7, offsetof(XdpState, root_dispersion));
+  alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_2);
+  swap_order(BPF_REG_1, 32);
+  store(BPF_W, BPF_REG_6, NTP_FIELD(root_dispersion), BPF_REG_1);
+
+  /* Fill in the other fields of the response.  This corresponds to
+     add_response() in ntp_io_workers.c. */
+  load(BPF_B, BPF_REG_1, BPF_REG_6, NTP_FIELD(lvm));
+  alu(BPF_AND, BPF_REG_1, 0x38);
+  alu(BPF_OR, BPF_REG_1, MODE_SERVER);
+  load(BPF_B, BPF_REG_2, BPF_REG_7, offsetof(XdpState, leap));
+  alu_reg(BPF_OR, BPF_REG_1, BPF_REG_2);
+  store(BPF_B, BPF_REG_6, NTP_FIELD(lvm), BPF_REG_1);
+
+  copy(BPF_B, BPF_REG_6, NTP_FIELD(stratum), BPF_REG_7, offsetof(XdpState, stratum));
+
+  load(BPF_B, BPF_REG_1, BPF_REG_6, NTP_FIELD(poll));
+  alu(BPF_LSH, BPF_REG_1, 56);
+  alu(BPF_ARSH, BPF_REG_1, 56);
+  load(BPF_B, BPF_REG_2, BPF_REG_7, offsetof(XdpState, min_poll));
+  alu(BPF_LSH, BPF_REG_2, 56);
+  alu(BPF_ARSH, BPF_REG_2, 56);
+  i = jump_reg(BPF_JSGE, BPF_REG_1, BPF_REG_2);
+  store(BPF_B, BPF_REG_6, NTP_FIELD(poll), BPF_REG_2);
+  set_jump_target(i);
+
+  copy(BPF_B, BPF_REG_6, NTP_FIELD(precision), BPF_REG_7, offsetof(XdpState, precision));
+  copy(BPF_W, BPF_REG_6, NTP_FIELD(root_delay), BPF_REG_7, offsetof(XdpState, root_delay));
+  copy(BPF_W, BPF_REG_6, NTP_FIELD(reference_id), BPF_REG_7, offsetof(XdpState, ref_id));
+  for (j = 0; j < 8; j += 4) {
+    copy(BPF_W, BPF_REG_6, NTP_FIELD(reference_ts) + j,
+         BPF_REG_7, offsetof(XdpState, ref_ts) + j);
+    copy(BPF_W, BPF_REG_6, NTP_FIELD(originate_ts) + j,
+         BPF_REG_6, NTP_FIELD(transmit_ts) + j);
+  }
+
+  store_timestamp(BPF_REG_6, NTP_FIELD(receive_ts), BPF_REG_8);
+
+  /* R9 = transmit timestamp, which must be later than the receive
+     timestamp */
+  add_ntp_time();
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_0, 0, 0);
+  add_fuzz(BPF_REG_9);
+  i = jump_reg(BPF_JGT, BPF_REG_9, BPF_REG_8);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_8, 0, 0);
+  alu(BPF_ADD, BPF_REG_9, 1);
+  set_jump_target(i);
+
+  store_timestamp(BPF_REG_6, NTP_FIELD(transmit_ts), BPF_REG_9);
+
+  /* Swap the addresses and ports, and update the checksums */
+  for (j = 0; j < ETH_ALEN; j += 2)
+    swap(BPF_H, BPF_REG_6, offsetof(struct ethhdr, h_dest) + j,
+         offsetof(struct ethhdr, h_source) + j);
+  swap(BPF_W, BPF_REG_6, IP_FIELD(saddr), IP_FIELD(daddr));
+  swap(BPF_H, BPF_REG_6, UDP_FIELD(source), UDP_FIELD(dest));
+
+  store_imm(BPF_B, BPF_REG_6, IP_FIELD(ttl), 64);
+  store_imm(BPF_H, BPF_REG_6, IP_FIELD(check), 0);
+  store_imm(BPF_H, BPF_REG_6, UDP_FIELD(check), 0);
+
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0);
+  for (j = 0; j < (int)sizeof (struct iphdr); j += 2) {
+    load(BPF_H, BPF_REG_2, BPF_REG_6, IP_OFFSET + j);
+    alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_2);
+  }
+  for (j = 0; j < 2; j++) {
+    add_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0);
+    alu(BPF_RSH, BPF_REG_2, 16);
+    alu(BPF_AND, BPF_REG_1, 0xffff);
+    alu_reg(BPF_ADD, BPF_REG_1, BPF_REG_2);
+  }
+  alu(BPF_XOR, BPF_REG_1, 0xffff);
+  store(BPF_H, BPF_REG_6, IP_FIELD(check), BPF_REG_1);
+
+  count_request(offsetof(SharedData, ntp_hits));
+
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_TX);
+  add_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  for (j = 0; j < num_pass_jumps; j++)
+    set_jump_target(pass_jumps[j]);
+  add_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+  add_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  DEBUG_LOG("Assembled XDP program with %d instructions", program_length);
+}
+
+/* ================================================== */
+
+static int
+load_program(void)
+{
+  union bpf_attr attr;
+  char log[65536];
+  int fd;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t)program;
+  attr.insn_cnt = program_length;
+  attr.license = (uintptr_t)"GPL";
+
+  fd = call_bpf(BPF_PROG_LOAD, &attr);
+  if (fd >= 0)
+    return fd;
+
+  LOG(LOGS_ERR, "Could not load XDP program : %s", strerror(errno));
+
+  /* Get the log of the verifier */
+  log[0] = '\0';
+  attr.log_buf = (uintptr_t)log;
+  attr.log_size = sizeof (log);
+  attr.log_level = 1;
+  fd = call_bpf(BPF_PROG_LOAD, &attr);
+  if (fd >= 0)
+    close(fd);
+  log[sizeof (log) - 1] = '\0';
+  DEBUG_LOG("%s", log);
+
+  return -1;
+}
+
+/* ================================================== */
+
+static void
+attach_program(const char *iface)
+{
+  union bpf_attr attr;
+  unsigned int index;
+  int fd;
+
+  index = if_nametoindex(iface);
+  if (index == 0) {
+    LOG(LOGS_ERR, "Unknown interface %s", iface);
+    return;
+  }
+
+  memset(&attr, 0, sizeof (attr));
+  attr.link_create.prog_fd = program_fd;
+  attr.link_create.target_ifindex = index;
+  attr.link_create.attach_type = BPF_XDP;
+
+  fd = call_bpf(BPF_LINK_CREATE, &attr);
+  if (fd < 0) {
+    LOG(LOGS_ERR, "Could not attach XDP program to %s : %s", iface, strerror(errno));
+    return;
+  }
+
+  ARR_AppendElement(links, &fd);
+
+  LOG(LOGS_INFO, "Enabled XDP server on %s", iface);
+}
+
+/* ================================================== */
+
+void
+NIO_Xdp_Initialise(int server_port, IPAddr *bind_address)
+{
+  int interval, burst, leak_rate, max_clients;
+  unsigned int i;
+  char *iface;
+  long page_size;
+
+  if (!CNF_GetXdpInterface(0, &iface))
+    return;
+
+  state_map_fd = access_map_fd = ratelimit_map_fd = program_fd = -1;
+  shared = MAP_FAILED;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  shared_size = (sizeof (SharedData) + page_size - 1) / page_size * page_size;
+
+  state_map_fd = create_map(BPF_MAP_TYPE_ARRAY, sizeof (uint32_t), sizeof (SharedData),
+                            1, BPF_F_MMAPABLE);
+  if (state_map_fd >= 0)
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, state_map_fd, 0);
+  access_map_fd = create_map(BPF_MAP_TYPE_LPM_TRIE, sizeof (AccessKey), sizeof (uint32_t),
+                             MAX_ACCESS_RULES, BPF_F_NO_PREALLOC);
+
+  if (state_map_fd < 0 || shared == MAP_FAILED || access_map_fd < 0) {
+    LOG(LOGS_ERR, "Could not create BPF maps : %s", strerror(errno));
+    goto error;
+  }
+
+  /* Drop requests exceeding the rate limit before they reach the socket */
+  if (CNF_GetNTPRateLimit(&interval, &burst, &leak_rate)) {
+    max_clients = CLAMP(MIN_RATELIMIT_CLIENTS,
+                        CNF_GetClientLogLimit() / RATELIMIT_CLIENT_SIZE,
+                        MAX_RATELIMIT_CLIENTS);
+    ratelimit_map_fd = create_map(BPF_MAP_TYPE_LRU_HASH, sizeof (uint32_t),
+                                  sizeof (uint64_t), max_clients, 0);
+    if (ratelimit_map_fd < 0)
+      LOG(LOGS_WARN, "Could not create BPF map for rate limiting : %s", strerror(errno));
+  }
+
+  assemble_program(server_port, bind_address);
+
+  program_fd = load_program();
+  if (program_fd < 0)
+    goto error;
+
+  initialised = 1;
+
+  links = ARR_CreateInstance(sizeof (int));
+  access_keys = ARR_CreateInstance(sizeof (AccessKey));
+
+  for (i = 0; CNF_GetXdpInterface(i, &iface); i++)
+    attach_program(iface);
+
+  LCL_AddParameterChangeHandler(handle_slew, NULL);
+
+  /* Update the state from the main loop after the reference module is
+     initialised */
+  update_timeout_id = SCH_AddTimeoutByDelay(0.0, update_timeout, NULL);
+  access_timeout_id = 0;
+
+  return;
+
+error:
+  if (shared != MAP_FAILED)
+    munmap(shared, shared_size);
+  if (state_map_fd >= 0)
+    close(state_map_fd);
+  if (access_map_fd >= 0)
+    close(access_map_fd);
+  if (ratelimit_map_fd >= 0)
+    close(ratelimit_map_fd);
+}
+
+/* ================================================== */
+
+void
+NIO_Xdp_Finalise(void)
+{
+  unsigned int i;
+
+  if (!initialised)
+    return;
+
+  for (i = 0; i < ARR_GetSize(links); i++)
+    close(*(int *)ARR_GetElement(links, i));
+  ARR_DestroyInstance(links);
+  ARR_DestroyInstance(access_keys);
+
+  SCH_RemoveTimeout(update_timeout_id);
+  SCH_RemoveTimeout(access_timeout_id);
+  LCL_RemoveParameterChangeHandler(handle_slew, NULL);
+
+  close(program_fd);
+  munmap(shared, shared_size);
+  close(state_map_fd);
+  close(access_map_fd);
+  if (ratelimit_map_fd >= 0)
+    close(ratelimit_map_fd);
+
+  initialised = 0;
+}
+
+/* ================================================== */
+
+static uint32_t
+convert_ntp32(double x)
+{
+  return ntohl(UTI_DoubleToNtp32(x));
+}
+
+/* ================================================== */
+
+static void
+update_state(void)
+{
+  struct timespec mono1, mono2, raw, raw2, cooked, cooked2, ref_time, ref_time2;
+  double correction, correction2, root_delay, root_delay2, root_dispersion;
+  double root_dispersion2, rate, smooth_offset, smooth_rate, delay;
+  int synchronised, stratum, stratum2, precision, smooth_time;
+  uint32_t ref_id, ref_id2;
+  NTP_Leap leap, leap2;
+  NTP_int64 ntp_ts;
+  XdpState *state;
+  unsigned int index;
+
+  /* Get the monotonic time corresponding to the raw time */
+  clock_gettime(CLOCK_MONOTONIC, &mono1);
+  LCL_ReadRawTime(&raw);
+  clock_gettime(CLOCK_MONOTONIC, &mono2);
+  UTI_AverageDiffTimespecs(&mono1, &mono2, &mono1, &delay);
+
+  /* Get the values at the current time and one second later to get
+     the rate of their change */
+  UTI_AddDoubleToTimespec(&raw, 1.0, &raw2);
+  LCL_GetOffsetCorrection(&raw, &correction, NULL);
+  LCL_GetOffsetCorrection(&raw2, &correction2, NULL);
+  rate = correction2 - correction;
+
+  UTI_AddDoubleToTimespec(&raw, correction, &cooked);
+  UTI_AddDoubleToTimespec(&raw2, correction2, &cooked2);
+
+  REF_GetReferenceParams(&cooked, &synchronised, &leap, &stratum, &ref_id, &ref_time,
+                         &root_delay, &root_dispersion);
+  REF_GetReferenceParams(&cooked2, &synchronised, &leap2, &stratum2, &ref_id2, &ref_time2,
+                         &root_delay2, &root_dispersion2);
+
+  smooth_time = 0;
+  if (SMT_IsEnabled()) {
+    smooth_offset = SMT_GetOffset(&cooked);
+    smooth_rate = SMT_GetOffset(&cooked2) - smooth_offset;
+
+    /* Suppress leap second when smoothing and slew mode are enabled */
+    if (REF_GetLeapMode() == REF_LeapModeSlew &&
+        (leap == LEAP_InsertSecond || leap == LEAP_DeleteSecond))
+      leap = LEAP_Normal;
+
+    smooth_time = fabs(smooth_offset) > LCL_GetSysPrecisionAsQuantum();
+    if (smooth_time) {
+      ref_id = NTP_REFID_SMOOTH;
+      UTI_AddDoubleToTimespec(&ref_time, smooth_offset, &ref_time);
+      UTI_AddDoubleToTimespec(&cooked, smooth_offset, &cooked);
+      rate += smooth_rate;
+    }
+  }
+
+  index = !shared->active_state;
+  state = &shared->states[index];
+
+  /* Invalidate the state if the rate cannot be handled by the program */
+  if (fabs(rate) >= 0.25) {
+    DEBUG_LOG("Invalid rate %e", rate);
+    memset(state, 0, sizeof (*state));
+  } else {
+    state->mono_base = (uint64_t)mono1.tv_sec * 1000000000U + mono1.tv_nsec;
+    UTI_TimespecToNtp64(&cooked, &ntp_ts, NULL);
+    state->ntp_base = (uint64_t)ntohl(ntp_ts.hi) << 32 | ntohl(ntp_ts.lo);
+    state->rate = fabs(rate) * 4294967296.0;
+    state->rate_negative = rate < 0.0;
+  }
+
+  state->root_dispersion = MIN(convert_ntp32(root_dispersion), 0xffff0000U);
+  state->root_dispersion_rate = CLAMP(0.0, root_dispersion2 - root_dispersion, 1.0e-3) *
+                                4294967296.0;
+
+  precision = LCL_GetSysPrecisionAsLog();
+  state->fuzz_mask = precision + 32 >= 32 ? 0xffffffffU : (1U << (precision + 32)) - 1;
+
+  state->root_delay = UTI_DoubleToNtp32(root_delay);
+  state->ref_id = htonl(ref_id);
+  UTI_TimespecToNtp64(&ref_time, &ntp_ts, NULL);
+  state->ref_ts[0] = ntp_ts.hi;
+  state->ref_ts[1] = ntp_ts.lo;
+  state->leap = NTP_LVM(leap, 0, 0);
+  state->stratum = stratum < NTP_MAX_STRATUM ? stratum : NTP_INVALID_STRATUM;
+  state->min_poll = CLG_GetNtpMinPoll();
+  state->precision = precision;
+
+  __atomic_store_n(&shared->active_state, index, __ATOMIC_RELEASE);
+}
+
+/* ================================================== */
+
+static void
+set_rate_limit(void)
+{
+  int interval, burst, leak_rate;
+  uint64_t interval_ns;
+
+  if (ratelimit_map_fd < 0 || !CLG_GetNtpRateLimit(&interval, &burst, &leak_rate))
+    return;
+
+  interval_ns = ldexp(1.0, interval) * 1.0e9;
+
+  shared->limit_burst = (burst - 1) * interval_ns;
+  shared->limit_leak_mask = (1U << leak_rate) - 1;
+  __atomic_store_n(&shared->limit_interval, interval_ns, __ATOMIC_RELEASE);
+
+  DEBUG_LOG("XDP rate limit interval=%d burst=%d leak=%d", interval, burst, leak_rate);
+}
+
+/* ================================================== */
+
+static void
+update_timeout(void *arg)
+{
+  /* The rate limiting parameters are available after the client log is
+     initialised */
+  if (!started)
+    set_rate_limit();
+
+  started = 1;
+
+  update_state();
+
+  update_timeout_id = SCH_AddTimeoutByDelay(STATE_UPDATE_INTERVAL, update_timeout, NULL);
+}
+
+/* ================================================== */
+
+static void
+handle_slew(struct timespec *raw, struct timespec *cooked, double dfreq,
+            double doffset, LCL_ChangeType change_type, void *anything)
+{
+  /* The reference module may not be initialised yet */
+  if (!started)
+    return;
+
+  update_state();
+}
+
+/* ================================================== */
+
+static void
+add_access_rule(IPAddr *ip, int subnet_bits, int allow, void *arg)
+{
+  int *failed = arg;
+  AccessKey key;
+  uint32_t value;
+
+  if (*failed)
+    return;
+
+  key.prefix_length = subnet_bits;
+  key.address = htonl(ip->addr.in4);
+  value = allow;
+
+  if (update_map(access_map_fd, &key, &value) < 0) {
+    LOG(LOGS_WARN, "Could not update XDP access map : %s%s", strerror(errno),
+        errno == EPERM ? " (XDP server disabled)" : "");
+    *failed = 1;
+    return;
+  }
+
+  ARR_AppendElement(access_keys, &key);
+}
+
+/* ================================================== */
+
+static void
+update_access(void *arg)
+{
+  unsigned int i;
+  int failed;
+
+  access_timeout_id = 0;
+
+  for (i = 0; i < ARR_GetSize(access_keys); i++)
+    delete_from_map(access_map_fd, ARR_GetElement(access_keys, i));
+  ARR_SetSize(access_keys, 0);
+
+  failed = 0;
+  NCR_IterateAccessRestrictions(IPADDR_INET4, add_access_rule, &failed);
+
+  DEBUG_LOG("Updated XDP access map with %u rules", ARR_GetSize(access_keys));
+
+  if (!failed)
+    __atomic_store_n(&shared->access_valid, 1, __ATOMIC_RELEASE);
+}
+
+/* ================================================== */
+
+void
+NIO_Xdp_UpdateAccess(void)
+{
+  if (!initialised)
+    return;
+
+  /* Pass all requests to the main thread until the map is updated */
+  __atomic_store_n(&shared->access_valid, 0, __ATOMIC_RELEASE);
+
+  if (!access_timeout_id)
+    access_timeout_id = SCH_AddTimeoutByDelay(0.0, update_access, NULL);
+}
+
+/* ================================================== */
+
+void
+NIO_Xdp_FlushAccess(void)
+{
+  if (!initialised || !access_timeout_id)
+    return;
+
+  SCH_RemoveTimeout(access_timeout_id);
+  update_access(NULL);
+}
+
+/* ================================================== */
+
+void
+NIO_Xdp_GetStats(uint32_t *hits, uint32_t *drops)
+{
+  if (!initialised) {
+    *hits = *drops = 0;
+    return;
+  }
+
+  *hits = __atomic_load_n(&shared->ntp_hits, __ATOMIC_RELAXED);
+  *drops = __atomic_load_n(&shared->ntp_drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,48 @@
+/*
+  chronyd/chronyc - Programs for keeping computer clocks accurate.
+
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+
+  =======================================================================
+
+  This is the header file for the XDP NTP server.
+  */
+
+#ifndef GOT_NTP_IO_XDP_H
+#define GOT_NTP_IO_XDP_H
+
+#include "addressing.h"
+
+/* Load the XDP program responding to client requests sent to the server
+   port (and the bind address if it is specified), and attach it to the
+   interfaces specified by the xdpinterface directive */
+extern void NIO_Xdp_Initialise(int server_port, IPAddr *bind_address);
+
+extern void NIO_Xdp_Finalise(void);
+
+/* Update the copy of the access restrictions used by the program */
+extern void NIO_Xdp_UpdateAccess(void);
+
+/* Make the pending update of the access restrictions now.  The maps cannot
+   be updated without root privileges if unprivileged BPF is disabled. */
+extern void NIO_Xdp_FlushAccess(void);
+
+/* Get the number of requests answered and dropped by the program */
+extern void NIO_Xdp_GetStats(uint32_t *hits, uint32_t *drops);
+
+#endif
@@ -73,6 +73,8 @@ struct UnresolvedSource {
   int port;
   int random_order;
   int replacement;
+  int resolving;
+  int started;
   union {
     struct {
       NTP_Source_Type type;
@@ -93,7 +95,7 @@ struct UnresolvedSource {
 static struct UnresolvedSource *unresolved_sources = NULL;
 static int resolving_interval = 0;
 static SCH_TimeoutID resolving_id;
-static struct UnresolvedSource *resolving_source = NULL;
+static int resolving_sources = 0;
 static NSR_SourceResolvingEndHandler resolving_end_handler = NULL;
 
 #define MAX_POOL_SOURCES 16
@@ -180,6 +182,8 @@ NSR_Finalise(void)
     Free(us);
   }
 
+  DNS_FinaliseAsync();
+
   initialised = 0;
 }
 
@@ -398,11 +402,13 @@ process_resolved_name(struct UnresolvedSource *us, IPAddr *ip_addrs, int n_addrs
 static void
 name_resolve_handler(DNS_Status status, int n_addrs, IPAddr *ip_addrs, void *anything)
 {
-  struct UnresolvedSource *us, **i, *next;
+  struct UnresolvedSource *us, **i;
 
   us = (struct UnresolvedSource *)anything;
 
-  assert(us == resolving_source);
+  assert(us->resolving && resolving_sources > 0);
+  us->resolving = 0;
+  resolving_sources--;
 
   DEBUG_LOG("%s resolved to %d addrs", us->name, n_addrs);
 
@@ -419,8 +425,6 @@ name_resolve_handler(DNS_Status status, int n_addrs, IPAddr *ip_addrs, void *any
       assert(0);
   }
 
-  next = us->next;
-
   /* Remove the source from the list on success or failure, replacements
      are removed on any status */
   if (us->replacement || status != DNS_TryAgain) {
@@ -434,14 +438,8 @@ name_resolve_handler(DNS_Status status, int n_addrs, IPAddr *ip_addrs, void *any
     }
   }
 
-  resolving_source = next;
-
-  if (next) {
-    /* Continue with the next source in the list */
-    DEBUG_LOG("resolving %s", next->name);
-    DNS_Name2IPAddressAsync(next->name, name_resolve_handler, next);
-  } else {
-    /* This was the last source in the list. If some sources couldn't
+  if (!resolving_sources) {
+    /* This was the last source being resolved. If some sources couldn't
        be resolved, try again in exponentially increasing interval. */
     if (unresolved_sources) {
       if (resolving_interval < MIN_RESOLVE_INTERVAL)
@@ -461,23 +459,37 @@ name_resolve_handler(DNS_Status status, int n_addrs, IPAddr *ip_addrs, void *any
 }
 
 /* ================================================== */
+/* Start resolving of sources in the list which are not being resolved yet,
+   or only sources which were not tried before.  The names are resolved
+   concurrently. */
 
 static void
-resolve_sources(void *arg)
+start_resolving(int only_new)
 {
   struct UnresolvedSource *us;
 
-  assert(!resolving_source);
+  for (us = unresolved_sources; us; us = us->next) {
+    if (us->resolving || (only_new && us->started))
+      continue;
 
-  PRV_ReloadDNS();
+    us->resolving = 1;
+    us->started = 1;
+    resolving_sources++;
+    DEBUG_LOG("resolving %s", us->name);
+    DNS_Name2IPAddressAsync(us->name, name_resolve_handler, us);
+  }
+}
 
-  /* Start with the first source in the list, name_resolve_handler
-     will iterate over the rest */
-  us = unresolved_sources;
+/* ================================================== */
 
-  resolving_source = us;
-  DEBUG_LOG("resolving %s", us->name);
-  DNS_Name2IPAddressAsync(us->name, name_resolve_handler, us);
+static void
+resolve_sources(void *arg)
+{
+  assert(!resolving_sources);
+
+  PRV_ReloadDNS();
+
+  start_resolving(0);
 }
 
 /* ================================================== */
@@ -523,6 +535,8 @@ NSR_AddSourceByName(char *name, int port, int pool, NTP_Source_Type type, Source
   us->port = port;
   us->random_order = 0;
   us->replacement = 0;
+  us->resolving = 0;
+  us->started = 0;
   us->new_source.type = type;
   us->new_source.params = *params;
 
@@ -555,13 +569,16 @@ NSR_ResolveSources(void)
 {
   /* Try to resolve unresolved sources now */
   if (unresolved_sources) {
-    /* Make sure no resolving is currently running */
-    if (!resolving_source) {
+    /* If resolving is already running, add the new sources to it.  Sources
+       which failed temporarily in this round will be retried later. */
+    if (!resolving_sources) {
       if (resolving_interval) {
         SCH_RemoveTimeout(resolving_id);
         resolving_interval--;
       }
       resolve_sources(NULL);
+    } else {
+      start_resolving(1);
     }
   } else {
     /* No unresolved sources, we are done */
@@ -668,6 +685,8 @@ resolve_source_replacement(SourceRecord *record)
      IPv4/IPv6 addresses if the resolver prefers inaccessible IP family */
   us->random_order = record->tentative;
   us->replacement = 1;
+  us->resolving = 0;
+  us->started = 0;
   us->replace_source = *record->remote_addr;
 
   append_unresolved_source(us);
@@ -31,6 +31,7 @@
 #include "nts_ke.h"
 
 #include "conf.h"
+#include "local.h"
 #include "logging.h"
 #include "memory.h"
 #include "ntp_core.h"
@@ -44,6 +45,11 @@
 #endif
 
 #include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#ifdef HAVE_NTS_KE_THREADS
+#include <pthread.h>
+#endif
 
 #define ALPN_NAME "ntske/1"
 #define EXPORTER_LABEL "EXPORTER-network-time-security/1"
@@ -122,8 +128,10 @@ struct NKE_Instance_Record {
   int sock_fd;
   gnutls_session_t session;
   SCH_TimeoutID timeout_id;
-  struct NKE_Message message;
+  struct NKE_Message *message;
   IPAddr remote_addr;
+  gnutls_datum_t session_data;  /* Data for resumption of the client
+                                   session in the next connection */
 };
 
 typedef struct {
@@ -134,6 +142,7 @@ typedef struct {
 
 typedef struct {
   uint32_t id;
+  uint8_t key[32];
   struct siv_cmac_aes128_ctx siv;
 } ServerKey;
 
@@ -145,24 +154,115 @@ union sockaddr_in46 {
   struct sockaddr u;
 };
 
-#define SERVER_KEY_TIMEOUT 3600
 #define KEY_ID_INDEX_BITS 2
 #define MAX_SERVER_KEYS (1U << KEY_ID_INDEX_BITS)
 static ServerKey server_keys[MAX_SERVER_KEYS];
 static int current_server_key;
 
+/* Number of keys generated before they are used, which allows servers
+   sharing the key file to load them before the rotation */
+#define FUTURE_KEYS 1
+
+/* File in ntsdumpdir with saved keys */
+#define KEY_FILE_NAME "ntskeys"
+#define KEY_FILE_IDENTIFIER "NKS0"
+
+/* Interval of checking the key file for changes when the keys are not
+   rotated by this server */
+#define KEY_FILE_CHECK_INTERVAL 60
+
+static double last_key_rotation;
+static time_t key_file_mtime;
+static SCH_TimeoutID server_key_timeout_id;
+
 static int server_sock_fd4;
 static int server_sock_fd6;
 
-#define MAX_SERVER_INSTANCES 10
-static NKE_Instance server_instances[MAX_SERVER_INSTANCES];
+/* Maximum number of connections accepted in one call of accept_connection() */
+#define MAX_ACCEPTED_CONNECTIONS 16
+
+/* Pool of server instances, which are created on demand, and a stack of
+   instances which are not serving any connection */
+static NKE_Instance *server_instances;
+static NKE_Instance *free_server_instances;
+static int max_server_instances;
+static int num_server_instances;
+static int num_free_server_instances;
+
 static gnutls_certificate_credentials_t server_credentials;
+static gnutls_datum_t server_ticket_key;
+
+/* Sum of weights of NTP servers provided to clients in the NTPv4 server
+   negotiation record */
+static unsigned int total_ntp_server_weight;
+
+/* Maximum number and length of queued messages from the server threads */
+#define MAX_THREAD_MESSAGES 32
+#define MAX_THREAD_MESSAGE_LENGTH 128
+
+#ifdef HAVE_NTS_KE_THREADS
+/* Threads serving accepted connections, each with its own instance */
+struct ServerThread {
+  pthread_t thread;
+  NKE_Instance inst;
+  int sock_fd;
+};
+
+static struct ServerThread *server_threads;
+static int num_server_threads;
+static int server_threads_started;
+static int stop_server_threads;
+
+/* Queue of accepted connections waiting for a thread and the number of
+   connections in the queue or being served by the threads, protected by
+   the queue lock */
+static pthread_mutex_t queue_lock;
+static pthread_cond_t queue_cond;
+struct QueuedConnection {
+  int sock_fd;
+  IPAddr remote_addr;
+};
+
+static struct QueuedConnection *queued_connections;
+static int first_queued_connection;
+static int num_queued_connections;
+static int num_thread_connections;
+
+/* Pipe used to wake up the main thread when it stopped accepting connections
+   and a thread finished serving a connection */
+static int notify_pipe[2];
+
+/* Lock preventing the threads from using a server key while it is
+   generated */
+static pthread_mutex_t server_keys_lock;
+
+#define LOCK_SERVER_KEYS() pthread_mutex_lock(&server_keys_lock)
+#define UNLOCK_SERVER_KEYS() pthread_mutex_unlock(&server_keys_lock)
+
+/* Debug messages from the server threads, which cannot log messages
+   directly.  They are logged by the main thread when it is notified.
+   The queue is protected by the queue lock. */
+static char thread_messages[MAX_THREAD_MESSAGES][MAX_THREAD_MESSAGE_LENGTH];
+static int num_thread_messages;
+static int dropped_thread_messages;
+static pthread_t main_thread;
+#else
+#define LOCK_SERVER_KEYS()
+#define UNLOCK_SERVER_KEYS()
+#endif
+
+/* Log a debug message in code which can run in the server threads */
+#define THREAD_DEBUG_LOG(...) \
+  do { \
+    if (DEBUG && log_debug_enabled) \
+      log_thread_message(__VA_ARGS__); \
+  } while (0)
 
 static gnutls_certificate_credentials_t client_credentials;
 
 static void update_state(NKE_Instance inst);
 static void read_write_socket(int fd, int event, void *arg);
-static int accept_server_connection(NKE_Instance inst, int sock_fd);
+static int accept_server_connection(NKE_Instance inst, int sock_fd, IPAddr *remote_addr);
 
 static int
 prepare_socket(NtsKeMode mode, IPAddr *ip, int port)
@@ -207,7 +307,7 @@ prepare_socket(NtsKeMode mode, IPAddr *ip, int port)
         return INVALID_SOCK_FD;
       }
 
-      if (listen(sock_fd, MAX_SERVER_INSTANCES) < 0) {
+      if (listen(sock_fd, SOMAXCONN) < 0) {
         DEBUG_LOG("listen() failed : %s", strerror(errno));
         close(sock_fd);
         return INVALID_SOCK_FD;
@@ -230,7 +330,7 @@ prepare_socket(NtsKeMode mode, IPAddr *ip, int port)
 }
 
 static gnutls_session_t
-create_session(NtsKeMode mode, int sock_fd, const char *server_name)
+create_session(NtsKeMode mode, int sock_fd, const char *server_name, int nonblocking)
 {
   gnutls_session_t session;
   gnutls_datum_t alpn;
@@ -240,7 +340,7 @@ create_session(NtsKeMode mode, int sock_fd, const char *server_name)
     return NULL;
   }
 
-  if (gnutls_init(&session, GNUTLS_NONBLOCK |
+  if (gnutls_init(&session, (nonblocking ? GNUTLS_NONBLOCK : 0) |
                   (mode == KE_SERVER ? GNUTLS_SERVER : GNUTLS_CLIENT)) < 0)
     return NULL;
 
@@ -257,6 +357,11 @@ create_session(NtsKeMode mode, int sock_fd, const char *server_name)
                              mode == KE_CLIENT ? client_credentials : server_credentials) < 0)
     return NULL;
 
+  /* Allow clients to resume their sessions without a full handshake */
+  if (mode == KE_SERVER && server_ticket_key.data &&
+      gnutls_session_ticket_enable_server(session, &server_ticket_key) < 0)
+    return NULL;
+
   //TODO: disable TLS < 1.2, disable RC4!
 
   alpn.data = (unsigned char *)ALPN_NAME; //TODO: is this safe?
@@ -284,6 +389,41 @@ get_socket_error(int sock_fd)
   return optval;
 }
 
+FORMAT_ATTRIBUTE_PRINTF(1, 2)
+static void
+log_thread_message(const char *format, ...)
+{
+  char buf[MAX_THREAD_MESSAGE_LENGTH];
+  va_list ap;
+#ifdef HAVE_NTS_KE_THREADS
+  int notify;
+#endif
+
+  va_start(ap, format);
+  vsnprintf(buf, sizeof (buf), format, ap);
+  va_end(ap);
+
+#ifdef HAVE_NTS_KE_THREADS
+  if (server_threads_started && !pthread_equal(pthread_self(), main_thread)) {
+    pthread_mutex_lock(&queue_lock);
+
+    notify = num_thread_messages == 0 && dropped_thread_messages == 0;
+    if (num_thread_messages < MAX_THREAD_MESSAGES)
+      memcpy(thread_messages[num_thread_messages++], buf, sizeof (buf));
+    else
+      dropped_thread_messages++;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    if (notify && write(notify_pipe[1], "", 1) < 0)
+      ;
+    return;
+  }
+#endif
+
+  DEBUG_LOG("%s", buf);
+}
+
 static int
 check_alpn(gnutls_session_t session)
 {
@@ -294,79 +434,217 @@ check_alpn(gnutls_session_t session)
   alpn.size = sizeof (ALPN_NAME) - 1;
 
   if ((r = gnutls_alpn_get_selected_protocol(session, &alpn)) < 0) {
-    DEBUG_LOG("gnutls_alpn_get_selected_protocol() fails: %s", gnutls_strerror(r));
+    THREAD_DEBUG_LOG("gnutls_alpn_get_selected_protocol() fails: %s", gnutls_strerror(r));
     return 0;
   }
 
   if (alpn.size != sizeof (ALPN_NAME) - 1 ||
       strncmp((const char *)alpn.data, ALPN_NAME, sizeof (ALPN_NAME) - 1)) {
-    DEBUG_LOG("ALPN mismatch");
+    THREAD_DEBUG_LOG("ALPN mismatch");
     return 0;
   }
 
   return 1;
 }
 
+static NKE_Instance
+get_server_instance(void)
+{
+  if (num_free_server_instances > 0)
+    return free_server_instances[--num_free_server_instances];
+
+  if (num_server_instances >= max_server_instances)
+    return NULL;
+
+  server_instances[num_server_instances] = NKE_CreateInstance();
+  return server_instances[num_server_instances++];
+}
+
 static void
-accept_connection(int server_fd, int event, void *arg)
+enable_accepting(int enable)
 {
-  union sockaddr_in46 addr;
-  socklen_t addr_len = sizeof (addr);
-  IPAddr ip_addr;
-  unsigned short port;
-  NKE_Instance inst;
-  int i, sock_fd;
+  if (server_sock_fd4 != INVALID_SOCK_FD)
+    SCH_SetFileHandlerEvent(server_sock_fd4, SCH_FILE_INPUT, enable);
+  if (server_sock_fd6 != INVALID_SOCK_FD)
+    SCH_SetFileHandlerEvent(server_sock_fd6, SCH_FILE_INPUT, enable);
+}
 
-  sock_fd = accept(server_fd, &addr.u, &addr_len);
-  if (sock_fd < 0) {
-    DEBUG_LOG("accept() failed : %s", strerror(errno));
-    return;
-  }
+static void
+release_server_instance(NKE_Instance inst)
+{
+  assert(num_free_server_instances < num_server_instances);
 
-  UTI_SockaddrToIPAndPort(&addr.u, &ip_addr, &port);
+  free_server_instances[num_free_server_instances++] = inst;
 
-  if (!NCR_CheckAccessRestriction(&ip_addr)) {
-    DEBUG_LOG("Rejected connection from %s:%d (%s)",
-              UTI_IPToString(&ip_addr), port, "access denied");
-    close(sock_fd);
-    return;
-  }
+  /* Resume accepting connections if the pool was exhausted */
+  if (num_free_server_instances == 1 && num_server_instances >= max_server_instances)
+    enable_accepting(1);
+}
 
-  for (i = 0, inst = NULL; i < MAX_SERVER_INSTANCES; i++) {
-    if (server_instances[i] == NULL) {
-      inst = NKE_CreateInstance();
-      server_instances[i] = inst;
-      break;
-    } else if (server_instances[i]->state == KE_CLOSED) {
-      inst = server_instances[i];
-      break;
-    }
-  }
+#ifdef HAVE_NTS_KE_THREADS
+static void
+queue_connection(int sock_fd, IPAddr *remote_addr)
+{
+  struct QueuedConnection *conn;
 
-  if (inst == NULL) {
-    DEBUG_LOG("Rejected connection from %s:%d (%s)",
-              UTI_IPToString(&ip_addr), port, "too many connections");
-    close(sock_fd);
-    return;
+  pthread_mutex_lock(&queue_lock);
+
+  assert(num_thread_connections < max_server_instances);
+  assert(num_queued_connections < max_server_instances);
+
+  conn = &queued_connections[(first_queued_connection + num_queued_connections) %
+                             max_server_instances];
+  conn->sock_fd = sock_fd;
+  conn->remote_addr = *remote_addr;
+  num_queued_connections++;
+  num_thread_connections++;
+
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static int has_free_server_instance(void);
+
+static void
+process_thread_notification(int fd, int event, void *arg)
+{
+  char buf[16], messages[MAX_THREAD_MESSAGES][MAX_THREAD_MESSAGE_LENGTH];
+  int i, num_messages, dropped_messages;
+
+  if (read(fd, buf, sizeof (buf)) < 0)
+    DEBUG_LOG("Could not read from notify pipe : %s", strerror(errno));
+
+  /* Log the messages from the threads outside the lock */
+  pthread_mutex_lock(&queue_lock);
+  num_messages = num_thread_messages;
+  dropped_messages = dropped_thread_messages;
+  memcpy(messages, thread_messages, num_messages * sizeof (messages[0]));
+  num_thread_messages = dropped_thread_messages = 0;
+  pthread_mutex_unlock(&queue_lock);
+
+  for (i = 0; i < num_messages; i++)
+    DEBUG_LOG("%s", messages[i]);
+  if (dropped_messages > 0)
+    DEBUG_LOG("Dropped %d messages from server threads", dropped_messages);
+
+  if (has_free_server_instance())
+    enable_accepting(1);
+}
+#endif
+
+static int
+has_free_server_instance(void)
+{
+#ifdef HAVE_NTS_KE_THREADS
+  int r;
+
+  if (num_server_threads > 0) {
+    pthread_mutex_lock(&queue_lock);
+    r = num_thread_connections < max_server_instances;
+    pthread_mutex_unlock(&queue_lock);
+    return r;
   }
+#endif
+
+  return num_free_server_instances > 0 || num_server_instances < max_server_instances;
+}
+
+static int
+accept_socket(int server_fd, union sockaddr_in46 *addr, int nonblocking)
+{
+  socklen_t addr_len = sizeof (*addr);
+  int sock_fd;
+
+#ifdef HAVE_ACCEPT4
+  sock_fd = accept4(server_fd, &addr->u, &addr_len,
+                    (nonblocking ? SOCK_NONBLOCK : 0) | SOCK_CLOEXEC);
+#else
+  sock_fd = accept(server_fd, &addr->u, &addr_len);
+  if (sock_fd < 0)
+    return sock_fd;
 
   //TODO: reuse code, merge with CLOEXEC?
-  if (fcntl(sock_fd, F_SETFL, O_NONBLOCK)) {
+  if (nonblocking && fcntl(sock_fd, F_SETFL, O_NONBLOCK)) {
     DEBUG_LOG("Could not set O_NONBLOCK : %s", strerror(errno));
     close(sock_fd);
-    return;
+    errno = EINVAL;
+    return -1;
   }
 
   UTI_FdSetCloexec(sock_fd);
+#endif
 
-  if (!accept_server_connection(inst, sock_fd)) {
-    NKE_DestroyInstance(inst);
-    close(sock_fd);
-    return;
-  }
+  return sock_fd;
+}
 
-  DEBUG_LOG("Accepted connection from %s:%d fd=%d",
-            UTI_IPToString(&ip_addr), port, sock_fd);
+#ifdef HAVE_NTS_KE_THREADS
+static void start_server_threads(void);
+#endif
+
+static void
+accept_connection(int server_fd, int event, void *arg)
+{
+  union sockaddr_in46 addr;
+  IPAddr ip_addr;
+  unsigned short port;
+  NKE_Instance inst;
+  int i, sock_fd, threads;
+
+#ifdef HAVE_NTS_KE_THREADS
+  threads = num_server_threads > 0;
+  if (threads && !server_threads_started)
+    start_server_threads();
+#else
+  threads = 0;
+#endif
+
+  /* Accept all pending connections up to a limit */
+  for (i = 0; i < MAX_ACCEPTED_CONNECTIONS; i++) {
+    if (!has_free_server_instance()) {
+      /* Leave the connections in the backlog until an instance is free */
+      DEBUG_LOG("Not accepting connections (%s)", "too many connections");
+      enable_accepting(0);
+      return;
+    }
+
+    /* The threads use blocking sockets */
+    sock_fd = accept_socket(server_fd, &addr, !threads);
+    if (sock_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        DEBUG_LOG("accept() failed : %s", strerror(errno));
+      return;
+    }
+
+    UTI_SockaddrToIPAndPort(&addr.u, &ip_addr, &port);
+
+    if (!NCR_CheckAccessRestriction(&ip_addr)) {
+      DEBUG_LOG("Rejected connection from %s:%d (%s)",
+                UTI_IPToString(&ip_addr), port, "access denied");
+      close(sock_fd);
+      continue;
+    }
+
+#ifdef HAVE_NTS_KE_THREADS
+    if (threads) {
+      DEBUG_LOG("Queued connection from %s:%d fd=%d",
+                UTI_IPToString(&ip_addr), port, sock_fd);
+      queue_connection(sock_fd, &ip_addr);
+      continue;
+    }
+#endif
+
+    inst = get_server_instance();
+    assert(inst);
+
+    if (!accept_server_connection(inst, sock_fd, &ip_addr)) {
+      close(sock_fd);
+      release_server_instance(inst);
+      continue;
+    }
+
+    DEBUG_LOG("Accepted connection from %s:%d fd=%d",
+              UTI_IPToString(&ip_addr), port, sock_fd);
+  }
 }
 
 static void
@@ -385,6 +663,13 @@ close_connection(NKE_Instance inst)
   }
 
   inst->state = KE_CLOSED;
+
+  /* The response was sent, the message is no longer needed on the server */
+  if (inst->mode == KE_SERVER) {
+    Free(inst->message);
+    inst->message = NULL;
+    release_server_instance(inst);
+  }
 }
 
 static void
@@ -491,65 +776,122 @@ prepare_request(NKE_Instance inst)
 {
   uint16_t datum;
 
-  reset_message(&inst->message);
+  reset_message(inst->message);
 
   datum = htons(NEXT_PROTOCOL_NTPV4);
-  if (!add_record(&inst->message, 1, RECORD_NEXT_PROTOCOL, &datum, sizeof (datum)))
+  if (!add_record(inst->message, 1, RECORD_NEXT_PROTOCOL, &datum, sizeof (datum)))
     return 0;
 
   datum = htons(AEAD_AES_SIV_CMAC_256);
-  if (!add_record(&inst->message, 1, RECORD_AEAD_ALGORITHM, &datum, sizeof (datum)))
+  if (!add_record(inst->message, 1, RECORD_AEAD_ALGORITHM, &datum, sizeof (datum)))
     return 0;
 
-  if (!add_record(&inst->message, 1, RECORD_END_OF_MESSAGE, NULL, 0))
+  if (!add_record(inst->message, 1, RECORD_END_OF_MESSAGE, NULL, 0))
     return 0;
 
   return 1;
 }
 
+/* Select an NTP server for the client.  The hash doesn't depend on a random
+   seed in order to select the same server on all NTS-KE servers with the
+   same configuration. */
+static CNF_NtsNtpServer *
+get_ntp_server(IPAddr *addr)
+{
+  CNF_NtsNtpServer *server;
+  unsigned char *data;
+  unsigned int i, len;
+  uint32_t hash;
+
+  if (total_ntp_server_weight <= 0)
+    return NULL;
+
+  switch (addr->family) {
+    case IPADDR_INET4:
+      data = (unsigned char *)&addr->addr.in4;
+      len = sizeof (addr->addr.in4);
+      break;
+    case IPADDR_INET6:
+      data = addr->addr.in6;
+      len = sizeof (addr->addr.in6);
+      break;
+    default:
+      data = NULL;
+      len = 0;
+  }
+
+  /* FNV-1a */
+  for (i = 0, hash = 2166136261U; i < len; i++)
+    hash = (hash ^ data[i]) * 16777619U;
+
+  hash %= total_ntp_server_weight;
+
+  for (i = 0; CNF_GetNtsNtpServer(i, &server); i++) {
+    if (hash < server->weight)
+      return server;
+    hash -= server->weight;
+  }
+
+  assert(0);
+  return NULL;
+}
+
 static int
 prepare_response(NKE_Instance inst, int error, int next_protocol, int aead_algorithm)
 {
-  NKE_Cookie cookie;
+  NKE_Cookie cookies[MAX_COOKIES];
+  CNF_NtsNtpServer *ntp_server;
   NKE_Key c2s, s2c;
   uint16_t datum;
-  int i;
+  int i, num_cookies, ntp_port;
 
-  DEBUG_LOG("NTS KE response: error=%d next=%d aead=%d", error, next_protocol, aead_algorithm);
+  THREAD_DEBUG_LOG("NTS KE response: error=%d next=%d aead=%d", error, next_protocol,
+                   aead_algorithm);
 
-  reset_message(&inst->message);
+  reset_message(inst->message);
 
   if (error != ERROR_NONE) {
     datum = htons(error);
-    if (!add_record(&inst->message, 1, RECORD_ERROR, &datum, sizeof (datum)))
+    if (!add_record(inst->message, 1, RECORD_ERROR, &datum, sizeof (datum)))
       return 0;
   } else {
     datum = htons(next_protocol);
-    if (!add_record(&inst->message, 1, RECORD_NEXT_PROTOCOL, &datum, sizeof (datum)))
+    if (!add_record(inst->message, 1, RECORD_NEXT_PROTOCOL, &datum, sizeof (datum)))
       return 0;
 
     datum = htons(aead_algorithm);
-    if (!add_record(&inst->message, 1, RECORD_AEAD_ALGORITHM, &datum, sizeof (datum)))
+    if (!add_record(inst->message, 1, RECORD_AEAD_ALGORITHM, &datum, sizeof (datum)))
+      return 0;
+
+    ntp_server = get_ntp_server(&inst->remote_addr);
+
+    if (ntp_server && !add_record(inst->message, 1, RECORD_NTPV4_SERVER_NEGOTIATION,
+                                  ntp_server->name, strlen(ntp_server->name)))
       return 0;
 
-    if (CNF_GetNTPPort() != NTP_PORT) {
-      datum = htons(CNF_GetNTPPort());
-      if (!add_record(&inst->message, 1, RECORD_NTPV4_PORT_NEGOTIATION, &datum, sizeof (datum)))
+    /* Use the NTP port of this server if not specified */
+    ntp_port = ntp_server && ntp_server->port ? ntp_server->port : CNF_GetNTPPort();
+    if (ntp_port != NTP_PORT) {
+      datum = htons(ntp_port);
+      if (!add_record(inst->message, 1, RECORD_NTPV4_PORT_NEGOTIATION, &datum, sizeof (datum)))
         return 0;
     }
 
     if (!NKE_GetKeys(inst, &c2s, &s2c))
       return 0;
 
-    for (i = 0; i < MAX_COOKIES; i++) {
-      if (!NKE_GenerateCookie(&c2s, &s2c, &cookie))
-        return 0;
-      if (!add_record(&inst->message, 0, RECORD_COOKIE, cookie.cookie, cookie.length))
+    num_cookies = NKE_GenerateCookies(&c2s, &s2c, cookies, MAX_COOKIES);
+    if (num_cookies <= 0)
+      return 0;
+
+    for (i = 0; i < num_cookies; i++) {
+      if (!add_record(inst->message, 0, RECORD_COOKIE, cookies[i].cookie,
+                      cookies[i].length))
         return 0;
     }
   }
 
-  if (!add_record(&inst->message, 1, RECORD_END_OF_MESSAGE, NULL, 0))
+  if (!add_record(inst->message, 1, RECORD_END_OF_MESSAGE, NULL, 0))
     return 0;
 
   return 1;
@@ -562,11 +904,11 @@ process_request(NKE_Instance inst)
   int has_next_protocol = 0, i, critical, type, length;
   uint16_t data[MAX_RECORD_BODY_LENGTH / 2];
 
-  reset_message_parsing(&inst->message);
+  reset_message_parsing(inst->message);
 
   while (error == ERROR_NONE) {
     length = sizeof (data);
-    if (!get_record(&inst->message, &critical, &type, &data, &length))
+    if (!get_record(inst->message, &critical, &type, &data, &length))
       break;
 
     switch (type) {
@@ -619,11 +961,14 @@ process_response(NKE_Instance inst, NKE_Cookie *cookies, int max_cookies, IPAddr
   int num_cookies = 0, critical, type, length;
   uint16_t data[NKE_MAX_COOKIE_LENGTH / sizeof (uint16_t)];
 
-  reset_message_parsing(&inst->message);
+  if (!inst->message)
+    return 0;
+
+  reset_message_parsing(inst->message);
 
   while (error == ERROR_NONE) {
     length = sizeof (data);
-    if (!get_record(&inst->message, &critical, &type, &data, &length))
+    if (!get_record(inst->message, &critical, &type, &data, &length))
       break;
 
     switch (type) {
@@ -671,7 +1016,7 @@ process_response(NKE_Instance inst, NKE_Cookie *cookies, int max_cookies, IPAddr
           char buf[MAX_RECORD_BODY_LENGTH + 1];
           IPAddr a;
 
-          /* TODO: IPv6 and hostname */
+          /* TODO: hostname */
           if (length >= sizeof (buf) ||
               snprintf(buf, length + 1, "%s", (char *)data) >= sizeof (buf) ||
               !UTI_StringToIP(buf, &a)) {
@@ -708,6 +1053,21 @@ process_response(NKE_Instance inst, NKE_Cookie *cookies, int max_cookies, IPAddr
   return num_cookies;
 }
 
+static void
+save_session_data(NKE_Instance inst)
+{
+  gnutls_free(inst->session_data.data);
+  inst->session_data.data = NULL;
+  inst->session_data.size = 0;
+
+  /* With TLS 1.3 the ticket is received after the handshake, so this needs
+     to wait for the response */
+  if (gnutls_session_get_data2(inst->session, &inst->session_data) < 0) {
+    inst->session_data.data = NULL;
+    inst->session_data.size = 0;
+  }
+}
+
 static void
 update_state(NKE_Instance inst)
 {
@@ -730,7 +1090,7 @@ update_state(NKE_Instance inst)
           next_state = KE_RECEIVE;
           break;
         case KE_RECEIVE:
-          switch (check_message_format(&inst->message)) {
+          switch (check_message_format(inst->message)) {
             case MSG_INCOMPLETE:
               /* Wait for more data */
               return;
@@ -776,12 +1136,12 @@ update_state(NKE_Instance inst)
           next_state = KE_SEND;
           break;
         case KE_SEND:
-          reset_message(&inst->message);
+          reset_message(inst->message);
           enable_output = 0;
           next_state = KE_RECEIVE;
           break;
         case KE_RECEIVE:
-          switch (check_message_format(&inst->message)) {
+          switch (check_message_format(inst->message)) {
             case MSG_INCOMPLETE:
               /* Wait for more data */
               return;
@@ -791,6 +1151,7 @@ update_state(NKE_Instance inst)
               close_connection(inst);
               return;
           }
+          save_session_data(inst);
           enable_output = 1;
           next_state = KE_SHUTDOWN;
           break;
@@ -851,13 +1212,14 @@ read_write_socket(int fd, int event, void *arg)
         return;
       }
 
-      DEBUG_LOG("Handshake completed");
+      DEBUG_LOG("Handshake completed%s",
+                gnutls_session_is_resumed(inst->session) ? " (resumed)" : "");
 
       break;
 
     case KE_SEND:
-      r = gnutls_record_send(inst->session, &inst->message.data[inst->message.sent],
-                             inst->message.length - inst->message.sent);
+      r = gnutls_record_send(inst->session, &inst->message->data[inst->message->sent],
+                             inst->message->length - inst->message->sent);
 
       if (r < 0) {
         DEBUG_LOG("gnutls_record_send() failed : %s", gnutls_strerror(r));
@@ -868,8 +1230,8 @@ read_write_socket(int fd, int event, void *arg)
 
       DEBUG_LOG("Sent %d bytes", r);
 
-      inst->message.sent += r;
-      if (inst->message.sent < inst->message.length)
+      inst->message->sent += r;
+      if (inst->message->sent < inst->message->length)
         return;
 
       break;
@@ -877,14 +1239,14 @@ read_write_socket(int fd, int event, void *arg)
     case KE_RECEIVE:
       /* TODO: handle/disable RENEGOTIATION? */
       do {
-        if (inst->message.length >= sizeof (inst->message.data)) {
+        if (inst->message->length >= sizeof (inst->message->data)) {
           DEBUG_LOG("Message is too long");
           close_connection(inst);
           return;
         }
 
-        r = gnutls_record_recv(inst->session, &inst->message.data[inst->message.length],
-                               sizeof (inst->message.data) - inst->message.length);
+        r = gnutls_record_recv(inst->session, &inst->message->data[inst->message->length],
+                               sizeof (inst->message->data) - inst->message->length);
 
         if (r < 0) {
           DEBUG_LOG("gnutls_record_recv() failed : %s", gnutls_strerror(r));
@@ -892,12 +1254,12 @@ read_write_socket(int fd, int event, void *arg)
             close_connection(inst);
           return;
         } else if (r == 0) {
-          inst->message.eof = 1;
+          inst->message->eof = 1;
         }
 
         DEBUG_LOG("Received %d bytes", r);
 
-        inst->message.length += r;
+        inst->message->length += r;
 
       } while (gnutls_record_check_pending(inst->session) > 0);
 
@@ -933,36 +1295,497 @@ read_write_socket(int fd, int event, void *arg)
   update_state(inst);
 }
 
+#ifdef HAVE_NTS_KE_THREADS
+static double
+get_remaining_time(struct timespec *start)
+{
+  struct timespec now;
+
+  LCL_ReadRawTime(&now);
+  return SERVER_TIMEOUT - UTI_DiffTimespecsToDouble(&now, start);
+}
+
+static int
+set_session_timeout(gnutls_session_t session, struct timespec *start)
+{
+  double timeout = get_remaining_time(start);
+
+  if (timeout <= 0.0) {
+    THREAD_DEBUG_LOG("Connection timed out");
+    return 0;
+  }
+
+  gnutls_record_set_timeout(session, timeout * 1000.0 + 1.0);
+  return 1;
+}
+
+/* Serve a connection in a thread using blocking I/O with a timeout instead
+   of the scheduler */
 static void
-generate_server_key(void)
+serve_connection(NKE_Instance inst, int sock_fd)
 {
-  uint8_t key[32];
+  struct timespec start;
+  int r;
 
-  current_server_key = (current_server_key + 1) % MAX_SERVER_KEYS;
+  LCL_ReadRawTime(&start);
+
+  inst->session = create_session(KE_SERVER, sock_fd, NULL, 0);
+  if (!inst->session)
+    return;
+
+  reset_message(inst->message);
+
+  gnutls_handshake_set_timeout(inst->session, SERVER_TIMEOUT * 1000);
+
+  do {
+    r = gnutls_handshake(inst->session);
+  } while (r < 0 && !gnutls_error_is_fatal(r) && get_remaining_time(&start) > 0.0);
+
+  if (r < 0) {
+    THREAD_DEBUG_LOG("gnutls_handshake() failed : %s", gnutls_strerror(r));
+    goto close;
+  }
+
+  if (!check_alpn(inst->session))
+    goto close;
+
+  while (check_message_format(inst->message) == MSG_INCOMPLETE) {
+    if (inst->message->length >= sizeof (inst->message->data)) {
+      THREAD_DEBUG_LOG("Message is too long");
+      goto close;
+    }
+
+    if (!set_session_timeout(inst->session, &start))
+      goto close;
+
+    r = gnutls_record_recv(inst->session, &inst->message->data[inst->message->length],
+                           sizeof (inst->message->data) - inst->message->length);
+    if (r < 0) {
+      THREAD_DEBUG_LOG("gnutls_record_recv() failed : %s", gnutls_strerror(r));
+      if (gnutls_error_is_fatal(r))
+        goto close;
+      continue;
+    } else if (r == 0) {
+      inst->message->eof = 1;
+    }
+
+    inst->message->length += r;
+  }
+
+  if (check_message_format(inst->message) != MSG_OK || !process_request(inst))
+    goto close;
+
+  while (inst->message->sent < inst->message->length) {
+    if (get_remaining_time(&start) <= 0.0)
+      goto close;
+
+    r = gnutls_record_send(inst->session, &inst->message->data[inst->message->sent],
+                           inst->message->length - inst->message->sent);
+    if (r < 0) {
+      THREAD_DEBUG_LOG("gnutls_record_send() failed : %s", gnutls_strerror(r));
+      if (gnutls_error_is_fatal(r))
+        goto close;
+      continue;
+    }
+
+    inst->message->sent += r;
+  }
+
+  do {
+    if (!set_session_timeout(inst->session, &start))
+      goto close;
+    r = gnutls_bye(inst->session, GNUTLS_SHUT_RDWR);
+  } while (r < 0 && !gnutls_error_is_fatal(r));
+
+  if (shutdown(sock_fd, SHUT_RDWR) < 0)
+    THREAD_DEBUG_LOG("shutdown() failed : %s", strerror(errno));
+
+close:
+  gnutls_deinit(inst->session);
+  inst->session = NULL;
+}
+
+static void *
+run_server_thread(void *arg)
+{
+  struct ServerThread *thread = arg;
+  int sock_fd, notify;
+
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+
+    while (!stop_server_threads && num_queued_connections == 0)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+
+    if (stop_server_threads) {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+
+    sock_fd = queued_connections[first_queued_connection].sock_fd;
+    thread->inst->remote_addr = queued_connections[first_queued_connection].remote_addr;
+    first_queued_connection = (first_queued_connection + 1) % max_server_instances;
+    num_queued_connections--;
+
+    /* Save the descriptor for shutdown in NKE_Finalise() */
+    thread->sock_fd = sock_fd;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    serve_connection(thread->inst, sock_fd);
+
+    pthread_mutex_lock(&queue_lock);
+
+    close(sock_fd);
+    thread->sock_fd = INVALID_SOCK_FD;
+
+    /* Wake up the main thread if it stopped accepting connections */
+    notify = num_thread_connections-- >= max_server_instances;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    if (notify && write(notify_pipe[1], "", 1) < 0)
+      ;
+  }
+
+  return NULL;
+}
+
+static void
+start_server_threads(void)
+{
+  int i;
+
+  for (i = 0; i < num_server_threads; i++) {
+    if (pthread_create(&server_threads[i].thread, NULL, run_server_thread, &server_threads[i]))
+      LOG_FATAL("pthread_create() failed");
+  }
+
+  server_threads_started = 1;
+}
+
+static void
+initialise_server_threads(void)
+{
+  int i;
+
+  num_server_threads = CNF_GetNtsServerThreads();
+  server_threads_started = 0;
+  stop_server_threads = 0;
+  num_thread_messages = 0;
+  dropped_thread_messages = 0;
+  main_thread = pthread_self();
+
+  if (num_server_threads <= 0) {
+    num_server_threads = 0;
+    return;
+  }
+
+  if (pthread_mutex_init(&queue_lock, NULL) || pthread_cond_init(&queue_cond, NULL) ||
+      pthread_mutex_init(&server_keys_lock, NULL))
+    LOG_FATAL("pthread_mutex_init() failed");
+
+  if (pipe2(notify_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    LOG_FATAL("pipe2() failed : %s", strerror(errno));
+  SCH_AddFileHandler(notify_pipe[0], SCH_FILE_INPUT, process_thread_notification, NULL);
+
+  queued_connections = MallocArray(struct QueuedConnection, max_server_instances);
+  first_queued_connection = 0;
+  num_queued_connections = 0;
+  num_thread_connections = 0;
+
+  server_threads = MallocArray(struct ServerThread, num_server_threads);
+  for (i = 0; i < num_server_threads; i++) {
+    server_threads[i].inst = NKE_CreateInstance();
+    server_threads[i].inst->message = MallocNew(struct NKE_Message);
+    server_threads[i].sock_fd = INVALID_SOCK_FD;
+  }
+}
+
+static void
+finalise_server_threads(void)
+{
+  int i;
+
+  if (num_server_threads == 0)
+    return;
+
+  if (server_threads_started) {
+    pthread_mutex_lock(&queue_lock);
+
+    /* Interrupt connections which are being served */
+    stop_server_threads = 1;
+    for (i = 0; i < num_server_threads; i++) {
+      if (server_threads[i].sock_fd != INVALID_SOCK_FD)
+        shutdown(server_threads[i].sock_fd, SHUT_RDWR);
+    }
+
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (i = 0; i < num_server_threads; i++) {
+      if (pthread_join(server_threads[i].thread, NULL))
+        LOG_FATAL("pthread_join() failed");
+    }
+  }
+
+  for (; num_queued_connections > 0; num_queued_connections--) {
+    close(queued_connections[first_queued_connection].sock_fd);
+    first_queued_connection = (first_queued_connection + 1) % max_server_instances;
+  }
+
+  for (i = 0; i < num_server_threads; i++)
+    NKE_DestroyInstance(server_threads[i].inst);
+
+  Free(server_threads);
+  Free(queued_connections);
+
+  SCH_RemoveFileHandler(notify_pipe[0]);
+  close(notify_pipe[0]);
+  close(notify_pipe[1]);
+
+  pthread_cond_destroy(&queue_cond);
+  pthread_mutex_destroy(&queue_lock);
+  pthread_mutex_destroy(&server_keys_lock);
+}
+#endif
+
+static double
+get_real_time(void)
+{
+  struct timespec now;
+
+  SCH_GetLastEventTime(&now, NULL, NULL);
+  return UTI_TimespecToDouble(&now);
+}
+
+static void
+generate_server_key(int index)
+{
+  ServerKey *key = &server_keys[index];
+
+  UTI_GetRandomBytesUrandom(key->key, sizeof (key->key));
+  siv_cmac_aes128_set_key(&key->siv, key->key);
+
+  UTI_GetRandomBytes(&key->id, sizeof (key->id));
+
+  key->id &= -1U << KEY_ID_INDEX_BITS;
+  key->id |= index;
+
+  DEBUG_LOG("Generated server key %"PRIx32, key->id);
+}
+
+static int
+get_key_file_name(char *buf, int len, const char *suffix)
+{
+  char *dir = CNF_GetNtsDumpDir();
+
+  if (!dir)
+    return 0;
+
+  if (snprintf(buf, len, "%s/%s%s", dir, KEY_FILE_NAME, suffix) >= len) {
+    LOG(LOGS_WARN, "ntsdumpdir too long");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Save the keys to a temporary file and rename it, so servers sharing the
+   file never read an incomplete file */
+static void
+save_server_keys(void)
+{
+  char filename[1024], tmp_filename[1024], hex[2 * sizeof (server_keys[0].key) + 1];
+  int i, fd;
+  FILE *f;
+
+  if (!get_key_file_name(filename, sizeof (filename), "") ||
+      !get_key_file_name(tmp_filename, sizeof (tmp_filename), ".tmp"))
+    return;
+
+  fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!f) {
+    if (fd >= 0)
+      close(fd);
+    LOG(LOGS_ERR, "Could not open %s : %s", tmp_filename, strerror(errno));
+    return;
+  }
+
+  fprintf(f, "%s\n%d %.0f\n", KEY_FILE_IDENTIFIER, current_server_key,
+          (double)last_key_rotation);
+
+  for (i = 0; i < MAX_SERVER_KEYS; i++) {
+    if (!UTI_BytesToHex(server_keys[i].key, sizeof (server_keys[i].key), hex, sizeof (hex)))
+      assert(0);
+    fprintf(f, "%08"PRIx32" %s\n", server_keys[i].id, hex);
+  }
+
+  if (fclose(f) != 0 || rename(tmp_filename, filename) < 0) {
+    LOG(LOGS_ERR, "Could not save %s : %s", filename, strerror(errno));
+    unlink(tmp_filename);
+    return;
+  }
+
+  DEBUG_LOG("Saved server keys to %s", filename);
+}
+
+/* Load keys saved by this server or another server sharing the file */
+static int
+load_server_keys(void)
+{
+  char filename[1024], line[128], *s;
+  ServerKey keys[MAX_SERVER_KEYS];
+  int i, current, ok = 0;
+  struct stat st;
+  double last_rotation;
+  FILE *f;
+
+  if (!get_key_file_name(filename, sizeof (filename), ""))
+    return 0;
+
+  f = fopen(filename, "r");
+  if (!f)
+    return 0;
+
+  if (fstat(fileno(f), &st) < 0 ||
+      !fgets(line, sizeof (line), f) || strcmp(line, KEY_FILE_IDENTIFIER "\n") ||
+      !fgets(line, sizeof (line), f) ||
+      sscanf(line, "%d %lf", &current, &last_rotation) != 2 ||
+      current < 0 || current >= MAX_SERVER_KEYS)
+    goto close;
+
+  for (i = 0; i < MAX_SERVER_KEYS; i++) {
+    if (!fgets(line, sizeof (line), f) ||
+        sscanf(line, "%"SCNx32, &keys[i].id) != 1 || (keys[i].id & ~(-1U << KEY_ID_INDEX_BITS)) != i)
+      goto close;
+
+    s = strchr(line, ' ');
+    if (!s)
+      goto close;
+    s[strcspn(s, "\n")] = '\0';
+    if (UTI_HexToBytes(s + 1, keys[i].key, sizeof (keys[i].key)) != sizeof (keys[i].key))
+      goto close;
+  }
+
+  ok = 1;
+
+close:
+  fclose(f);
 
-  UTI_GetRandomBytesUrandom(key, sizeof (key));
-  siv_cmac_aes128_set_key(&server_keys[current_server_key].siv, key);
+  if (!ok) {
+    LOG(LOGS_WARN, "Could not load %s", filename);
+    return 0;
+  }
 
-  UTI_GetRandomBytes(&server_keys[current_server_key].id,
-                     sizeof (server_keys[current_server_key].id));
+  LOCK_SERVER_KEYS();
+
+  for (i = 0; i < MAX_SERVER_KEYS; i++) {
+    server_keys[i].id = keys[i].id;
+    memcpy(server_keys[i].key, keys[i].key, sizeof (server_keys[i].key));
+    siv_cmac_aes128_set_key(&server_keys[i].siv, server_keys[i].key);
+  }
+  current_server_key = current;
 
-  server_keys[current_server_key].id &= -1U << KEY_ID_INDEX_BITS;
-  server_keys[current_server_key].id |= current_server_key;
+  UNLOCK_SERVER_KEYS();
 
-  DEBUG_LOG("Generated server key %"PRIx32, server_keys[current_server_key].id);
+  last_key_rotation = last_rotation;
+  key_file_mtime = st.st_mtime;
+
+  DEBUG_LOG("Loaded server keys from %s (current %"PRIx32")",
+            filename, server_keys[current_server_key].id);
+
+  return 1;
+}
+
+static void
+rotate_server_keys(void)
+{
+  LOCK_SERVER_KEYS();
+
+  /* Start using the key generated in advance and generate a new one */
+  current_server_key = (current_server_key + 1) % MAX_SERVER_KEYS;
+  generate_server_key((current_server_key + FUTURE_KEYS) % MAX_SERVER_KEYS);
+
+  UNLOCK_SERVER_KEYS();
+
+  last_key_rotation = get_real_time();
+  save_server_keys();
 }
 
 static void
 server_key_timeout(void *arg)
 {
-  generate_server_key();
-  SCH_AddTimeoutByDelay(SERVER_KEY_TIMEOUT, server_key_timeout, NULL);
+  char filename[1024];
+  struct stat st;
+  double delay;
+
+  server_key_timeout_id = 0;
+
+  if (CNF_GetNtsRotate() > 0) {
+    rotate_server_keys();
+    delay = CNF_GetNtsRotate();
+  } else {
+    /* Follow the keys rotated by another server */
+    if (get_key_file_name(filename, sizeof (filename), "") &&
+        stat(filename, &st) == 0 && st.st_mtime != key_file_mtime)
+      load_server_keys();
+    delay = KEY_FILE_CHECK_INTERVAL;
+  }
+
+  server_key_timeout_id = SCH_AddTimeoutByDelay(delay, server_key_timeout, NULL);
+}
+
+static void
+initialise_server_keys(void)
+{
+  double delay;
+  int i;
+
+  if (!load_server_keys()) {
+    /* Fill all slots to have a complete key file */
+    LOCK_SERVER_KEYS();
+    current_server_key = 0;
+    for (i = 0; i < MAX_SERVER_KEYS; i++)
+      generate_server_key(i);
+    UNLOCK_SERVER_KEYS();
+
+    last_key_rotation = get_real_time();
+
+    /* Don't create the file if the keys are rotated by another server.
+       The random keys will be replaced when its file is loaded. */
+    if (CNF_GetNtsRotate() > 0)
+      save_server_keys();
+  }
+
+  /* Keep the rotation interval over restarts and servers sharing the keys */
+  if (CNF_GetNtsRotate() > 0) {
+    delay = last_key_rotation + CNF_GetNtsRotate() - get_real_time();
+    delay = CLAMP(0.0, delay, CNF_GetNtsRotate());
+  } else {
+    delay = KEY_FILE_CHECK_INTERVAL;
+  }
+
+  server_key_timeout_id = SCH_AddTimeoutByDelay(delay, server_key_timeout, NULL);
+}
+
+void
+NKE_ReloadKeys(void)
+{
+  /* Ignore the request if the server is disabled */
+  if (!server_key_timeout_id)
+    return;
+
+  if (load_server_keys())
+    LOG(LOGS_INFO, "Reloaded NTS server keys");
 }
 
 void
 NKE_Initialise(void)
 {
   char *cert, *key, *ca_cert;
+  CNF_NtsNtpServer *ntp_server;
   IPAddr ip;
   int i, r;
 
@@ -994,8 +1817,23 @@ NKE_Initialise(void)
 
   server_sock_fd4 = INVALID_SOCK_FD;
   server_sock_fd6 = INVALID_SOCK_FD;
-  for (i = 0; i < MAX_SERVER_INSTANCES; i++)
-    server_instances[i] = NULL;
+  server_ticket_key.data = NULL;
+  server_ticket_key.size = 0;
+  server_key_timeout_id = 0;
+  key_file_mtime = 0;
+
+  for (i = 0, total_ntp_server_weight = 0; CNF_GetNtsNtpServer(i, &ntp_server); i++)
+    total_ntp_server_weight += ntp_server->weight;
+
+  max_server_instances = MAX(1, CNF_GetMaxNtsConnections());
+  server_instances = MallocArray(NKE_Instance, max_server_instances);
+  free_server_instances = MallocArray(NKE_Instance, max_server_instances);
+  num_server_instances = 0;
+  num_free_server_instances = 0;
+
+#ifdef HAVE_NTS_KE_THREADS
+  num_server_threads = 0;
+#endif
 
   if (cert && key) {
     r = gnutls_certificate_set_x509_key_file(server_credentials, cert, key,
@@ -1003,6 +1841,16 @@ NKE_Initialise(void)
     if (r < 0)
       LOG_FATAL("gnutls: %s", gnutls_strerror(r));
 
+    r = gnutls_session_ticket_key_generate(&server_ticket_key);
+    if (r < 0)
+      LOG_FATAL("gnutls: %s", gnutls_strerror(r));
+
+#ifdef HAVE_NTS_KE_THREADS
+    initialise_server_threads();
+#endif
+
+    initialise_server_keys();
+
     if (!UTI_StringToIP(SERVER_BIND_ADDRESS4, &ip))
       return;
     server_sock_fd4 = prepare_socket(KE_SERVER, &ip, CNF_GetNtsServerPort());
@@ -1014,9 +1862,6 @@ NKE_Initialise(void)
     server_sock_fd6 = prepare_socket(KE_SERVER, &ip, CNF_GetNtsServerPort());
     if (server_sock_fd6 != INVALID_SOCK_FD)
       SCH_AddFileHandler(server_sock_fd6, SCH_FILE_INPUT, accept_connection, NULL);
-
-    current_server_key = 0;
-    server_key_timeout(NULL);
   }
 }
 
@@ -1029,10 +1874,21 @@ NKE_Finalise(void)
     close(server_sock_fd4);
   if (server_sock_fd6 != INVALID_SOCK_FD)
     close(server_sock_fd6);
+  server_sock_fd4 = server_sock_fd6 = INVALID_SOCK_FD;
+
+#ifdef HAVE_NTS_KE_THREADS
+  finalise_server_threads();
+#endif
 
-  for (i = 0; i < MAX_SERVER_INSTANCES; i++) {
-    if (server_instances[i] != NULL)
-      NKE_DestroyInstance(server_instances[i]);
+  for (i = 0; i < num_server_instances; i++)
+    NKE_DestroyInstance(server_instances[i]);
+
+  Free(server_instances);
+  Free(free_server_instances);
+
+  if (server_ticket_key.data) {
+    gnutls_memset(server_ticket_key.data, 0, server_ticket_key.size);
+    gnutls_free(server_ticket_key.data);
   }
 
   gnutls_certificate_free_credentials(client_credentials);
@@ -1052,13 +1908,15 @@ NKE_CreateInstance(void)
   inst->sock_fd = INVALID_SOCK_FD;
   inst->session = NULL;
   inst->timeout_id = 0;
-  reset_message(&inst->message);
+  inst->message = NULL;
+  inst->session_data.data = NULL;
+  inst->session_data.size = 0;
 
   return inst;
 }
 
 static int
-accept_server_connection(NKE_Instance inst, int sock_fd)
+accept_server_connection(NKE_Instance inst, int sock_fd, IPAddr *remote_addr)
 {
   gnutls_session_t session;
 
@@ -1069,7 +1927,7 @@ accept_server_connection(NKE_Instance inst, int sock_fd)
     inst->session = NULL;
   }
 
-  session = create_session(KE_SERVER, sock_fd, NULL);
+  session = create_session(KE_SERVER, sock_fd, NULL, 1);
   if (!session)
     return 0;
 
@@ -1077,8 +1935,12 @@ accept_server_connection(NKE_Instance inst, int sock_fd)
   inst->state = KE_HANDSHAKE;
   inst->sock_fd = sock_fd;
   inst->session = session;
+  inst->remote_addr = *remote_addr;
   inst->timeout_id = SCH_AddTimeoutByDelay(SERVER_TIMEOUT, session_timeout, inst);
-  reset_message(&inst->message);
+
+  if (!inst->message)
+    inst->message = MallocNew(struct NKE_Message);
+  reset_message(inst->message);
 
   SCH_AddFileHandler(inst->sock_fd, SCH_FILE_INPUT, read_write_socket, inst);
 
@@ -1099,18 +1961,28 @@ NKE_OpenClientConnection(NKE_Instance inst, IPAddr *addr, int port, const char *
   if (inst->session)
     gnutls_deinit(inst->session);
 
-  inst->session = create_session(KE_CLIENT, sock_fd, name);
+  inst->session = create_session(KE_CLIENT, sock_fd, name, 1);
   if (!inst->session) {
     close(sock_fd);
     return 0;
   }
 
+  /* Try to resume the previous session to avoid a full handshake */
+  if (inst->session_data.data &&
+      gnutls_session_set_data(inst->session, inst->session_data.data,
+                              inst->session_data.size) < 0)
+    DEBUG_LOG("Could not set session data");
+
   inst->mode = KE_CLIENT;
   inst->state = KE_WAIT_CONNECT;
   inst->sock_fd = sock_fd;
   inst->timeout_id = SCH_AddTimeoutByDelay(CLIENT_TIMEOUT, session_timeout, inst);
   inst->remote_addr = *addr;
 
+  if (!inst->message)
+    inst->message = MallocNew(struct NKE_Message);
+  reset_message(inst->message);
+
   SCH_AddFileHandler(sock_fd, SCH_FILE_INPUT | SCH_FILE_OUTPUT, read_write_socket, inst);
 
   return 1;
@@ -1145,9 +2017,13 @@ NKE_GetNtpAddress(NKE_Instance inst, NTP_Remote_Address *address)
   if (!process_response(inst, &cookie, 1, &addr, &port))
     return 0;
 
-  if (port == 0)
+  if (addr.family == IPADDR_UNSPEC && port == 0)
     return 0;
 
+  /* The port negotiation record is missing if the port is the default */
+  if (port == 0)
+    port = NTP_PORT;
+
   if (addr.family != IPADDR_UNSPEC)
     address->ip_addr = addr;
   else
@@ -1183,44 +2059,86 @@ NKE_DestroyInstance(NKE_Instance inst)
   if (inst->mode != KE_UNKNOWN)
     gnutls_deinit(inst->session);
 
+  gnutls_free(inst->session_data.data);
+  Free(inst->message);
   Free(inst);
 }
 
 int
-NKE_GenerateCookie(NKE_Key *c2s, NKE_Key *s2c, NKE_Cookie *nke_cookie)
+NKE_GenerateCookies(NKE_Key *c2s, NKE_Key *s2c, NKE_Cookie *nke_cookies, int n)
 {
-  ServerCookie *cookie;
+  uint8_t nonces[MAX_COOKIES][sizeof (((ServerCookie *)NULL)->nonce)];
+  ServerCookie cookie;
   ServerKey *key;
   uint8_t plaintext[64];
+  int i;
 
-  key = &server_keys[current_server_key];
-
-  assert(sizeof (nke_cookie->cookie) >= sizeof (*cookie));
-
-  nke_cookie->length = sizeof (*cookie);
-
-  //TODO: alignment
-  cookie = (ServerCookie *)nke_cookie->cookie;
-  cookie->key_id = key->id;
-  UTI_GetRandomBytes(cookie->nonce, sizeof (cookie->nonce));
+  if (n <= 0)
+    return 0;
+  n = MIN(n, MAX_COOKIES);
 
+  assert(sizeof (nke_cookies[0].cookie) >= sizeof (cookie));
   assert(c2s->length == 32);
   assert(s2c->length == 32);
 
   memcpy(plaintext, c2s->key, 32);
   memcpy(plaintext + 32, s2c->key, 32);
 
-  assert(sizeof (cookie->ciphertext) == sizeof (plaintext) + SIV_DIGEST_SIZE);
-  siv_cmac_aes128_encrypt_message(&key->siv, sizeof (cookie->nonce), cookie->nonce,
-                                  0, NULL,
-                                  sizeof (plaintext) + SIV_DIGEST_SIZE,
-                                  cookie->ciphertext, plaintext);
+  /* Get the nonces of all cookies at once (gnutls_rnd() can be called
+     from the server threads) */
+  if (gnutls_rnd(GNUTLS_RND_NONCE, nonces, n * sizeof (nonces[0])) < 0)
+    return 0;
+
+  LOCK_SERVER_KEYS();
+
+  key = &server_keys[current_server_key];
+
+  for (i = 0; i < n; i++) {
+    cookie.key_id = key->id;
+    memcpy(cookie.nonce, nonces[i], sizeof (cookie.nonce));
+
+    assert(sizeof (cookie.ciphertext) == sizeof (plaintext) + SIV_DIGEST_SIZE);
+    siv_cmac_aes128_encrypt_message(&key->siv, sizeof (cookie.nonce), cookie.nonce,
+                                    0, NULL,
+                                    sizeof (plaintext) + SIV_DIGEST_SIZE,
+                                    cookie.ciphertext, plaintext);
+
+    /* Copy the cookie to the buffer, which may not be aligned */
+    memcpy(nke_cookies[i].cookie, &cookie, sizeof (cookie));
+    nke_cookies[i].length = sizeof (cookie);
+  }
+
+  UNLOCK_SERVER_KEYS();
+
+  return n;
+}
+
+int
+NKE_GetCookieHash(unsigned char *data, int length, uint32_t *hash)
+{
+  ServerCookie cookie;
+  uint32_t words[sizeof (cookie.nonce) / sizeof (uint32_t)];
+  int i;
+
+  if (length != sizeof (cookie))
+    return 0;
+
+  /* Copy only the key ID and nonce to avoid unaligned access */
+  memcpy(&cookie, data, offsetof(ServerCookie, ciphertext));
+
+  if (cookie.key_id != server_keys[cookie.key_id % MAX_SERVER_KEYS].id)
+    return 0;
+
+  /* The nonce is random, no mixing is needed */
+  memcpy(words, cookie.nonce, sizeof (words));
+  for (i = 0, *hash = cookie.key_id; i < sizeof (words) / sizeof (words[0]); i++)
+    *hash ^= words[i];
 
   return 1;
 }
 
 int
-NKE_DecodeCookie(NKE_Cookie *nke_cookie, NKE_Key *c2s, NKE_Key *s2c)
+NKE_DecodeCookie(unsigned char *data, int length, NKE_Key *c2s, NKE_Key *s2c)
 {
   ServerCookie *cookie;
   ServerKey *key;
@@ -1229,11 +2147,11 @@ NKE_DecodeCookie(NKE_Cookie *nke_cookie, NKE_Key *c2s, NKE_Key *s2c)
     uint8_t s2c[32];
   } plaintext;
 
-  if (nke_cookie->length != sizeof (*cookie))
+  if (length != sizeof (*cookie))
     return 0;
 
   //TODO: alignment
-  cookie = (ServerCookie *)nke_cookie->cookie;
+  cookie = (ServerCookie *)data;
 
   key = &server_keys[cookie->key_id % MAX_SERVER_KEYS];
   if (cookie->key_id != key->id) {
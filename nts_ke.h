@@ -56,7 +56,20 @@ extern int NKE_GetNtpAddress(NKE_Instance inst, NTP_Remote_Address *address);
 extern int NKE_GetKeys(NKE_Instance inst, NKE_Key *c2s, NKE_Key *s2c);
 extern void NKE_DestroyInstance(NKE_Instance inst);
 
-extern int NKE_GenerateCookie(NKE_Key *c2s, NKE_Key *s2c, NKE_Cookie *cookie);
-extern int NKE_DecodeCookie(NKE_Cookie *cookie, NKE_Key *c2s, NKE_Key *s2c);
+/* Generate cookies containing the keys and return the number of generated
+   cookies, which can be smaller than requested */
+extern int NKE_GenerateCookies(NKE_Key *c2s, NKE_Key *s2c, NKE_Cookie *cookies, int n);
+
+/* Check if the cookie was encrypted with a valid server key and get a hash
+   of its key ID and nonce, which can be used to look up data cached for
+   previously issued cookies */
+extern int NKE_GetCookieHash(unsigned char *cookie, int length, uint32_t *hash);
+
+/* Reload the server keys from the key file in ntsdumpdir */
+extern void NKE_ReloadKeys(void);
+
+/* Decode keys from a cookie, which can be in a receive buffer (aligned to
+   4 bytes) */
+extern int NKE_DecodeCookie(unsigned char *cookie, int length, NKE_Key *c2s, NKE_Key *s2c);
 
 #endif
@@ -28,6 +28,7 @@
 
 #include "sysincl.h"
 
+#include "conf.h"
 #include "logging.h"
 #include "memory.h"
 #include "ntp_ext.h"
@@ -47,14 +48,36 @@
 #define NONCE_LENGTH 16
 #define UNIQ_ID_LENGTH 32
 
+/* Identifier of the file in ntsdumpdir with saved cookies and keys */
+#define DUMP_IDENTIFIER "NNC1"
+
+/* Maximum number of requests using cookies loaded from the file which can
+   be sent without a valid response before making a new NTS-KE session */
+#define MAX_RESTORED_REQUESTS 2
+
+/* Number of remaining cookies which triggers a new NTS-KE session in the
+   background, before the cookies run out */
+#define MIN_COOKIES 2
+
 struct NTS_ClientInstance_Record {
   IPAddr address;
   int port;
   char *name;
+  NTP_Remote_Address ntp_address; /* Current address of the source */
+  NTP_Remote_Address restored_ntp_address; /* Address of the NTP server
+                                              which provided the loaded
+                                              cookies, or unspecified */
   NKE_Instance nke;
+  int nke_started;              /* Flag indicating an NTS-KE session which
+                                   was started and not processed yet */
   NKE_Cookie cookies[MAX_COOKIES];
   int num_cookies;
   int cookie_index;
+  int restored_requests;        /* Requests using loaded cookies, or -1 if
+                                   the cookies were not loaded or a valid
+                                   response was received */
+  NKE_Key c2s;
+  NKE_Key s2c;
   struct siv_cmac_aes128_ctx siv_c2s;
   struct siv_cmac_aes128_ctx siv_s2c;
   unsigned char nonce[NONCE_LENGTH];
@@ -68,8 +91,37 @@ struct AuthAndEEF {
   int ciphertext_length;
 };
 
-struct {
+/* Keys and expanded SIV contexts of a client seen by the server */
+typedef struct {
+  NKE_Key c2s;
+  NKE_Key s2c;
+  struct siv_cmac_aes128_ctx siv_c2s;
   struct siv_cmac_aes128_ctx siv_s2c;
+  uint32_t last_use;
+  uint32_t generation;
+} ServerContext;
+
+/* Entry in the index of cookies issued by the server, pointing to the
+   context which has their keys (if it was not replaced yet) */
+typedef struct {
+  uint32_t hash;
+  uint32_t generation;
+  int context;
+  int cookie_length;
+  unsigned char cookie[NKE_MAX_COOKIE_LENGTH];
+} CookieIndexEntry;
+
+/* Number of cached contexts of recently seen clients, which are replaced
+   in the LRU order, and size of the direct-mapped index of cookies */
+#define MAX_SERVER_CONTEXTS 64
+#define COOKIE_INDEX_SIZE 512
+
+static ServerContext *server_contexts;
+static CookieIndexEntry *cookie_index;
+static uint32_t last_context_use;
+
+struct {
+  ServerContext *context;
   unsigned char nonce[NONCE_LENGTH];
   NKE_Cookie cookies[MAX_COOKIES];
   int num_cookies;
@@ -106,66 +158,153 @@ parse_auth_and_eef(unsigned char *ef_body, int ef_body_length,
 void
 NTS_Initialise(void)
 {
+  server_contexts = NULL;
+  cookie_index = NULL;
+  last_context_use = 0;
+  server_inst.context = NULL;
 }
 
 void
 NTS_Finalise(void)
 {
+  Free(server_contexts);
+  Free(cookie_index);
+}
+
+static ServerContext *
+find_server_context(unsigned char *cookie, int cookie_length)
+{
+  CookieIndexEntry *entry;
+  ServerContext *context;
+  uint32_t hash;
+
+  if (!server_contexts || !NKE_GetCookieHash(cookie, cookie_length, &hash))
+    return NULL;
+
+  entry = &cookie_index[hash % COOKIE_INDEX_SIZE];
+  if (entry->hash != hash || entry->cookie_length != cookie_length ||
+      memcmp(entry->cookie, cookie, cookie_length) != 0)
+    return NULL;
+
+  context = &server_contexts[entry->context];
+  if (entry->generation != context->generation)
+    return NULL;
+
+  context->last_use = ++last_context_use;
+
+  return context;
+}
+
+static ServerContext *
+create_server_context(unsigned char *cookie, int cookie_length)
+{
+  ServerContext *context;
+  NKE_Key c2s, s2c;
+  int i;
+
+  if (!NKE_DecodeCookie(cookie, cookie_length, &c2s, &s2c))
+    return NULL;
+
+  if (!server_contexts) {
+    server_contexts = Malloc2(MAX_SERVER_CONTEXTS, sizeof (server_contexts[0]));
+    memset(server_contexts, 0, MAX_SERVER_CONTEXTS * sizeof (server_contexts[0]));
+    cookie_index = Malloc2(COOKIE_INDEX_SIZE, sizeof (cookie_index[0]));
+    memset(cookie_index, 0, COOKIE_INDEX_SIZE * sizeof (cookie_index[0]));
+  }
+
+  /* Replace the least recently used context */
+  for (i = 1, context = &server_contexts[0]; i < MAX_SERVER_CONTEXTS; i++) {
+    if (last_context_use - server_contexts[i].last_use >
+        last_context_use - context->last_use)
+      context = &server_contexts[i];
+  }
+
+  /* Invalidate the index entries pointing to the replaced context,
+     generation 0 is reserved for unused entries */
+  if (++context->generation == 0)
+    context->generation++;
+  context->last_use = ++last_context_use;
+
+  assert(c2s.length == 32);
+  assert(s2c.length == 32);
+  context->c2s = c2s;
+  context->s2c = s2c;
+  siv_cmac_aes128_set_key(&context->siv_c2s, (uint8_t *)c2s.key);
+  siv_cmac_aes128_set_key(&context->siv_s2c, (uint8_t *)s2c.key);
+
+  return context;
+}
+
+static void
+index_cookies(ServerContext *context, NKE_Cookie *cookies, int num_cookies)
+{
+  CookieIndexEntry *entry;
+  uint32_t hash;
+  int i;
+
+  for (i = 0; i < num_cookies; i++) {
+    if (cookies[i].length > sizeof (entry->cookie) ||
+        !NKE_GetCookieHash(cookies[i].cookie, cookies[i].length, &hash))
+      continue;
+    entry = &cookie_index[hash % COOKIE_INDEX_SIZE];
+    entry->hash = hash;
+    entry->cookie_length = cookies[i].length;
+    memcpy(entry->cookie, cookies[i].cookie, cookies[i].length);
+    entry->generation = context->generation;
+    entry->context = context - server_contexts;
+  }
+}
+
+static int
+decrypt_request(ServerContext *context, NTP_Packet *packet, int aad_length,
+                struct AuthAndEEF *auth, NTP_Packet *plaintext)
+{
+  if (!siv_cmac_aes128_decrypt_message(&context->siv_c2s,
+                                       auth->nonce_length, auth->nonce,
+                                       aad_length, (uint8_t *)packet,
+                                       auth->ciphertext_length - SIV_DIGEST_SIZE,
+                                       plaintext->extensions, auth->ciphertext)) {
+    DEBUG_LOG("SIV decrypt failed");
+    return 0;
+  }
+
+  return 1;
 }
 
 int
 NTS_CheckRequestAuth(NTP_Packet *packet, NTP_PacketInfo *info)
 {
-  int ef_type, ef_body_length, ef_parsed, parsed, has_auth = 0, has_cookie = 0;
-  int i, requested_cookies = 0;
+  int i, ef_type, ef_body_length, has_auth = 0, cookie_length = 0;
+  int requested_cookies = 0, aad_length = 0;
   void *ef_body;
+  unsigned char *cookie = NULL;
   struct AuthAndEEF auth_and_eef;
-  NKE_Cookie cookie;
-  NKE_Key c2s, s2c;
-  struct siv_cmac_aes128_ctx siv_c2s;
+  ServerContext *context;
   NTP_Packet plaintext;
 
   if (info->ext_fields == 0 || info->mode != MODE_CLIENT)
     return 0;
 
-  parsed = 0;
-
-  while (1) {
-    ef_parsed = NEF_ParseField(packet, info->length, parsed,
-                               &ef_type, &ef_body, &ef_body_length);
-    if (ef_parsed < parsed)
-      break;
-    parsed = ef_parsed;
-
+  /* Use the fields indexed in the parsing of the packet.  The cookie is
+     decoded directly from the receive buffer. */
+  for (i = 0; NEF_GetIndexedField(packet, info, i, &ef_type, &ef_body, &ef_body_length); i++) {
     switch (ef_type) {
       case NTP_EF_NTS_COOKIE:
-        if (has_cookie || ef_body_length > sizeof (cookie.cookie))
-          return 0;
-        cookie.length = ef_body_length;
-        memcpy(cookie.cookie, ef_body, ef_body_length);
-        if (!NKE_DecodeCookie(&cookie, &c2s, &s2c))
+        if (cookie || ef_body_length > NKE_MAX_COOKIE_LENGTH)
           return 0;
-        has_cookie = 1;
+        cookie = ef_body;
+        cookie_length = ef_body_length;
         requested_cookies++;
         break;
       case NTP_EF_NTS_COOKIE_PLACEHOLDER:
         requested_cookies++;
         break;
       case NTP_EF_NTS_AUTH_AND_EEF:
-        if (!has_cookie)
+        if (!cookie || has_auth)
           return 0;
         if (!parse_auth_and_eef(ef_body, ef_body_length, &auth_and_eef))
           return 0;
-        assert(c2s.length == 32);
-        siv_cmac_aes128_set_key(&siv_c2s, (uint8_t *)c2s.key);
-        if (!siv_cmac_aes128_decrypt_message(&siv_c2s,
-                                             auth_and_eef.nonce_length, auth_and_eef.nonce,
-                                             info->length - ef_body_length - 4, (uint8_t *)packet,
-                                             auth_and_eef.ciphertext_length - SIV_DIGEST_SIZE,
-                                             plaintext.extensions, auth_and_eef.ciphertext)) {
-          DEBUG_LOG("SIV decrypt failed");
-          return 0;
-        }
+        aad_length = (unsigned char *)ef_body - (unsigned char *)packet - 4;
         has_auth = 1;
         break;
       default:
@@ -176,16 +315,26 @@ NTS_CheckRequestAuth(NTP_Packet *packet, NTP_PacketInfo *info)
   if (!has_auth)
     return 0;
 
+  /* Avoid decoding the cookie and expanding the keys if the cookie was
+     issued to a recently seen client.  If the request cannot be decrypted
+     with the cached context, try again with the keys from the cookie. */
+  context = find_server_context(cookie, cookie_length);
+  if (!context || !decrypt_request(context, packet, aad_length, &auth_and_eef, &plaintext)) {
+    context = create_server_context(cookie, cookie_length);
+    if (!context || !decrypt_request(context, packet, aad_length, &auth_and_eef, &plaintext))
+      return 0;
+  }
+
   //TODO: process plaintext?
 
-  assert(s2c.length == 32);
-  siv_cmac_aes128_set_key(&server_inst.siv_s2c, (uint8_t *)s2c.key);
+  server_inst.context = context;
 
   UTI_GetRandomBytes(server_inst.nonce, sizeof (server_inst.nonce));
 
-  server_inst.num_cookies = MIN(MAX_COOKIES, requested_cookies);
-  for (i = 0; i < server_inst.num_cookies; i++)
-    NKE_GenerateCookie(&c2s, &s2c, &server_inst.cookies[i]);
+  server_inst.num_cookies = NKE_GenerateCookies(&context->c2s, &context->s2c,
+                                                server_inst.cookies,
+                                                MIN(MAX_COOKIES, requested_cookies));
+  index_cookies(context, server_inst.cookies, server_inst.num_cookies);
 
   return 1;
 }
@@ -194,27 +343,21 @@ int
 NTS_GenerateResponseAuth(NTP_Packet *request, NTP_PacketInfo *req_info,
                          NTP_Packet *response, NTP_PacketInfo *res_info)
 {
-  int i, ef_type, ef_body_length, ef_parsed, parsed;
+  int i, ef_type, ef_body_length;
   void *ef_body;
   NTP_Packet plaintext;
   NTP_PacketInfo plaintext_info;
   uint8_t auth[4 + NONCE_LENGTH + SIV_DIGEST_SIZE + MAX_COOKIES * (4 + NKE_MAX_COOKIE_LENGTH)];
   int auth_length, ciphertext_length;
 
-  if (req_info->mode != MODE_CLIENT || res_info->mode != MODE_SERVER)
+  if (req_info->mode != MODE_CLIENT || res_info->mode != MODE_SERVER ||
+      !server_inst.context)
     return 0;
 
   //TODO: check if server_inst corresponds to this response
 
-  parsed = 0;
-
-  while (1) {
-    ef_parsed = NEF_ParseField(request, req_info->length, parsed,
-                               &ef_type, &ef_body, &ef_body_length);
-    if (ef_parsed < parsed)
-      break;
-    parsed = ef_parsed;
-
+  for (i = 0; NEF_GetIndexedField(request, req_info, i, &ef_type, &ef_body, &ef_body_length);
+       i++) {
     switch (ef_type) {
       case NTP_EF_NTS_UNIQUE_IDENTIFIER:
         /* Copy the ID from the request */
@@ -245,7 +388,7 @@ NTS_GenerateResponseAuth(NTP_Packet *request, NTP_PacketInfo *req_info,
   *(uint16_t *)&auth[2] = htons(ciphertext_length);
   memcpy(&auth[4], server_inst.nonce, sizeof (server_inst.nonce));
 
-  siv_cmac_aes128_encrypt_message(&server_inst.siv_s2c,
+  siv_cmac_aes128_encrypt_message(&server_inst.context->siv_s2c,
                                   sizeof (server_inst.nonce), server_inst.nonce,
                                   res_info->length, (uint8_t *)response,
                                   ciphertext_length,
@@ -259,21 +402,168 @@ NTS_GenerateResponseAuth(NTP_Packet *request, NTP_PacketInfo *req_info,
   return 1;
 }
 
+static int
+get_dump_file_name(NTS_ClientInstance inst, char *buf, int len, const char *suffix)
+{
+  char *dir = CNF_GetNtsDumpDir();
+
+  if (!dir || inst->address.family == IPADDR_UNSPEC)
+    return 0;
+
+  if (snprintf(buf, len, "%s/%s.nts%s", dir, UTI_IPToString(&inst->address),
+               suffix) >= len) {
+    DEBUG_LOG("ntsdumpdir too long");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Save unused cookies, the keys, and the address of the NTP server which
+   provided them, which allows the client to send authenticated requests
+   after restart without an NTS-KE session */
+static void
+save_cookies(NTS_ClientInstance inst)
+{
+  char filename[1024], tmp_filename[1024], hex[2 * NKE_MAX_COOKIE_LENGTH + 1];
+  NKE_Cookie *cookie;
+  int i, fd;
+  FILE *f;
+
+  if (inst->num_cookies <= 0 || inst->c2s.length <= 0 || inst->s2c.length <= 0 ||
+      !get_dump_file_name(inst, filename, sizeof (filename), "") ||
+      !get_dump_file_name(inst, tmp_filename, sizeof (tmp_filename), ".tmp"))
+    return;
+
+  fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!f) {
+    if (fd >= 0)
+      close(fd);
+    DEBUG_LOG("Could not open %s : %s", tmp_filename, strerror(errno));
+    return;
+  }
+
+  fprintf(f, "%s\n%s %d\n", DUMP_IDENTIFIER, UTI_IPToString(&inst->ntp_address.ip_addr),
+          inst->ntp_address.port);
+
+  if (!UTI_BytesToHex(inst->c2s.key, inst->c2s.length, hex, sizeof (hex)))
+    assert(0);
+  fprintf(f, "%s ", hex);
+  if (!UTI_BytesToHex(inst->s2c.key, inst->s2c.length, hex, sizeof (hex)))
+    assert(0);
+  fprintf(f, "%s\n", hex);
+
+  for (i = 0; i < inst->num_cookies; i++) {
+    cookie = &inst->cookies[(inst->cookie_index + i) % MAX_COOKIES];
+    if (!UTI_BytesToHex(cookie->cookie, cookie->length, hex, sizeof (hex)))
+      assert(0);
+    fprintf(f, "%s\n", hex);
+  }
+
+  if (fclose(f) != 0 || rename(tmp_filename, filename) < 0) {
+    DEBUG_LOG("Could not save %s : %s", filename, strerror(errno));
+    unlink(tmp_filename);
+    return;
+  }
+
+  DEBUG_LOG("Saved %d cookies to %s", inst->num_cookies, filename);
+}
+
+static void
+load_cookies(NTS_ClientInstance inst)
+{
+  char filename[1024], line[2 * NKE_MAX_COOKIE_LENGTH + 2], *s;
+  NTP_Remote_Address ntp_address;
+  NKE_Cookie *cookie;
+  NKE_Key c2s, s2c;
+  int port;
+  FILE *f;
+
+  if (!get_dump_file_name(inst, filename, sizeof (filename), ""))
+    return;
+
+  f = fopen(filename, "r");
+  if (!f)
+    return;
+
+  /* Don't use the cookies again if something fails later */
+  unlink(filename);
+
+  if (!fgets(line, sizeof (line), f) || strcmp(line, DUMP_IDENTIFIER "\n") ||
+      !fgets(line, sizeof (line), f) || !(s = strchr(line, ' ')))
+    goto error;
+
+  *s++ = '\0';
+  if (!UTI_StringToIP(line, &ntp_address.ip_addr) || sscanf(s, "%d", &port) != 1 ||
+      port <= 0 || port > 65535)
+    goto error;
+  ntp_address.port = port;
+
+  if (!fgets(line, sizeof (line), f) || !(s = strchr(line, ' ')))
+    goto error;
+
+  *s++ = '\0';
+  s[strcspn(s, "\n")] = '\0';
+  c2s.length = UTI_HexToBytes(line, c2s.key, sizeof (c2s.key));
+  s2c.length = UTI_HexToBytes(s, s2c.key, sizeof (s2c.key));
+  if (c2s.length != 2 * AES128_KEY_SIZE || s2c.length != 2 * AES128_KEY_SIZE)
+    goto error;
+
+  inst->num_cookies = 0;
+  inst->cookie_index = 0;
+
+  while (inst->num_cookies < MAX_COOKIES && fgets(line, sizeof (line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    cookie = &inst->cookies[inst->num_cookies];
+    cookie->length = UTI_HexToBytes(line, cookie->cookie, sizeof (cookie->cookie));
+    if (cookie->length <= 0)
+      goto error;
+    inst->num_cookies++;
+  }
+
+  fclose(f);
+
+  if (inst->num_cookies == 0)
+    return;
+
+  inst->c2s = c2s;
+  inst->s2c = s2c;
+  siv_cmac_aes128_set_key(&inst->siv_c2s, (uint8_t *)c2s.key);
+  siv_cmac_aes128_set_key(&inst->siv_s2c, (uint8_t *)s2c.key);
+  inst->restored_requests = 0;
+  inst->restored_ntp_address = ntp_address;
+
+  DEBUG_LOG("Loaded %d cookies from %s", inst->num_cookies, filename);
+  return;
+
+error:
+  DEBUG_LOG("Could not load %s", filename);
+  inst->num_cookies = 0;
+  fclose(f);
+}
+
 NTS_ClientInstance
-NTS_CreateClientInstance(IPAddr *address, int port, const char *name)
+NTS_CreateClientInstance(NTP_Remote_Address *ntp_address, int port, const char *name)
 {
   NTS_ClientInstance inst;
 
   inst = MallocNew(struct NTS_ClientInstance_Record);
 
   memset(inst, 0, sizeof (*inst));
-  inst->address = *address;
+  inst->address = ntp_address->ip_addr;
   inst->port = port;
   inst->name = name ? strdup(name) : NULL;
+  inst->ntp_address = *ntp_address;
+  inst->restored_ntp_address.ip_addr.family = IPADDR_UNSPEC;
   inst->num_cookies = 0;
   memset(inst->uniq_id, 0, sizeof (inst->uniq_id));
+  inst->restored_requests = -1;
 
   inst->nke = NULL;
+  inst->nke_started = 0;
+
+  load_cookies(inst);
 
   return inst;
 }
@@ -284,6 +574,8 @@ NTS_DestroyClientInstance(NTS_ClientInstance inst)
   if (inst->nke)
     NKE_DestroyInstance(inst->nke);
 
+  save_cookies(inst);
+
   Free(inst->name);
   Free(inst);
 }
@@ -294,64 +586,117 @@ needs_nke(NTS_ClientInstance inst)
   return inst->num_cookies == 0;
 }
 
-static void
-get_nke_data(NTS_ClientInstance inst)
+static int
+wants_nke(NTS_ClientInstance inst)
 {
-  NTP_Remote_Address old_ntp_address, new_ntp_address;
-  NKE_Key c2s, s2c;
+  /* Start the session before the cookies run out, or if a request using
+     loaded cookies was not answered */
+  return inst->num_cookies <= MIN_COOKIES || inst->restored_requests > 0;
+}
+
+/* Replace the source with the NTP server which provided the cookies.
+   Return 1 if the address of the source was changed. */
+static int
+replace_ntp_address(NTS_ClientInstance inst, NTP_Remote_Address *address)
+{
+  if (UTI_CompareIPs(&address->ip_addr, &inst->ntp_address.ip_addr, NULL) == 0 &&
+      address->port == inst->ntp_address.port)
+    return 0;
+
+  if (NSR_ReplaceSource(&inst->ntp_address, address) != NSR_Success)
+    return 0;
+
+  inst->ntp_address = *address;
+
+  return 1;
+}
 
-  assert(needs_nke(inst));
+/* Start an NTS-KE session, or replace the cookies and keys if the session
+   started in a previous call is finished.  The remaining cookies can be used
+   while the session is in progress.  Return 1 if the cookies were replaced. */
+static int
+get_nke_data(NTS_ClientInstance inst, int *replaced_source)
+{
+  NTP_Remote_Address ntp_address;
+  NKE_Cookie cookies[MAX_COOKIES];
+  NKE_Key c2s, s2c;
+  int i, num_cookies;
 
   if (!inst->nke)
     inst->nke = NKE_CreateInstance();
 
-  inst->cookie_index = 0;
-  inst->num_cookies = NKE_GetCookies(inst->nke, inst->cookies, MAX_COOKIES);
-
-  if (inst->num_cookies == 0) {
-    if (NKE_IsClosed(inst->nke))
-      NKE_OpenClientConnection(inst->nke, &inst->address, inst->port, inst->name);
-    return;
+  if (!inst->nke_started) {
+    inst->nke_started = NKE_OpenClientConnection(inst->nke, &inst->address,
+                                                 inst->port, inst->name);
+    return 0;
   }
 
-  if (NKE_GetNtpAddress(inst->nke, &new_ntp_address)) {
-    //TODO
-    old_ntp_address.ip_addr = inst->address;
-    old_ntp_address.port = 123;
-    NSR_ReplaceSource(&old_ntp_address, &new_ntp_address);
-  }
+  if (!NKE_IsClosed(inst->nke))
+    return 0;
 
-  if (!NKE_GetKeys(inst->nke, &c2s, &s2c)) {
-    inst->num_cookies = 0;
-    return;
-  }
+  inst->nke_started = 0;
+
+  num_cookies = NKE_GetCookies(inst->nke, cookies, MAX_COOKIES);
+  if (num_cookies == 0 || !NKE_GetKeys(inst->nke, &c2s, &s2c))
+    return 0;
+
+  if (NKE_GetNtpAddress(inst->nke, &ntp_address) &&
+      replace_ntp_address(inst, &ntp_address))
+    *replaced_source = 1;
 
   assert(c2s.length == 2 * AES128_KEY_SIZE);
   assert(s2c.length == 2 * AES128_KEY_SIZE);
 
+  for (i = 0; i < num_cookies; i++)
+    inst->cookies[i] = cookies[i];
+  inst->num_cookies = num_cookies;
+  inst->cookie_index = 0;
+  inst->c2s = c2s;
+  inst->s2c = s2c;
+  inst->restored_requests = -1;
+
   DEBUG_LOG("c2s key: %x s2c key: %x", *(unsigned int *)c2s.key, *(unsigned int *)s2c.key);
   siv_cmac_aes128_set_key(&inst->siv_c2s, (uint8_t *)c2s.key);
   siv_cmac_aes128_set_key(&inst->siv_s2c, (uint8_t *)s2c.key);
 
-  NKE_DestroyInstance(inst->nke);
-  inst->nke = NULL;
+  return 1;
 }
 
 int
 NTS_PrepareForAuth(NTS_ClientInstance inst)
 {
-  if (!needs_nke(inst))
+  int replaced_source = 0;
+
+  /* Drop the loaded cookies if the server didn't accept them (e.g. its keys
+     were replaced) */
+  if (inst->restored_requests >= MAX_RESTORED_REQUESTS) {
+    DEBUG_LOG("Dropping loaded cookies");
+    inst->num_cookies = 0;
+    inst->restored_requests = -1;
+  }
+
+  /* Switch to the NTP server which provided the loaded cookies and don't
+     send the request to the old address */
+  if (inst->restored_ntp_address.ip_addr.family != IPADDR_UNSPEC) {
+    replaced_source = replace_ntp_address(inst, &inst->restored_ntp_address);
+    inst->restored_ntp_address.ip_addr.family = IPADDR_UNSPEC;
+    if (replaced_source)
+      return 0;
+  }
+
+  if (!wants_nke(inst) && !inst->nke_started)
     return 1;
 
-  get_nke_data(inst);
+  if (get_nke_data(inst, &replaced_source)) {
+    UTI_GetRandomBytes(&inst->uniq_id, sizeof (inst->uniq_id)); 
+    UTI_GetRandomBytes(&inst->nonce, sizeof (inst->nonce)); 
+  }
 
-  if (needs_nke(inst))
+  /* Don't send the request if the source was reset to the new address */
+  if (replaced_source)
     return 0;
 
-  UTI_GetRandomBytes(&inst->uniq_id, sizeof (inst->uniq_id)); 
-  UTI_GetRandomBytes(&inst->nonce, sizeof (inst->nonce)); 
-
-  return 1;
+  return !needs_nke(inst);
 }
 
 int
@@ -406,6 +751,9 @@ NTS_GenerateRequestAuth(NTS_ClientInstance inst, NTP_Packet *packet,
     return 0;
 
   inst->num_cookies--;
+
+  if (inst->restored_requests >= 0)
+    inst->restored_requests++;
   inst->cookie_index = (inst->cookie_index + 1) % MAX_COOKIES;
 
   return 1;
@@ -449,7 +797,7 @@ int
 NTS_CheckResponseAuth(NTS_ClientInstance inst, NTP_Packet *packet,
                       NTP_PacketInfo *info)
 {
-  int ef_type, ef_body_length, ef_parsed, parsed, has_uniq_id = 0, has_auth = 0;
+  int i, ef_type, ef_body_length, has_uniq_id = 0, has_auth = 0;
   void *ef_body;
   struct AuthAndEEF auth_and_eef;
   NTP_Packet plaintext;
@@ -457,19 +805,11 @@ NTS_CheckResponseAuth(NTS_ClientInstance inst, NTP_Packet *packet,
   if (info->ext_fields == 0 || info->mode != MODE_SERVER)
     return 0;
 
-  parsed = NTP_HEADER_LENGTH;
-
-  while (1) {
-    ef_parsed = NEF_ParseField(packet, info->length, parsed,
-                               &ef_type, &ef_body, &ef_body_length);
-    if (ef_parsed < parsed)
-      break;
-    parsed = ef_parsed;
-
+  for (i = 0; NEF_GetIndexedField(packet, info, i, &ef_type, &ef_body, &ef_body_length); i++) {
     switch (ef_type) {
       case NTP_EF_NTS_UNIQUE_IDENTIFIER:
         if (ef_body_length != sizeof (inst->uniq_id) ||
-            memcmp(inst->uniq_id, inst->uniq_id, sizeof (inst->uniq_id))) {
+            memcmp(ef_body, inst->uniq_id, sizeof (inst->uniq_id))) {
           DEBUG_LOG("Invalid uniq id");
           return 0;
         }
@@ -479,7 +819,8 @@ NTS_CheckResponseAuth(NTS_ClientInstance inst, NTP_Packet *packet,
         DEBUG_LOG("Unencrypted cookie");
         break;
       case NTP_EF_NTS_AUTH_AND_EEF:
-        if (ef_parsed != info->length) {
+        if ((unsigned char *)ef_body + ef_body_length !=
+            (unsigned char *)packet + info->length) {
           DEBUG_LOG("Auth not last EF");
           return 0;
         }
@@ -521,5 +862,8 @@ NTS_CheckResponseAuth(NTS_ClientInstance inst, NTP_Packet *packet,
     return 0;
   }
 
+  /* The server accepted the loaded cookies */
+  inst->restored_requests = -1;
+
   return 1;
 }
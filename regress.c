@@ -191,6 +191,124 @@ n_runs_from_residuals(double *resid, int n)
   return nruns;
 }
 
+/* ================================================== */
+/* Calculate the weighted fit of the points from start to n directly */
+
+static void
+fit_points(double *x, double *y, double *w, int start, int n,
+           double *a, double *b, double *u, double *V, double *W)
+{
+  double P, Q, U, ui;
+  int i;
+
+  *W = U = 0;
+  for (i=start; i<n; i++) {
+    U += x[i]        / w[i];
+    *W += 1.0        / w[i];
+  }
+
+  *u = U / *W;
+
+  P = Q = *V = 0.0;
+  for (i=start; i<n; i++) {
+    ui = x[i] - *u;
+    P += y[i]        / w[i];
+    Q += y[i] * ui   / w[i];
+    *V += ui  * ui   / w[i];
+  }
+
+  *b = Q / *V;
+  *a = (P / *W) - (*b * *u);
+}
+
+/* ================================================== */
+/* Sums of the weighted points from each index to the end of the arrays,
+   which allow the fit to be updated in constant time when dropping points
+   from the start.  The points are taken relative to the last point to
+   avoid losing precision in the subtractions.  The maximum distances from
+   the last point are needed to estimate the rounding errors. */
+
+typedef struct {
+  double x0, y0;
+  double w[MAX_POINTS + 1];
+  double x[MAX_POINTS + 1];
+  double y[MAX_POINTS + 1];
+  double xx[MAX_POINTS + 1];
+  double xy[MAX_POINTS + 1];
+  double max_dx[MAX_POINTS + 1];
+  double max_dy[MAX_POINTS + 1];
+} SuffixSums;
+
+/* Relative error of the residuals which is certainly larger than the
+   difference between the fits calculated from the suffix sums and
+   directly */
+#define RESID_TOLERANCE 1.0e-6
+
+static void
+prepare_suffix_sums(double *x, double *y, double *w, int n, SuffixSums *s)
+{
+  double dx, dy, iw;
+  int i;
+
+  s->x0 = x[n - 1];
+  s->y0 = y[n - 1];
+  s->w[n] = s->x[n] = s->y[n] = s->xx[n] = s->xy[n] = 0.0;
+  s->max_dx[n] = s->max_dy[n] = 0.0;
+
+  for (i = n - 1; i >= 0; i--) {
+    iw = 1.0 / w[i];
+    dx = x[i] - s->x0;
+    dy = y[i] - s->y0;
+    s->w[i] = s->w[i + 1] + iw;
+    s->x[i] = s->x[i + 1] + dx * iw;
+    s->y[i] = s->y[i + 1] + dy * iw;
+    s->xx[i] = s->xx[i + 1] + dx * dx * iw;
+    s->xy[i] = s->xy[i + 1] + dx * dy * iw;
+    s->max_dx[i] = MAX(s->max_dx[i + 1], fabs(dx));
+    s->max_dy[i] = MAX(s->max_dy[i + 1], fabs(dy));
+  }
+}
+
+/* ================================================== */
+/* Calculate the fit of the points from start to n using the suffix sums
+   and the residuals of the points from resid_start.  Return 0 if a residual
+   is too close to zero to be sure it has the same sign as with the fit
+   calculated directly, i.e. the number of runs could be different. */
+
+static int
+fit_suffix_sums(SuffixSums *s, double *x, double *y, int start, int resid_start,
+                int n, double *resid, double *a, double *b)
+{
+  double mx, my, V, Q, tolerance, min_resid, min_resid_x;
+  int i;
+
+  mx = s->x[start] / s->w[start];
+  my = s->y[start] / s->w[start];
+  V = s->xx[start] - s->x[start] * mx;
+  Q = s->xy[start] - s->x[start] * my;
+
+  if (!(V > 0.0))
+    return 0;
+
+  *b = Q / V;
+  *a = (s->y0 + my) - *b * (s->x0 + mx);
+
+  /* The errors of both fits increase with the cancellation in V */
+  tolerance = RESID_TOLERANCE * s->xx[start] / V;
+  min_resid = tolerance * (fabs(*a) + s->max_dy[start] +
+                           fabs(*b) * (fabs(s->x0) + s->max_dx[start]));
+  min_resid_x = tolerance * fabs(*b);
+
+  for (i = resid_start; i < n; i++) {
+    resid[i - resid_start] = y[i] - *a - *b * x[i];
+    if (!(fabs(resid[i - resid_start]) >
+          min_resid + min_resid_x * fabs(x[i]) + tolerance * fabs(y[i])))
+      return 0;
+  }
+
+  return 1;
+}
+
 /* ================================================== */
 /* Return a boolean indicating whether we had enough points for
    regression */
@@ -231,10 +349,11 @@ RGR_FindBestRegression
 
 )
 {
-  double P, Q, U, V, W; /* total */
+  double V, W; /* total */
   double resid[MAX_POINTS * REGRESS_RUNS_RATIO];
   double ss;
-  double a, b, u, ui, aa;
+  double a, b, u, aa;
+  SuffixSums sums;
 
   int start, resid_start, nruns, npoints;
   int i;
@@ -249,32 +368,27 @@ RGR_FindBestRegression
   start = 0;
   do {
 
-    W = U = 0;
-    for (i=start; i<n; i++) {
-      U += x[i]        / w[i];
-      W += 1.0         / w[i];
-    }
-
-    u = U / W;
-
-    P = Q = V = 0.0;
-    for (i=start; i<n; i++) {
-      ui = x[i] - u;
-      P += y[i]        / w[i];
-      Q += y[i] * ui   / w[i];
-      V += ui   * ui   / w[i];
-    }
-
-    b = Q / V;
-    a = (P / W) - (b * u);
-
     /* Get residuals also for the extra samples before start */
     resid_start = n - (n - start) * REGRESS_RUNS_RATIO;
     if (resid_start < -m)
       resid_start = -m;
 
-    for (i=resid_start; i<n; i++) {
-      resid[i - resid_start] = y[i] - a - b*x[i];
+    /* The first fit is calculated directly.  If some points need to be
+       dropped, use the suffix sums to get the fits in constant time, unless
+       a residual is too close to zero to get the same number of runs.  The
+       residuals still need to be calculated for each start as their signs
+       depend on the fit.  The final fit is recalculated directly when the
+       runs test passes. */
+    if (start == 1)
+      prepare_suffix_sums(x, y, w, n, &sums);
+
+    if (start == 0 ||
+        !fit_suffix_sums(&sums, x, y, start, resid_start, n, resid, &a, &b)) {
+      fit_points(x, y, w, start, n, &a, &b, &u, &V, &W);
+
+      for (i=resid_start; i<n; i++) {
+        resid[i - resid_start] = y[i] - a - b*x[i];
+      }
     }
 
     /* Count number of runs */
@@ -283,10 +397,6 @@ RGR_FindBestRegression
     if (nruns > critical_runs[n - resid_start] ||
         n - start <= MIN_SAMPLES_FOR_REGRESS ||
         n - start <= min_samples) {
-      if (start != resid_start) {
-        /* Ignore extra samples in returned nruns */
-        nruns = n_runs_from_residuals(resid + (start - resid_start), n - start);
-      }
       break;
     } else {
       /* Try dropping one sample at a time until the runs test passes. */
@@ -295,6 +405,18 @@ RGR_FindBestRegression
 
   } while (1);
 
+  if (start > 0) {
+    fit_points(x, y, w, start, n, &a, &b, &u, &V, &W);
+
+    for (i = start; i < n; i++)
+      resid[i - resid_start] = y[i] - a - b * x[i];
+  }
+
+  if (start != resid_start) {
+    /* Ignore extra samples in returned nruns */
+    nruns = n_runs_from_residuals(resid + (start - resid_start), n - start);
+  }
+
   /* Work out statistics from full dataset */
   *b1 = b;
   *b0 = a;
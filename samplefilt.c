@@ -47,6 +47,7 @@ struct SPF_Instance_Record {
   double avg_var;
   double max_var;
   double combine_ratio;
+  LCL_Correction correction;
   NTP_Sample *samples;
   int *selected;
   double *x_data;
@@ -78,6 +79,7 @@ SPF_CreateInstance(int min_samples, int max_samples, double max_dispersion, doub
   filter->avg_var = SQUARE(LCL_GetSysPrecisionAsQuantum());
   filter->max_var = SQUARE(max_dispersion);
   filter->combine_ratio = combine_ratio;
+  LCL_GetCorrection(&filter->correction);
   filter->samples = MallocArray(NTP_Sample, filter->max_samples);
   filter->selected = MallocArray(int, filter->max_samples);
   filter->x_data = MallocArray(double, filter->max_samples);
@@ -102,6 +104,42 @@ SPF_DestroyInstance(SPF_Instance filter)
 
 /* ================================================== */
 
+/* Apply changes of the local clock made since the samples were last
+   corrected */
+
+static void
+correct_samples(SPF_Instance filter)
+{
+  struct timespec when;
+  double dfreq, doffset, delta_time;
+  int i, first, last;
+
+  if (!LCL_GetPendingCorrection(&filter->correction, &when, &dfreq, &doffset))
+    return;
+
+  LCL_GetCorrection(&filter->correction);
+
+  if (filter->last < 0)
+    return;
+
+  /* Always correct the last sample as it may be returned even if no new
+     samples were accumulated */
+  if (filter->used > 0) {
+    first = 0;
+    last = filter->used - 1;
+  } else {
+    first = last = filter->last;
+  }
+
+  for (i = first; i <= last; i++) {
+    UTI_AdjustTimespec(&filter->samples[i].time, &when, &filter->samples[i].time,
+                       &delta_time, dfreq, doffset);
+    filter->samples[i].offset -= delta_time;
+  }
+}
+
+/* ================================================== */
+
 /* Check that samples times are strictly increasing */
 
 static int
@@ -123,6 +161,8 @@ check_sample(SPF_Instance filter, NTP_Sample *sample)
 int
 SPF_AccumulateSample(SPF_Instance filter, NTP_Sample *sample)
 {
+  correct_samples(filter);
+
   if (!check_sample(filter, sample))
       return 0;
 
@@ -148,6 +188,8 @@ SPF_GetLastSample(SPF_Instance filter, NTP_Sample *sample)
   if (filter->last < 0)
     return 0;
 
+  correct_samples(filter);
+
   *sample = filter->samples[filter->last];
   return 1;
 }
@@ -173,6 +215,9 @@ SPF_GetAvgSampleDispersion(SPF_Instance filter)
 void
 SPF_DropSamples(SPF_Instance filter)
 {
+  /* Keep the last sample corrected */
+  correct_samples(filter);
+
   filter->index = -1;
   filter->used = 0;
 }
@@ -399,6 +444,8 @@ SPF_GetFilteredSample(SPF_Instance filter, NTP_Sample *sample)
 {
   int n;
 
+  correct_samples(filter);
+
   n = select_samples(filter);
 
   if (n < 1)
@@ -417,26 +464,10 @@ SPF_GetFilteredSample(SPF_Instance filter, NTP_Sample *sample)
 void
 SPF_SlewSamples(SPF_Instance filter, struct timespec *when, double dfreq, double doffset)
 {
-  int i, first, last;
-  double delta_time;
-
-  if (filter->last < 0)
-    return;
-
-  /* Always slew the last sample as it may be returned even if no new
-     samples were accumulated */
-  if (filter->used > 0) {
-    first = 0;
-    last = filter->used - 1;
-  } else {
-    first = last = filter->last;
-  }
-
-  for (i = first; i <= last; i++) {
-    UTI_AdjustTimespec(&filter->samples[i].time, when, &filter->samples[i].time,
-                       &delta_time, dfreq, doffset);
-    filter->samples[i].offset -= delta_time;
-  }
+  /* The samples are corrected when they are used, unless the accumulated
+     correction was restarted by a step */
+  if (filter->correction.epoch != LCL_GetCorrectionEpoch())
+    correct_samples(filter);
 }
 
 /* ================================================== */
@@ -47,6 +47,18 @@ static int initialised = 0;
 /* One more than the highest file descriptor that is registered */
 static unsigned int one_highest_fd;
 
+#ifdef HAVE_EPOLL
+/* Descriptor of the epoll instance which has all file descriptors with
+   enabled events registered (select() is not used in this case) */
+static int epoll_fd;
+
+/* Maximum number of events returned by one epoll_wait() call */
+#define MAX_EPOLL_EVENTS 64
+
+/* Maximum timeout of epoll_wait() in seconds */
+#define MAX_EPOLL_TIMEOUT 1000000
+#endif
+
 #ifndef FD_SETSIZE
 /* If FD_SETSIZE is not defined, assume that fd_set is implemented
    as a fixed size array of bits, possibly embedded inside a record */
@@ -57,6 +69,9 @@ typedef struct {
   SCH_FileHandler       handler;
   SCH_ArbitraryArgument arg;
   int                   events;
+#ifdef HAVE_EPOLL
+  int                   epoll_registered;
+#endif
 } FileHandlerEntry;
 
 static ARR_Instance file_handlers;
@@ -67,12 +82,9 @@ static double last_select_ts_err;
 
 /* ================================================== */
 
-/* Variables to handler the timer queue */
+/* Variables to handle the timer queue */
 
-typedef struct _TimerQueueEntry
-{
-  struct _TimerQueueEntry *next; /* Forward and back links in the list */
-  struct _TimerQueueEntry *prev;
+typedef struct {
   struct timespec ts;           /* Local system time at which the
                                    timeout is to expire.  Clearly this
                                    must be in terms of what the
@@ -88,17 +100,40 @@ typedef struct _TimerQueueEntry
   SCH_TimeoutClass class;       /* The class that the epoch is in */
   SCH_TimeoutHandler handler;   /* The handler routine to use */
   SCH_ArbitraryArgument arg;    /* The argument to pass to the handler */
-
+  uint64_t order;               /* Sequence number keeping timeouts with
+                                   equal expiry time in FIFO order */
+  unsigned int heap_index;      /* Position of the entry in the heap, or
+                                   INVALID_HEAP_INDEX if the entry is free */
+  unsigned int next;            /* Links in the list of entries in the same
+                                   class (ordered by the expiry time), or in */
+  unsigned int prev;            /* the list of free entries */
 } TimerQueueEntry;
 
-/* The timer queue.  We only use the next and prev entries of this
-   record, these chain to the real entries. */
-static TimerQueueEntry timer_queue;
-static unsigned long n_timer_queue_entries;
-static SCH_TimeoutID next_tqe_id;
+#define INVALID_HEAP_INDEX ((unsigned int)-1)
+
+/* The timeout IDs have the index of the entry in the lower bits and
+   a generation counter of the entry in the upper bits, which allows the
+   entry to be found directly and catches use of stale IDs */
+#define TQE_INDEX_BITS 20
+#define TQE_INDEX_MASK ((1U << TQE_INDEX_BITS) - 1)
+
+/* Array of all (used and free) entries.  The entry with index 0 is not
+   used, the index terminates the lists. */
+static ARR_Instance tqes;
+
+/* Index of the first free entry */
+static unsigned int tqe_free_list;
 
-/* Pointer to head of free list */
-static TimerQueueEntry *tqe_free_list = NULL;
+/* The timer queue, a 4-ary min-heap of indices of used entries ordered by
+   their expiry time */
+#define HEAP_ARITY 4
+static ARR_Instance timer_heap;
+
+static uint64_t next_tqe_order;
+
+/* First and last entry in the list of timeouts in each class */
+static unsigned int first_class_tqe[SCH_NumberOfClasses];
+static unsigned int last_class_tqe[SCH_NumberOfClasses];
 
 /* Timestamp when was last timeout dispatched for each class */
 static struct timespec last_class_dispatch[SCH_NumberOfClasses];
@@ -124,16 +159,26 @@ SCH_Initialise(void)
 {
   file_handlers = ARR_CreateInstance(sizeof (FileHandlerEntry));
 
-  n_timer_queue_entries = 0;
-  next_tqe_id = 0;
+  tqes = ARR_CreateInstance(sizeof (TimerQueueEntry));
+  timer_heap = ARR_CreateInstance(sizeof (unsigned int));
+  tqe_free_list = 0;
+  next_tqe_order = 0;
+  memset(first_class_tqe, 0, sizeof (first_class_tqe));
+  memset(last_class_tqe, 0, sizeof (last_class_tqe));
 
-  timer_queue.next = &timer_queue;
-  timer_queue.prev = &timer_queue;
+  /* Reserve the zero index */
+  ARR_GetNewElement(tqes);
 
   need_to_exit = 0;
 
   LCL_AddParameterChangeHandler(handle_slew, NULL);
 
+#ifdef HAVE_EPOLL
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    LOG_FATAL("Could not create epoll instance : %s", strerror(errno));
+#endif
+
   LCL_ReadRawTime(&last_select_ts_raw);
   last_select_ts = last_select_ts_raw;
 
@@ -146,10 +191,50 @@ SCH_Initialise(void)
 void
 SCH_Finalise(void) {
   ARR_DestroyInstance(file_handlers);
+  ARR_DestroyInstance(tqes);
+  ARR_DestroyInstance(timer_heap);
+
+#ifdef HAVE_EPOLL
+  close(epoll_fd);
+#endif
 
   initialised = 0;
 }
 
+/* ================================================== */
+/* Update the set of events the OS is waiting for on a descriptor */
+
+static void
+update_fd_events(int fd, FileHandlerEntry *ptr)
+{
+#ifdef HAVE_EPOLL
+  struct epoll_event ev;
+  int op;
+
+  /* Descriptors without enabled events need to be removed from the epoll
+     set as errors and hangups would be reported for them anyway */
+  if (!ptr->events) {
+    if (!ptr->epoll_registered)
+      return;
+    op = EPOLL_CTL_DEL;
+  } else {
+    op = ptr->epoll_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  }
+
+  memset(&ev, 0, sizeof (ev));
+  ev.events = (ptr->events & SCH_FILE_INPUT ? EPOLLIN : 0) |
+              (ptr->events & SCH_FILE_OUTPUT ? EPOLLOUT : 0) |
+              (ptr->events & SCH_FILE_EXCEPTION ? EPOLLPRI : 0);
+  ev.data.fd = fd;
+
+  /* Removing can fail if the descriptor was already closed */
+  if (epoll_ctl(epoll_fd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL)
+    LOG_FATAL("epoll_ctl() failed : %s", strerror(errno));
+
+  ptr->epoll_registered = op != EPOLL_CTL_DEL;
+#endif
+}
+
 /* ================================================== */
 
 void
@@ -162,8 +247,10 @@ SCH_AddFileHandler
   assert(events);
   assert(fd >= 0);
   
+#ifndef HAVE_EPOLL
   if (fd >= FD_SETSIZE)
     LOG_FATAL("Too many file descriptors");
+#endif
 
   /* Resize the array if the descriptor is highest so far */
   while (ARR_GetSize(file_handlers) <= fd) {
@@ -171,6 +258,9 @@ SCH_AddFileHandler
     ptr->handler = NULL;
     ptr->arg = NULL;
     ptr->events = 0;
+#ifdef HAVE_EPOLL
+    ptr->epoll_registered = 0;
+#endif
   }
 
   ptr = ARR_GetElement(file_handlers, fd);
@@ -184,6 +274,8 @@ SCH_AddFileHandler
   ptr->arg = arg;
   ptr->events = events;
 
+  update_fd_events(fd, ptr);
+
   if (one_highest_fd < fd + 1)
     one_highest_fd = fd + 1;
 }
@@ -207,6 +299,8 @@ SCH_RemoveFileHandler(int fd)
   ptr->arg = NULL;
   ptr->events = 0;
 
+  update_fd_events(fd, ptr);
+
   /* Find new highest file descriptor */
   while (one_highest_fd > 0) {
     ptr = ARR_GetElement(file_handlers, one_highest_fd - 1);
@@ -223,12 +317,18 @@ SCH_SetFileHandlerEvent(int fd, int event, int enable)
 {
   FileHandlerEntry *ptr;
 
+  int events;
+
   ptr = ARR_GetElement(file_handlers, fd);
+  events = ptr->events;
 
   if (enable)
     ptr->events |= event;
   else
     ptr->events &= ~event;
+
+  if (ptr->events != events)
+    update_fd_events(fd, ptr);
 }
 
 /* ================================================== */
@@ -247,55 +347,151 @@ SCH_GetLastEventTime(struct timespec *cooked, double *err, struct timespec *raw)
 
 /* ================================================== */
 
-#define TQE_ALLOC_QUANTUM 32
-
-static TimerQueueEntry *
+static unsigned int
 allocate_tqe(void)
 {
-  TimerQueueEntry *new_block;
-  TimerQueueEntry *result;
-  int i;
-  if (tqe_free_list == NULL) {
-    new_block = MallocArray(TimerQueueEntry, TQE_ALLOC_QUANTUM);
-    for (i=1; i<TQE_ALLOC_QUANTUM; i++) {
-      new_block[i].next = &(new_block[i-1]);
-    }
-    new_block[0].next = NULL;
-    tqe_free_list = &(new_block[TQE_ALLOC_QUANTUM - 1]);
+  TimerQueueEntry *tqe;
+  unsigned int index;
+
+  if (tqe_free_list == 0) {
+    index = ARR_GetSize(tqes);
+    if (index > TQE_INDEX_MASK)
+      LOG_FATAL("Too many timeouts");
+    tqe = ARR_GetNewElement(tqes);
+    tqe->id = 0;
+  } else {
+    index = tqe_free_list;
+    tqe = ARR_GetElement(tqes, index);
+    tqe_free_list = tqe->next;
   }
 
-  result = tqe_free_list;
-  tqe_free_list = tqe_free_list->next;
-  return result;
+  /* Start a new generation of the ID */
+  tqe->id = (((tqe->id >> TQE_INDEX_BITS) + 1) << TQE_INDEX_BITS) | index;
+  tqe->next = tqe->prev = 0;
+
+  return index;
 }
 
 /* ================================================== */
 
 static void
-release_tqe(TimerQueueEntry *node)
+release_tqe(unsigned int index)
 {
-  node->next = tqe_free_list;
-  tqe_free_list = node;
+  TimerQueueEntry *tqe = ARR_GetElement(tqes, index);
+
+  tqe->heap_index = INVALID_HEAP_INDEX;
+  tqe->next = tqe_free_list;
+  tqe_free_list = index;
 }
 
 /* ================================================== */
 
+static int
+is_tqe_before(TimerQueueEntry *tqe1, TimerQueueEntry *tqe2)
+{
+  int r = UTI_CompareTimespecs(&tqe1->ts, &tqe2->ts);
+
+  return r < 0 || (r == 0 && tqe1->order < tqe2->order);
+}
+
+/* ================================================== */
+
+static void
+sift_up_tqe(unsigned int pos)
+{
+  unsigned int *heap = ARR_GetElements(timer_heap), index = heap[pos], parent;
+  TimerQueueEntry *entries = ARR_GetElements(tqes);
+
+  while (pos > 0) {
+    parent = (pos - 1) / HEAP_ARITY;
+    if (!is_tqe_before(&entries[index], &entries[heap[parent]]))
+      break;
+    heap[pos] = heap[parent];
+    entries[heap[pos]].heap_index = pos;
+    pos = parent;
+  }
+
+  heap[pos] = index;
+  entries[index].heap_index = pos;
+}
+
+/* ================================================== */
+
+static void
+sift_down_tqe(unsigned int pos)
+{
+  unsigned int *heap = ARR_GetElements(timer_heap), index = heap[pos];
+  unsigned int size = ARR_GetSize(timer_heap), first, child, min;
+  TimerQueueEntry *entries = ARR_GetElements(tqes);
+
+  while (1) {
+    first = pos * HEAP_ARITY + 1;
+    if (first >= size)
+      break;
+
+    for (min = child = first; child < size && child < first + HEAP_ARITY; child++) {
+      if (is_tqe_before(&entries[heap[child]], &entries[heap[min]]))
+        min = child;
+    }
+
+    if (!is_tqe_before(&entries[heap[min]], &entries[index]))
+      break;
+
+    heap[pos] = heap[min];
+    entries[heap[pos]].heap_index = pos;
+    pos = min;
+  }
+
+  heap[pos] = index;
+  entries[index].heap_index = pos;
+}
+
+/* ================================================== */
+/* Insert a prepared entry into the heap (and the list of its class) */
+
 static SCH_TimeoutID
-get_new_tqe_id(void)
+enqueue_tqe(unsigned int index)
 {
-  TimerQueueEntry *ptr;
+  TimerQueueEntry *tqe, *entries = ARR_GetElements(tqes);
+  unsigned int prev;
+
+  tqe = &entries[index];
+  tqe->order = next_tqe_order++;
+
+  if (tqe->class != SCH_ReservedTimeoutValue) {
+    /* New timeouts are usually the last ones in the class */
+    for (prev = last_class_tqe[tqe->class]; prev != 0; prev = entries[prev].prev) {
+      if (UTI_CompareTimespecs(&entries[prev].ts, &tqe->ts) <= 0)
+        break;
+    }
+
+    tqe->prev = prev;
+    tqe->next = prev ? entries[prev].next : first_class_tqe[tqe->class];
+    if (tqe->prev)
+      entries[tqe->prev].next = index;
+    else
+      first_class_tqe[tqe->class] = index;
+    if (tqe->next)
+      entries[tqe->next].prev = index;
+    else
+      last_class_tqe[tqe->class] = index;
+  }
+
+  ARR_AppendElement(timer_heap, &index);
+  sift_up_tqe(ARR_GetSize(timer_heap) - 1);
 
-try_again:
-  next_tqe_id++;
-  if (!next_tqe_id)
-    goto try_again;
+  return tqe->id;
+}
+
+/* ================================================== */
 
-  /* Make sure the ID isn't already used */
-  for (ptr = timer_queue.next; ptr != &timer_queue; ptr = ptr->next)
-    if (ptr->id == next_tqe_id)
-      goto try_again;
+static TimerQueueEntry *
+get_first_tqe(void)
+{
+  if (ARR_GetSize(timer_heap) == 0)
+    return NULL;
 
-  return next_tqe_id;
+  return ARR_GetElement(tqes, *(unsigned int *)ARR_GetElement(timer_heap, 0));
 }
 
 /* ================================================== */
@@ -304,38 +500,19 @@ SCH_TimeoutID
 SCH_AddTimeout(struct timespec *ts, SCH_TimeoutHandler handler, SCH_ArbitraryArgument arg)
 {
   TimerQueueEntry *new_tqe;
-  TimerQueueEntry *ptr;
+  unsigned int index;
 
   assert(initialised);
 
-  new_tqe = allocate_tqe();
+  index = allocate_tqe();
+  new_tqe = ARR_GetElement(tqes, index);
 
-  new_tqe->id = get_new_tqe_id();
   new_tqe->handler = handler;
   new_tqe->arg = arg;
   new_tqe->ts = *ts;
   new_tqe->class = SCH_ReservedTimeoutValue;
 
-  /* Now work out where to insert the new entry in the list */
-  for (ptr = timer_queue.next; ptr != &timer_queue; ptr = ptr->next) {
-    if (UTI_CompareTimespecs(&new_tqe->ts, &ptr->ts) == -1) {
-      /* If the new entry comes before the current pointer location in
-         the list, we want to insert the new entry just before ptr. */
-      break;
-    }
-  }
-
-  /* At this stage, we want to insert the new entry immediately before
-     the entry identified by 'ptr' */
-
-  new_tqe->next = ptr;
-  new_tqe->prev = ptr->prev;
-  ptr->prev->next = new_tqe;
-  ptr->prev = new_tqe;
-
-  n_timer_queue_entries++;
-
-  return new_tqe->id;
+  return enqueue_tqe(index);
 }
 
 /* ================================================== */
@@ -367,11 +544,11 @@ SCH_AddTimeoutInClass(double min_delay, double separation, double randomness,
                       SCH_TimeoutClass class,
                       SCH_TimeoutHandler handler, SCH_ArbitraryArgument arg)
 {
-  TimerQueueEntry *new_tqe;
-  TimerQueueEntry *ptr;
+  TimerQueueEntry *new_tqe, *ptr;
   struct timespec now;
   double diff, r;
   double new_min_delay;
+  unsigned int index;
 
   assert(initialised);
   assert(min_delay >= 0.0);
@@ -395,46 +572,31 @@ SCH_AddTimeoutInClass(double min_delay, double separation, double randomness,
     new_min_delay = separation - diff;
   }
 
-  /* Scan through list for entries in the same class and increase min_delay
-     if necessary to keep at least the separation away */
-  for (ptr = timer_queue.next; ptr != &timer_queue; ptr = ptr->next) {
-    if (ptr->class == class) {
-      diff = UTI_DiffTimespecsToDouble(&ptr->ts, &now);
-      if (new_min_delay > diff) {
-        if (new_min_delay - diff < separation) {
-          new_min_delay = diff + separation;
-        }
-      } else {
-        if (diff - new_min_delay < separation) {
-          new_min_delay = diff + separation;
-        }
-      }
-    }
-  }
-
-  for (ptr = timer_queue.next; ptr != &timer_queue; ptr = ptr->next) {
+  /* Scan through the ordered list of entries in the same class and increase
+     min_delay if necessary to keep at least the separation away */
+  for (index = first_class_tqe[class]; index != 0; index = ptr->next) {
+    ptr = ARR_GetElement(tqes, index);
     diff = UTI_DiffTimespecsToDouble(&ptr->ts, &now);
-    if (diff > new_min_delay) {
-      break;
+    if (new_min_delay > diff) {
+      if (new_min_delay - diff < separation) {
+        new_min_delay = diff + separation;
+      }
+    } else {
+      if (diff - new_min_delay < separation) {
+        new_min_delay = diff + separation;
+      }
     }
   }
 
-  /* We have located the insertion point */
-  new_tqe = allocate_tqe();
+  index = allocate_tqe();
+  new_tqe = ARR_GetElement(tqes, index);
 
-  new_tqe->id = get_new_tqe_id();
   new_tqe->handler = handler;
   new_tqe->arg = arg;
   UTI_AddDoubleToTimespec(&now, new_min_delay, &new_tqe->ts);
   new_tqe->class = class;
 
-  new_tqe->next = ptr;
-  new_tqe->prev = ptr->prev;
-  ptr->prev->next = new_tqe;
-  ptr->prev = new_tqe;
-  n_timer_queue_entries++;
-
-  return new_tqe->id;
+  return enqueue_tqe(index);
 }
 
 /* ================================================== */
@@ -442,34 +604,56 @@ SCH_AddTimeoutInClass(double min_delay, double separation, double randomness,
 void
 SCH_RemoveTimeout(SCH_TimeoutID id)
 {
-  TimerQueueEntry *ptr;
+  TimerQueueEntry *ptr, *entries;
+  unsigned int index, pos, last, *heap;
 
   assert(initialised);
 
   if (!id)
     return;
 
-  for (ptr = timer_queue.next; ptr != &timer_queue; ptr = ptr->next) {
-
-    if (ptr->id == id) {
-      /* Found the required entry */
-      
-      /* Unlink from the queue */
-      ptr->next->prev = ptr->prev;
-      ptr->prev->next = ptr->next;
-      
-      /* Decrement entry count */
-      --n_timer_queue_entries;
-      
-      /* Release memory back to the operating system */
-      release_tqe(ptr);
+  index = id & TQE_INDEX_MASK;
 
-      return;
-    }
+  /* Catch calls with invalid non-zero ID */
+  assert(index > 0 && index < ARR_GetSize(tqes));
+  entries = ARR_GetElements(tqes);
+  ptr = &entries[index];
+  assert(ptr->id == id && ptr->heap_index != INVALID_HEAP_INDEX);
+
+  /* Replace the entry in the heap with the last entry */
+  heap = ARR_GetElements(timer_heap);
+  pos = ptr->heap_index;
+  last = ARR_GetSize(timer_heap) - 1;
+
+  if (pos < last) {
+    heap[pos] = heap[last];
+    entries[heap[pos]].heap_index = pos;
   }
 
-  /* Catch calls with invalid non-zero ID */
-  assert(0);
+  ARR_SetSize(timer_heap, last);
+
+  if (pos < last) {
+    heap = ARR_GetElements(timer_heap);
+    if (pos > 0 && is_tqe_before(&entries[heap[pos]],
+                                 &entries[heap[(pos - 1) / HEAP_ARITY]]))
+      sift_up_tqe(pos);
+    else
+      sift_down_tqe(pos);
+  }
+
+  /* Unlink from the list of the class */
+  if (ptr->class != SCH_ReservedTimeoutValue) {
+    if (ptr->prev)
+      entries[ptr->prev].next = ptr->next;
+    else
+      first_class_tqe[ptr->class] = ptr->next;
+    if (ptr->next)
+      entries[ptr->next].prev = ptr->prev;
+    else
+      last_class_tqe[ptr->class] = ptr->prev;
+  }
+
+  release_tqe(index);
 }
 
 /* ================================================== */
@@ -483,17 +667,14 @@ dispatch_timeouts(struct timespec *now) {
   TimerQueueEntry *ptr;
   SCH_TimeoutHandler handler;
   SCH_ArbitraryArgument arg;
-  int n_done = 0, n_entries_on_start = n_timer_queue_entries;
+  unsigned int n_done = 0, n_entries_on_start = ARR_GetSize(timer_heap);
 
   while (1) {
     LCL_ReadRawTime(now);
 
-    if (!(n_timer_queue_entries > 0 &&
-          UTI_CompareTimespecs(now, &timer_queue.next->ts) >= 0)) {
+    ptr = get_first_tqe();
+    if (!ptr || UTI_CompareTimespecs(now, &ptr->ts) < 0)
       break;
-    }
-
-    ptr = timer_queue.next;
 
     last_class_dispatch[ptr->class] = *now;
 
@@ -513,7 +694,7 @@ dispatch_timeouts(struct timespec *now) {
        negative delays and abort.  Make the actual limit higher in case the
        machine is temporarily overloaded and dispatching the handlers takes
        more time than was delay of a scheduled timeout. */
-    if (n_done > n_timer_queue_entries * 4 &&
+    if (n_done > ARR_GetSize(timer_heap) * 4 &&
         n_done > n_entries_on_start * 4) {
       LOG_FATAL("Possible infinite loop in scheduling");
     }
@@ -522,6 +703,8 @@ dispatch_timeouts(struct timespec *now) {
 
 /* ================================================== */
 
+#ifndef HAVE_EPOLL
+
 /* nfd is the number of bits set in all fd_sets */
 
 static void
@@ -563,6 +746,50 @@ dispatch_filehandlers(int nfd, fd_set *read_fds, fd_set *write_fds, fd_set *exce
   }
 }
 
+#endif
+
+/* ================================================== */
+
+#ifdef HAVE_EPOLL
+static void
+dispatch_epoll_events(int n, struct epoll_event *events)
+{
+  FileHandlerEntry *ptr;
+  int i, fd, revents;
+
+  for (i = 0; i < n; i++) {
+    fd = events[i].data.fd;
+    revents = events[i].events;
+
+    /* Errors are reported as exceptions if the handler is waiting for them
+       (e.g. messages in the error queue), and otherwise they make the
+       descriptor readable and writable, as with select() */
+    if (revents & (EPOLLPRI | EPOLLERR)) {
+      /* The handlers may have changed while dispatching previous events */
+      ptr = ARR_GetElement(file_handlers, fd);
+      if (ptr->handler && ptr->events & SCH_FILE_EXCEPTION) {
+        (ptr->handler)(fd, SCH_FILE_EXCEPTION, ptr->arg);
+
+        /* Don't try to read from it now */
+        revents &= ~(EPOLLIN | EPOLLERR | EPOLLHUP);
+      }
+    }
+
+    if (revents & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      ptr = ARR_GetElement(file_handlers, fd);
+      if (ptr->handler && ptr->events & SCH_FILE_INPUT)
+        (ptr->handler)(fd, SCH_FILE_INPUT, ptr->arg);
+    }
+
+    if (revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+      ptr = ARR_GetElement(file_handlers, fd);
+      if (ptr->handler && ptr->events & SCH_FILE_OUTPUT)
+        (ptr->handler)(fd, SCH_FILE_OUTPUT, ptr->arg);
+    }
+  }
+}
+#endif
+
 /* ================================================== */
 
 static void
@@ -573,7 +800,8 @@ handle_slew(struct timespec *raw,
             LCL_ChangeType change_type,
             void *anything)
 {
-  TimerQueueEntry *ptr;
+  TimerQueueEntry *entries;
+  unsigned int *heap;
   double delta;
   int i;
 
@@ -582,10 +810,13 @@ handle_slew(struct timespec *raw,
        added from other handlers */
     assert(LCL_IsFirstParameterChangeHandler(handle_slew));
 
-    /* If a step change occurs, just shift all raw time stamps by the offset */
+    /* If a step change occurs, just shift all raw time stamps by the offset.
+       The order of the timeouts in the heap and class lists is not changed. */
     
-    for (ptr = timer_queue.next; ptr != &timer_queue; ptr = ptr->next) {
-      UTI_AddDoubleToTimespec(&ptr->ts, -doffset, &ptr->ts);
+    entries = ARR_GetElements(tqes);
+    heap = ARR_GetElements(timer_heap);
+    for (i = 0; i < ARR_GetSize(timer_heap); i++) {
+      UTI_AddDoubleToTimespec(&entries[heap[i]].ts, -doffset, &entries[heap[i]].ts);
     }
 
     for (i = 0; i < SCH_NumberOfClasses; i++) {
@@ -600,6 +831,8 @@ handle_slew(struct timespec *raw,
 
 /* ================================================== */
 
+#ifndef HAVE_EPOLL
+
 static void
 fill_fd_sets(fd_set **read_fds, fd_set **write_fds, fd_set **except_fds)
 {
@@ -650,6 +883,8 @@ fill_fd_sets(fd_set **read_fds, fd_set **write_fds, fd_set **except_fds)
     *except_fds = NULL;
 }
 
+#endif
+
 /* ================================================== */
 
 #define JUMP_DETECT_THRESHOLD 10
@@ -709,8 +944,14 @@ check_current_time(struct timespec *prev_raw, struct timespec *raw, int timeout,
 void
 SCH_MainLoop(void)
 {
+#ifdef HAVE_EPOLL
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  struct timespec mono_before, mono_after, mono_elapsed;
+  int epoll_timeout;
+#else
   fd_set read_fds, write_fds, except_fds;
   fd_set *p_read_fds, *p_write_fds, *p_except_fds;
+#endif
   int status, errsv;
   struct timeval tv, saved_tv, *ptv;
   struct timespec ts, now, saved_now, cooked;
@@ -728,8 +969,8 @@ SCH_MainLoop(void)
       break;
 
     /* Check whether there is a timeout and set it up */
-    if (n_timer_queue_entries > 0) {
-      UTI_DiffTimespecs(&ts, &timer_queue.next->ts, &now);
+    if (ARR_GetSize(timer_heap) > 0) {
+      UTI_DiffTimespecs(&ts, &get_first_tqe()->ts, &now);
       assert(ts.tv_sec > 0 || ts.tv_nsec > 0);
 
       UTI_TimespecToTimeval(&ts, &tv);
@@ -740,6 +981,46 @@ SCH_MainLoop(void)
       saved_tv.tv_sec = saved_tv.tv_usec = 0;
     }
 
+#ifdef HAVE_EPOLL
+    /* Round the timeout up to milliseconds to not wake up before the timer
+       expires */
+    if (ptv) {
+      if (tv.tv_sec >= MAX_EPOLL_TIMEOUT) {
+        tv.tv_sec = MAX_EPOLL_TIMEOUT;
+        tv.tv_usec = 0;
+      }
+      epoll_timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+      tv.tv_sec = epoll_timeout / 1000;
+      tv.tv_usec = epoll_timeout % 1000 * 1000;
+      saved_tv = tv;
+    } else {
+      epoll_timeout = -1;
+    }
+
+    /* if there are no file descriptors being waited on and no
+       timeout set, this is clearly ridiculous, so stop the run */
+    if (!ptv && !one_highest_fd)
+      LOG_FATAL("Nothing to do");
+
+    if (clock_gettime(CLOCK_MONOTONIC, &mono_before) < 0)
+      LOG_FATAL("clock_gettime() failed : %s", strerror(errno));
+
+    status = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, epoll_timeout);
+    errsv = errno;
+
+    /* Unlike select() on Linux, epoll_wait() doesn't return the remaining
+       time.  Calculate it from the monotonic clock for the jump detection. */
+    if (ptv) {
+      if (clock_gettime(CLOCK_MONOTONIC, &mono_after) < 0)
+        LOG_FATAL("clock_gettime() failed : %s", strerror(errno));
+      UTI_DiffTimespecs(&mono_elapsed, &mono_after, &mono_before);
+      UTI_TimevalToTimespec(&saved_tv, &ts);
+      UTI_DiffTimespecs(&ts, &ts, &mono_elapsed);
+      if (ts.tv_sec < 0)
+        UTI_ZeroTimespec(&ts);
+      UTI_TimespecToTimeval(&ts, &tv);
+    }
+#else
     p_read_fds = &read_fds;
     p_write_fds = &write_fds;
     p_except_fds = &except_fds;
@@ -752,6 +1033,7 @@ SCH_MainLoop(void)
 
     status = select(one_highest_fd, p_read_fds, p_write_fds, p_except_fds, ptv);
     errsv = errno;
+#endif
 
     LCL_ReadRawTime(&now);
     LCL_CookTime(&now, &cooked, &err);
@@ -768,11 +1050,19 @@ SCH_MainLoop(void)
 
     if (status < 0) {
       if (!need_to_exit && errsv != EINTR) {
+#ifdef HAVE_EPOLL
+        LOG_FATAL("epoll_wait() failed : %s", strerror(errsv));
+#else
         LOG_FATAL("select() failed : %s", strerror(errsv));
+#endif
       }
     } else if (status > 0) {
       /* A file descriptor is ready for input or output */
+#ifdef HAVE_EPOLL
+      dispatch_epoll_events(status, events);
+#else
       dispatch_filehandlers(status, p_read_fds, p_write_fds, p_except_fds);
+#endif
     } else {
       /* No descriptors readable, timeout must have elapsed.
        Therefore, tv must be non-null */
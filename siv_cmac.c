@@ -150,21 +150,12 @@ _cmac128_block_mulx(union nettle_block16 *dst,
 }
 
 static void
-cmac128_set_key(struct cmac128_ctx *ctx, const void *cipher,
-		nettle_cipher_func *encrypt)
+cmac128_init(struct cmac128_ctx *ctx, const union nettle_block16 *K1,
+	     const union nettle_block16 *K2)
 {
-  static const uint8_t const_zero[] = {
-    0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00
-  };
-  union nettle_block16 *L = &ctx->block;
   memset(ctx, 0, sizeof(*ctx));
-
-  /* step 1 - generate subkeys k1 and k2 */
-  encrypt(cipher, 16, L->b, const_zero);
-
-  _cmac128_block_mulx(&ctx->K1, L);
-  _cmac128_block_mulx(&ctx->K2, &ctx->K1);
+  ctx->K1 = *K1;
+  ctx->K2 = *K2;
 }
 
 #define MIN(x,y) ((x)<(y)?(x):(y))
@@ -254,52 +245,6 @@ cmac128_digest(struct cmac128_ctx *ctx, const void *cipher,
 }
 
 
-#define CMAC128_CTX(type) \
-  { struct cmac128_ctx ctx; type cipher; }
-
-/* NOTE: Avoid using NULL, as we don't include anything defining it. */
-#define CMAC128_SET_KEY(self, set_key, encrypt, cmac_key)	\
-  do {								\
-    (set_key)(&(self)->cipher, (cmac_key));			\
-    if (0) (encrypt)(&(self)->cipher, ~(size_t) 0,		\
-		     (uint8_t *) 0, (const uint8_t *) 0);	\
-    cmac128_set_key(&(self)->ctx, &(self)->cipher,		\
-		(nettle_cipher_func *) (encrypt));		\
-  } while (0)
-
-#define CMAC128_UPDATE(self, encrypt, length, src)		\
-  cmac128_update(&(self)->ctx, &(self)->cipher,			\
-	      (nettle_cipher_func *)encrypt, (length), (src))
-
-#define CMAC128_DIGEST(self, encrypt, length, digest)		\
-  (0 ? (encrypt)(&(self)->cipher, ~(size_t) 0,			\
-		 (uint8_t *) 0, (const uint8_t *) 0)		\
-     : cmac128_digest(&(self)->ctx, &(self)->cipher,		\
-		  (nettle_cipher_func *) (encrypt),		\
-		  (length), (digest)))
-
-struct cmac_aes128_ctx CMAC128_CTX(struct aes128_ctx);
-
-static void
-cmac_aes128_set_key(struct cmac_aes128_ctx *ctx, const uint8_t *key)
-{
-  CMAC128_SET_KEY(ctx, aes128_set_encrypt_key, aes128_encrypt, key);
-}
-
-static void
-cmac_aes128_update (struct cmac_aes128_ctx *ctx,
-		   size_t length, const uint8_t *data)
-{
-  CMAC128_UPDATE (ctx, aes128_encrypt, length, data);
-}
-
-static void
-cmac_aes128_digest(struct cmac_aes128_ctx *ctx,
-		  size_t length, uint8_t *digest)
-{
-  CMAC128_DIGEST(ctx, aes128_encrypt, length, digest);
-}
-
 static const uint8_t const_one[] = {
 	0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x01
@@ -310,51 +255,56 @@ static const uint8_t const_zero[] = {
 	0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00
 };
 
+/* The CMAC state is kept between the components of S2V.  The key schedule
+   and subkeys are computed in siv_cmac_aes128_set_key() instead of
+   each message. */
+#define CMAC_UPDATE(ctx, cmac, length, data) \
+  cmac128_update(&(cmac), &(ctx)->s2v_cipher, \
+		 (nettle_cipher_func *)aes128_encrypt, (length), (data))
+#define CMAC_DIGEST(ctx, cmac, digest) \
+  cmac128_digest(&(cmac), &(ctx)->s2v_cipher, \
+		 (nettle_cipher_func *)aes128_encrypt, 16, (digest))
+
 static
-void _siv_s2v(nettle_set_key_func *cmac_set_key,
-	      nettle_hash_update_func *cmac_update,
-	      nettle_hash_digest_func *cmac_digest,
-	      size_t cmac_ctx_size,
-	      const uint8_t *s2vk, size_t alength, const uint8_t *adata,
+void _siv_s2v(const struct siv_cmac_aes128_ctx *ctx,
+	      size_t alength, const uint8_t *adata,
               size_t nlength, const uint8_t *nonce,
               size_t plength, const uint8_t *pdata,
               uint8_t *v)
 {
-  uint8_t ctx[sizeof(struct cmac128_ctx)+sizeof(struct aes_ctx)];
+  struct cmac128_ctx cmac;
   union nettle_block16 D, S, T;
 
-  assert(cmac_ctx_size <= sizeof (ctx));
-
-  cmac_set_key(ctx, s2vk);
+  cmac128_init(&cmac, &ctx->s2v_k1, &ctx->s2v_k2);
 
   if (nlength == 0 && alength == 0) {
-    cmac_update(ctx, 16, const_one);
-    cmac_digest(ctx, 16, v);
+    CMAC_UPDATE(ctx, cmac, 16, const_one);
+    CMAC_DIGEST(ctx, cmac, v);
     return;
   }
 
-  cmac_update(ctx, 16, const_zero);
-  cmac_digest(ctx, 16, D.b);
+  /* D = CMAC(zero) depends only on the key */
+  D = ctx->s2v_d;
 
   if (alength > 0) {
     _cmac128_block_mulx(&D, &D);
-    cmac_update(ctx, alength, adata);
-    cmac_digest(ctx, 16, S.b);
+    CMAC_UPDATE(ctx, cmac, alength, adata);
+    CMAC_DIGEST(ctx, cmac, S.b);
 
     memxor(D.b, S.b, 16);
   }
 
   if (nlength > 0) {
     _cmac128_block_mulx(&D, &D);
-    cmac_update(ctx, nlength, nonce);
-    cmac_digest(ctx, 16, S.b);
+    CMAC_UPDATE(ctx, cmac, nlength, nonce);
+    CMAC_DIGEST(ctx, cmac, S.b);
 
     memxor(D.b, S.b, 16);
   }
 
   /* Sn */
   if (plength > 16) {
-    cmac_update(ctx, plength-16, pdata);
+    CMAC_UPDATE(ctx, cmac, plength-16, pdata);
 
     pdata += plength-16;
 
@@ -371,15 +321,28 @@ void _siv_s2v(nettle_set_key_func *cmac_set_key,
     memxor(T.b, pad.b, 16);
   }
 
-  cmac_update(ctx, 16, T.b);
-  cmac_digest(ctx, 16, v);
+  CMAC_UPDATE(ctx, cmac, 16, T.b);
+  CMAC_DIGEST(ctx, cmac, v);
 }
 
 void
 siv_cmac_aes128_set_key(struct siv_cmac_aes128_ctx *ctx, const uint8_t *key)
 {
-  memcpy(ctx->s2vk, key, 16);
+  struct cmac128_ctx cmac;
+  union nettle_block16 L;
+
+  aes128_set_encrypt_key(&ctx->s2v_cipher, key);
   aes128_set_encrypt_key(&ctx->cipher, key+16);
+
+  /* Generate the CMAC subkeys K1 and K2 */
+  aes128_encrypt(&ctx->s2v_cipher, 16, L.b, const_zero);
+  _cmac128_block_mulx(&ctx->s2v_k1, &L);
+  _cmac128_block_mulx(&ctx->s2v_k2, &ctx->s2v_k1);
+
+  /* Precompute the first S2V component */
+  cmac128_init(&cmac, &ctx->s2v_k1, &ctx->s2v_k2);
+  CMAC_UPDATE(ctx, cmac, 16, const_zero);
+  CMAC_DIGEST(ctx, cmac, ctx->s2v_d.b);
 }
 
 void
@@ -395,11 +358,7 @@ siv_cmac_aes128_encrypt_message(struct siv_cmac_aes128_ctx *ctx,
   slength = clength - SIV_DIGEST_SIZE;
 
   /* create CTR nonce */
-  _siv_s2v((nettle_set_key_func*)cmac_aes128_set_key,
-	   (nettle_hash_update_func*)cmac_aes128_update,
-	   (nettle_hash_digest_func*)cmac_aes128_digest,
-	   sizeof(struct cmac_aes128_ctx), ctx->s2vk, alength, adata,
-	   nlength, nonce, slength, src, siv.b);
+  _siv_s2v(ctx, alength, adata, nlength, nonce, slength, src, siv.b);
   memcpy(dst, siv.b, SIV_DIGEST_SIZE);
   siv.b[8] &= ~0x80;
   siv.b[12] &= ~0x80;
@@ -425,11 +384,7 @@ siv_cmac_aes128_decrypt_message(struct siv_cmac_aes128_ctx *ctx,
             ctr.b, mlength, dst, src+SIV_DIGEST_SIZE);
 
   /* create CTR nonce */
-  _siv_s2v((nettle_set_key_func*)cmac_aes128_set_key,
-	   (nettle_hash_update_func*)cmac_aes128_update,
-	   (nettle_hash_digest_func*)cmac_aes128_digest,
-	   sizeof(struct cmac_aes128_ctx), ctx->s2vk, alength, adata,
-	   nlength, nonce, mlength, dst, siv.b);
+  _siv_s2v(ctx, alength, adata, nlength, nonce, mlength, dst, siv.b);
 
   return memeql_sec(siv.b, src, SIV_DIGEST_SIZE);
 }
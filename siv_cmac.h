@@ -50,7 +50,12 @@
 /* AES_SIV_CMAC_256 */
 struct siv_cmac_aes128_ctx {
     struct aes128_ctx         cipher;
-    uint8_t s2vk[AES128_KEY_SIZE];
+    /* Expanded S2V key, CMAC subkeys and CMAC of the zero block,
+       which are computed only once for the key */
+    struct aes128_ctx         s2v_cipher;
+    union nettle_block16      s2v_k1;
+    union nettle_block16      s2v_k2;
+    union nettle_block16      s2v_d;
 };
 
 void
@@ -125,6 +125,9 @@ struct SRC_Instance_Record {
   /* Score against currently selected source */
   double sel_score;
 
+  /* Flag indicating that the source has its endpoints in the sort list */
+  int sorted;
+
   struct SelectInfo sel_info;
 };
 
@@ -143,6 +146,8 @@ struct Sort_Element {
 /* Table of sources */
 static struct SRC_Instance_Record **sources;
 static struct Sort_Element *sort_list;
+static int n_sorted_endpoints; /* Number of endpoints in the sort list
+                                  kept from the last selection */
 static int *sel_sources;
 static int n_sources; /* Number of sources currently in the table */
 static int max_n_sources; /* Capacity of the table */
@@ -180,6 +185,7 @@ source_to_string(SRC_Instance inst);
 void SRC_Initialise(void) {
   sources = NULL;
   sort_list = NULL;
+  n_sorted_endpoints = 0;
   sel_sources = NULL;
   n_sources = 0;
   max_n_sources = 0;
@@ -245,6 +251,7 @@ SRC_Instance SRC_CreateNewInstance(uint32_t ref_id, SRC_Type type, int sel_optio
   }
 
   sources[n_sources] = result;
+  n_sorted_endpoints = 0;
 
   result->index = n_sources;
   result->type = type;
@@ -277,6 +284,7 @@ void SRC_DestroyInstance(SRC_Instance instance)
     sources[i]->index = i;
   }
   --n_sources;
+  n_sorted_endpoints = 0;
   Free(instance);
 
   /* If this was the previous reference source, we have to reselect! */
@@ -462,6 +470,36 @@ compare_sort_elements(const void *a, const void *b)
   }
 }
 
+/* ================================================== */
+/* Sort the endpoint list.  The list is expected to be mostly sorted from
+   the last selection (the intervals of sources which didn't have a new
+   sample move only slightly), so an insertion sort is used first and
+   qsort() only if too many elements would need to be moved. */
+
+static void
+sort_endpoints(int n_endpoints)
+{
+  struct Sort_Element element;
+  int i, j, moves;
+
+  for (i = 1, moves = 0; i < n_endpoints; i++) {
+    if (compare_sort_elements(&sort_list[i - 1], &sort_list[i]) <= 0)
+      continue;
+
+    element = sort_list[i];
+    for (j = i; j > 0 && compare_sort_elements(&sort_list[j - 1], &element) > 0; j--)
+      sort_list[j] = sort_list[j - 1];
+    sort_list[j] = element;
+
+    moves += i - j;
+    if (moves > 4 * n_endpoints) {
+      qsort((void *) sort_list, n_endpoints, sizeof(struct Sort_Element),
+            compare_sort_elements);
+      return;
+    }
+  }
+}
+
 /* ================================================== */
 
 static char *
@@ -630,6 +668,8 @@ SRC_SelectSource(SRC_Instance updated_inst)
   for (i = 0; i < n_sources; i++) {
     assert(sources[i]->status != SRC_OK);
 
+    sources[i]->sorted = 0;
+
     /* If some sources are specified with the require option, at least one
        of them will have to be selectable in order to update the clock */
     if (sources[i]->sel_options & SRC_SELECT_REQUIRE)
@@ -750,8 +790,25 @@ SRC_SelectSource(SRC_Instance updated_inst)
     }
   }
 
+  /* Update the endpoints kept from the last selection in their order and
+     drop endpoints of sources which are no longer selectable */
+  for (i = j = 0; i < n_sorted_endpoints; i++) {
+    index = sort_list[i].index;
+    if (sources[index]->status != SRC_OK)
+      continue;
+
+    si = &sources[index]->sel_info;
+    sort_list[j] = sort_list[i];
+    sort_list[j].offset = sort_list[i].tag == LOW ? si->lo_limit : si->hi_limit;
+    sources[index]->sorted = 1;
+    j++;
+  }
+
+  n_endpoints = j;
+
+  /* Add endpoints of sources which were not in the list */
   for (i = 0; i < n_sources; i++) {
-    if (sources[i]->status != SRC_OK)
+    if (sources[i]->status != SRC_OK || sources[i]->sorted)
       continue;
 
     si = &sources[i]->sel_info;
@@ -770,6 +827,8 @@ SRC_SelectSource(SRC_Instance updated_inst)
     n_endpoints += 2;
   }
 
+  n_sorted_endpoints = n_endpoints;
+
   DEBUG_LOG("badstat=%d sel=%d badstat_reach=%x sel_reach=%x size=%d max_reach_ago=%f",
             n_badstats_sources, n_sel_sources, (unsigned int)max_badstat_reach,
             (unsigned int)max_sel_reach, max_sel_reach_size, max_reach_sample_ago);
@@ -795,7 +854,7 @@ SRC_SelectSource(SRC_Instance updated_inst)
   }
 
   /* Now sort the endpoint list */
-  qsort((void *) sort_list, n_endpoints, sizeof(struct Sort_Element), compare_sort_elements);
+  sort_endpoints(n_endpoints);
 
   /* Now search for the interval which is contained in the most
      individual source intervals.  Any source which overlaps this
@@ -43,6 +43,12 @@
    to store per source */
 #define MAX_SAMPLES 64
 
+/* The buffers are allocated according to the maximum number of samples
+   of the source, i.e. the size of the sample_times, offsets and
+   peer_delays buffers is size * REGRESS_RUNS_RATIO and the size of the
+   other buffers is size */
+#define RUNS_BUF_SIZE(size) ((size) * REGRESS_RUNS_RATIO)
+
 /* This is the assumed worst case bound on an unknown frequency,
    2000ppm, which would be pretty bad */
 #define WORST_CASE_FREQ_BOUND (2000.0/1.0e6)
@@ -85,6 +91,9 @@ struct SST_Stats_Record {
   int min_samples;
   int max_samples;
 
+  /* Number of samples which can be stored in the buffers */
+  int size;
+
   /* User defined minimum delay */
   double fixed_min_delay;
 
@@ -142,38 +151,45 @@ struct SST_Stats_Record {
   /* This is the estimated standard deviation of the data points */
   double std_dev;
 
-  /* This array contains the sample epochs, in terms of the local
+  /* Accumulated correction of the local clock to which the sample_times
+     and offsets arrays correspond.  The arrays are corrected for later
+     changes of the local clock when they are used. */
+  LCL_Correction correction;
+
+  /* The following arrays are allocated in one block of memory.
+
+     This array contains the sample epochs, in terms of the local
      clock. */
-  struct timespec sample_times[MAX_SAMPLES * REGRESS_RUNS_RATIO];
+  struct timespec *sample_times;
 
   /* This is an array of offsets, in seconds, corresponding to the
      sample times.  In this module, we use the convention that
      positive means the local clock is FAST of the source and negative
      means it is SLOW.  This is contrary to the convention in the NTP
      stuff. */
-  double offsets[MAX_SAMPLES * REGRESS_RUNS_RATIO];
+  double *offsets;
 
   /* This is an array of the offsets as originally measured.  Local
      clock fast of real time is indicated by positive values.  This
      array is not slewed to adjust the readings when we apply
      adjustments to the local clock, as is done for the array
      'offset'. */
-  double orig_offsets[MAX_SAMPLES];
+  double *orig_offsets;
 
   /* This is an array of peer delays, in seconds, being the roundtrip
      measurement delay to the peer */
-  double peer_delays[MAX_SAMPLES * REGRESS_RUNS_RATIO];
+  double *peer_delays;
 
   /* This is an array of peer dispersions, being the skew and local
      precision dispersion terms from sampling the peer */
-  double peer_dispersions[MAX_SAMPLES];
+  double *peer_dispersions;
 
   /* This array contains the root delays of each sample, in seconds */
-  double root_delays[MAX_SAMPLES];
+  double *root_delays;
 
   /* This array contains the root dispersions of each sample at the
      time of the measurements */
-  double root_dispersions[MAX_SAMPLES];
+  double *root_dispersions;
 
   /* The stratum from the last accumulated sample */
   int stratum;
@@ -186,6 +202,7 @@ struct SST_Stats_Record {
 
 static void find_min_delay_sample(SST_Stats inst);
 static int get_buf_index(SST_Stats inst, int i);
+static int get_runsbuf_index(SST_Stats inst, int i);
 
 /* ================================================== */
 
@@ -212,10 +229,25 @@ SST_CreateInstance(uint32_t refid, IPAddr *addr, int min_samples, int max_sample
                    double min_delay, double asymmetry)
 {
   SST_Stats inst;
+  int size;
+
   inst = MallocNew(struct SST_Stats_Record);
 
   inst->min_samples = min_samples;
   inst->max_samples = max_samples;
+
+  /* Allocate the buffers for the configured number of samples, keeping
+     the arrays contiguous in memory */
+  size = max_samples > 0 && max_samples < MAX_SAMPLES ? max_samples : MAX_SAMPLES;
+  inst->size = size;
+  inst->sample_times = Malloc(RUNS_BUF_SIZE(size) * sizeof (struct timespec) +
+                              (2 * RUNS_BUF_SIZE(size) + 4 * size) * sizeof (double));
+  inst->offsets = (double *)(inst->sample_times + RUNS_BUF_SIZE(size));
+  inst->peer_delays = inst->offsets + RUNS_BUF_SIZE(size);
+  inst->orig_offsets = inst->peer_delays + RUNS_BUF_SIZE(size);
+  inst->peer_dispersions = inst->orig_offsets + size;
+  inst->root_delays = inst->peer_dispersions + size;
+  inst->root_dispersions = inst->root_delays + size;
   inst->fixed_min_delay = min_delay;
   inst->fixed_asymmetry = asymmetry;
 
@@ -231,6 +263,7 @@ SST_CreateInstance(uint32_t refid, IPAddr *addr, int min_samples, int max_sample
 void
 SST_DeleteInstance(SST_Stats inst)
 {
+  Free(inst->sample_times);
   Free(inst);
 }
 
@@ -256,6 +289,7 @@ SST_ResetInstance(SST_Stats inst)
   inst->asymmetry_run = 0;
   inst->asymmetry = 0.0;
   inst->leap = LEAP_Unsynchronised;
+  LCL_GetCorrection(&inst->correction);
 }
 
 /* ================================================== */
@@ -283,11 +317,55 @@ prune_register(SST_Stats inst, int new_oldest)
   if (inst->runs_samples > inst->n_samples * (REGRESS_RUNS_RATIO - 1))
     inst->runs_samples = inst->n_samples * (REGRESS_RUNS_RATIO - 1);
   
-  assert(inst->n_samples + inst->runs_samples <= MAX_SAMPLES * REGRESS_RUNS_RATIO);
+  assert(inst->n_samples + inst->runs_samples <= RUNS_BUF_SIZE(inst->size));
 
   find_min_delay_sample(inst);
 }
 
+/* ================================================== */
+/* Apply changes of the local clock which were made since the samples
+   were last corrected */
+
+static void
+correct_samples(SST_Stats inst)
+{
+  struct timespec when;
+  double dfreq, doffset, delta_time;
+  int m, i;
+
+  if (!LCL_GetPendingCorrection(&inst->correction, &when, &dfreq, &doffset))
+    return;
+
+  for (m = -inst->runs_samples; m < inst->n_samples; m++) {
+    i = get_runsbuf_index(inst, m);
+    UTI_AdjustTimespec(&inst->sample_times[i], &when, &inst->sample_times[i],
+                       &delta_time, dfreq, doffset);
+    inst->offsets[i] += delta_time;
+  }
+
+  LCL_GetCorrection(&inst->correction);
+}
+
+/* ================================================== */
+/* Get a corrected time and offset of a sample without correcting the
+   whole register */
+
+static void
+get_corrected_sample(SST_Stats inst, int i, struct timespec *time, double *offset)
+{
+  struct timespec when;
+  double dfreq, doffset, delta_time;
+
+  *time = inst->sample_times[i];
+  *offset = inst->offsets[i];
+
+  if (!LCL_GetPendingCorrection(&inst->correction, &when, &dfreq, &doffset))
+    return;
+
+  UTI_AdjustTimespec(time, &when, time, &delta_time, dfreq, doffset);
+  *offset += delta_time;
+}
+
 /* ================================================== */
 
 void
@@ -295,9 +373,10 @@ SST_AccumulateSample(SST_Stats inst, NTP_Sample *sample)
 {
   int n, m;
 
+  correct_samples(inst);
+
   /* Make room for the new sample */
-  if (inst->n_samples > 0 &&
-      (inst->n_samples == MAX_SAMPLES || inst->n_samples == inst->max_samples)) {
+  if (inst->n_samples > 0 && inst->n_samples == inst->size) {
     prune_register(inst, 1);
   }
 
@@ -309,9 +388,8 @@ SST_AccumulateSample(SST_Stats inst, NTP_Sample *sample)
     SST_ResetInstance(inst);
   }
 
-  n = inst->last_sample = (inst->last_sample + 1) %
-    (MAX_SAMPLES * REGRESS_RUNS_RATIO);
-  m = n % MAX_SAMPLES;
+  n = inst->last_sample = (inst->last_sample + 1) % RUNS_BUF_SIZE(inst->size);
+  m = n % inst->size;
 
   /* WE HAVE TO NEGATE OFFSET IN THIS CALL, IT IS HERE THAT THE SENSE OF OFFSET
      IS FLIPPED */
@@ -341,8 +419,8 @@ SST_AccumulateSample(SST_Stats inst, NTP_Sample *sample)
 static int
 get_runsbuf_index(SST_Stats inst, int i)
 {
-  return (unsigned int)(inst->last_sample + 2 * MAX_SAMPLES * REGRESS_RUNS_RATIO -
-      inst->n_samples + i + 1) % (MAX_SAMPLES * REGRESS_RUNS_RATIO);
+  return (unsigned int)(inst->last_sample + 2 * RUNS_BUF_SIZE(inst->size) -
+      inst->n_samples + i + 1) % RUNS_BUF_SIZE(inst->size);
 }
 
 /* ================================================== */
@@ -351,8 +429,8 @@ get_runsbuf_index(SST_Stats inst, int i)
 static int
 get_buf_index(SST_Stats inst, int i)
 {
-  return (unsigned int)(inst->last_sample + MAX_SAMPLES * REGRESS_RUNS_RATIO -
-      inst->n_samples + i + 1) % MAX_SAMPLES;
+  return (unsigned int)(inst->last_sample + RUNS_BUF_SIZE(inst->size) -
+      inst->n_samples + i + 1) % inst->size;
 }
 
 /* ================================================== */
@@ -524,6 +602,8 @@ SST_DoNewRegression(SST_Stats inst)
   double old_skew, old_freq, stress;
   double precision;
 
+  correct_samples(inst);
+
   convert_to_intervals(inst, times_back + inst->runs_samples);
 
   if (inst->n_samples > 0) {
@@ -650,7 +730,8 @@ SST_GetSelectionData(SST_Stats inst, struct timespec *now,
                      double *last_sample_ago,
                      int *select_ok)
 {
-  double offset, sample_elapsed;
+  struct timespec sample_time;
+  double offset, sample_offset, sample_elapsed;
   int i, j;
   
   if (!inst->n_samples) {
@@ -665,8 +746,12 @@ SST_GetSelectionData(SST_Stats inst, struct timespec *now,
   *leap = inst->leap;
   *std_dev = inst->std_dev;
 
-  sample_elapsed = fabs(UTI_DiffTimespecsToDouble(now, &inst->sample_times[i]));
-  offset = inst->offsets[i] + sample_elapsed * inst->estimated_frequency;
+  /* This is called for all sources on each update of the clock, avoid
+     correcting all samples */
+  get_corrected_sample(inst, i, &sample_time, &sample_offset);
+
+  sample_elapsed = fabs(UTI_DiffTimespecsToDouble(now, &sample_time));
+  offset = sample_offset + sample_elapsed * inst->estimated_frequency;
   *root_distance = 0.5 * inst->root_delays[j] +
     inst->root_dispersions[j] + sample_elapsed * inst->skew;
 
@@ -687,10 +772,11 @@ SST_GetSelectionData(SST_Stats inst, struct timespec *now,
   }
 #endif
 
-  i = get_runsbuf_index(inst, 0);
-  *first_sample_ago = UTI_DiffTimespecsToDouble(now, &inst->sample_times[i]);
-  i = get_runsbuf_index(inst, inst->n_samples - 1);
-  *last_sample_ago = UTI_DiffTimespecsToDouble(now, &inst->sample_times[i]);
+  get_corrected_sample(inst, get_runsbuf_index(inst, 0), &sample_time, &sample_offset);
+  *first_sample_ago = UTI_DiffTimespecsToDouble(now, &sample_time);
+  get_corrected_sample(inst, get_runsbuf_index(inst, inst->n_samples - 1),
+                       &sample_time, &sample_offset);
+  *last_sample_ago = UTI_DiffTimespecsToDouble(now, &sample_time);
 
   *select_ok = inst->regression_ok;
 
@@ -707,8 +793,9 @@ SST_GetTrackingData(SST_Stats inst, struct timespec *ref_time,
                     double *frequency, double *frequency_sd, double *skew,
                     double *root_delay, double *root_dispersion)
 {
+  struct timespec sample_time;
+  double elapsed_sample, sample_offset;
   int i, j;
-  double elapsed_sample;
 
   assert(inst->n_samples > 0);
 
@@ -723,7 +810,8 @@ SST_GetTrackingData(SST_Stats inst, struct timespec *ref_time,
   *skew = inst->skew;
   *root_delay = inst->root_delays[j];
 
-  elapsed_sample = UTI_DiffTimespecsToDouble(&inst->offset_time, &inst->sample_times[i]);
+  get_corrected_sample(inst, i, &sample_time, &sample_offset);
+  elapsed_sample = UTI_DiffTimespecsToDouble(&inst->offset_time, &sample_time);
   *root_dispersion = inst->root_dispersions[j] + inst->skew * elapsed_sample + *offset_sd;
 
   DEBUG_LOG("n=%d off=%f offsd=%f freq=%e freqsd=%e skew=%e delay=%f disp=%f",
@@ -736,22 +824,18 @@ SST_GetTrackingData(SST_Stats inst, struct timespec *ref_time,
 void
 SST_SlewSamples(SST_Stats inst, struct timespec *when, double dfreq, double doffset)
 {
-  int m, i;
   double delta_time;
-  struct timespec *sample, prev;
+  struct timespec prev;
   double prev_offset, prev_freq;
 
+  /* The samples are corrected when they are used, unless the accumulated
+     correction was restarted by a step */
+  if (inst->correction.epoch != LCL_GetCorrectionEpoch())
+    correct_samples(inst);
+
   if (!inst->n_samples)
     return;
 
-  for (m = -inst->runs_samples; m < inst->n_samples; m++) {
-    i = get_runsbuf_index(inst, m);
-    sample = &inst->sample_times[i];
-    prev = *sample;
-    UTI_AdjustTimespec(sample, when, sample, &delta_time, dfreq, doffset);
-    inst->offsets[i] += delta_time;
-  }
-
   /* Update the regression estimates */
   prev = inst->offset_time;
   prev_offset = inst->estimated_offset;
@@ -787,14 +871,16 @@ SST_AddDispersion(SST_Stats inst, double dispersion)
 double
 SST_PredictOffset(SST_Stats inst, struct timespec *when)
 {
-  double elapsed;
+  struct timespec sample_time;
+  double elapsed, sample_offset;
   
   if (inst->n_samples < 3) {
     /* We don't have any useful statistics, and presumably the poll
        interval is minimal.  We can't do any useful prediction other
        than use the latest sample or zero if we don't have any samples */
     if (inst->n_samples > 0) {
-      return inst->offsets[inst->last_sample];
+      get_corrected_sample(inst, inst->last_sample, &sample_time, &sample_offset);
+      return sample_offset;
     } else {
       return 0.0;
     }
@@ -848,6 +934,8 @@ SST_SaveToFile(SST_Stats inst, FILE *out)
 {
   int m, i, j;
 
+  correct_samples(inst);
+
   fprintf(out, "%d\n", inst->n_samples);
 
   for(m = 0; m < inst->n_samples; m++) {
@@ -889,15 +977,23 @@ SST_LoadFromFile(SST_Stats inst, FILE *in)
   unsigned long sec;
 #endif
   unsigned long usec;
-  int i;
+  int i, n_samples;
   char line[1024];
   double weight;
 
   SST_ResetInstance(inst);
 
   if (fgets(line, sizeof(line), in) &&
-      sscanf(line, "%d", &inst->n_samples) == 1 &&
-      inst->n_samples >= 0 && inst->n_samples <= MAX_SAMPLES) {
+      sscanf(line, "%d", &n_samples) == 1 &&
+      n_samples >= 0 && n_samples <= MAX_SAMPLES) {
+
+    /* Skip the oldest samples which don't fit in the buffers */
+    for (i = inst->size; i < n_samples; i++) {
+      if (!fgets(line, sizeof(line), in))
+        return 0;
+    }
+
+    inst->n_samples = MIN(n_samples, inst->size);
 
     for (i=0; i<inst->n_samples; i++) {
       if (!fgets(line, sizeof(line), in) ||
@@ -957,6 +1053,8 @@ SST_DoSourceReport(SST_Stats inst, RPT_SourceReport *report, struct timespec *no
   int i, j;
   struct timespec last_sample_time;
 
+  correct_samples(inst);
+
   if (inst->n_samples > 0) {
     i = get_runsbuf_index(inst, inst->n_samples - 1);
     j = get_buf_index(inst, inst->n_samples - 1);
@@ -995,6 +1093,8 @@ SST_DoSourcestatsReport(SST_Stats inst, RPT_SourcestatsReport *report, struct ti
   double elapsed, sample_elapsed;
   int li, lj, bi, bj;
 
+  correct_samples(inst);
+
   report->n_samples = inst->n_samples;
   report->n_runs = inst->nruns;
 
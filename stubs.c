@@ -104,6 +104,11 @@ DNS_Name2IPAddressAsync(const char *name, DNS_NameResolveHandler handler, void *
     ;
 }
 
+void
+DNS_FinaliseAsync(void)
+{
+}
+
 #endif /* !FEAT_ASYNCDNS */
 
 #ifndef FEAT_CMDMON
@@ -180,6 +185,27 @@ NIO_Finalise(void)
 {
 }
 
+void
+NIO_LockServerWorkers(void)
+{
+}
+
+void
+NIO_UnlockServerWorkers(void)
+{
+}
+
+void
+NIO_FlushServerAccess(void)
+{
+}
+
+void
+NIO_GetKernelServerStats(uint32_t *hits, uint32_t *drops)
+{
+  *hits = *drops = 0;
+}
+
 void
 NSR_Initialise(void)
 {
@@ -439,7 +465,7 @@ NTS_GenerateResponseAuth(NTP_Packet *request, NTP_PacketInfo *req_info,
 }
 
 NTS_ClientInstance
-NTS_CreateClientInstance(IPAddr *address, int port, const char *name)
+NTS_CreateClientInstance(NTP_Remote_Address *ntp_address, int port, const char *name)
 {
   return NULL;
 }
@@ -476,4 +502,9 @@ void NKE_Finalise(void)
 {
 }
 
+void
+NKE_ReloadKeys(void)
+{
+}
+
 #endif /* !FEAT_NTS */
@@ -485,6 +485,14 @@ SYS_Linux_EnableSystemCallFilter(int level)
     SCMP_SYS(getrlimit), SCMP_SYS(rt_sigaction), SCMP_SYS(rt_sigreturn),
     SCMP_SYS(rt_sigprocmask), SCMP_SYS(set_tid_address), SCMP_SYS(sigreturn),
     SCMP_SYS(wait4), SCMP_SYS(waitpid),
+#ifdef HAVE_SERVER_WORKERS
+#ifdef __NR_clone3
+    SCMP_SYS(clone3),
+#endif
+#ifdef __NR_rseq
+    SCMP_SYS(rseq),
+#endif
+#endif
     /* Memory */
     SCMP_SYS(brk), SCMP_SYS(madvise), SCMP_SYS(mmap), SCMP_SYS(mmap2),
     SCMP_SYS(mprotect), SCMP_SYS(mremap), SCMP_SYS(munmap), SCMP_SYS(shmdt),
@@ -502,14 +510,25 @@ SYS_Linux_EnableSystemCallFilter(int level)
     /* TODO: check socketcall arguments */
     SCMP_SYS(socketcall),
 #ifdef FEAT_NTS
-    SCMP_SYS(accept), SCMP_SYS(shutdown),
+    SCMP_SYS(accept), SCMP_SYS(accept4),
+#endif
+#if defined(FEAT_NTS) || defined(HAVE_SERVER_WORKERS)
+    SCMP_SYS(shutdown),
 #endif
     /* General I/O */
-    SCMP_SYS(_newselect), SCMP_SYS(close), SCMP_SYS(open), SCMP_SYS(openat), SCMP_SYS(pipe),
-    SCMP_SYS(pipe2), SCMP_SYS(poll), SCMP_SYS(ppoll), SCMP_SYS(pselect6), SCMP_SYS(read),
-    SCMP_SYS(futex), SCMP_SYS(select), SCMP_SYS(set_robust_list), SCMP_SYS(write),
+    SCMP_SYS(_newselect), SCMP_SYS(close), SCMP_SYS(epoll_ctl), SCMP_SYS(epoll_pwait),
+    SCMP_SYS(epoll_wait), SCMP_SYS(open), SCMP_SYS(openat), SCMP_SYS(pipe), SCMP_SYS(pipe2),
+    SCMP_SYS(poll), SCMP_SYS(ppoll), SCMP_SYS(pselect6), SCMP_SYS(read), SCMP_SYS(futex),
+    SCMP_SYS(select), SCMP_SYS(set_robust_list), SCMP_SYS(write),
     /* Miscellaneous */
     SCMP_SYS(getrandom), SCMP_SYS(sysinfo), SCMP_SYS(uname),
+#ifdef HAVE_XDP
+    SCMP_SYS(bpf),
+#endif
+#ifdef HAVE_IO_URING
+    /* The ring is restricted to recvmsg and sendmsg requests */
+    SCMP_SYS(io_uring_enter),
+#endif
   };
 
   const int socket_domains[] = {
@@ -71,4 +71,8 @@
 #include <sys/random.h>
 #endif
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #endif /* GOT_SYSINCL_H */
@@ -23,6 +23,157 @@
 #include <util.h>
 #include "test.h"
 
+static int
+get_address_bit(IPAddr *ip, unsigned int b)
+{
+  if (ip->family == IPADDR_INET4)
+    return ip->addr.in4 >> (31 - b) & 1;
+  return ip->addr.in6[b / 8] >> (7 - b % 8) & 1;
+}
+
+struct Lookup {
+  IPAddr *ip;
+  int bits;
+  int allow;
+};
+
+static void
+lookup_subnet(IPAddr *ip, int subnet_bits, int allow, void *arg)
+{
+  struct Lookup *lookup = arg;
+  int i;
+
+  TEST_CHECK(ip->family == lookup->ip->family);
+
+  for (i = 0; i < subnet_bits; i++) {
+    if (get_address_bit(ip, i) != get_address_bit(lookup->ip, i))
+      return;
+  }
+
+  TEST_CHECK(subnet_bits > lookup->bits);
+
+  lookup->bits = subnet_bits;
+  lookup->allow = allow;
+}
+
+static int
+is_allowed_by_iteration(ADF_AuthTable table, IPAddr *ip)
+{
+  struct Lookup lookup;
+
+  lookup.ip = ip;
+  lookup.bits = -1;
+  lookup.allow = -1;
+  ADF_IterateSubnets(table, ip->family, lookup_subnet, &lookup);
+  TEST_CHECK(lookup.bits >= 0);
+
+  return lookup.allow;
+}
+
+static void
+test_compiled(ADF_AuthTable table)
+{
+  int i, j, sub, maxsub, allowed[1000];
+  ADF_CompiledTable compiled;
+  IPAddr ips[1000];
+
+  for (i = 0; i < 20; i++) {
+    for (j = 0; j < 1000; j++) {
+      maxsub = j % 2 ? 32 : 128;
+      TST_GetRandomAddress(&ips[j], j % 2 ? IPADDR_INET4 : IPADDR_INET6, -1);
+      sub = random() % (maxsub + 1);
+
+      /* Any modification must invalidate the compiled table */
+      if (random() % 2)
+        ADF_Compile(table);
+
+      switch (random() % 4) {
+        case 0:
+          ADF_Allow(table, &ips[j], sub);
+          break;
+        case 1:
+          ADF_AllowAll(table, &ips[j], sub);
+          break;
+        case 2:
+          ADF_Deny(table, &ips[j], sub);
+          break;
+        default:
+          ADF_DenyAll(table, &ips[j], sub);
+          break;
+      }
+    }
+
+    for (j = 0; j < 1000; j++) {
+      if (random() % 2)
+        TST_SwapAddressBit(&ips[j], random() % (ips[j].family == IPADDR_INET4 ? 32 : 128));
+      allowed[j] = ADF_IsAllowed(table, &ips[j]);
+    }
+
+    if (random() % 2) {
+      ADF_Compile(table);
+      ADF_Compile(table);
+    } else {
+      /* Lookups use the trie until the compiled table is published */
+      compiled = ADF_PrepareCompiled(table);
+      for (j = 0; j < 1000; j++)
+        TEST_CHECK(ADF_IsAllowed(table, &ips[j]) == allowed[j]);
+      ADF_PublishCompiled(table, compiled);
+      ADF_PublishCompiled(table, ADF_PrepareCompiled(table));
+    }
+
+    for (j = 0; j < 1000; j++)
+      TEST_CHECK(ADF_IsAllowed(table, &ips[j]) == allowed[j]);
+
+    ips[0].family = IPADDR_INET4;
+    ADF_DenyAll(table, &ips[0], 0);
+    ips[0].family = IPADDR_INET6;
+    ADF_DenyAll(table, &ips[0], 0);
+  }
+}
+
+static void
+test_root_bits(ADF_AuthTable table)
+{
+  int i, allowed[1000];
+  IPAddr ip, ips[1000];
+
+  /* Small tables have a small root */
+  UTI_StringToIP("192.168.1.0", &ip);
+  ADF_Allow(table, &ip, 24);
+  UTI_StringToIP("2001:db8::", &ip);
+  ADF_Allow(table, &ip, 64);
+  ADF_Compile(table);
+  TEST_CHECK(table->compiled4->root_bits == MIN_ROOT_BITS);
+  TEST_CHECK(table->compiled6->root_bits == MIN_ROOT_BITS);
+  TEST_CHECK(ARR_GetSize(table->compiled4->chunk_array) <= 4 * NODE_CHUNKS);
+  TEST_CHECK(ARR_GetSize(table->compiled6->chunk_array) <= 8 * NODE_CHUNKS);
+
+  /* Large lists of prefixes have the maximum root */
+  for (i = 0; i < 20000; i++) {
+    TST_GetRandomAddress(&ip, IPADDR_INET4, 24);
+    ip.addr.in4 <<= 8;
+    ADF_Allow(table, &ip, 24);
+    if (i < 1000)
+      ips[i] = ip;
+  }
+
+  for (i = 0; i < 1000; i++) {
+    TST_SwapAddressBit(&ips[i], random() % 32);
+    allowed[i] = ADF_IsAllowed(table, &ips[i]);
+  }
+
+  ADF_Compile(table);
+  TEST_CHECK(table->compiled4->root_bits == MAX_ROOT_BITS);
+
+  for (i = 0; i < 1000; i++)
+    TEST_CHECK(ADF_IsAllowed(table, &ips[i]) == allowed[i]);
+
+  ip.family = IPADDR_INET4;
+  ADF_DenyAll(table, &ip, 0);
+  ip.family = IPADDR_INET6;
+  ADF_DenyAll(table, &ip, 0);
+}
+
 void
 test_unit(void)
 {
@@ -70,6 +221,10 @@ test_unit(void)
         TEST_CHECK(ADF_IsAllowed(table, &ip));
       }
 
+      TEST_CHECK(ADF_IsAllowed(table, &ip) == is_allowed_by_iteration(table, &ip));
+      TST_SwapAddressBit(&ip, random() % maxsub);
+      TEST_CHECK(ADF_IsAllowed(table, &ip) == is_allowed_by_iteration(table, &ip));
+
       ADF_DenyAll(table, &ip, 0);
     }
 
@@ -79,5 +234,8 @@ test_unit(void)
     ADF_DenyAll(table, &ip, 0);
   }
 
+  test_compiled(table);
+  test_root_bits(table);
+
   ADF_DestroyTable(table);
 }
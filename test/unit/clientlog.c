@@ -39,7 +39,7 @@ test_unit(void)
 
   CLG_Initialise();
 
-  TEST_CHECK(ARR_GetSize(records) == 16);
+  TEST_CHECK(slots * SLOT_SIZE == 16);
 
   for (i = 0; i < 500; i++) {
     DEBUG_LOG("iteration %d", i);
@@ -65,8 +65,10 @@ test_unit(void)
     }
   }
 
-  DEBUG_LOG("records %u", ARR_GetSize(records));
-  TEST_CHECK(ARR_GetSize(records) == 64);
+  DEBUG_LOG("records %u", slots * SLOT_SIZE);
+  TEST_CHECK(slots * SLOT_SIZE == 64);
+  TEST_CHECK(!old_records);
+  TEST_CHECK(((uintptr_t)records & (RECORD_ALIGNMENT - 1)) == 0);
 
   for (i = j = 0; i < 10000; i++) {
     ts.tv_sec += 1;
@@ -79,6 +81,21 @@ test_unit(void)
   DEBUG_LOG("requests %d responses %d", i, j);
   TEST_CHECK(j * 4 < i && j * 6 > i);
 
+  for (i = j = 0; i < 10000; i++) {
+    ts.tv_sec += 1;
+    index = CLG_LogAndLimitNTPAccess(&ip, &ts, random());
+    TEST_CHECK(index >= 0);
+    if (!index)
+      j++;
+  }
+
+  DEBUG_LOG("requests %d responses %d", i, j);
+  TEST_CHECK(j * 4 < i && j * 6 > i);
+
+  TST_GetRandomAddress(&ip, IPADDR_INET4, -1);
+  if (!get_existing_record(&ip))
+    TEST_CHECK(CLG_LogAndLimitNTPAccess(&ip, &ts, random()) < 0);
+
   CLG_Finalise();
   CNF_Finalise();
 }
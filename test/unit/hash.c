@@ -79,6 +79,7 @@ test_unit(void)
 
   unsigned int length;
   int i, j, hash_id;
+  HSH_State state;
 
   for (i = 0; tests[i].name[0] != '\0'; i++) {
     hash_id = HSH_GetHashId(tests[i].name);
@@ -111,6 +112,22 @@ test_unit(void)
       TEST_CHECK(!memcmp(out, tests[i].out, length));
     }
 
+    state = HSH_CreateState(hash_id, data1, sizeof (data1) - 1);
+
+    for (j = 0; j <= sizeof (out); j++) {
+      memset(out, 0, sizeof (out));
+      length = HSH_HashState(state, data2, sizeof (data2) - 1, out, j);
+
+      if (j >= tests[i].length)
+        TEST_CHECK(length == tests[i].length);
+      else
+        TEST_CHECK(length == j);
+
+      TEST_CHECK(!memcmp(out, tests[i].out, length));
+    }
+
+    HSH_DestroyState(state);
+
     for (j = 0; j < 10000; j++) {
       length = HSH_Hash(hash_id, data1, random() % sizeof (data1),
                         random() % 2 ? data2 : NULL, random() % sizeof (data2),
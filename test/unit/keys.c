@@ -86,6 +86,7 @@ test_unit(void)
   int i, j, data_len, auth_len;
   uint32_t keys[KEYS], key;
   unsigned char data[100], auth[MAX_HASH_LENGTH];
+  HSH_State states[KEYS];
   char conf[][100] = {
     "keyfile "KEYFILE
   };
@@ -137,6 +138,15 @@ test_unit(void)
       TEST_CHECK(!KEY_GenerateAuth(key, data, data_len, auth, sizeof (auth)));
       TEST_CHECK(!KEY_CheckAuth(key, data, data_len, auth, auth_len, auth_len));
     }
+
+    /* Unchanged keys should keep their state */
+    for (j = 0; j < KEYS; j++)
+      states[j] = get_key_by_id(keys[j])->hash_state;
+
+    KEY_Reload();
+
+    for (j = 0; j < KEYS; j++)
+      TEST_CHECK(get_key_by_id(keys[j])->hash_state == states[j]);
   }
 
   unlink(KEYFILE);
@@ -0,0 +1,237 @@
+/*
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+ */
+
+#include <config.h>
+#include "test.h"
+
+#ifdef FEAT_ASYNCDNS
+
+#include <sysincl.h>
+#include <nameserv.h>
+#include <privops.h>
+
+static DNS_Status resolve_name(const char *name, IPAddr *ip_addrs, int max_addrs);
+
+#undef PRV_Name2IPAddress
+#define PRV_Name2IPAddress resolve_name
+
+#include <nameserv_async.c>
+#include <conf.h>
+#include <local.h>
+
+#define NAMES MAX_CACHED_NAMES
+#define REQUESTS (2 * NAMES)
+
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static int resolver_calls[NAMES];
+static int active_resolvers;
+static int max_active_resolvers;
+
+static int phase;
+static int pending_requests;
+static int handled_requests[NAMES];
+
+struct Request {
+  int index;
+  int order;
+  int fail;
+};
+
+static struct Request test_requests[REQUESTS];
+
+/* Resolve "nameN" to two addresses, or fail with "failN" */
+static DNS_Status
+resolve_name(const char *name, IPAddr *ip_addrs, int max_addrs)
+{
+  int i, index, fail;
+
+  fail = name[0] == 'f';
+  TEST_CHECK(sscanf(name + 4, "%d", &index) == 1 && index >= 0 && index < NAMES);
+
+  pthread_mutex_lock(&resolver_lock);
+  resolver_calls[index]++;
+  active_resolvers++;
+  max_active_resolvers = MAX(max_active_resolvers, active_resolvers);
+  pthread_mutex_unlock(&resolver_lock);
+
+  usleep(20000);
+
+  pthread_mutex_lock(&resolver_lock);
+  active_resolvers--;
+  pthread_mutex_unlock(&resolver_lock);
+
+  if (fail)
+    return DNS_Failure;
+
+  for (i = 0; i < max_addrs; i++) {
+    ip_addrs[i].family = i < 2 ? IPADDR_INET4 : IPADDR_UNSPEC;
+    ip_addrs[i].addr.in4 = 0x0a000000 | index << 8 | (2 - i);
+  }
+
+  return DNS_Success;
+}
+
+static void
+handle_result(DNS_Status status, int n_addrs, IPAddr *ip_addrs, void *anything)
+{
+  struct Request *req = anything;
+
+  if (req->fail) {
+    TEST_CHECK(status == DNS_Failure);
+  } else {
+    TEST_CHECK(status == DNS_Success);
+    TEST_CHECK(n_addrs == 2);
+    TEST_CHECK(ip_addrs[0].family == IPADDR_INET4 && ip_addrs[1].family == IPADDR_INET4);
+    TEST_CHECK(ip_addrs[0].addr.in4 == (0x0a000002 | req->index << 8));
+    TEST_CHECK(ip_addrs[1].addr.in4 == (0x0a000001 | req->index << 8));
+  }
+
+  /* Requests for the same name are finished in the order they were made */
+  TEST_CHECK(req->order == handled_requests[req->index]);
+  handled_requests[req->index]++;
+
+  TEST_CHECK(pending_requests > 0);
+  pending_requests--;
+}
+
+static void
+make_requests(int first, int last, const char *prefix)
+{
+  struct Request *req;
+  char name[16];
+  int i, j;
+
+  memset(handled_requests, 0, sizeof (handled_requests));
+
+  for (i = 0; i < 2; i++) {
+    for (j = first; j <= last; j++) {
+      req = &test_requests[i * NAMES + j];
+      req->index = j;
+      req->order = i;
+      req->fail = prefix[0] == 'f';
+      snprintf(name, sizeof (name), "%s%d", prefix, j);
+      DNS_Name2IPAddressAsync(name, handle_result, req);
+      pending_requests++;
+    }
+  }
+
+  /* The handler is never called directly */
+  TEST_CHECK(pending_requests == 2 * (last - first + 1));
+}
+
+static void
+check_calls(int first, int last, int calls)
+{
+  int i;
+
+  for (i = first; i <= last; i++)
+    TEST_CHECK(resolver_calls[i] == calls);
+}
+
+static void
+run_phase(void *arg)
+{
+  int i;
+
+  if (pending_requests > 0) {
+    SCH_AddTimeoutByDelay(0.01, run_phase, NULL);
+    return;
+  }
+
+  DEBUG_LOG("phase %d", phase);
+
+  switch (phase++) {
+    case 0:
+      /* Resolve more names than threads, each name only once */
+      make_requests(0, NAMES - 1, "name");
+      break;
+    case 1:
+      check_calls(0, NAMES - 1, 1);
+      TEST_CHECK(max_active_resolvers == MAX_RESOLVING_THREADS);
+      TEST_CHECK(requests == NULL && resolving_threads == 0);
+
+      /* Use the cached results */
+      make_requests(0, NAMES - 1, "name");
+      TEST_CHECK(requests == NULL);
+      break;
+    case 2:
+      check_calls(0, NAMES - 1, 1);
+
+      /* Expire the cached results */
+      for (i = 0; i < MAX_CACHED_NAMES; i++) {
+        TEST_CHECK(cache[i].name);
+        UTI_AddDoubleToTimespec(&cache[i].time, -CACHE_TIME, &cache[i].time);
+      }
+
+      make_requests(0, NAMES - 1, "name");
+      break;
+    case 3:
+    case 4:
+      check_calls(0, NAMES - 1, phase - 2);
+
+      /* Failures are not cached */
+      make_requests(0, NAMES - 1, "fail");
+      break;
+    case 5:
+      check_calls(0, NAMES - 1, 4);
+      SCH_QuitProgram();
+      return;
+  }
+
+  SCH_AddTimeoutByDelay(0.01, run_phase, NULL);
+}
+
+static void
+fail_timeout(void *arg)
+{
+  TEST_CHECK(0);
+}
+
+void
+test_unit(void)
+{
+  int i;
+
+  CNF_Initialise(0, 0);
+  LCL_Initialise();
+  TST_RegisterDummyDrivers();
+  SCH_Initialise();
+
+  SCH_AddTimeoutByDelay(0.0, run_phase, NULL);
+  SCH_AddTimeoutByDelay(10.0, fail_timeout, NULL);
+  SCH_MainLoop();
+
+  TEST_CHECK(phase == 6);
+
+  DNS_FinaliseAsync();
+  for (i = 0; i < MAX_CACHED_NAMES; i++)
+    TEST_CHECK(!cache[i].name);
+
+  SCH_Finalise();
+  LCL_Finalise();
+  CNF_Finalise();
+}
+
+#else
+void
+test_unit(void)
+{
+  TEST_REQUIRE(0);
+}
+#endif
@@ -0,0 +1,87 @@
+/*
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+ */
+#include <ntp_ext.c>
+#include "test.h"
+
+/* Index the fields in the same way as parse_packet() in ntp_core.c */
+static void
+index_fields(NTP_Packet *packet, NTP_PacketInfo *info)
+{
+  int parsed, type, body_length;
+  void *body;
+
+  info->ext_fields = 0;
+
+  for (parsed = NTP_HEADER_LENGTH; ; info->ext_fields++) {
+    parsed = NEF_ParseField(packet, info->length, parsed, &type, &body, &body_length);
+    if (!parsed)
+      break;
+
+    if (info->ext_fields < NTP_MAX_INDEXED_EFS) {
+      info->ext_field_index[info->ext_fields].type = type;
+      info->ext_field_index[info->ext_fields].body_start =
+        (unsigned char *)body - (unsigned char *)packet;
+      info->ext_field_index[info->ext_fields].body_length = body_length;
+    }
+  }
+}
+
+void
+test_unit(void)
+{
+  int i, j, n, parsed, type, type2, body_length, body_length2, lengths[64];
+  unsigned char data[64];
+  void *body, *body2;
+  NTP_PacketInfo info;
+  NTP_Packet packet;
+
+  memset(data, 0, sizeof (data));
+
+  for (i = 0; i < 1000; i++) {
+    memset(&packet, 0, sizeof (packet));
+    packet.lvm = NTP_LVM(0, 4, MODE_CLIENT);
+    memset(&info, 0, sizeof (info));
+    info.length = NTP_HEADER_LENGTH;
+
+    n = random() % (sizeof (lengths) / sizeof (lengths[0]));
+
+    for (j = 0; j < n; j++) {
+      /* Make all fields longer than the maximum MAC */
+      lengths[j] = NTP_MAX_V4_MAC_LENGTH + random() % 3 * 4;
+      if (!NEF_AddField(&packet, &info, j, data, lengths[j]))
+        break;
+    }
+
+    n = j;
+    index_fields(&packet, &info);
+    TEST_CHECK(info.ext_fields == n);
+
+    for (j = 0, parsed = NTP_HEADER_LENGTH; j < n; j++) {
+      parsed = NEF_ParseField(&packet, info.length, parsed, &type, &body, &body_length);
+      TEST_CHECK(parsed > 0);
+      TEST_CHECK(NEF_GetIndexedField(&packet, &info, j, &type2, &body2, &body_length2));
+      TEST_CHECK(type == j && type2 == j);
+      TEST_CHECK(body == body2);
+      TEST_CHECK(body_length == lengths[j] && body_length2 == lengths[j]);
+    }
+
+    TEST_CHECK(!NEF_GetIndexedField(&packet, &info, n, &type, &body, &body_length));
+    TEST_CHECK(!NEF_GetIndexedField(&packet, &info, -1, &type, &body, &body_length));
+  }
+}
@@ -0,0 +1,229 @@
+/*
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+ */
+
+#include <config.h>
+#include "test.h"
+
+#ifdef HAVE_IO_URING
+
+#include <ntp_io_uring.c>
+#include <conf.h>
+#include <local.h>
+
+#define PACKETS 200
+
+static int server_fd;
+static int client_fd;
+static int sent;
+static int received;
+static int echoed;
+static int fallback_fd;
+
+static int
+open_socket(void)
+{
+  struct sockaddr_in sin;
+  int sock_fd;
+
+  sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  TEST_CHECK(sock_fd >= 0);
+
+  memset(&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  TEST_CHECK(bind(sock_fd, (struct sockaddr *)&sin, sizeof (sin)) == 0);
+  TEST_CHECK(fcntl(sock_fd, F_SETFL, O_NONBLOCK) == 0);
+
+  return sock_fd;
+}
+
+/* Send the message back to the client */
+static void
+handle_message(struct msghdr *hdr, int length, int sock_fd)
+{
+  NTP_Packet *packet = hdr->msg_iov[0].iov_base;
+  struct sockaddr_in *sin = hdr->msg_name;
+  struct msghdr msg;
+  struct iovec iov;
+
+  TEST_CHECK(sock_fd == server_fd);
+  TEST_CHECK(length == NTP_HEADER_LENGTH);
+  TEST_CHECK(hdr->msg_namelen == sizeof (*sin));
+  TEST_CHECK(sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+  TEST_CHECK(ntohl(packet->transmit_ts.lo) == received);
+
+  received++;
+
+  iov.iov_base = packet;
+  iov.iov_len = length;
+
+  memset(&msg, 0, sizeof (msg));
+  msg.msg_name = hdr->msg_name;
+  msg.msg_namelen = hdr->msg_namelen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  TEST_CHECK(NIO_Uring_QueueMessage(&msg, sock_fd));
+}
+
+static void
+handle_fallback(int sock_fd)
+{
+  fallback_fd = sock_fd;
+}
+
+static void
+read_echo(int fd, int event, void *anything)
+{
+  NTP_Packet packet;
+  int r;
+
+  while ((r = recv(fd, &packet, sizeof (packet), 0)) > 0) {
+    TEST_CHECK(r == NTP_HEADER_LENGTH);
+    TEST_CHECK(ntohl(packet.transmit_ts.lo) == echoed);
+    echoed++;
+  }
+
+  if (echoed == PACKETS)
+    SCH_QuitProgram();
+}
+
+static void
+send_packets(void *arg)
+{
+  struct sockaddr_in sin;
+  socklen_t sin_len;
+  NTP_Packet packet;
+  int i;
+
+  sin_len = sizeof (sin);
+  TEST_CHECK(getsockname(server_fd, (struct sockaddr *)&sin, &sin_len) == 0);
+
+  memset(&packet, 0, sizeof (packet));
+  packet.lvm = NTP_LVM(LEAP_Normal, NTP_VERSION, MODE_CLIENT);
+
+  /* Send the packets in bursts to fill multiple batches */
+  for (i = 0; i < PACKETS / 4; i++, sent++) {
+    packet.transmit_ts.lo = htonl(sent);
+    TEST_CHECK(sendto(client_fd, &packet, NTP_HEADER_LENGTH, 0,
+                      (struct sockaddr *)&sin, sizeof (sin)) == NTP_HEADER_LENGTH);
+  }
+
+  if (sent < PACKETS)
+    SCH_AddTimeoutByDelay(0.01, send_packets, NULL);
+}
+
+static void
+fail_timeout(void *arg)
+{
+  TEST_CHECK(0);
+}
+
+/* Check that a request not allowed by the restrictions is rejected */
+static void
+test_restrictions(void)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+  int found = 0;
+
+  sqe = get_sqe();
+  TEST_CHECK(sqe);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)"/dev/null";
+  sqe->user_data = MAKE_USER_DATA(REQUEST_CANCEL + 1, 0);
+  submit_requests();
+
+  for (head = *cq_head; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+    cqe = &cqes[head & *cq_mask];
+    if (cqe->user_data != MAKE_USER_DATA(REQUEST_CANCEL + 1, 0))
+      continue;
+    TEST_CHECK(cqe->res == -EACCES);
+    found = 1;
+  }
+
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+  TEST_CHECK(found);
+}
+
+void
+test_unit(void)
+{
+  int pipe_fds[2];
+
+  CNF_Initialise(0, 0);
+  LCL_Initialise();
+  TST_RegisterDummyDrivers();
+  SCH_Initialise();
+
+  NIO_Uring_Initialise(handle_message, handle_fallback);
+  TEST_REQUIRE(initialised);
+
+  server_fd = open_socket();
+  client_fd = open_socket();
+
+  TEST_CHECK(NIO_Uring_AddSocket(server_fd));
+  SCH_AddFileHandler(client_fd, SCH_FILE_INPUT, read_echo, NULL);
+
+  /* A descriptor which cannot be read by recvmsg is returned to the caller */
+  TEST_CHECK(pipe(pipe_fds) == 0);
+  fallback_fd = -1;
+  TEST_CHECK(NIO_Uring_AddSocket(pipe_fds[0]));
+
+  SCH_AddTimeoutByDelay(0.0, send_packets, NULL);
+  SCH_AddTimeoutByDelay(10.0, fail_timeout, NULL);
+  SCH_MainLoop();
+
+  TEST_CHECK(received == PACKETS);
+  TEST_CHECK(echoed == PACKETS);
+  TEST_CHECK(fallback_fd == pipe_fds[0]);
+  TEST_CHECK(!find_socket(pipe_fds[0]));
+
+  /* Process the remaining completions of the sent messages */
+  read_completions(ring_fd, SCH_FILE_INPUT, NULL);
+  TEST_CHECK(ARR_GetSize(free_sent_messages) == MAX_SENT_MESSAGES);
+
+  test_restrictions();
+
+  NIO_Uring_RemoveSocket(server_fd);
+  TEST_CHECK(!find_socket(server_fd));
+  SCH_RemoveFileHandler(client_fd);
+
+  NIO_Uring_Finalise();
+
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  close(server_fd);
+  close(client_fd);
+
+  SCH_Finalise();
+  LCL_Finalise();
+  CNF_Finalise();
+}
+
+#else
+void
+test_unit(void)
+{
+  TEST_REQUIRE(0);
+}
+#endif
@@ -0,0 +1,398 @@
+/*
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+ */
+
+#include <config.h>
+#include "test.h"
+
+#ifdef HAVE_XDP
+
+#include <sysincl.h>
+#include <reference.h>
+#include <smooth.h>
+
+static void get_reference_params(struct timespec *local_time, int *is_synchronised,
+                                 NTP_Leap *leap_status, int *stratum, uint32_t *ref_id,
+                                 struct timespec *ref_time, double *root_delay,
+                                 double *root_dispersion);
+static REF_LeapMode get_leap_mode(void);
+static int is_smoothing_enabled(void);
+static double get_smoothing_offset(struct timespec *now);
+
+#define REF_GetReferenceParams get_reference_params
+#define REF_GetLeapMode get_leap_mode
+#define SMT_IsEnabled is_smoothing_enabled
+#define SMT_GetOffset get_smoothing_offset
+
+#include <ntp_io_xdp.c>
+
+#define BUFFER_SIZE (NTP_OFFSET + 40 + (int)sizeof (NTP_Packet))
+#define SERVER_PORT 123
+#define SERVER_ADDRESS 0xc0000201
+#define CLIENT_ADDRESS 0xc0000202
+
+static NTP_Leap ref_leap;
+static int ref_stratum;
+static double smoothing_offset;
+
+static void
+get_reference_params(struct timespec *local_time, int *is_synchronised,
+                     NTP_Leap *leap_status, int *stratum, uint32_t *ref_id,
+                     struct timespec *ref_time, double *root_delay,
+                     double *root_dispersion)
+{
+  *is_synchronised = ref_leap != LEAP_Unsynchronised;
+  *leap_status = ref_leap;
+  *stratum = ref_stratum;
+  *ref_id = 0x7f7f0101;
+  UTI_AddDoubleToTimespec(local_time, -10.0, ref_time);
+  *root_delay = 0.02;
+  *root_dispersion = 0.01;
+}
+
+static REF_LeapMode
+get_leap_mode(void)
+{
+  return REF_LeapModeSystem;
+}
+
+static int
+is_smoothing_enabled(void)
+{
+  return smoothing_offset != 0.0;
+}
+
+static double
+get_smoothing_offset(struct timespec *now)
+{
+  return smoothing_offset;
+}
+
+static uint16_t
+get_ip_checksum(struct iphdr *ip)
+{
+  uint32_t sum;
+  int i;
+
+  for (i = 0, sum = 0; i < ip->ihl * 2; i++)
+    sum += ((uint16_t *)ip)[i];
+  while (sum > 0xffff)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return sum;
+}
+
+/* Make a request from the client to the server with the specified length
+   of the IP header and NTP message */
+static int
+make_request(unsigned char *buf, int ip_length, int ntp_length)
+{
+  const unsigned char dst_mac[ETH_ALEN] = {2, 0, 0, 0, 0, 1};
+  const unsigned char src_mac[ETH_ALEN] = {2, 0, 0, 0, 0, 2};
+  struct ethhdr *eth;
+  struct udphdr *udp;
+  struct iphdr *ip;
+  NTP_Packet *ntp;
+
+  memset(buf, 0, BUFFER_SIZE);
+
+  eth = (struct ethhdr *)buf;
+  memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+  memcpy(eth->h_source, src_mac, ETH_ALEN);
+  eth->h_proto = htons(ETH_P_IP);
+
+  ip = (struct iphdr *)(buf + ETH_HLEN);
+  ip->version = 4;
+  ip->ihl = ip_length / 4;
+  ip->tot_len = htons(ip_length + sizeof (*udp) + ntp_length);
+  ip->id = htons(random());
+  ip->ttl = 32;
+  ip->protocol = IPPROTO_UDP;
+  ip->saddr = htonl(CLIENT_ADDRESS);
+  ip->daddr = htonl(SERVER_ADDRESS);
+  ip->check = ~get_ip_checksum(ip);
+
+  udp = (struct udphdr *)((char *)ip + ip_length);
+  udp->source = htons(32123);
+  udp->dest = htons(SERVER_PORT);
+  udp->len = htons(sizeof (*udp) + ntp_length);
+  udp->check = htons(0x1234);
+
+  ntp = (NTP_Packet *)(udp + 1);
+  ntp->lvm = NTP_LVM(LEAP_Normal, NTP_VERSION, MODE_CLIENT);
+  ntp->poll = 6;
+  ntp->transmit_ts.hi = htonl(random());
+  ntp->transmit_ts.lo = htonl(random());
+
+  return ETH_HLEN + ip_length + sizeof (*udp) + ntp_length;
+}
+
+static int
+run_program(unsigned char *buf, int length, unsigned char *out, int *out_length)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof (attr));
+  attr.test.prog_fd = program_fd;
+  attr.test.data_in = (uintptr_t)buf;
+  attr.test.data_size_in = length;
+  attr.test.data_out = (uintptr_t)out;
+  attr.test.data_size_out = BUFFER_SIZE;
+  attr.test.repeat = 1;
+
+  TEST_CHECK(call_bpf(BPF_PROG_TEST_RUN, &attr) == 0);
+  *out_length = attr.test.data_size_out;
+
+  return attr.test.retval;
+}
+
+/* Check that the packet is passed to the network stack without change */
+static void
+check_pass(unsigned char *buf, int length)
+{
+  unsigned char out[BUFFER_SIZE];
+  int out_length;
+
+  TEST_CHECK(run_program(buf, length, out, &out_length) == XDP_PASS);
+  TEST_CHECK(out_length == length);
+  TEST_CHECK(memcmp(buf, out, length) == 0);
+}
+
+/* Check the response to a basic request */
+static void
+check_response(unsigned char *buf, int length)
+{
+  unsigned char out[BUFFER_SIZE];
+  struct ethhdr *eth1, *eth2;
+  struct udphdr *udp1, *udp2;
+  struct iphdr *ip1, *ip2;
+  NTP_Packet *req, *res;
+  struct timespec now, rx, tx, ref;
+  int out_length;
+  uint64_t hits;
+
+  hits = shared->ntp_hits;
+
+  TEST_CHECK(run_program(buf, length, out, &out_length) == XDP_TX);
+  TEST_CHECK(out_length == length);
+  TEST_CHECK(shared->ntp_hits == hits + 1);
+
+  LCL_ReadCookedTime(&now, NULL);
+  UTI_AddDoubleToTimespec(&now, smoothing_offset, &now);
+
+  eth1 = (struct ethhdr *)buf;
+  eth2 = (struct ethhdr *)out;
+  TEST_CHECK(memcmp(eth1->h_dest, eth2->h_source, ETH_ALEN) == 0);
+  TEST_CHECK(memcmp(eth1->h_source, eth2->h_dest, ETH_ALEN) == 0);
+  TEST_CHECK(eth2->h_proto == htons(ETH_P_IP));
+
+  ip1 = (struct iphdr *)(buf + IP_OFFSET);
+  ip2 = (struct iphdr *)(out + IP_OFFSET);
+  TEST_CHECK(ip2->saddr == ip1->daddr && ip2->daddr == ip1->saddr);
+  TEST_CHECK(ip2->ttl == 64);
+  TEST_CHECK(ip2->id == ip1->id && ip2->tot_len == ip1->tot_len);
+  TEST_CHECK(get_ip_checksum(ip2) == 0xffff);
+
+  /* The UDP checksum is optional with IPv4 */
+  udp1 = (struct udphdr *)(buf + UDP_OFFSET);
+  udp2 = (struct udphdr *)(out + UDP_OFFSET);
+  TEST_CHECK(udp2->source == udp1->dest && udp2->dest == udp1->source);
+  TEST_CHECK(udp2->len == udp1->len);
+  TEST_CHECK(udp2->check == 0);
+
+  req = (NTP_Packet *)(buf + NTP_OFFSET);
+  res = (NTP_Packet *)(out + NTP_OFFSET);
+  TEST_CHECK(NTP_LVM_TO_LEAP(res->lvm) == ref_leap);
+  TEST_CHECK(NTP_LVM_TO_VERSION(res->lvm) == NTP_LVM_TO_VERSION(req->lvm));
+  TEST_CHECK(NTP_LVM_TO_MODE(res->lvm) == MODE_SERVER);
+  TEST_CHECK(res->stratum == (ref_stratum < NTP_MAX_STRATUM ? ref_stratum : 0));
+  TEST_CHECK(res->poll == MAX(req->poll, CLG_GetNtpMinPoll()));
+  TEST_CHECK(res->precision == LCL_GetSysPrecisionAsLog());
+  TEST_CHECK(res->root_delay == UTI_DoubleToNtp32(0.02));
+  TEST_CHECK(fabs(UTI_Ntp32ToDouble(res->root_dispersion) - 0.01) < 1.0e-4);
+  TEST_CHECK(res->reference_id ==
+             htonl(smoothing_offset != 0.0 ? NTP_REFID_SMOOTH : 0x7f7f0101));
+  TEST_CHECK(memcmp(&res->originate_ts, &req->transmit_ts, sizeof (req->transmit_ts)) == 0);
+
+  UTI_Ntp64ToTimespec(&res->reference_ts, &ref);
+  UTI_Ntp64ToTimespec(&res->receive_ts, &rx);
+  UTI_Ntp64ToTimespec(&res->transmit_ts, &tx);
+  TEST_CHECK(fabs(UTI_DiffTimespecsToDouble(&now, &ref) - 10.0) < 0.01);
+  TEST_CHECK(fabs(UTI_DiffTimespecsToDouble(&now, &rx)) < 0.01);
+  TEST_CHECK(UTI_CompareNtp64(&res->transmit_ts, &res->receive_ts) > 0);
+  TEST_CHECK(UTI_DiffTimespecsToDouble(&tx, &rx) < 0.01);
+}
+
+static void
+set_access(uint32_t address, int subnet_bits, int allow)
+{
+  IPAddr ip;
+  int failed = 0;
+
+  ip.family = IPADDR_INET4;
+  ip.addr.in4 = address;
+  add_access_rule(&ip, subnet_bits, allow, &failed);
+  TEST_CHECK(!failed);
+}
+
+void
+test_unit(void)
+{
+  unsigned char buf[BUFFER_SIZE];
+  char conf[] = "xdpinterface chronytest0";
+  NTP_Packet *ntp;
+  struct iphdr *ip;
+  IPAddr bind_address;
+  int i, length;
+
+  CNF_Initialise(0, 0);
+  CNF_ParseLine(NULL, 1, conf);
+  LCL_Initialise();
+  TST_RegisterDummyDrivers();
+  SCH_Initialise();
+
+  bind_address.family = IPADDR_INET4;
+  bind_address.addr.in4 = 0;
+
+  /* Loading the program needs privileges, the interface doesn't exist */
+  TST_SuspendLogging();
+  NIO_Xdp_Initialise(SERVER_PORT, &bind_address);
+  TST_ResumeLogging();
+  TEST_REQUIRE(initialised);
+  TEST_CHECK(ARR_GetSize(links) == 0);
+
+  ref_leap = LEAP_Normal;
+  ref_stratum = 2;
+  smoothing_offset = 0.0;
+  started = 1;
+  update_state();
+
+  /* All requests are passed until the access map is valid */
+  length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+  check_pass(buf, length);
+
+  set_access(CLIENT_ADDRESS & 0xffffff00, 24, 1);
+  shared->access_valid = 1;
+
+  for (i = 0; i < 100; i++) {
+    DEBUG_LOG("iteration %d", i);
+
+    ref_leap = random() % 4;
+    ref_stratum = 1 + random() % NTP_MAX_STRATUM;
+    smoothing_offset = random() % 2 ? (random() % 2 ? 1 : -1) * (1 + random() % 1000) / 1.0e3 : 0.0;
+    update_state();
+
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+    ntp = (NTP_Packet *)(buf + NTP_OFFSET);
+    ntp->poll = random() % 20 - 10;
+    ntp->lvm = NTP_LVM(LEAP_Normal, 2 + random() % 3, MODE_CLIENT);
+
+    /* An origin timestamp equal to the transmit timestamp is not interleaved */
+    if (random() % 2) {
+      ntp->originate_ts.hi = htonl(random());
+      ntp->receive_ts = ntp->transmit_ts;
+    }
+
+    check_response(buf, length);
+
+    /* Interleaved requests */
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+    ntp = (NTP_Packet *)(buf + NTP_OFFSET);
+    ntp->originate_ts.lo = htonl(1 + random() % 1000);
+    ntp->receive_ts.lo = htonl(random());
+    check_pass(buf, length);
+
+    /* Authenticated requests with a symmetric key (MAC) and NTS requests
+       (extension fields) */
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH + 4 + 16);
+    check_pass(buf, length);
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH + 4 + 20);
+    check_pass(buf, length);
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH + 36 + 104 + 20);
+    ntp = (NTP_Packet *)(buf + NTP_OFFSET);
+    ntp->extensions[0] = 0x01;
+    ntp->extensions[1] = 0x04;
+    ntp->extensions[3] = 36;
+    check_pass(buf, length);
+
+    /* Requests which are not 48 bytes long */
+    length = make_request(buf, sizeof (struct iphdr), random() % NTP_HEADER_LENGTH);
+    check_pass(buf, length);
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH + 1 + random() % 4);
+    check_pass(buf, length);
+
+    /* Requests with IP options */
+    length = make_request(buf, sizeof (struct iphdr) + 4 * (1 + random() % 10),
+                          NTP_HEADER_LENGTH);
+    check_pass(buf, length);
+
+    /* Requests in other modes, NTPv1 requests, and requests to other ports
+       and addresses */
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+    ntp = (NTP_Packet *)(buf + NTP_OFFSET);
+    ntp->lvm = NTP_LVM(LEAP_Normal, NTP_VERSION, random() % 2 ? MODE_ACTIVE : MODE_SERVER);
+    check_pass(buf, length);
+    ntp->lvm = NTP_LVM(LEAP_Normal, 1, MODE_CLIENT);
+    check_pass(buf, length);
+
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+    ((struct udphdr *)(buf + UDP_OFFSET))->dest = htons(SERVER_PORT + 1);
+    check_pass(buf, length);
+
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+    ip = (struct iphdr *)(buf + IP_OFFSET);
+    ip->daddr = htonl(0xe0000000 | random() % 0x10000000);
+    check_pass(buf, length);
+
+    length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+    ip = (struct iphdr *)(buf + IP_OFFSET);
+    ip->frag_off = htons(0x2000);
+    check_pass(buf, length);
+  }
+
+  /* Requests from addresses which are not allowed */
+  set_access(CLIENT_ADDRESS, 32, 0);
+  length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+  check_pass(buf, length);
+  ip = (struct iphdr *)(buf + IP_OFFSET);
+  ip->saddr = htonl(0xc6336401);
+  ip->check = 0;
+  ip->check = ~get_ip_checksum(ip);
+  check_pass(buf, length);
+
+  /* Invalid server state */
+  set_access(CLIENT_ADDRESS, 32, 1);
+  length = make_request(buf, sizeof (struct iphdr), NTP_HEADER_LENGTH);
+  check_response(buf, length);
+  shared->states[shared->active_state].mono_base -= 3 * 1000000000ULL;
+  check_pass(buf, length);
+
+  NIO_Xdp_Finalise();
+
+  SCH_Finalise();
+  LCL_Finalise();
+  CNF_Finalise();
+}
+
+#else
+void
+test_unit(void)
+{
+  TEST_REQUIRE(0);
+}
+#endif
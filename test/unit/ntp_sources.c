@@ -23,10 +23,81 @@
 
 #ifdef FEAT_NTP
 
+#include <sysincl.h>
+#include <nameserv_async.h>
+
+static void resolve_name(const char *name, DNS_NameResolveHandler handler, void *anything);
+
+#undef DNS_Name2IPAddressAsync
+#define DNS_Name2IPAddressAsync resolve_name
+
 #include <ntp_sources.c>
 #include <conf.h>
 #include <ntp_io.h>
 
+#define MAX_REQUESTS 4
+
+static void *requests[MAX_REQUESTS];
+static int num_requests;
+
+static void
+resolve_name(const char *name, DNS_NameResolveHandler handler, void *anything)
+{
+  TEST_CHECK(handler == name_resolve_handler);
+  TEST_CHECK(num_requests < MAX_REQUESTS);
+  requests[num_requests++] = anything;
+}
+
+static void
+finish_requests(DNS_Status status)
+{
+  int i;
+
+  for (i = 0; i < num_requests; i++)
+    name_resolve_handler(status, 0, NULL, requests[i]);
+  num_requests = 0;
+}
+
+static void
+test_resolving(SourceParameters *params)
+{
+  char name1[] = "a.test", name2[] = "b.test", name3[] = "c.test";
+
+  NSR_AddSourceByName(name1, 123, 0, NTP_SERVER, params);
+  NSR_AddSourceByName(name2, 123, 0, NTP_SERVER, params);
+
+  NSR_ResolveSources();
+  TEST_CHECK(num_requests == 2);
+  TEST_CHECK(resolving_sources == 2);
+
+  /* The first source fails temporarily in a running round */
+  name_resolve_handler(DNS_TryAgain, 0, NULL, requests[0]);
+  requests[0] = requests[1];
+  num_requests = 1;
+
+  /* Only the new source joins the round, the failed one waits */
+  NSR_AddSourceByName(name3, 123, 0, NTP_SERVER, params);
+  NSR_ResolveSources();
+  TEST_CHECK(num_requests == 2);
+  TEST_CHECK(strcmp(((struct UnresolvedSource *)requests[1])->name, name3) == 0);
+  TEST_CHECK(resolving_sources == 2);
+
+  finish_requests(DNS_TryAgain);
+  TEST_CHECK(resolving_sources == 0);
+  TEST_CHECK(resolving_interval == MIN_RESOLVE_INTERVAL);
+
+  /* All sources are retried in the next round */
+  SCH_RemoveTimeout(resolving_id);
+  resolve_sources(NULL);
+  TEST_CHECK(num_requests == 3);
+
+  TST_SuspendLogging();
+  finish_requests(DNS_Failure);
+  TST_ResumeLogging();
+  TEST_CHECK(!unresolved_sources);
+  TEST_CHECK(resolving_interval == 0);
+}
+
 void
 test_unit(void)
 {
@@ -93,6 +164,8 @@ test_unit(void)
     }
   }
 
+  test_resolving(&params);
+
   NSR_Finalise();
   NCR_Finalise();
   NIO_Finalise();
@@ -0,0 +1,277 @@
+/*
+ **********************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ **********************************************************************
+ */
+
+#include <config.h>
+#include "test.h"
+
+#ifdef FEAT_NTS
+
+#include <sysincl.h>
+#include <gnutls/gnutls.h>
+
+static int get_keys(gnutls_session_t session, size_t label_size, const char *label,
+                    size_t context_size, const char *context, size_t outsize, char *out);
+
+#undef gnutls_prf_rfc5705
+#define gnutls_prf_rfc5705 get_keys
+
+#include <nts_ke.c>
+
+#define KEY_FILE "./" KEY_FILE_NAME
+
+static int
+compare_keys(ServerKey *keys1, ServerKey *keys2)
+{
+  int i;
+
+  for (i = 0; i < MAX_SERVER_KEYS; i++) {
+    if (keys1[i].id != keys2[i].id ||
+        memcmp(keys1[i].key, keys2[i].key, sizeof (keys1[i].key)) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Export keys without a TLS session */
+static int
+get_keys(gnutls_session_t session, size_t label_size, const char *label,
+         size_t context_size, const char *context, size_t outsize, char *out)
+{
+  memset(out, context[context_size - 1], outsize);
+  return 0;
+}
+
+static void
+check_key_ids(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_SERVER_KEYS; i++)
+    TEST_CHECK((server_keys[i].id & ~(-1U << KEY_ID_INDEX_BITS)) == i);
+}
+
+static void
+test_server_negotiation(void)
+{
+  NKE_Cookie cookies[MAX_COOKIES];
+  CNF_NtsNtpServer *server;
+  NTP_Remote_Address ntp_addr;
+  IPAddr addr, server_addr;
+  NKE_Instance inst;
+  int i, j, port;
+
+  for (i = 0, total_ntp_server_weight = 0; CNF_GetNtsNtpServer(i, &server); i++)
+    total_ntp_server_weight += server->weight;
+  TEST_CHECK(total_ntp_server_weight == 3);
+
+  inst = NKE_CreateInstance();
+  inst->message = MallocNew(struct NKE_Message);
+
+  for (i = 0; i < 1000; i++) {
+    TST_GetRandomAddress(&inst->remote_addr, IPADDR_UNSPEC, -1);
+
+    server = get_ntp_server(&inst->remote_addr);
+    TEST_CHECK(server);
+    TEST_CHECK(UTI_StringToIP(server->name, &server_addr));
+
+    TEST_CHECK(prepare_response(inst, ERROR_NONE, NEXT_PROTOCOL_NTPV4,
+                                AEAD_AES_SIV_CMAC_256));
+
+    addr.family = IPADDR_UNSPEC;
+    port = 0;
+    TEST_CHECK(process_response(inst, cookies, MAX_COOKIES, &addr, &port) == MAX_COOKIES);
+    TEST_CHECK(UTI_CompareIPs(&addr, &server_addr, NULL) == 0);
+    TEST_CHECK(port == server->port);
+
+    TEST_CHECK(NKE_GetNtpAddress(inst, &ntp_addr));
+    TEST_CHECK(UTI_CompareIPs(&ntp_addr.ip_addr, &server_addr, NULL) == 0);
+    TEST_CHECK(ntp_addr.port == (server->port ? server->port : NTP_PORT));
+
+    for (j = 0; j < MAX_COOKIES; j++)
+      TEST_CHECK(cookies[j].length == sizeof (ServerCookie));
+  }
+
+  NKE_DestroyInstance(inst);
+}
+
+void
+test_unit(void)
+{
+  ServerKey saved_keys[MAX_SERVER_KEYS];
+  int i, j, current;
+  char conf[][100] = {
+    "ntsdumpdir .",
+    "ntsrotate 0",
+    "ntsntpserver 192.0.2.1 port 1234",
+    "ntsntpserver 2001:db8::1 weight 2"
+  };
+  char rotate_conf[] = "ntsrotate 100", follow_conf[] = "ntsrotate 0";
+  struct stat st;
+  FILE *f;
+
+  CNF_Initialise(0, 0);
+  for (i = 0; i < sizeof conf / sizeof conf[0]; i++)
+    CNF_ParseLine(NULL, i + 1, conf[i]);
+
+  LCL_Initialise();
+  TST_RegisterDummyDrivers();
+  SCH_Initialise();
+
+#ifdef HAVE_NTS_KE_THREADS
+  TEST_CHECK(pthread_mutex_init(&server_keys_lock, NULL) == 0);
+#endif
+
+  unlink(KEY_FILE);
+
+  /* A server following keys of another server must not create the file */
+  initialise_server_keys();
+  TEST_CHECK(server_key_timeout_id != 0);
+  TEST_CHECK(stat(KEY_FILE, &st) < 0);
+  check_key_ids();
+  SCH_RemoveTimeout(server_key_timeout_id);
+
+  CNF_ParseLine(NULL, 5, rotate_conf);
+
+  initialise_server_keys();
+  TEST_CHECK(stat(KEY_FILE, &st) == 0);
+  SCH_RemoveTimeout(server_key_timeout_id);
+
+  for (i = 0; i < 100; i++) {
+    DEBUG_LOG("iteration %d", i);
+
+    memcpy(saved_keys, server_keys, sizeof (saved_keys));
+    current = current_server_key;
+
+    if (i % 2) {
+      rotate_server_keys();
+      check_key_ids();
+      TEST_CHECK(current_server_key == (current + 1) % MAX_SERVER_KEYS);
+
+      /* Only the key following the future key is replaced */
+      for (j = 0; j < MAX_SERVER_KEYS; j++) {
+        if (j == (current_server_key + FUTURE_KEYS) % MAX_SERVER_KEYS)
+          TEST_CHECK(server_keys[j].id != saved_keys[j].id);
+        else
+          TEST_CHECK(server_keys[j].id == saved_keys[j].id);
+      }
+
+      memcpy(saved_keys, server_keys, sizeof (saved_keys));
+      current = current_server_key;
+    } else {
+      save_server_keys();
+    }
+
+    for (j = 0; j < MAX_SERVER_KEYS; j++)
+      generate_server_key(j);
+    current_server_key = random() % MAX_SERVER_KEYS;
+    TEST_CHECK(!compare_keys(saved_keys, server_keys));
+
+    TEST_CHECK(load_server_keys());
+    TEST_CHECK(compare_keys(saved_keys, server_keys));
+    TEST_CHECK(current_server_key == current);
+  }
+
+  /* Follow the keys rotated by another server */
+  CNF_ParseLine(NULL, 6, follow_conf);
+
+  memcpy(saved_keys, server_keys, sizeof (saved_keys));
+  for (j = 0; j < MAX_SERVER_KEYS; j++)
+    generate_server_key(j);
+  key_file_mtime = 0;
+
+  server_key_timeout(NULL);
+  TEST_CHECK(compare_keys(saved_keys, server_keys));
+  SCH_RemoveTimeout(server_key_timeout_id);
+
+  f = fopen(KEY_FILE, "w");
+  TEST_CHECK(f);
+  fprintf(f, "%s\n%d 0\n", KEY_FILE_IDENTIFIER, MAX_SERVER_KEYS);
+  fclose(f);
+
+  TST_SuspendLogging();
+  TEST_CHECK(!load_server_keys());
+  TST_ResumeLogging();
+  TEST_CHECK(compare_keys(saved_keys, server_keys));
+
+  /* The NTP server from the response is accepted by the client */
+  test_server_negotiation();
+
+  unlink(KEY_FILE);
+
+#ifdef HAVE_NTS_KE_THREADS
+  pthread_mutex_destroy(&server_keys_lock);
+#endif
+
+  SCH_Finalise();
+  LCL_Finalise();
+  CNF_Finalise();
+}
+
+#else
+static void
+test_server_negotiation(void)
+{
+  NKE_Cookie cookies[MAX_COOKIES];
+  CNF_NtsNtpServer *server;
+  NTP_Remote_Address ntp_addr;
+  IPAddr addr, server_addr;
+  NKE_Instance inst;
+  int i, j, port;
+
+  for (i = 0, total_ntp_server_weight = 0; CNF_GetNtsNtpServer(i, &server); i++)
+    total_ntp_server_weight += server->weight;
+  TEST_CHECK(total_ntp_server_weight == 3);
+
+  inst = NKE_CreateInstance();
+  inst->message = MallocNew(struct NKE_Message);
+
+  for (i = 0; i < 1000; i++) {
+    TST_GetRandomAddress(&inst->remote_addr, IPADDR_UNSPEC, -1);
+
+    server = get_ntp_server(&inst->remote_addr);
+    TEST_CHECK(server);
+    TEST_CHECK(UTI_StringToIP(server->name, &server_addr));
+
+    TEST_CHECK(prepare_response(inst, ERROR_NONE, NEXT_PROTOCOL_NTPV4,
+                                AEAD_AES_SIV_CMAC_256));
+
+    addr.family = IPADDR_UNSPEC;
+    port = 0;
+    TEST_CHECK(process_response(inst, cookies, MAX_COOKIES, &addr, &port) == MAX_COOKIES);
+    TEST_CHECK(UTI_CompareIPs(&addr, &server_addr, NULL) == 0);
+    TEST_CHECK(port == server->port);
+
+    TEST_CHECK(NKE_GetNtpAddress(inst, &ntp_addr));
+    TEST_CHECK(UTI_CompareIPs(&ntp_addr.ip_addr, &server_addr, NULL) == 0);
+    TEST_CHECK(ntp_addr.port == (server->port ? server->port : NTP_PORT));
+
+    for (j = 0; j < MAX_COOKIES; j++)
+      TEST_CHECK(cookies[j].length == sizeof (ServerCookie));
+  }
+
+  NKE_DestroyInstance(inst);
+}
+
+void
+test_unit(void)
+{
+  TEST_REQUIRE(0);
+}
+#endif
@@ -22,6 +22,154 @@
 
 #define POINTS 64
 
+/* Original implementation of RGR_FindBestRegression() recalculating all
+   sums for each starting index */
+static int
+find_best_regression_ref(double *x, double *y, double *w, int n, int m, int min_samples,
+                         double *b0, double *b1, double *s2, double *sb0, double *sb1,
+                         int *new_start, int *n_runs, int *dof)
+{
+  double P, Q, U, V, W, resid[MAX_POINTS * REGRESS_RUNS_RATIO], ss, a, b, u, ui, aa;
+  int start, resid_start, nruns, npoints, i;
+
+  if (n < MIN_SAMPLES_FOR_REGRESS)
+    return 0;
+
+  for (start = 0; ; start++) {
+    W = U = 0;
+    for (i = start; i < n; i++) {
+      U += x[i] / w[i];
+      W += 1.0 / w[i];
+    }
+
+    u = U / W;
+
+    P = Q = V = 0.0;
+    for (i = start; i < n; i++) {
+      ui = x[i] - u;
+      P += y[i] / w[i];
+      Q += y[i] * ui / w[i];
+      V += ui * ui / w[i];
+    }
+
+    b = Q / V;
+    a = (P / W) - (b * u);
+
+    resid_start = n - (n - start) * REGRESS_RUNS_RATIO;
+    if (resid_start < -m)
+      resid_start = -m;
+
+    for (i = resid_start; i < n; i++)
+      resid[i - resid_start] = y[i] - a - b * x[i];
+
+    nruns = n_runs_from_residuals(resid, n - resid_start);
+
+    if (nruns > critical_runs[n - resid_start] ||
+        n - start <= MIN_SAMPLES_FOR_REGRESS || n - start <= min_samples) {
+      if (start != resid_start)
+        nruns = n_runs_from_residuals(resid + (start - resid_start), n - start);
+      break;
+    }
+  }
+
+  *b1 = b;
+  *b0 = a;
+
+  for (i = start, ss = 0.0; i < n; i++)
+    ss += resid[i - resid_start] * resid[i - resid_start] / w[i];
+
+  npoints = n - start;
+  ss /= (double)(npoints - 2);
+  *sb1 = sqrt(ss / V);
+  aa = u * (*sb1);
+  *sb0 = sqrt((ss / W) + (aa * aa));
+  *s2 = ss * (double) npoints / W;
+
+  *new_start = start;
+  *dof = npoints - 2;
+  *n_runs = nruns;
+
+  return 1;
+}
+
+static void
+test_best_regression(void)
+{
+  double x[2 * POINTS], y[2 * POINTS], w[2 * POINTS], r1[5], r2[5];
+  int i, j, k, n, m, r, res1, res2, i1[3], i2[3];
+  struct timespec ts1, ts2;
+  double times[2];
+
+  for (i = 0; i < 10000; i++) {
+    n = random() % (POINTS + 1);
+    m = random() % (POINTS + 1);
+
+    for (j = 0; j < n + m; j++) {
+      x[j] = -(n + m - j) * TST_GetRandomDouble(1.0, 100.0);
+      y[j] = TST_GetRandomDouble(-1.0e-6, 1.0e-6) + 1.0e-3 * (j % 2 ? 1.0 : 0.0);
+      switch (random() % 3) {
+        case 0:
+          y[j] += 1.0e-12 * x[j] * x[j];
+          break;
+        case 1:
+          y[j] += 1.0e-9 * x[j];
+          break;
+      }
+      w[j] = TST_GetRandomDouble(1.0, 10.0);
+
+      /* Include points with residuals close to zero */
+      if (i % 10 == 0)
+        y[j] = i % 20 == 0 ? 1.0e-3 : 1.0e-9 * x[j];
+    }
+
+    res1 = RGR_FindBestRegression(x + m, y + m, w + m, n, m, 3, &r1[0], &r1[1], &r1[2],
+                                  &r1[3], &r1[4], &i1[0], &i1[1], &i1[2]);
+    res2 = find_best_regression_ref(x + m, y + m, w + m, n, m, 3, &r2[0], &r2[1], &r2[2],
+                                    &r2[3], &r2[4], &i2[0], &i2[1], &i2[2]);
+    TEST_CHECK(res1 == res2);
+    if (!res1)
+      continue;
+
+    TEST_CHECK(memcmp(r1, r2, sizeof (r1)) == 0);
+    TEST_CHECK(memcmp(i1, i2, sizeof (i1)) == 0);
+  }
+
+  /* Compare the speed with points which never pass the runs test, up to
+     the maximum number of points and the same number of extra points
+     before them */
+  for (i = 0; i < 6; i++) {
+    n = POINTS >> (i / 2);
+    m = i % 2 ? n : 0;
+
+    for (j = 0; j < n + m; j++) {
+      x[j] = j - (n + m);
+      y[j] = x[j] * x[j];
+      w[j] = 1.0;
+    }
+
+    for (k = 0; k < 2; k++) {
+      clock_gettime(CLOCK_MONOTONIC, &ts1);
+      for (r = 0; r < 1000; r++) {
+        if (k == 0)
+          res1 = RGR_FindBestRegression(x + m, y + m, w + m, n, m, 3, &r1[0], &r1[1],
+                                        &r1[2], &r1[3], &r1[4], &i1[0], &i1[1], &i1[2]);
+        else
+          res1 = find_best_regression_ref(x + m, y + m, w + m, n, m, 3, &r2[0], &r2[1],
+                                          &r2[2], &r2[3], &r2[4], &i2[0], &i2[1], &i2[2]);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &ts2);
+      times[k] = UTI_DiffTimespecsToDouble(&ts2, &ts1) / r;
+    }
+
+    TEST_CHECK(i1[0] > n / 2);
+    TEST_CHECK(memcmp(r1, r2, sizeof (r1)) == 0);
+    TEST_CHECK(memcmp(i1, i2, sizeof (i1)) == 0);
+
+    DEBUG_LOG("n=%d m=%d incremental=%.3fus full=%.3fus speedup=%.1f",
+              n, m, times[0] * 1.0e6, times[1] * 1.0e6, times[1] / times[0]);
+  }
+}
+
 void
 test_unit(void)
 {
@@ -30,6 +178,8 @@ test_unit(void)
   double xrange, yrange, wrange, x2range;
   int i, j, n, m, c1, c2, c3, runs, best_start, dof;
 
+  test_best_regression();
+
   for (n = 3; n <= POINTS; n++) {
     for (i = 0; i < 200; i++) {
       slope = TST_GetRandomDouble(-0.1, 0.1);
@@ -19,12 +19,107 @@
  */
 
 #include <local.h>
+#include <localp.h>
 #include "test.h"
 
 #define LCL_GetSysPrecisionAsQuantum() (1.0e-6)
 
 #include <samplefilt.c>
 
+static double freq_ppm;
+static NTP_Sample expected_sample;
+
+static double
+read_frequency(void)
+{
+  return freq_ppm;
+}
+
+static double
+set_frequency(double freq)
+{
+  return freq_ppm = freq;
+}
+
+static void
+accrue_offset(double offset, double corr_rate)
+{
+}
+
+static int
+apply_step_offset(double offset)
+{
+  return 1;
+}
+
+static void
+offset_convert(struct timespec *raw, double *corr, double *err)
+{
+  *corr = 0.0;
+  if (err)
+    *err = 0.0;
+}
+
+static void
+slew_samples(struct timespec *raw, struct timespec *cooked, double dfreq,
+             double doffset, LCL_ChangeType change_type, void *anything)
+{
+  double delta;
+
+  SPF_SlewSamples(anything, cooked, dfreq, doffset);
+
+  UTI_AdjustTimespec(&expected_sample.time, cooked, &expected_sample.time, &delta,
+                     dfreq, doffset);
+  expected_sample.offset -= delta;
+}
+
+static void
+test_lazy_correction(void)
+{
+  NTP_Sample sample;
+  SPF_Instance filter;
+  int i, j;
+
+  lcl_RegisterSystemDrivers(read_frequency, set_frequency, accrue_offset,
+                            apply_step_offset, offset_convert, NULL, NULL);
+
+  filter = SPF_CreateInstance(1, 1, 2.0, 0.0);
+  LCL_AddParameterChangeHandler(slew_samples, filter);
+
+  for (i = 0; i < 1000; i++) {
+    memset(&sample, 0, sizeof (sample));
+    LCL_ReadCookedTime(&sample.time, NULL);
+    UTI_AddDoubleToTimespec(&sample.time, TST_GetRandomDouble(-1.0e3, 0.0), &sample.time);
+    sample.offset = TST_GetRandomDouble(-1.0, 1.0);
+
+    SPF_DropSamples(filter);
+    TEST_CHECK(SPF_AccumulateSample(filter, &sample));
+    expected_sample = sample;
+
+    for (j = random() % 10; j > 0; j--) {
+      switch (random() % 10) {
+        case 0:
+          TEST_CHECK(LCL_ApplyStepOffset(TST_GetRandomDouble(-1.0e3, 1.0e3)));
+          break;
+        case 1:
+          LCL_NotifyLeap(random() % 2 ? 1 : -1);
+          break;
+        default:
+          LCL_AccumulateFrequencyAndOffset(TST_GetRandomDouble(-1.0e-5, 1.0e-5),
+                                           TST_GetRandomDouble(-1.0e-3, 1.0e-3), 1.0);
+          break;
+      }
+    }
+
+    TEST_CHECK(SPF_GetLastSample(filter, &sample));
+    TEST_CHECK(fabs(UTI_DiffTimespecsToDouble(&sample.time, &expected_sample.time)) < 1.0e-8);
+    TEST_CHECK(fabs(sample.offset - expected_sample.offset) < 1.0e-8);
+  }
+
+  LCL_RemoveParameterChangeHandler(slew_samples, filter);
+  SPF_DestroyInstance(filter);
+}
+
 void
 test_unit(void)
 {
@@ -113,5 +208,7 @@ test_unit(void)
     SPF_DestroyInstance(filter);
   }
 
+  test_lazy_correction();
+
   LCL_Finalise();
 }
@@ -124,6 +124,9 @@ test_unit(void)
         TEST_CHECK(!trusted || !passed || (passed_lo >= trusted_lo && passed_hi <= trusted_hi));
         TEST_CHECK(!passed || trusted != 1 || (trusted == 1 && trusted_passed == 1));
         TEST_CHECK(!passed || !required || required_passed > 0);
+
+        for (l = 1; passed && l < n_sorted_endpoints; l++)
+          TEST_CHECK(compare_sort_elements(&sort_list[l - 1], &sort_list[l]) <= 0);
       }
     }
 
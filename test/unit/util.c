@@ -264,4 +264,17 @@ void test_unit(void) {
   TEST_CHECK(!UTI_CheckDirPermissions("testdir", 0700, uid + 1, gid));
   TEST_CHECK(!UTI_CheckDirPermissions("testdir", 0700, uid, gid + 1));
   TST_ResumeLogging();
+
+  TEST_CHECK(UTI_BytesToHex("\x00\x01\xa2\xff", 4, buf, 9));
+  TEST_CHECK(strcmp(buf, "0001A2FF") == 0);
+  TEST_CHECK(!UTI_BytesToHex("\x00\x01\xa2\xff", 4, buf, 8));
+  TEST_CHECK(UTI_BytesToHex("", 0, buf, 1));
+  TEST_CHECK(strcmp(buf, "") == 0);
+
+  TEST_CHECK(UTI_HexToBytes("0001a2FF", buf, 4) == 4);
+  TEST_CHECK(memcmp(buf, "\x00\x01\xa2\xff", 4) == 0);
+  TEST_CHECK(UTI_HexToBytes("0001a2FF", buf, 3) == 0);
+  TEST_CHECK(UTI_HexToBytes("0001a2F", buf, 4) == 0);
+  TEST_CHECK(UTI_HexToBytes("0001a2Fx", buf, 4) == 0);
+  TEST_CHECK(UTI_HexToBytes("0001 2FF", buf, 4) == 0);
 }
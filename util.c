@@ -1258,3 +1258,44 @@ UTI_GetRandomBytes(void *buf, unsigned int len)
   UTI_GetRandomBytesUrandom(buf, len);
 #endif
 }
+
+/* ================================================== */
+
+int
+UTI_BytesToHex(const void *buf, unsigned int buf_len, char *hex, unsigned int hex_len)
+{
+  unsigned int i;
+
+  if (hex_len < 2 * buf_len + 1)
+    return 0;
+
+  for (i = 0; i < buf_len; i++)
+    snprintf(hex + 2 * i, 3, "%02hhX", ((const unsigned char *)buf)[i]);
+  hex[2 * buf_len] = '\0';
+
+  return 1;
+}
+
+/* ================================================== */
+
+unsigned int
+UTI_HexToBytes(const char *hex, void *buf, unsigned int len)
+{
+  char byte[3];
+  unsigned int i;
+
+  for (i = 0; i < len && *hex != '\0'; i++) {
+    if (!isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1]))
+      return 0;
+
+    byte[0] = *hex++;
+    byte[1] = *hex++;
+    byte[2] = '\0';
+    ((unsigned char *)buf)[i] = strtol(byte, NULL, 16);
+  }
+
+  if (*hex != '\0')
+    return 0;
+
+  return i;
+}
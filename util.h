@@ -187,6 +187,14 @@ extern void UTI_GetRandomBytesUrandom(void *buf, unsigned int len);
    generating long-term keys */
 extern void UTI_GetRandomBytes(void *buf, unsigned int len);
 
+/* Print data in hexadecimal format.  Return zero if the buffer is too
+   short. */
+extern int UTI_BytesToHex(const void *buf, unsigned int buf_len, char *hex, unsigned int hex_len);
+
+/* Parse a string of hexadecimal digits and return the number of decoded
+   bytes, or zero on error (invalid character or too short buffer) */
+extern unsigned int UTI_HexToBytes(const char *hex, void *buf, unsigned int len);
+
 /* Macros to get maximum and minimum of two values */
 #ifdef MAX
 #undef MAX